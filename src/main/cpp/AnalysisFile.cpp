@@ -0,0 +1,378 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "AnalysisFile.hpp"
+
+#define ANALYSIS_FILE_MAGIC "bigsh0t-stab360"
+#define ANALYSIS_FILE_VERSION 1
+#define ANALYSIS_FILE_SEGMENT_MAGIC "segm"
+
+/**
+ * Appending more segments than this makes the file be compacted, so that
+ * reading it stays a copy of a few sorted runs.
+ */
+#define ANALYSIS_FILE_MAX_SEGMENTS 16
+
+static_assert(sizeof(AnalysisRecord) == 5 * sizeof(double), "AnalysisRecord must not be padded");
+
+namespace {
+
+class FileHeader {
+  public:
+    char magic[16];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+class SegmentHeader {
+  public:
+    char magic[4];
+    uint16_t shard;
+    uint16_t shards;
+    uint64_t count;
+    double firstTime;
+    double lastTime;
+};
+
+bool writeSegment(std::ofstream& file, const AnalysisFile::Segment& segment) {
+    SegmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANALYSIS_FILE_SEGMENT_MAGIC, sizeof(header.magic));
+    header.shard = (uint16_t) std::max(0, std::min(segment.shard, 0xffff));
+    header.shards = (uint16_t) std::max(0, std::min(segment.shards, 0xffff));
+    header.count = segment.count;
+    header.firstTime = segment.firstTime;
+    header.lastTime = segment.lastTime;
+    file.write((const char*) &header, sizeof(header));
+    if (segment.count > 0) {
+        file.write((const char*) segment.records, segment.count * sizeof(AnalysisRecord));
+    }
+    return (bool) file;
+}
+
+AnalysisFile::Segment toSegment(const std::vector<AnalysisRecord>& records, int shard, int shards) {
+    AnalysisFile::Segment segment;
+    segment.records = records.data();
+    segment.count = records.size();
+    segment.firstTime = records.size() > 0 ? records.front().previousTime : 0;
+    segment.lastTime = records.size() > 0 ? records.back().time : 0;
+    segment.shard = shard;
+    segment.shards = shards;
+    return segment;
+}
+
+bool writeFileHeader(std::ofstream& file) {
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANALYSIS_FILE_MAGIC, sizeof(ANALYSIS_FILE_MAGIC));
+    header.version = ANALYSIS_FILE_VERSION;
+    header.recordSize = sizeof(AnalysisRecord);
+    file.write((const char*) &header, sizeof(header));
+    return (bool) file;
+}
+
+bool statFile(const std::string& path, std::size_t& size, int64_t& modified) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    size = (std::size_t) st.st_size;
+    modified = (int64_t) st.st_mtime;
+    return true;
+}
+
+}
+
+AnalysisFile::AnalysisFile(const std::string& path) : path(path), data(NULL), size(0), modified(0), legacy(false), truncated(false), unreadable(false) {
+}
+
+AnalysisFile::~AnalysisFile() {
+    unmap();
+}
+
+std::shared_ptr<AnalysisFile> AnalysisFile::open(const std::string& fileName) {
+    static std::mutex registryLock;
+    static std::map<std::string, std::weak_ptr<AnalysisFile>> registry;
+
+    std::string path = parseFileName(fileName);
+    std::lock_guard<std::mutex> guard(registryLock);
+    std::shared_ptr<AnalysisFile> file = registry[path].lock();
+    if (!file) {
+        file.reset(new AnalysisFile(path));
+        registry[path] = file;
+    }
+    return file;
+}
+
+std::string AnalysisFile::parseFileName(const std::string& fileName) {
+    if (fileName.length() > 8 && fileName.compare(0, 8, std::string("file:///")) == 0) {
+        if (fileName.length() > 10 && fileName.at (9) == ':') {
+            // Windows file URL - file:///X:/...
+            return fileName.substr (8);
+        } else {
+            // UNIX / OSX file URL - file:///home/...
+            return fileName.substr (7);
+        }
+    } else {
+        return fileName;
+    }
+}
+
+void AnalysisFile::read(const std::function<void(const Segment& segment)>& f) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+    for (const Segment& segment : segments) {
+        f(segment);
+    }
+}
+
+bool AnalysisFile::append(const std::vector<AnalysisRecord>& records, int shard, int shards) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+    if (unreadable) {
+        return false;
+    }
+    if (legacy || truncated) {
+        // Rewrite the file in the current format, with the new records last.
+        // The old records are copied, as the mapping is closed first.
+        std::vector<std::vector<AnalysisRecord>> copies;
+        for (const Segment& segment : segments) {
+            copies.push_back(std::vector<AnalysisRecord>(segment.records, segment.records + segment.count));
+        }
+        std::vector<Segment> newSegments;
+        for (std::size_t i = 0; i < segments.size(); ++i) {
+            newSegments.push_back(toSegment(copies[i], segments[i].shard, segments[i].shards));
+        }
+        newSegments.push_back(toSegment(records, shard, shards));
+        return replace(newSegments);
+    }
+
+    std::size_t fileSize = 0;
+    int64_t fileModified = 0;
+    bool empty = !statFile(path, fileSize, fileModified) || fileSize == 0;
+
+    // Nothing may hold a view of the file while it grows on Windows
+    unmap();
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::app);
+    bool written = (bool) file;
+    if (written && empty) {
+        written = writeFileHeader(file);
+    }
+    written = written && writeSegment(file, toSegment(records, shard, shards));
+    file.close();
+    map();
+    return written;
+}
+
+bool AnalysisFile::rewrite(const std::vector<AnalysisRecord>& records, int shard, int shards) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+    if (unreadable) {
+        return false;
+    }
+    return replace(std::vector<Segment>(1, toSegment(records, shard, shards)));
+}
+
+bool AnalysisFile::needsCompaction() {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+    return !unreadable && (legacy || truncated || segments.size() > ANALYSIS_FILE_MAX_SEGMENTS);
+}
+
+bool AnalysisFile::isUnreadable() {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+    return unreadable;
+}
+
+std::size_t AnalysisFile::getNumSegments() {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+    return segments.size();
+}
+
+bool AnalysisFile::replace(const std::vector<Segment>& newSegments) {
+    unmap();
+
+    // Written next to the file and renamed, so that a file that is being read
+    // is never half written.
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::out | std::ios::binary);
+    bool written = (bool) file && writeFileHeader(file);
+    for (const Segment& segment : newSegments) {
+        written = written && writeSegment(file, segment);
+    }
+    file.close();
+    if (written && std::rename(temporary.c_str(), path.c_str()) != 0) {
+        // Windows does not rename over an existing file
+        std::remove(path.c_str());
+        written = std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+    if (!written) {
+        std::remove(temporary.c_str());
+    }
+    map();
+    return written;
+}
+
+void AnalysisFile::refresh() {
+    std::size_t currentSize = 0;
+    int64_t currentModified = 0;
+    bool exists = statFile(path, currentSize, currentModified);
+    if (!exists) {
+        unmap();
+        return;
+    }
+    if (data == NULL || currentSize != size || currentModified != modified) {
+        unmap();
+        map();
+    }
+}
+
+void AnalysisFile::map() {
+    unmap();
+    std::size_t mappedSize = 0;
+    if (!statFile(path, mappedSize, modified) || mappedSize == 0) {
+        return;
+    }
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, mappedSize);
+    // The view keeps the mapping open
+    CloseHandle(mapping);
+    if (view == NULL) {
+        return;
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    void* view = mmap(NULL, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED) {
+        return;
+    }
+#endif
+
+    data = (const char*) view;
+    size = mappedSize;
+    scan();
+}
+
+void AnalysisFile::unmap() {
+    if (data != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap((void*) data, size);
+#endif
+    }
+    data = NULL;
+    size = 0;
+    legacy = false;
+    truncated = false;
+    unreadable = false;
+    segments.clear();
+}
+
+void AnalysisFile::scan() {
+    segments.clear();
+    legacy = false;
+    truncated = false;
+    unreadable = false;
+
+    FileHeader fileHeader;
+    if (size >= sizeof(fileHeader)) {
+        memcpy(&fileHeader, data, sizeof(fileHeader));
+    }
+    if (size < sizeof(fileHeader) || memcmp(fileHeader.magic, ANALYSIS_FILE_MAGIC, sizeof(ANALYSIS_FILE_MAGIC)) != 0) {
+        // A count followed by the records
+        uint64_t count = 0;
+        if (size >= sizeof(count)) {
+            memcpy(&count, data, sizeof(count));
+        }
+        std::size_t available = size >= sizeof(count) ? (size - sizeof(count)) / sizeof(AnalysisRecord) : 0;
+        legacy = true;
+        truncated = count > available;
+        Segment segment;
+        segment.records = (const AnalysisRecord*) (data + sizeof(count));
+        segment.count = (std::size_t) std::min(count, (uint64_t) available);
+        segment.firstTime = segment.count > 0 ? segment.records[0].previousTime : 0;
+        segment.lastTime = segment.count > 0 ? segment.records[segment.count - 1].time : 0;
+        segment.shard = 0;
+        segment.shards = 0;
+        if (segment.count > 0) {
+            segments.push_back(segment);
+        }
+        return;
+    }
+    if (fileHeader.version != ANALYSIS_FILE_VERSION || fileHeader.recordSize != sizeof(AnalysisRecord)) {
+        // Written by a later version. Read nothing, and leave it alone.
+        unreadable = true;
+        return;
+    }
+
+    std::size_t offset = sizeof(fileHeader);
+    while (offset < size) {
+        SegmentHeader header;
+        if (size - offset < sizeof(header)) {
+            truncated = true;
+            break;
+        }
+        memcpy(&header, data + offset, sizeof(header));
+        if (memcmp(header.magic, ANALYSIS_FILE_SEGMENT_MAGIC, sizeof(header.magic)) != 0) {
+            // Not written by this version. Keep the segments before it, and
+            // leave the file alone.
+            unreadable = true;
+            break;
+        }
+        offset += sizeof(header);
+        uint64_t available = (size - offset) / sizeof(AnalysisRecord);
+        if (header.count > available) {
+            // Cut short while it was being appended. What is there is still
+            // sorted, and it is kept.
+            header.count = available;
+            truncated = true;
+        }
+
+        Segment segment;
+        segment.records = (const AnalysisRecord*) (data + offset);
+        segment.count = (std::size_t) header.count;
+        segment.firstTime = header.firstTime;
+        segment.lastTime = header.lastTime;
+        segment.shard = header.shard;
+        segment.shards = header.shards;
+        if (segment.count > 0) {
+            segments.push_back(segment);
+        }
+        offset += segment.count * sizeof(AnalysisRecord);
+        if (truncated) {
+            break;
+        }
+    }
+}
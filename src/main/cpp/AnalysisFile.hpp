@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef AnalysisFile_HPP
+#define AnalysisFile_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A frame-to-frame rotation as it is stored in an analysis file.
+ */
+class AnalysisRecord {
+  public:
+    double previousTime;
+    double time;
+    double yaw;
+    double pitch;
+    double roll;
+};
+
+/**
+ * The analysis file of Stabilize 360. The file is a header followed by
+ * segments, each of which holds rotations sorted by time:
+ *
+ *     header:  "bigsh0t-stab360\0", uint32 version, uint32 record size
+ *     segment: "segm", uint16 shard, uint16 shards, uint64 count,
+ *              double first time, double last time,
+ *              count records
+ *
+ * An analysis session appends the rotations it has found as a new segment,
+ * and where segments overlap the later one wins. The segment headers are
+ * the index of the file: opening it only reads them, and the records are
+ * read straight from the mapping when they are needed. When the segments
+ * become too many, the file is compacted into a single segment.
+ *
+ * Files written by earlier versions - a count followed by the records - are
+ * read as a single segment, and rewritten in the current format the first
+ * time something is appended to them.
+ *
+ * A file with a header that this version does not know - written by a later
+ * version, or with something else than a segment where a segment should
+ * start - is unreadable. What can be read of it is read, but it is never
+ * appended to, compacted or rewritten, so the analysis in it is not lost.
+ *
+ * The analysis of a long clip can be split into shards that are analyzed
+ * separately, each into a file of its own. The segments of a shard are
+ * marked with its number and the number of shards, and the files are
+ * joined by AnalysisMerge.
+ *
+ * All filter instances in the plugin that open the same file share one
+ * AnalysisFile and one mapping. The file is mapped again if it has been
+ * changed by another process.
+ *
+ * Thread-safe.
+ */
+class AnalysisFile {
+  public:
+    ~AnalysisFile();
+
+    /**
+     * Returns the AnalysisFile for a file name or file URL.
+     */
+    static std::shared_ptr<AnalysisFile> open(const std::string& fileName);
+
+    /**
+     * Converts a file URL to a file name. Anything else is returned as is.
+     */
+    static std::string parseFileName(const std::string& fileName);
+
+    /**
+     * A run of records sorted by time.
+     */
+    class Segment {
+      public:
+        const AnalysisRecord* records;
+        std::size_t count;
+        double firstTime;
+        double lastTime;
+
+        /**
+         * The number of the shard, from 1, and the number of shards, or 0
+         * if the analysis was not split into shards.
+         */
+        int shard;
+        int shards;
+    };
+
+    /**
+     * Calls f with each segment, oldest first. The records point into the
+     * mapping and are only valid during the call.
+     */
+    void read(const std::function<void(const Segment& segment)>& f);
+
+    /**
+     * Appends the records, which must be sorted by time, as a new segment.
+     *
+     * @return true if the segment was written, false also if the file is
+     *         unreadable
+     */
+    bool append(const std::vector<AnalysisRecord>& records, int shard, int shards);
+
+    /**
+     * Replaces the contents of the file with a single segment.
+     *
+     * @return true if the file was written, false also if the file is
+     *         unreadable
+     */
+    bool rewrite(const std::vector<AnalysisRecord>& records, int shard, int shards);
+
+    /**
+     * True if the file should be rewritten: it is in the old format, ends
+     * in a segment that was cut short, or has too many segments. Never true
+     * for an unreadable file.
+     */
+    bool needsCompaction();
+
+    /**
+     * True if the file exists, but is not an analysis file that this version
+     * can read all of.
+     */
+    bool isUnreadable();
+
+    std::size_t getNumSegments();
+
+  private:
+    AnalysisFile(const std::string& path);
+
+    /**
+     * Writes a new file with the segments, and puts it in place of the old
+     * one.
+     */
+    bool replace(const std::vector<Segment>& newSegments);
+
+    /**
+     * Maps the file again if it has changed since it was mapped.
+     */
+    void refresh();
+    void map();
+    void unmap();
+
+    /**
+     * Reads the segment headers of the mapping.
+     */
+    void scan();
+
+    std::string path;
+    std::mutex lock;
+
+    const char* data;
+    std::size_t size;
+    int64_t modified;
+
+    bool legacy;
+    bool truncated;
+    bool unreadable;
+    std::vector<Segment> segments;
+};
+
+#endif
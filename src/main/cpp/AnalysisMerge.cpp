@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include <cstdio>
+
+#include "AnalysisMerge.hpp"
+
+/**
+ * How far apart, in seconds, the end of one rotation and the start of the
+ * next may be before there is a frame missing between them. Consecutive
+ * rotations are a ten-thousandth of a second apart, and frames more than a
+ * two-hundred-fortieth.
+ */
+#define ANALYSIS_MERGE_MAX_GAP 0.001
+
+void AnalysisMerge::add(const std::string& name, AnalysisFile& file) {
+    Shard s;
+    s.name = name;
+    s.shard = 0;
+    s.shards = 0;
+    file.read([&](const AnalysisFile::Segment& segment) {
+        overlay(s.records, segment.records, segment.count);
+        if (segment.shards > 0) {
+            s.shard = segment.shard;
+            s.shards = segment.shards;
+        }
+    });
+    shards.push_back(s);
+}
+
+void AnalysisMerge::add(const std::string& name, const std::vector<AnalysisRecord>& records, int shard, int shards) {
+    Shard s;
+    s.name = name;
+    s.records = records;
+    s.shard = shard;
+    s.shards = shards;
+    this->shards.push_back(s);
+}
+
+std::vector<AnalysisRecord> AnalysisMerge::merge(std::vector<std::string>& warnings) const {
+    char buf[1024];
+
+    std::vector<const Shard*> ordered;
+    for (const Shard& s : shards) {
+        if (s.records.empty()) {
+            snprintf(buf, sizeof(buf), "%s has no analysis.", s.name.c_str());
+            warnings.push_back(buf);
+        } else {
+            ordered.push_back(&s);
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const Shard* a, const Shard* b) {
+        if (a->records.front().previousTime != b->records.front().previousTime) {
+            return a->records.front().previousTime < b->records.front().previousTime;
+        }
+        if (a->records.back().time != b->records.back().time) {
+            return a->records.back().time < b->records.back().time;
+        }
+        return a->name < b->name;
+    });
+
+    // Check the shard numbers against each other
+    int numShards = 0;
+    for (const Shard* s : ordered) {
+        if (s->shards > 0 && numShards == 0) {
+            numShards = s->shards;
+        } else if (s->shards > 0 && s->shards != numShards) {
+            snprintf(buf, sizeof(buf), "%s is shard %d of %d, but an earlier shard is of %d.", s->name.c_str(), s->shard, s->shards, numShards);
+            warnings.push_back(buf);
+        }
+    }
+    if (numShards > 0) {
+        std::vector<int> found(numShards + 1, 0);
+        for (const Shard* s : ordered) {
+            if (s->shard < 1 || s->shard > numShards) {
+                snprintf(buf, sizeof(buf), "%s is not marked as one of the %d shards.", s->name.c_str(), numShards);
+                warnings.push_back(buf);
+            } else {
+                ++found[s->shard];
+            }
+        }
+        for (int i = 1; i <= numShards; ++i) {
+            if (found[i] == 0) {
+                snprintf(buf, sizeof(buf), "Shard %d of %d is missing.", i, numShards);
+                warnings.push_back(buf);
+            } else if (found[i] > 1) {
+                snprintf(buf, sizeof(buf), "Shard %d of %d is given %d times.", i, numShards, found[i]);
+                warnings.push_back(buf);
+            }
+        }
+    }
+
+    std::vector<AnalysisRecord> merged;
+    for (const Shard* s : ordered) {
+        const std::vector<AnalysisRecord>& records = s->records;
+        std::size_t first = 0;
+        if (!merged.empty()) {
+            double end = merged.back().time;
+            double start = records.front().previousTime;
+            if (records.back().time <= end) {
+                snprintf(buf, sizeof(buf), "%s is covered by the shards before it, and is not used.", s->name.c_str());
+                warnings.push_back(buf);
+                continue;
+            }
+            if (start <= end) {
+                // Overlapping: seam in the middle of the overlap
+                double seam = (start + end) / 2;
+                while (!merged.empty() && merged.back().time > seam) {
+                    merged.pop_back();
+                }
+                while (first < records.size() && records[first].time <= seam) {
+                    ++first;
+                }
+            }
+            if (!merged.empty() && records[first].previousTime - merged.back().time > ANALYSIS_MERGE_MAX_GAP) {
+                snprintf(buf, sizeof(buf), "No rotation from %.3f s to %.3f s, at the start of %s. Start each shard at the last frame of the one before it.",
+                         merged.back().time, records[first].previousTime, s->name.c_str());
+                warnings.push_back(buf);
+            }
+        }
+        merged.insert(merged.end(), records.begin() + first, records.end());
+    }
+    return merged;
+}
+
+void AnalysisMerge::overlay(std::vector<AnalysisRecord>& records, const AnalysisRecord* newRecords, std::size_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (records.empty() || records.back().time < newRecords[0].previousTime) {
+        records.insert(records.end(), newRecords, newRecords + count);
+        return;
+    }
+
+    std::vector<AnalysisRecord> merged;
+    merged.reserve(records.size() + count);
+    std::size_t next = 0;
+    for (const AnalysisRecord& r : records) {
+        while (next < count && newRecords[next].time < r.previousTime) {
+            merged.push_back(newRecords[next++]);
+        }
+        if (next < count && newRecords[next].previousTime <= r.time) {
+            // Replaced by the new record
+            continue;
+        }
+        merged.push_back(r);
+    }
+    merged.insert(merged.end(), newRecords + next, newRecords + count);
+    records.swap(merged);
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef AnalysisMerge_HPP
+#define AnalysisMerge_HPP
+
+#include <string>
+#include <vector>
+#include "AnalysisFile.hpp"
+
+/**
+ * Joins the analysis files of the shards of a clip into one.
+ *
+ * An analysis session has no rotation for its first frame, as there is no
+ * frame before it to compare it to. The shards must therefore overlap by at
+ * least one frame: a shard that starts at the last frame of the shard before
+ * it has the rotation into its first frame of its own. Where shards overlap
+ * by more than that, the rotations of the earlier shard are used up to the
+ * middle of the overlap, and those of the later shard after it. The seam is
+ * then where the tracking has settled on both sides, and every frame-to-frame
+ * rotation is used exactly once, so the orientations that the rotations add
+ * up to are the same as if the clip had been analyzed in one go.
+ *
+ * The shards are ordered by time, so the result does not depend on the
+ * order they are added in.
+ */
+class AnalysisMerge {
+  public:
+    /**
+     * Adds the analysis in a file as a shard.
+     *
+     * @param name what the shard is called in the warnings
+     */
+    void add(const std::string& name, AnalysisFile& file);
+
+    /**
+     * Adds a shard.
+     *
+     * @param records sorted by time
+     * @param shard the number of the shard, from 1, or 0 if unknown
+     * @param shards the number of shards, or 0 if unknown
+     */
+    void add(const std::string& name, const std::vector<AnalysisRecord>& records, int shard, int shards);
+
+    /**
+     * Joins the shards. Anything that looks wrong - shards that are missing,
+     * or frames that no shard has a rotation for - is described in warnings.
+     */
+    std::vector<AnalysisRecord> merge(std::vector<std::string>& warnings) const;
+
+    /**
+     * Adds records sorted by time to other records sorted by time, replacing
+     * those that they overlap. This is how the segments of an analysis file
+     * are combined.
+     */
+    static void overlay(std::vector<AnalysisRecord>& records, const AnalysisRecord* newRecords, std::size_t count);
+
+  private:
+    class Shard {
+      public:
+        std::string name;
+        std::vector<AnalysisRecord> records;
+        int shard;
+        int shards;
+    };
+
+    std::vector<Shard> shards;
+};
+
+#endif
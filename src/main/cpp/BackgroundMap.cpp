@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <cstdlib>
+#include <cstring>
+
+#include "BackgroundMap.hpp"
+#include "ScanlineScheduler.hpp"
+#include "ThreadPool.hpp"
+
+void BackgroundMap::State::publish(const MapKey& key, const std::shared_ptr<void>& map) {
+    std::atomic_store(&published, std::make_shared<Published>(key, map));
+}
+
+BackgroundMap::BackgroundMap() : state(std::make_shared<State>()) {
+}
+
+BackgroundMap::~BackgroundMap() {
+    state->cancelled = true;
+    std::unique_lock<std::mutex> guard(state->lock);
+    state->done.wait(guard, [this] {
+        return !state->building;
+    });
+}
+
+static bool staleMapsFromEnvironment() {
+    const char* env = getenv("BIGSH0T_MAP_QUALITY");
+    return env != NULL && strcmp(env, "fast") == 0;
+}
+
+bool BackgroundMap::useStaleMaps() {
+    static const bool stale = staleMapsFromEnvironment();
+    return stale;
+}
+
+std::shared_ptr<void> BackgroundMap::getMap(const MapKey& key) {
+    std::shared_ptr<Published> published = std::atomic_load(&state->published);
+    if (published && published->key == key) {
+        return published->map;
+    }
+    std::shared_ptr<void> cached = MapCache::instance().get<void>(key);
+    if (cached) {
+        state->publish(key, cached);
+    }
+    return cached;
+}
+
+std::shared_ptr<void> BackgroundMap::latestMap() {
+    std::shared_ptr<Published> published = std::atomic_load(&state->published);
+    if (published) {
+        return published->map;
+    }
+    return std::shared_ptr<void>();
+}
+
+void BackgroundMap::build(const MapKey& key, const Builder& builder, std::size_t size) {
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        if (state->building) {
+            if (!(*state->buildingKey == key)) {
+                state->cancelled = true;
+            }
+            return;
+        }
+        state->building = true;
+        state->buildingKey.reset(new MapKey(key));
+        state->cancelled = false;
+    }
+
+    std::shared_ptr<State> state = this->state;
+    ThreadPool::instance().post([state, key, builder, size]() {
+        if (!state->cancelled) {
+            std::shared_ptr<void> map = builder(state->cancelled);
+            if (map) {
+                MapCache::instance().put(key, map, size);
+                state->publish(key, map);
+            }
+        }
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->building = false;
+        state->done.notify_all();
+    });
+}
+
+bool BackgroundMap::forEachChunk(int height, const std::atomic<bool>& cancelled, const std::function<void(int start, int num)>& f) {
+    std::atomic<bool> complete(true);
+    ScanlineScheduler::forEachChunk(height, [&](int start, int num) {
+        if (cancelled) {
+            complete = false;
+            return;
+        }
+        f(start, num);
+    });
+    return complete;
+}
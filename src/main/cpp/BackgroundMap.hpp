@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef BackgroundMap_HPP
+#define BackgroundMap_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include "MapCache.hpp"
+
+/**
+ * The map of a filter instance, rebuilt on the ThreadPool when the
+ * parameters change. Frames never wait for a map to be built: until the new
+ * map is done, a frame renders without a map, or with the previous one if
+ * useStaleMaps() is true. When the build finishes, the map is put in the
+ * MapCache and published with an atomic pointer swap, so frames that read
+ * the map take no lock.
+ *
+ * Only one map is built at a time. A build for other parameters than the
+ * latest ones is cancelled, so scrubbing through a keyframed parameter does
+ * not queue up maps that nobody will use.
+ *
+ * The builder may refer to members of the filter, as the destructor waits for
+ * a running build to stop. Declare the BackgroundMap after the members that
+ * the builder uses, so that it is destroyed first.
+ */
+class BackgroundMap {
+  public:
+    /**
+     * Builds a map, and returns it, or an empty pointer if cancelled was set
+     * before it was done. Builders should check cancelled every few rows.
+     */
+    typedef std::function<std::shared_ptr<void>(const std::atomic<bool>& cancelled)> Builder;
+
+    BackgroundMap();
+    ~BackgroundMap();
+
+    /**
+     * True if frames may use the previous map while the map for their
+     * parameters is built. They then render quickly, but with the geometry
+     * of an earlier frame, which is fine for scrubbing in a preview. Set the
+     * BIGSH0T_MAP_QUALITY environment variable to "fast" to turn it on. The
+     * default, "exact", renders such frames without a map instead.
+     */
+    static bool useStaleMaps();
+
+    /**
+     * Returns the map for the key, if it has been built by this instance or
+     * is in the MapCache, or an empty pointer.
+     */
+    template<typename T>
+    std::shared_ptr<T> get(const MapKey& key) {
+        return std::static_pointer_cast<T>(getMap(key));
+    }
+
+    /**
+     * Returns the most recently published map, whatever it was built for, or
+     * an empty pointer if there is none.
+     */
+    template<typename T>
+    std::shared_ptr<T> latest() {
+        return std::static_pointer_cast<T>(latestMap());
+    }
+
+    /**
+     * Starts building the map for the key, unless that map is already being
+     * built. If a map for another key is being built, it is cancelled, and
+     * the map for this key is started by a later call.
+     *
+     * @param size the size of the map in bytes
+     */
+    void build(const MapKey& key, const Builder& builder, std::size_t size);
+
+    /**
+     * Calls f(start, num) for the scanlines [0, height) like
+     * ScanlineScheduler::forEachChunk, for builders. Stops handing out
+     * scanlines once cancelled is set.
+     *
+     * @return true if all scanlines were processed
+     */
+    static bool forEachChunk(int height, const std::atomic<bool>& cancelled, const std::function<void(int start, int num)>& f);
+
+  private:
+    class Published {
+      public:
+        Published(const MapKey& key, const std::shared_ptr<void>& map) : key(key), map(map) {
+        }
+
+        const MapKey key;
+        const std::shared_ptr<void> map;
+    };
+
+    /**
+     * Shared with the task that runs the build.
+     */
+    class State {
+      public:
+        State() : building(false), cancelled(false) {
+        }
+
+        void publish(const MapKey& key, const std::shared_ptr<void>& map);
+
+        std::shared_ptr<Published> published;
+
+        std::mutex lock;
+        std::condition_variable done;
+        bool building;
+        std::unique_ptr<MapKey> buildingKey;
+        std::atomic<bool> cancelled;
+    };
+
+    std::shared_ptr<void> getMap(const MapKey& key);
+    std::shared_ptr<void> latestMap();
+
+    std::shared_ptr<State> state;
+};
+
+#endif
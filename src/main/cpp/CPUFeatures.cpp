@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#   include <immintrin.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+
+#include "CPUFeatures.hpp"
+
+static const char* const CPU_LEVEL_NAMES[] = { "scalar", "sse2", "sse4.1", "avx2", "avx512" };
+
+static bool detectSSE41() {
+#if defined(USE_SSE41)
+#   if defined(__GNUC__) || defined (__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+#   elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+#   else
+    return false;
+#   endif
+#else
+    return false;
+#endif
+}
+
+bool cpuSupportsSSE41() {
+    static const bool supported = detectSSE41();
+    return supported;
+}
+
+static bool detectAVX2() {
+#if defined(USE_AVX2)
+#   if defined(__GNUC__) || defined (__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#   elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) {
+        return false;
+    }
+    // The OS must save the YMM registers on context switch.
+    if ((_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#   else
+    return false;
+#   endif
+#else
+    return false;
+#endif
+}
+
+bool cpuSupportsAVX2() {
+    static const bool supported = detectAVX2();
+    return supported;
+}
+
+static bool detectAVX512() {
+#if defined(USE_AVX512)
+#   if defined(__GNUC__) || defined (__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#   elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave) {
+        return false;
+    }
+    // The OS must save the opmask and ZMM registers as well as the YMM ones.
+    if ((_xgetbv(0) & 0xe6) != 0xe6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 16)) != 0;
+#   else
+    return false;
+#   endif
+#else
+    return false;
+#endif
+}
+
+bool cpuSupportsAVX512() {
+    static const bool supported = detectAVX512();
+    return supported;
+}
+
+static CPULevel detectLevel() {
+    CPULevel level = CPU_SCALAR;
+#if defined(USE_SSE)
+    // SSE2 is part of x86-64, and the build requires it on 32-bit x86
+    level = CPU_SSE2;
+#endif
+    if (cpuSupportsSSE41()) {
+        level = CPU_SSE41;
+    }
+    if (level == CPU_SSE41 && cpuSupportsAVX2()) {
+        level = CPU_AVX2;
+    }
+    if (level == CPU_AVX2 && cpuSupportsAVX512()) {
+        level = CPU_AVX512;
+    }
+
+    const char* env = getenv("BIGSH0T_CPU");
+    if (env != NULL && *env != '\0') {
+        for (int i = CPU_SCALAR; i <= CPU_AVX512; ++i) {
+            if (strcmp(env, CPU_LEVEL_NAMES[i]) == 0 && i < level) {
+                level = (CPULevel) i;
+            }
+        }
+    }
+    return level;
+}
+
+CPULevel cpuLevel() {
+    static const CPULevel level = detectLevel();
+    return level;
+}
+
+const char* cpuLevelName(CPULevel level) {
+    return CPU_LEVEL_NAMES[level];
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef CPUFeatures_HPP
+#define CPUFeatures_HPP
+
+/**
+ * Instruction sets that the kernels are compiled for, from the least to the
+ * most capable. Each level includes the ones below it.
+ */
+enum CPULevel {
+    CPU_SCALAR = 0,
+    CPU_SSE2 = 1,
+    CPU_SSE41 = 2,
+    CPU_AVX2 = 3,
+    CPU_AVX512 = 4
+};
+
+/**
+ * Returns the most capable instruction set that both the CPU and this build
+ * support. The kernels are picked from this once, the first time they are
+ * used.
+ *
+ * The environment variable BIGSH0T_CPU, set to scalar, sse2, sse4.1, avx2 or
+ * avx512, lowers the level. This makes it possible to render with the same
+ * code on every machine, or to compare the kernels with each other.
+ */
+CPULevel cpuLevel();
+
+/**
+ * The name of a level, as used in BIGSH0T_CPU.
+ */
+const char* cpuLevelName(CPULevel level);
+
+/**
+ * Returns true if the CPU supports SSE4.1.
+ * The result is computed once and cached.
+ */
+bool cpuSupportsSSE41();
+
+/**
+ * Returns true if the CPU and the operating system support AVX2.
+ * The result is computed once and cached.
+ */
+bool cpuSupportsAVX2();
+
+/**
+ * Returns true if the CPU and the operating system support AVX-512F.
+ * The result is computed once and cached.
+ */
+bool cpuSupportsAVX512();
+
+#endif
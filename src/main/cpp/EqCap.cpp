@@ -29,6 +29,39 @@ class CapParameters {
     bool enabled;
     const bool isBottom;
 
+    CapParameters(bool _isBottom) : isBottom(_isBottom) {
+        start = 45;
+        end = 85;
+        blendIn = 0.0;
+        blendOut = 10.0;
+        blurWidthStart = 0.0;
+        blurWidthEnd = 360.0;
+        blurHeightStart = 0.0;
+        blurHeightEnd = 2.0;
+        fadeIn = 10.0;
+        enabled = true;
+    }
+};
+
+/**
+ * The state of one cap for a single frame. The parameter values are
+ * copied when the object is created, so each frame gets a consistent
+ * set of values even if the parameters are changed while it is processed.
+ */
+class Cap {
+  public:
+    double start;
+    double end;
+    double blendIn;
+    double blendOut;
+    double fadeIn;
+    double blurWidthStart;
+    double blurWidthEnd;
+    double blurHeightStart;
+    double blurHeightEnd;
+    bool enabled;
+    const bool isBottom;
+
     int startPixels;
     int endPixels;
     int blendInPixels;
@@ -42,17 +75,17 @@ class CapParameters {
     int maxSampleRow;
     SummedAreaTable sat;
 
-    CapParameters(bool _isBottom) : isBottom(_isBottom), sat(10, 10) {
-        start = 45;
-        end = 85;
-        blendIn = 0.0;
-        blendOut = 10.0;
-        blurWidthStart = 0.0;
-        blurWidthEnd = 360.0;
-        blurHeightStart = 0.0;
-        blurHeightEnd = 2.0;
-        fadeIn = 10.0;
-        enabled = true;
+    Cap(CapParameters& parameters) : isBottom(parameters.isBottom), sat(10, 10) {
+        start = parameters.start;
+        end = parameters.end;
+        blendIn = parameters.blendIn;
+        blendOut = parameters.blendOut;
+        fadeIn = parameters.fadeIn;
+        blurWidthStart = parameters.blurWidthStart;
+        blurWidthEnd = parameters.blurWidthEnd;
+        blurHeightStart = parameters.blurHeightStart;
+        blurHeightEnd = parameters.blurHeightEnd;
+        enabled = parameters.enabled;
     }
 
     void compute(int width, int height, const uint32_t* in) {
@@ -125,59 +158,13 @@ class CapParameters {
     }
 };
 
-class EqCap : public Frei0rFilter, MPFilter {
-
+/**
+ * Renders one frame.
+ */
+class EqCapFrame : public MPFilter {
   public:
-    CapParameters top;
-    CapParameters bottom;
-    Frei0rParameter<int,double> interpolation;
-    Transform360Support t360;
-
-    std::mutex lock;
-
-    EqCap(unsigned int width, unsigned int height) : Frei0rFilter(width, height), top(false), bottom(true), t360(width, height) {
-        interpolation = 0;
-
-        register_param(top.enabled, "topEnabled", "");
-        register_fparam(top.start, "topStart", "");
-        register_fparam(top.end, "topEnd", "");
-        register_fparam(top.blendIn, "topBlendIn", "");
-        register_fparam(top.blendOut, "topBlendOut", "");
-        register_fparam(top.fadeIn, "topFadeIn", "");
-        register_fparam(top.blurWidthStart, "topBlurWidthStart", "");
-        register_fparam(top.blurWidthEnd, "topBlurWidthEnd", "");
-        register_fparam(top.blurHeightStart, "topBlurHeightStart", "");
-        register_fparam(top.blurHeightEnd, "topBlurHeightEnd", "");
-
-        register_param(bottom.enabled, "bottomEnabled", "");
-        register_fparam(bottom.start, "bottomStart", "");
-        register_fparam(bottom.end, "bottomEnd", "");
-        register_fparam(bottom.blendIn, "bottomBlendIn", "");
-        register_fparam(bottom.blendOut, "bottomBlendOut", "");
-        register_fparam(bottom.fadeIn, "bottomFadeIn", "");
-        register_fparam(bottom.blurWidthStart, "bottomBlurWidthStart", "");
-        register_fparam(bottom.blurWidthEnd, "bottomBlurWidthEnd", "");
-        register_fparam(bottom.blurHeightStart, "bottomBlurHeightStart", "");
-        register_fparam(bottom.blurHeightEnd, "bottomBlurHeightEnd", "");
-
-        register_fparam(interpolation, "interpolation", "");
-    }
-
-    ~EqCap() {
-    }
-
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
-
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
-
-        top.compute(width, height, in);
-        bottom.compute(width, height, in);
-
-        MPFilter::updateMP(this, time, out, in, width, height);
+    EqCapFrame(int width, int height, Cap& top, Cap& bottom) :
+        width(width), height(height), top(top), bottom(bottom) {
     }
 
     virtual void updateLines(double time,
@@ -185,7 +172,7 @@ class EqCap : public Frei0rFilter, MPFilter {
                              const uint32_t* in,
                              int start, int num) {
         for (int y = start; y < start + num; ++y) {
-            CapParameters& hemisphere = (y < height / 2) ? top : bottom;
+            Cap& hemisphere = (y < height / 2) ? top : bottom;
             int hy = y;
             int h0 = 0;
             int hm = 1;
@@ -246,10 +233,71 @@ class EqCap : public Frei0rFilter, MPFilter {
         }
     }
 
-  protected:
-
   private:
+    int width;
+    int height;
+    Cap& top;
+    Cap& bottom;
+};
+
+class EqCap : public Frei0rFilter {
+
+  public:
+    CapParameters top;
+    CapParameters bottom;
+    Frei0rParameter<int,double> interpolation;
+    Transform360Support t360;
+
+    std::mutex lock;
+
+    EqCap(unsigned int width, unsigned int height) : Frei0rFilter(width, height), top(false), bottom(true), t360(width, height) {
+        interpolation = 0;
+
+        register_param(top.enabled, "topEnabled", "");
+        register_fparam(top.start, "topStart", "");
+        register_fparam(top.end, "topEnd", "");
+        register_fparam(top.blendIn, "topBlendIn", "");
+        register_fparam(top.blendOut, "topBlendOut", "");
+        register_fparam(top.fadeIn, "topFadeIn", "");
+        register_fparam(top.blurWidthStart, "topBlurWidthStart", "");
+        register_fparam(top.blurWidthEnd, "topBlurWidthEnd", "");
+        register_fparam(top.blurHeightStart, "topBlurHeightStart", "");
+        register_fparam(top.blurHeightEnd, "topBlurHeightEnd", "");
+
+        register_param(bottom.enabled, "bottomEnabled", "");
+        register_fparam(bottom.start, "bottomStart", "");
+        register_fparam(bottom.end, "bottomEnd", "");
+        register_fparam(bottom.blendIn, "bottomBlendIn", "");
+        register_fparam(bottom.blendOut, "bottomBlendOut", "");
+        register_fparam(bottom.fadeIn, "bottomFadeIn", "");
+        register_fparam(bottom.blurWidthStart, "bottomBlurWidthStart", "");
+        register_fparam(bottom.blurWidthEnd, "bottomBlurWidthEnd", "");
+        register_fparam(bottom.blurHeightStart, "bottomBlurHeightStart", "");
+        register_fparam(bottom.blurHeightEnd, "bottomBlurHeightEnd", "");
+
+        register_fparam(interpolation, "interpolation", "");
+    }
 
+    ~EqCap() {
+    }
+
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        // frei0r filter instances are not thread-safe, and Shotcut will call update
+        // from several threads when exporting in parallel. Take a snapshot of the
+        // parameters under the lock, and render the frame outside it.
+        std::unique_lock<std::mutex> guard(lock);
+        Cap frameTop(top);
+        Cap frameBottom(bottom);
+        guard.unlock();
+
+        frameTop.compute(width, height, in);
+        frameBottom.compute(width, height, in);
+
+        EqCapFrame frame(width, height, frameTop, frameBottom);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
+    }
 };
 
 frei0r::construct<EqCap> plugin("bigsh0t_eq_cap",
@@ -3,90 +3,70 @@
 #include <climits>
 #include <cmath>
 #include <mutex>
+#include <memory>
+#include <vector>
 
 #include "frei0r.hpp"
 #include "Matrix.hpp"
+#include "BackgroundMap.hpp"
+#include "MapCache.hpp"
 #include "MPFilter.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
 #include "Math.hpp"
+#include "VectorMath.hpp"
 #include "Version.hpp"
 
 
-class EqMask : public Frei0rFilter, MPFilter {
-
+class EqMaskParameters {
   public:
-    Frei0rParameter<double,double> hfov0;
-    Frei0rParameter<double,double> hfov1;
-    Frei0rParameter<double,double> vfov0;
-    Frei0rParameter<double,double> vfov1;
-    int interpolation;
-
-    std::mutex lock;
-
-    unsigned char* map;
-    bool updateMap;
-
-    EqMask(unsigned int width, unsigned int height) : Frei0rFilter(width, height) {
-        hfov0 = 160.0;
-        hfov1 = 180.0;
-        vfov0 = 120.0;
-        vfov1 = 140.0;
-
-        map = NULL;
-
-        interpolation = 0;
-
-        register_fparam(hfov0, "hfov0", "");
-        register_fparam(hfov1, "hfov1", "");
-        register_fparam(vfov0, "vfov0", "");
-        register_fparam(vfov1, "vfov1", "");
-    }
+    double hfov0;
+    double hfov1;
+    double vfov0;
+    double vfov1;
 
-    ~EqMask() {
-        if (map != NULL) {
-            free (map);
-        }
+    bool operator== (const EqMaskParameters& other) const {
+        return hfov0 == other.hfov0 && hfov1 == other.hfov1 && vfov0 == other.vfov0 && vfov1 == other.vfov1;
     }
+};
 
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
-
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
-
-        if (map == NULL || hfov0.changed() || hfov1.changed() || vfov0.changed() || vfov1.changed()) {
-            if (map == NULL) {
-                map = (unsigned char*) malloc (width * height);
-            }
-            updateMap = true;
-        } else {
-            updateMap = false;
-        }
-
-        MPFilter::updateMP(this, time, out, in, width, height);
+/**
+ * Renders one frame from a parameter snapshot. Without a map, each call
+ * builds the map for its scanlines and applies it.
+ */
+class EqMaskFrame : public MPFilter {
+  public:
+    EqMaskFrame(int width, int height, const EqMaskParameters& parameters, const unsigned char* map) :
+        width(width), height(height), hfov0(parameters.hfov0), hfov1(parameters.hfov1), vfov0(parameters.vfov0), vfov1(parameters.vfov1),
+        map(map) {
     }
 
     virtual void updateLines(double time,
                              uint32_t* out,
                              const uint32_t* in,
                              int start, int num) {
-        if (updateMap) {
-            makeMap(start, num);
+        if (map != NULL) {
+            applyMap(out, in, map + start * width, start, num);
+        } else {
+            std::vector<unsigned char> rows(num * width);
+            makeMap(rows.data(), start, num);
+            applyMap(out, in, rows.data(), start, num);
         }
-        applyMap(out, in, start, num);
     }
 
+    /**
+     * Applies the mask to the scanlines [start, start + num). rows points to
+     * the mask of the first one.
+     */
     void applyMap (uint32_t* out,
                    const uint32_t* in,
+                   const unsigned char* rows,
                    int start, int num) {
 
         for (int y = start; y < (start + num); ++y) {
             for (unsigned int x = 0; x < width; ++x) {
                 int offset = y * width + x;
-                int vInt = map[offset];
+                int vInt = rows[(y - start) * width + x];
                 unsigned char* inP = (unsigned char*) (in + offset);
                 unsigned char* outP = (unsigned char*) (out + offset);
                 for (int c = 0; c < 3; ++c) {
@@ -96,15 +76,28 @@ class EqMask : public Frei0rFilter, MPFilter {
         }
     }
 
-    void makeMap (int start, int num) {
-        double coshfov0 = cos(DEG2RADF(hfov0.read()) / 2);
-        double coshfov1 = cos(DEG2RADF(hfov1.read()) / 2);
+    /**
+     * Fills in the mask for the scanlines [start, start + num). rows points
+     * to the mask of the first one.
+     */
+    void makeMap (unsigned char* rows, int start, int num) {
+        double coshfov0 = cos(DEG2RADF(hfov0) / 2);
+        double coshfov1 = cos(DEG2RADF(hfov1) / 2);
         double coshfovd = coshfov0 - coshfov1;
 
-        double sinvfov0 = sin(DEG2RADF(vfov0.read()) / 2);
-        double sinvfov1 = sin(DEG2RADF(vfov1.read()) / 2);
+        double sinvfov0 = sin(DEG2RADF(vfov0) / 2);
+        double sinvfov1 = sin(DEG2RADF(vfov1) / 2);
         double sinvfovd = sinvfov0 - sinvfov1;
 
+        // The mask has eight bits, so single precision is plenty
+        std::vector<float> theta(width);
+        std::vector<float> sinTheta(width);
+        std::vector<float> cosTheta(width);
+        for (unsigned int x = 0; x < width; ++x) {
+            theta[x] = (float) (M_PI - (2 * M_PI * x / width));
+        }
+        batchSinCos(theta.data(), sinTheta.data(), cosTheta.data(), (int) width);
+
         for (int y = start; y < (start + num); ++y) {
             double phi = (-M_PI / 2) + (y * M_PI / height);
             double cosPhi = cos(phi);
@@ -121,10 +114,7 @@ class EqMask : public Frei0rFilter, MPFilter {
             vv = smooth (vv);
 
             for (unsigned int x = 0; x < width; ++x) {
-                double theta = M_PI - (2 * M_PI * x / width);
-                double cosTheta = cos(theta);
-
-                double z = cosTheta * cosPhi;
+                double z = cosTheta[x] * cosPhi;
 
                 double vh = 1.0;
                 if (z < coshfov1) {
@@ -143,8 +133,7 @@ class EqMask : public Frei0rFilter, MPFilter {
                 if (vInt < 0) {
                     vInt = 0;
                 }
-                int offset = y * width + x;
-                map[offset] = (unsigned char) vInt;
+                rows[(y - start) * width + x] = (unsigned char) vInt;
             }
         }
     }
@@ -157,7 +146,88 @@ class EqMask : public Frei0rFilter, MPFilter {
     }
 
   private:
+    int width;
+    int height;
+    double hfov0;
+    double hfov1;
+    double vfov0;
+    double vfov1;
+    const unsigned char* map;
+};
+
+class EqMask : public Frei0rFilter {
+
+  public:
+    Frei0rParameter<double,double> hfov0;
+    Frei0rParameter<double,double> hfov1;
+    Frei0rParameter<double,double> vfov0;
+    Frei0rParameter<double,double> vfov1;
 
+    std::mutex lock;
+
+    /**
+     * The masks. Frames in flight hold their own reference, so a mask can be
+     * replaced while they are still using it.
+     */
+    BackgroundMap maps;
+
+    EqMask(unsigned int width, unsigned int height) : Frei0rFilter(width, height) {
+        hfov0 = 160.0;
+        hfov1 = 180.0;
+        vfov0 = 120.0;
+        vfov1 = 140.0;
+
+        register_fparam(hfov0, "hfov0", "");
+        register_fparam(hfov1, "hfov1", "");
+        register_fparam(vfov0, "vfov0", "");
+        register_fparam(vfov1, "vfov1", "");
+    }
+
+    ~EqMask() {
+    }
+
+    MapKey mapKey(const EqMaskParameters& parameters) {
+        return MapKey("bigsh0t_eq_mask", width, height).add(parameters.hfov0).add(parameters.hfov1).add(parameters.vfov0).add(parameters.vfov1);
+    }
+
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        EqMaskParameters parameters;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            parameters.hfov0 = hfov0.read();
+            parameters.hfov1 = hfov1.read();
+            parameters.vfov0 = vfov0.read();
+            parameters.vfov1 = vfov1.read();
+        }
+
+        MapKey key = mapKey(parameters);
+        std::shared_ptr<unsigned char> frameMap = maps.get<unsigned char>(key);
+        if (!frameMap) {
+            maps.build(key, [this, parameters](const std::atomic<bool>& cancelled) {
+                std::shared_ptr<unsigned char> map((unsigned char*) malloc (width * height), free);
+                EqMaskFrame builder(width, height, parameters, NULL);
+                bool complete = BackgroundMap::forEachChunk(height, cancelled, [&](int start, int num) {
+                    builder.makeMap(map.get() + start * width, start, num);
+                });
+                return complete ? map : std::shared_ptr<unsigned char>();
+            }, width * height);
+
+            // Without worker threads the map has been built already
+            frameMap = maps.get<unsigned char>(key);
+        }
+        if (!frameMap && BackgroundMap::useStaleMaps()) {
+            frameMap = maps.latest<unsigned char>();
+        }
+
+        EqMaskFrame frame(width, height, parameters, frameMap.get());
+        MPFilter::updateMP(&frame, time, out, in, width, height);
+    }
 };
 
 frei0r::construct<EqMask> plugin("bigsh0t_eq_mask",
@@ -1,14 +1,20 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
 #include <limits>
 #include <climits>
 #include <cmath>
 #include <mutex>
+#include <memory>
+#include <vector>
 
 #include "frei0r.hpp"
 #include "Math.hpp"
 #include "Matrix.hpp"
 #include "MPFilter.hpp"
 #include "ImageProcessing.hpp"
+#include "MapCache.hpp"
+#include "MapStrategy.hpp"
+#include "VectorMath.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
 #include "Version.hpp"
@@ -17,197 +23,422 @@
 #define INTERP_NONE 0
 
 
-class EqToRect : public Frei0rFilter, MPFilter {
+class EqToRectParameters {
+  public:
+    double yaw;
+    double pitch;
+    double roll;
+    double fov;
+    double fisheye;
+
+    bool operator== (const EqToRectParameters& other) const {
+        return yaw == other.yaw && pitch == other.pitch && roll == other.roll && fov == other.fov && fisheye == other.fisheye;
+    }
+};
 
+/**
+ * Maps pixels in the rectilinear image to the equirectangular.
+ */
+class EqToRectProjection final : public Projection360 {
   public:
-    Frei0rParameter<double,double> yaw;
-    Frei0rParameter<double,double> pitch;
-    Frei0rParameter<double,double> roll;
-    Frei0rParameter<double,double> fov;
-    Frei0rParameter<double,double> fisheye;
-    Frei0rParameter<int,double> interpolation;
-    bool updateMap;
-    float* map;
+    EqToRectProjection(int width, int height, const EqToRectParameters& parameters) :
+        width(width), height(height), fov(parameters.fov) {
+        double yawR = DEG2RADF(parameters.yaw);
+        double pitchR = DEG2RADF(parameters.pitch);
+        double rollR = DEG2RADF(parameters.roll);
 
-    std::mutex lock;
+        xform.identity();
+        rotateX(xform, rollR);
+        rotateY(xform, pitchR);
+        rotateZ(xform, yawR);
 
-    EqToRect(unsigned int width, unsigned int height) : Frei0rFilter(width, height) {
-        yaw = 0.0;
-        pitch = 0.0;
-        roll = 0.0;
-        fisheye = 0.0;
-        fov = 90.0;
+        topLeft[0] = 1.0;
+        topLeft[1] = -tan(DEG2RADF(fov / 2));
+        topLeft[2] = topLeft[1] * height / width;
 
-        interpolation = Interpolation::BILINEAR;
+        delta[0] = 0.0;
+        delta[1] = -topLeft[1] / (width / 2);
+        delta[2] = -topLeft[2] / (height / 2);
 
-        map = NULL;
+        fe = parameters.fisheye / 100;
+        ife = 1.0 - fe;
+        maxdc = sqrt(width * width + height * height) / 2.0;
 
-        register_fparam(yaw, "yaw", "");
-        register_fparam(pitch, "pitch", "");
-        register_fparam(roll, "roll", "");
-        register_fparam(fov, "fov", "");
-        register_fparam(fisheye, "fisheye", "");
-        register_fparam(interpolation, "interpolation", "");
-    }
+        fisheyeEnabled = true;
+        rectilinearEnabled = true;
 
-    ~EqToRect() {
-        if (map != NULL) {
-            free(map);
+        if (fov > 179.9) {
+            fe = 1.0;
+            ife = 0.0;
+        }
+
+        if (fe > 0.99) {
+            fisheyeEnabled = true;
+            rectilinearEnabled = false;
+        } else if (fe < 0.01) {
+            fisheyeEnabled = false;
+            rectilinearEnabled = true;
         }
     }
 
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
+    virtual bool project(double x, double y, double& xt, double& yt) const {
+        Vector3 rray;
+        rray.zero();
 
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
+        Vector3 fray;
+        fray.zero();
 
-        if (map == NULL || yaw.changed() || pitch.changed() || roll.changed() || fov.changed() || fisheye.changed()) {
-            if (map == NULL) {
-                map = (float*) malloc (2 * width * height * sizeof(float));
-            }
-            updateMap = true;
+        Vector3 ray;
+        Vector3 ray2;
+
+        if (rectilinearEnabled) {
+            rray[0] = 1.0;
+            rray[1] = topLeft[1] + x * delta[1];
+            rray[2] = topLeft[2] + y * delta[2];
+            mulV3S(rray, ife, rray);
         }
 
-        MPFilter::updateMP(this, time, out, in, width, height);
-    }
+        if (fisheyeEnabled) {
+            double dx = x;
+            dx -= (width / 2.0);
+            double dy = y;
+            dy -= (height / 2.0);
 
-    virtual void updateLines(double time,
-                             uint32_t* out,
-                             const uint32_t* in, int start, int num) {
-        if (updateMap) {
-            make_map(start, num);
+            double dc = DEG2RADF(fov / 2) * sqrt(dx * dx + dy * dy) / maxdc;
+            double ang = atan2(dy, dx);
+
+            if (dc > M_PI) {
+                return false;
+            }
+
+            fray[0] = cos(dc);
+            fray[1] = sin(dc) * cos(ang);
+            fray[2] = sin(dc) * sin(ang);
+            mulV3S(fray, fe, fray);
         }
-        apply_360_map (out, (uint32_t*) in, map, width, height, start, num, interpolation);
-    }
 
-  protected:
-    void make_map(int start_scanline, int num_scanlines) {
+        addV3V3(rray, fray, ray);
 
-        int w = width;
-        int h = height;
+        mulM3V3(xform, ray, ray2);
 
-        double yawR = DEG2RADF(yaw);
-        double pitchR = DEG2RADF(pitch);
-        double rollR = DEG2RADF(roll);
+        double theta_out = fastAtan2 (ray2[1], ray2[0]);
+        double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
+        double phi_out = fastAtan2 (ray2[2], dxy);
 
-        Matrix3 xform;
+        toEquirectangular(theta_out, phi_out, xt, yt);
+        return true;
+    }
 
-        xform.identity();
-        rotateX(xform, rollR);
-        rotateY(xform, pitchR);
-        rotateZ(xform, yawR);
+    /**
+     * Room for the rays of a scanline, so that the scanlines of a chunk can
+     * be projected one after the other without allocating.
+     */
+    class RowBuffers {
+      public:
+        RowBuffers(int width) :
+            rx(width), ry(width), rz(width), r(width), dc(width), sin_dc(width), cos_dc(width), theta_out(width), inside(width) {
+        }
 
-        int xi, yi;
-        double xt, yt;
+        std::vector<double> rx;
+        std::vector<double> ry;
+        std::vector<double> rz;
+        std::vector<double> r;
+        std::vector<double> dc;
+        std::vector<double> sin_dc;
+        std::vector<double> cos_dc;
+        std::vector<double> theta_out;
+        std::vector<bool> inside;
+    };
+
+    /**
+     * Projects a whole scanline into a map, using the batch math functions.
+     * Gives the same result as project, except that the fisheye angles come
+     * from batchSinCos instead of the standard library.
+     */
+    void projectRow(int y, Map360Entry* out, RowBuffers& buffers) const {
+        std::vector<double>& rx = buffers.rx;
+        std::vector<double>& ry = buffers.ry;
+        std::vector<double>& rz = buffers.rz;
+        std::vector<bool>& inside = buffers.inside;
+        std::fill(rx.begin(), rx.end(), 0.0);
+        std::fill(ry.begin(), ry.end(), 0.0);
+        std::fill(rz.begin(), rz.end(), 0.0);
+        std::fill(inside.begin(), inside.end(), true);
+
+        if (rectilinearEnabled) {
+            double rray2 = ife * (topLeft[2] + y * delta[2]);
+            for (int xi = 0; xi < width; xi++) {
+                rx[xi] = ife * 1.0;
+                ry[xi] = ife * (topLeft[1] + xi * delta[1]);
+                rz[xi] = rray2;
+            }
+        }
 
-        Vector3 rray;
-        rray.zero();
+        if (fisheyeEnabled) {
+            std::vector<double>& r = buffers.r;
+            std::vector<double>& dc = buffers.dc;
+            std::vector<double>& sin_dc = buffers.sin_dc;
+            std::vector<double>& cos_dc = buffers.cos_dc;
+            double dy = y;
+            dy -= (height / 2.0);
+            for (int xi = 0; xi < width; xi++) {
+                double dx = xi;
+                dx -= (width / 2.0);
+                r[xi] = dx * dx + dy * dy;
+            }
+            batchSqrt(r.data(), r.data(), width);
+            double dcScale = DEG2RADF(fov / 2);
+            for (int xi = 0; xi < width; xi++) {
+                dc[xi] = dcScale * r[xi] / maxdc;
+                inside[xi] = dc[xi] <= M_PI;
+            }
+            batchSinCos(dc.data(), sin_dc.data(), cos_dc.data(), width);
+            for (int xi = 0; xi < width; xi++) {
+                double dx = xi;
+                dx -= (width / 2.0);
+                // cos and sin of atan2(dy, dx), which is zero at the center
+                double cos_ang = 1.0;
+                double sin_ang = 0.0;
+                if (r[xi] > 0) {
+                    cos_ang = dx / r[xi];
+                    sin_ang = dy / r[xi];
+                }
+                rx[xi] += fe * cos_dc[xi];
+                ry[xi] += fe * (sin_dc[xi] * cos_ang);
+                rz[xi] += fe * (sin_dc[xi] * sin_ang);
+            }
+        }
 
-        Vector3 fray;
-        fray.zero();
+        for (int xi = 0; xi < width; xi++) {
+            double x0 = rx[xi];
+            double y0 = ry[xi];
+            double z0 = rz[xi];
+            rx[xi] = xform[0] * x0 + xform[1] * y0 + xform[2] * z0;
+            ry[xi] = xform[3] * x0 + xform[4] * y0 + xform[5] * z0;
+            rz[xi] = xform[6] * x0 + xform[7] * y0 + xform[8] * z0;
+        }
 
-        Vector3 ray;
-        Vector3 ray2;
+        std::vector<double>& theta_out = buffers.theta_out;
+        batchAtan2(ry.data(), rx.data(), theta_out.data(), width);
+        for (int xi = 0; xi < width; xi++) {
+            rx[xi] = rx[xi] * rx[xi] + ry[xi] * ry[xi];
+        }
+        batchSqrt(rx.data(), rx.data(), width);
+        batchAtan2(rz.data(), rx.data(), rz.data(), width);
+
+        for (int xi = 0; xi < width; xi++) {
+            if (inside[xi]) {
+                double xt;
+                double yt;
+                toEquirectangular(theta_out[xi], rz[xi], xt, yt);
+                out[xi] = makeMap360Entry(xt, yt);
+            } else {
+                out[xi] = makeMap360Entry(-1, 0);
+            }
+        }
+    }
 
-        Vector3 topLeft;
-        topLeft[0] = 1.0;
-        topLeft[1] = -tan(DEG2RADF(fov / 2));
-        topLeft[2] = topLeft[1] * height / width;
+  private:
+    void toEquirectangular(double theta_out, double phi_out, double& xt, double& yt) const {
+        int w = width;
+        int h = height;
 
-        Vector3 delta;
-        delta[0] = 0.0;
-        delta[1] = -topLeft[1] / (width / 2);
-        delta[2] = -topLeft[2] / (height / 2);
+        xt = w / 2 + (w / 2) * theta_out / M_PI;
+        yt = h / 2 + (h / 2) * phi_out / (M_PI / 2);
 
-        double fe = fisheye / 100;
-        double ife = 1.0 - fe;
-        double maxdc = sqrt(width * width + height * height) / 2.0;
+        if (xt < 0) {
+            xt += w;
+        }
+        if (xt >= w) {
+            xt -= w;
+        }
 
-        bool fisheyeEnabled = true;
-        bool rectilinearEnabled = true;
+        if (yt < 0) {
+            yt = 0;
+        }
+        if (yt > h - 1) {
+            yt = h - 1;
+        }
+    }
 
-        if (fov > 179.9) {
-            fe = 1.0;
-            ife = 0.0;
+    int width;
+    int height;
+    double fov;
+    Matrix3 xform;
+    Vector3 topLeft;
+    Vector3 delta;
+    double fe;
+    double ife;
+    double maxdc;
+    bool fisheyeEnabled;
+    bool rectilinearEnabled;
+};
+
+/**
+ * Renders one frame from a parameter snapshot through a map. If no map is
+ * given, the map is built and applied a row at a time instead, which gives
+ * the same result. Frames too large for a map are rendered by
+ * apply_360_projection.
+ */
+class EqToRectFrame : public MPFilter {
+  public:
+    EqToRectFrame(int width, int height, const EqToRectParameters& parameters, int interpolation, Map360Entry* map, bool buildMap) :
+        width(width), height(height), projection(width, height, parameters), interpolation(interpolation),
+        map(map), buildMap(buildMap) {
+    }
+
+    virtual void updateLines(double time,
+                             uint32_t* out,
+                             const uint32_t* in, int start, int num) {
+        if (map == NULL) {
+            if (canMap360(width, height)) {
+                render_direct(out, in, start, num);
+            } else {
+                apply_360_projection(projection, out, (uint32_t*) in, width, height, start, num, interpolation);
+            }
+            return;
+        }
+        if (buildMap) {
+            make_map(start, num);
         }
+        apply_360_map (out, (uint32_t*) in, map, width, height, start, num, interpolation);
+    }
 
-        if (fe > 0.99) {
-            fisheyeEnabled = true;
-            rectilinearEnabled = false;
-        } else if (fe < 0.01) {
-            fisheyeEnabled = false;
-            rectilinearEnabled = true;
+  protected:
+    void make_map(int start_scanline, int num_scanlines) {
+        EqToRectProjection::RowBuffers buffers(width);
+        for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+            projection.projectRow(yi, map + yi * width, buffers);
         }
+    }
 
+    void render_direct(uint32_t* out, const uint32_t* in, int start_scanline, int num_scanlines) {
+        EqToRectProjection::RowBuffers buffers(width);
+        std::vector<Map360Entry> row(width);
+        for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+            projection.projectRow(yi, row.data(), buffers);
+            // The map entries hold source coordinates, so a map of one row
+            // can be applied as if it were the first row of the frame.
+            apply_360_map (out + yi * width, (uint32_t*) in, row.data(), width, height, 0, 1, interpolation);
+        }
+    }
+
+  private:
+    int width;
+    int height;
+    EqToRectProjection projection;
+    int interpolation;
+    Map360Entry* map;
+    bool buildMap;
+};
 
-        for (yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
-            for (xi = 0; xi < w; xi++) {
-                int midx = (yi * width + xi) * 2;
+class EqToRect : public Frei0rFilter {
 
-                if (rectilinearEnabled) {
-                    rray[0] = 1.0;
-                    rray[1] = topLeft[1] + xi * delta[1];
-                    rray[2] = topLeft[2] + yi * delta[2];
-                    mulV3S(rray, ife, rray);
-                }
+  public:
+    Frei0rParameter<double,double> yaw;
+    Frei0rParameter<double,double> pitch;
+    Frei0rParameter<double,double> roll;
+    Frei0rParameter<double,double> fov;
+    Frei0rParameter<double,double> fisheye;
+    Frei0rParameter<int,double> interpolation;
 
-                if (fisheyeEnabled) {
-                    double dx = xi;
-                    dx -= (width / 2.0);
-                    double dy = yi;
-                    dy -= (height / 2.0);
+    /**
+     * The most recently built map and the parameters it was built for.
+     */
+    std::shared_ptr<Map360Entry> map;
+    EqToRectParameters mapParameters;
 
-                    double dc = DEG2RADF(fov / 2) * sqrt(dx * dx + dy * dy) / maxdc;
-                    double ang = atan2(dy, dx);
+    /**
+     * Decides between the map and rendering directly. While the parameters are
+     * animated, building a map seldom pays off.
+     */
+    MapStrategy strategy;
 
-                    if (dc > M_PI) {
-                        map[midx] = -1;
-                        continue;
-                    }
+    std::mutex lock;
 
-                    fray[0] = cos(dc);
-                    fray[1] = sin(dc) * cos(ang);
-                    fray[2] = sin(dc) * sin(ang);
-                    mulV3S(fray, fe, fray);
-                }
+    EqToRect(unsigned int width, unsigned int height) : Frei0rFilter(width, height) {
+        yaw = 0.0;
+        pitch = 0.0;
+        roll = 0.0;
+        fisheye = 0.0;
+        fov = 90.0;
 
-                addV3V3(rray, fray, ray);
+        interpolation = Interpolation::BILINEAR;
 
-                mulM3V3(xform, ray, ray2);
+        register_fparam(yaw, "yaw", "");
+        register_fparam(pitch, "pitch", "");
+        register_fparam(roll, "roll", "");
+        register_fparam(fov, "fov", "");
+        register_fparam(fisheye, "fisheye", "");
+        register_fparam(interpolation, "interpolation", "");
+    }
 
-                double theta_out = atan2 (ray2[1], ray2[0]);
-                double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
-                double phi_out = atan2 (ray2[2], dxy);
+    ~EqToRect() {
+    }
 
-                xt = w / 2 + (w / 2) * theta_out / M_PI;
-                yt = h / 2 + (h / 2) * phi_out / (M_PI / 2);
+    MapKey mapKey(const EqToRectParameters& parameters) {
+        return MapKey("bigsh0t_eq_to_rect", width, height).add(parameters.yaw).add(parameters.pitch).add(parameters.roll).add(parameters.fov).add(parameters.fisheye);
+    }
 
-                if (xt < 0) {
-                    xt += w;
-                }
-                if (xt >= w) {
-                    xt -= w;
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        EqToRectParameters parameters;
+        int frameInterpolation;
+        std::shared_ptr<Map360Entry> frameMap;
+        bool buildMap = false;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters and the map under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            parameters.yaw = yaw.read();
+            parameters.pitch = pitch.read();
+            parameters.roll = roll.read();
+            parameters.fov = fov.read();
+            parameters.fisheye = fisheye.read();
+            frameInterpolation = interpolation.read();
+
+            strategy.next(mapKey(parameters));
+            if (!(map && mapParameters == parameters)) {
+                std::shared_ptr<Map360Entry> cached = MapCache::instance().get<Map360Entry>(mapKey(parameters));
+                if (cached) {
+                    map = cached;
+                    mapParameters = parameters;
                 }
+            }
 
-                if (yt < 0) {
-                    yt = 0;
-                }
-                if (yt > h - 1) {
-                    yt = h - 1;
+            if (map && mapParameters == parameters) {
+                if (strategy.useMap()) {
+                    frameMap = map;
                 }
-
-                map[midx] = (float) xt;
-                map[midx + 1] = (float) yt;
+            } else if (canMap360(width, height) && strategy.buildMap()) {
+                frameMap = std::shared_ptr<Map360Entry>((Map360Entry*) malloc (width * height * sizeof(Map360Entry)), free);
+                buildMap = true;
             }
         }
-    }
 
+        MapStrategy::Timer timer;
+        EqToRectFrame frame(width, height, parameters, frameInterpolation, frameMap.get(), buildMap);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
 
-  private:
+        if (!frameMap) {
+            strategy.addDirectTime(timer.seconds());
+        } else if (!buildMap) {
+            strategy.addMapTime(timer.seconds());
+        } else {
+            // The map is built while the frame is rendered, so this includes
+            // applying it, which makes the estimate err towards not building.
+            strategy.addBuildTime(timer.seconds());
+
+            MapCache::instance().put(mapKey(parameters), frameMap, width * height * sizeof(Map360Entry));
 
+            std::lock_guard<std::mutex> guard(lock);
+            map = frameMap;
+            mapParameters = parameters;
+        }
+    }
 };
 
 frei0r::construct<EqToRect> plugin("bigsh0t_eq_to_rect",
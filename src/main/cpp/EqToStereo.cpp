@@ -3,12 +3,17 @@
 #include <climits>
 #include <cmath>
 #include <mutex>
+#include <memory>
+#include <vector>
 
 #include "frei0r.hpp"
 #include "Math.hpp"
 #include "Matrix.hpp"
 #include "MPFilter.hpp"
 #include "ImageProcessing.hpp"
+#include "MapCache.hpp"
+#include "MapStrategy.hpp"
+#include "VectorMath.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
 #include "Version.hpp"
@@ -16,67 +21,205 @@
 #define INTERP_NONE 0
 
 
-class EqToStereo : public Frei0rFilter, MPFilter {
+class EqToStereoParameters {
+  public:
+    double yaw;
+    double pitch;
+    double roll;
+    double fov;
+    double amount;
+
+    bool operator== (const EqToStereoParameters& other) const {
+        return yaw == other.yaw && pitch == other.pitch && roll == other.roll && fov == other.fov && amount == other.amount;
+    }
+};
 
+/**
+ * Maps pixels in the stereographic image to the equirectangular.
+ */
+class EqToStereoProjection final : public Projection360 {
   public:
-    Frei0rParameter<double,double> yaw;
-    Frei0rParameter<double,double> pitch;
-    Frei0rParameter<double,double> roll;
-    Frei0rParameter<double,double> fov;
-    Frei0rParameter<double,double> amount;
-    Frei0rParameter<int,double> interpolation;
-    bool updateMap;
-    float* map;
+    EqToStereoProjection(int width, int height, const EqToStereoParameters& parameters) :
+        width(width), height(height) {
+        double yawR = DEG2RADF(parameters.yaw);
+        double pitchR = DEG2RADF(parameters.pitch);
+        double rollR = DEG2RADF(parameters.roll);
 
-    std::mutex lock;
+        xform.identity();
+        rotateX(xform, rollR);
+        rotateY(xform, pitchR);
+        rotateZ(xform, yawR);
 
-    EqToStereo(unsigned int width, unsigned int height) : Frei0rFilter(width, height) {
-        yaw = 0.0;
-        pitch = 0.0;
-        roll = 0.0;
-        amount = 0.0;
-        fov = 90.0;
+        famount = parameters.amount / 100.0;
 
-        interpolation = Interpolation::BILINEAR;
+        viewer[0] = -famount;
+        viewer[1] = 0.0;
+        viewer[2] = 0.0;
 
-        map = NULL;
+        topLeft[0] = 1.0;
+        topLeft[1] = -tan(DEG2RADF(parameters.fov / 2));
+        topLeft[2] = topLeft[1] * height / width;
 
-        register_fparam(yaw, "yaw", "");
-        register_fparam(pitch, "pitch", "");
-        register_fparam(roll, "roll", "");
-        register_fparam(fov, "fov", "");
-        register_fparam(amount, "amount", "");
-        register_fparam(interpolation, "interpolation", "");
+        delta[0] = 0.0;
+        delta[1] = -topLeft[1] / (width / 2);
+        delta[2] = delta[1];
+
+        amount2 = famount * famount;
     }
 
-    ~EqToStereo() {
-        if (map != NULL) {
-            free(map);
+    virtual bool project(double x, double y, double& xt, double& yt) const {
+        Vector3 iray;
+        Vector3 p;
+        Vector3 ray2;
+
+        iray[0] = 1.0 + famount;
+        iray[1] = topLeft[1] + delta[1] * x;
+        iray[2] = topLeft[2] + delta[2] * y;
+        iray.normalize();
+
+        double rdv = dotV3V3(iray, viewer);
+
+        double nabla = rdv * rdv - (amount2 - 1);
+
+        double d = - rdv + sqrt(nabla);
+
+        p[0] = iray[0] * d + viewer[0];
+        p[1] = iray[1] * d + viewer[1];
+        p[2] = iray[2] * d + viewer[2];
+
+        // p is a 3d point on the image sphere
+        mulM3V3(xform, p, ray2);
+
+        double theta_out = fastAtan2 (ray2[1], ray2[0]);
+        double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
+        double phi_out = fastAtan2 (ray2[2], dxy);
+
+        toEquirectangular(theta_out, phi_out, xt, yt);
+        return true;
+    }
+
+    /**
+     * Room for the rays of a scanline, so that the scanlines of a chunk can
+     * be projected one after the other without allocating.
+     */
+    class RowBuffers {
+      public:
+        RowBuffers(int width) : rx(width), ry(width), rz(width), d(width) {
+        }
+
+        std::vector<double> rx;
+        std::vector<double> ry;
+        std::vector<double> rz;
+        std::vector<double> d;
+    };
+
+    /**
+     * Projects a whole scanline into a map, using the batch math functions.
+     * Gives the same result as project.
+     */
+    void projectRow(int y, Map360Entry* out, RowBuffers& buffers) const {
+        std::vector<double>& rx = buffers.rx;
+        std::vector<double>& ry = buffers.ry;
+        std::vector<double>& rz = buffers.rz;
+        std::vector<double>& d = buffers.d;
+
+        for (int xi = 0; xi < width; xi++) {
+            rx[xi] = 1.0 + famount;
+            ry[xi] = topLeft[1] + delta[1] * xi;
+            rz[xi] = topLeft[2] + delta[2] * y;
+        }
+        batchNormalize(rx.data(), ry.data(), rz.data(), width);
+
+        for (int xi = 0; xi < width; xi++) {
+            double rdv = rx[xi] * viewer[0] + ry[xi] * viewer[1] + rz[xi] * viewer[2];
+            d[xi] = rdv * rdv - (amount2 - 1);
+        }
+        batchSqrt(d.data(), d.data(), width);
+
+        for (int xi = 0; xi < width; xi++) {
+            double rdv = rx[xi] * viewer[0] + ry[xi] * viewer[1] + rz[xi] * viewer[2];
+            double di = - rdv + d[xi];
+            double p0 = rx[xi] * di + viewer[0];
+            double p1 = ry[xi] * di + viewer[1];
+            double p2 = rz[xi] * di + viewer[2];
+            rx[xi] = xform[0] * p0 + xform[1] * p1 + xform[2] * p2;
+            ry[xi] = xform[3] * p0 + xform[4] * p1 + xform[5] * p2;
+            rz[xi] = xform[6] * p0 + xform[7] * p1 + xform[8] * p2;
+        }
+
+        batchAtan2(ry.data(), rx.data(), d.data(), width);
+        for (int xi = 0; xi < width; xi++) {
+            rx[xi] = rx[xi] * rx[xi] + ry[xi] * ry[xi];
+        }
+        batchSqrt(rx.data(), rx.data(), width);
+        batchAtan2(rz.data(), rx.data(), rz.data(), width);
+
+        for (int xi = 0; xi < width; xi++) {
+            double xt;
+            double yt;
+            toEquirectangular(d[xi], rz[xi], xt, yt);
+            out[xi] = makeMap360Entry(xt, yt);
         }
     }
 
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
+  private:
+    void toEquirectangular(double theta_out, double phi_out, double& xt, double& yt) const {
+        int w = width;
+        int h = height;
 
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
+        xt = w / 2 + (w / 2) * theta_out / M_PI;
+        yt = h / 2 + (h / 2) * phi_out / (M_PI / 2);
 
-        if (map == NULL || yaw.changed() || pitch.changed() || roll.changed() || fov.changed() || amount.changed()) {
-            if (map == NULL) {
-                map = (float*) malloc (2 * width * height * sizeof(float));
-            }
-            updateMap = true;
+        if (xt < 0) {
+            xt += w;
+        }
+        if (xt >= w) {
+            xt -= w;
         }
 
-        MPFilter::updateMP(this, time, out, in, width, height);
+        if (yt < 0) {
+            yt = 0;
+        }
+        if (yt > h - 1) {
+            yt = h - 1;
+        }
+    }
+
+    int width;
+    int height;
+    Matrix3 xform;
+    double famount;
+    double amount2;
+    Vector3 viewer;
+    Vector3 topLeft;
+    Vector3 delta;
+};
+
+/**
+ * Renders one frame from a parameter snapshot through a map. If no map is
+ * given, the map is built and applied a row at a time instead, which gives
+ * the same result. Frames too large for a map are rendered by
+ * apply_360_projection.
+ */
+class EqToStereoFrame : public MPFilter {
+  public:
+    EqToStereoFrame(int width, int height, const EqToStereoParameters& parameters, int interpolation, Map360Entry* map, bool buildMap) :
+        width(width), height(height), projection(width, height, parameters), interpolation(interpolation),
+        map(map), buildMap(buildMap) {
     }
 
     virtual void updateLines(double time,
                              uint32_t* out,
                              const uint32_t* in, int start, int num) {
-        if (updateMap) {
+        if (map == NULL) {
+            if (canMap360(width, height)) {
+                render_direct(out, in, start, num);
+            } else {
+                apply_360_projection(projection, out, (uint32_t*) in, width, height, start, num, interpolation);
+            }
+            return;
+        }
+        if (buildMap) {
             make_map(start, num);
         }
         apply_360_map (out, (uint32_t*) in, map, width, height, start, num, interpolation);
@@ -84,100 +227,139 @@ class EqToStereo : public Frei0rFilter, MPFilter {
 
   protected:
     void make_map(int start_scanline, int num_scanlines) {
+        EqToStereoProjection::RowBuffers buffers(width);
+        for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+            projection.projectRow(yi, map + yi * width, buffers);
+        }
+    }
 
-        int w = width;
-        int h = height;
-
-        double yawR = DEG2RADF(yaw);
-        double pitchR = DEG2RADF(pitch);
-        double rollR = DEG2RADF(roll);
-
-        Matrix3 xform;
-
-        xform.identity();
-        rotateX(xform, rollR);
-        rotateY(xform, pitchR);
-        rotateZ(xform, yawR);
-
-        int xi, yi;
-        double xt, yt;
-        double famount = amount / 100.0;
-
-        Vector3 viewer;
-        viewer[0] = -famount;
-        viewer[1] = 0.0;
-        viewer[2] = 0.0;
-
-        Vector3 iray;
-        Vector3 p;
-
-        Vector3 ray;
-        Vector3 ray2;
-
-        Vector3 topLeft;
-        topLeft[0] = 1.0;
-        topLeft[1] = -tan(DEG2RADF(fov / 2));
-        topLeft[2] = topLeft[1] * height / width;
+    void render_direct(uint32_t* out, const uint32_t* in, int start_scanline, int num_scanlines) {
+        EqToStereoProjection::RowBuffers buffers(width);
+        std::vector<Map360Entry> row(width);
+        for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+            projection.projectRow(yi, row.data(), buffers);
+            // The map entries hold source coordinates, so a map of one row
+            // can be applied as if it were the first row of the frame.
+            apply_360_map (out + yi * width, (uint32_t*) in, row.data(), width, height, 0, 1, interpolation);
+        }
+    }
 
-        Vector3 delta;
-        delta[0] = 0.0;
-        delta[1] = -topLeft[1] / (width / 2);
-        delta[2] = delta[1];
+  private:
+    int width;
+    int height;
+    EqToStereoProjection projection;
+    int interpolation;
+    Map360Entry* map;
+    bool buildMap;
+};
 
-        double amount2 = famount * famount;
+class EqToStereo : public Frei0rFilter {
 
-        for (yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
-            for (xi = 0; xi < w; xi++) {
-                int midx = (yi * width + xi) * 2;
+  public:
+    Frei0rParameter<double,double> yaw;
+    Frei0rParameter<double,double> pitch;
+    Frei0rParameter<double,double> roll;
+    Frei0rParameter<double,double> fov;
+    Frei0rParameter<double,double> amount;
+    Frei0rParameter<int,double> interpolation;
 
-                iray[0] = 1.0 + famount;
-                iray[1] = topLeft[1] + delta[1] * xi;
-                iray[2] = topLeft[2] + delta[2] * yi;
-                iray.normalize();
+    /**
+     * The most recently built map and the parameters it was built for.
+     */
+    std::shared_ptr<Map360Entry> map;
+    EqToStereoParameters mapParameters;
 
-                double rdv = dotV3V3(iray, viewer);
+    /**
+     * Decides between the map and rendering directly. While the parameters are
+     * animated, building a map seldom pays off.
+     */
+    MapStrategy strategy;
 
-                double nabla = rdv * rdv - (amount2 - 1);
+    std::mutex lock;
 
-                double d = - rdv + sqrt(nabla);
+    EqToStereo(unsigned int width, unsigned int height) : Frei0rFilter(width, height) {
+        yaw = 0.0;
+        pitch = 0.0;
+        roll = 0.0;
+        amount = 0.0;
+        fov = 90.0;
 
-                p[0] = iray[0] * d + viewer[0];
-                p[1] = iray[1] * d + viewer[1];
-                p[2] = iray[2] * d + viewer[2];
+        interpolation = Interpolation::BILINEAR;
 
-                // p is a 3d point on the image sphere
-                mulM3V3(xform, p, ray2);
+        register_fparam(yaw, "yaw", "");
+        register_fparam(pitch, "pitch", "");
+        register_fparam(roll, "roll", "");
+        register_fparam(fov, "fov", "");
+        register_fparam(amount, "amount", "");
+        register_fparam(interpolation, "interpolation", "");
+    }
 
-                double theta_out = atan2 (ray2[1], ray2[0]);
-                double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
-                double phi_out = atan2 (ray2[2], dxy);
+    ~EqToStereo() {
+    }
 
-                xt = w / 2 + (w / 2) * theta_out / M_PI;
-                yt = h / 2 + (h / 2) * phi_out / (M_PI / 2);
+    MapKey mapKey(const EqToStereoParameters& parameters) {
+        return MapKey("bigsh0t_eq_to_stereo", width, height).add(parameters.yaw).add(parameters.pitch).add(parameters.roll).add(parameters.fov).add(parameters.amount);
+    }
 
-                if (xt < 0) {
-                    xt += w;
-                }
-                if (xt >= w) {
-                    xt -= w;
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        EqToStereoParameters parameters;
+        int frameInterpolation;
+        std::shared_ptr<Map360Entry> frameMap;
+        bool buildMap = false;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters and the map under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            parameters.yaw = yaw.read();
+            parameters.pitch = pitch.read();
+            parameters.roll = roll.read();
+            parameters.fov = fov.read();
+            parameters.amount = amount.read();
+            frameInterpolation = interpolation.read();
+
+            strategy.next(mapKey(parameters));
+            if (!(map && mapParameters == parameters)) {
+                std::shared_ptr<Map360Entry> cached = MapCache::instance().get<Map360Entry>(mapKey(parameters));
+                if (cached) {
+                    map = cached;
+                    mapParameters = parameters;
                 }
+            }
 
-                if (yt < 0) {
-                    yt = 0;
-                }
-                if (yt > h - 1) {
-                    yt = h - 1;
+            if (map && mapParameters == parameters) {
+                if (strategy.useMap()) {
+                    frameMap = map;
                 }
-
-                map[midx] = (float) xt;
-                map[midx + 1] = (float) yt;
+            } else if (canMap360(width, height) && strategy.buildMap()) {
+                frameMap = std::shared_ptr<Map360Entry>((Map360Entry*) malloc (width * height * sizeof(Map360Entry)), free);
+                buildMap = true;
             }
         }
-    }
 
+        MapStrategy::Timer timer;
+        EqToStereoFrame frame(width, height, parameters, frameInterpolation, frameMap.get(), buildMap);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
 
-  private:
+        if (!frameMap) {
+            strategy.addDirectTime(timer.seconds());
+        } else if (!buildMap) {
+            strategy.addMapTime(timer.seconds());
+        } else {
+            // The map is built while the frame is rendered, so this includes
+            // applying it, which makes the estimate err towards not building.
+            strategy.addBuildTime(timer.seconds());
+
+            MapCache::instance().put(mapKey(parameters), frameMap, width * height * sizeof(Map360Entry));
 
+            std::lock_guard<std::mutex> guard(lock);
+            map = frameMap;
+            mapParameters = parameters;
+        }
+    }
 };
 
 frei0r::construct<EqToStereo> plugin("bigsh0t_eq_to_stereo",
@@ -4,6 +4,7 @@
 #include <cmath>
 #include <mutex>
 #include <cstring>
+#include <vector>
 
 #include "frei0r.hpp"
 #include "Matrix.hpp"
@@ -16,65 +17,17 @@
 #include "Version.hpp"
 
 
-class EqWrap : public Frei0rFilter, MPFilter {
-
+/**
+ * Renders one frame. The pixel extents are computed from a snapshot
+ * of the parameters when the object is created.
+ */
+class EqWrapFrame : public MPFilter {
   public:
-    SummedAreaTable sat;
-    Frei0rParameter<int,double> interpolation;
-    Frei0rParameter<double,double> hfov0;
-    Frei0rParameter<double,double> hfov1;
-    Frei0rParameter<double,double> vfov0;
-    Frei0rParameter<double,double> vfov1;
-    Frei0rParameter<double,double> blurStart;
-    Frei0rParameter<double,double> blurEnd;
-    Transform360Support t360;
-
-    std::mutex lock;
-
-    int hfov0px;
-    int hfov1px;
-    int vfov0px;
-    int vfov1px;
-    int hfovPx;
-    int vfovPx;
-    int blurStartPx;
-    int blurEndPx;
-    double pitchPixels;
-    double yawPixels;
-
-    EqWrap(unsigned int width, unsigned int height) : Frei0rFilter(width, height), sat(width, height), t360(width, height) {
-        interpolation = 0;
-
-        hfov0 = -90.0;
-        hfov1 = 90.0;
-        vfov0 = -45.0;
-        vfov1 = 45.0;
-        blurStart = 0.1;
-        blurEnd = 1.0;
-
-        register_fparam(hfov0, "hfov0", "");
-        register_fparam(hfov1, "hfov1", "");
-        register_fparam(vfov0, "vfov0", "");
-        register_fparam(vfov1, "vfov1", "");
-        register_fparam(blurStart, "blurStart", "");
-        register_fparam(blurEnd, "blurEnd", "");
-
-        register_fparam(interpolation, "interpolation", "");
-
-        pitchPixels = height / 180.0;
-        yawPixels = width / 360.0;
-    }
-
-    ~EqWrap() {
-    }
-
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
-
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
+    EqWrapFrame(int width, int height, SummedAreaTable& sat,
+                double hfov0, double hfov1, double vfov0, double vfov1, double blurStart, double blurEnd) :
+        width(width), height(height), sat(sat) {
+        double pitchPixels = height / 180.0;
+        double yawPixels = width / 360.0;
 
         hfov0px = hfov0 * yawPixels + width / 2;
         hfov1px = hfov1 * yawPixels + width / 2;
@@ -100,10 +53,10 @@ class EqWrap : public Frei0rFilter, MPFilter {
         if (blurEndPx < blurStartPx) {
             blurEndPx = blurStartPx;
         }
+    }
 
+    void computeSummedAreaTable(const uint32_t* in) {
         sat.compute(in, width, hfov0px, vfov0px, hfovPx, vfovPx);
-
-        MPFilter::updateMP(this, time, out, in, width, height);
     }
 
     virtual void updateLines(double time,
@@ -166,10 +119,108 @@ class EqWrap : public Frei0rFilter, MPFilter {
         }
     }
 
-  protected:
-
   private:
+    int width;
+    int height;
+    SummedAreaTable& sat;
+
+    int hfov0px;
+    int hfov1px;
+    int vfov0px;
+    int vfov1px;
+    int hfovPx;
+    int vfovPx;
+    int blurStartPx;
+    int blurEndPx;
+};
+
+class EqWrap : public Frei0rFilter {
+
+  public:
+    Frei0rParameter<int,double> interpolation;
+    Frei0rParameter<double,double> hfov0;
+    Frei0rParameter<double,double> hfov1;
+    Frei0rParameter<double,double> vfov0;
+    Frei0rParameter<double,double> vfov1;
+    Frei0rParameter<double,double> blurStart;
+    Frei0rParameter<double,double> blurEnd;
+    Transform360Support t360;
+
+    std::mutex lock;
+
+    /**
+     * Summed area tables not used by any frame in flight. Each frame
+     * takes one from here, or allocates a new one if there are none left.
+     */
+    std::vector<SummedAreaTable*> spareTables;
+
+    EqWrap(unsigned int width, unsigned int height) : Frei0rFilter(width, height), t360(width, height) {
+        interpolation = 0;
+
+        hfov0 = -90.0;
+        hfov1 = 90.0;
+        vfov0 = -45.0;
+        vfov1 = 45.0;
+        blurStart = 0.1;
+        blurEnd = 1.0;
+
+        register_fparam(hfov0, "hfov0", "");
+        register_fparam(hfov1, "hfov1", "");
+        register_fparam(vfov0, "vfov0", "");
+        register_fparam(vfov1, "vfov1", "");
+        register_fparam(blurStart, "blurStart", "");
+        register_fparam(blurEnd, "blurEnd", "");
 
+        register_fparam(interpolation, "interpolation", "");
+    }
+
+    ~EqWrap() {
+        for (SummedAreaTable* sat : spareTables) {
+            delete sat;
+        }
+    }
+
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        double frameHfov0;
+        double frameHfov1;
+        double frameVfov0;
+        double frameVfov1;
+        double frameBlurStart;
+        double frameBlurEnd;
+        SummedAreaTable* sat = NULL;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            frameHfov0 = hfov0;
+            frameHfov1 = hfov1;
+            frameVfov0 = vfov0;
+            frameVfov1 = vfov1;
+            frameBlurStart = blurStart;
+            frameBlurEnd = blurEnd;
+
+            if (!spareTables.empty()) {
+                sat = spareTables.back();
+                spareTables.pop_back();
+            }
+        }
+        if (sat == NULL) {
+            sat = new SummedAreaTable(width, height);
+        }
+
+        EqWrapFrame frame(width, height, *sat, frameHfov0, frameHfov1, frameVfov0, frameVfov1, frameBlurStart, frameBlurEnd);
+        frame.computeSummedAreaTable(in);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            spareTables.push_back(sat);
+        }
+    }
 };
 
 frei0r::construct<EqWrap> plugin("bigsh0t_eq_wrap",
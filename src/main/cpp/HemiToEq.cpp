@@ -3,16 +3,22 @@
 #include <climits>
 #include <cmath>
 #include <mutex>
+#include <memory>
+#include <vector>
 
 #include "frei0r.hpp"
 #include "Matrix.hpp"
 #include "EMoR.hpp"
 #include "MPFilter.hpp"
+#include "BackgroundMap.hpp"
 #include "ImageProcessing.hpp"
+#include "MapCache.hpp"
+#include "MapStrategy.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
 #include "Version.hpp"
 #include "Math.hpp"
+#include "VectorMath.hpp"
 
 
 enum Projection {
@@ -21,43 +27,79 @@ enum Projection {
 
 const int MAP_ENTRY_SIZE = 7;
 
-class HemiToEquirect : public Frei0rFilter, MPFilter {
+/**
+ * The parameters that the map depends on.
+ */
+class HemiToEquirectParameters {
+  public:
+    double yaw;
+    double pitch;
+    double roll;
+    int projection;
+    double fov;
+    double radius;
+    double frontX;
+    double frontY;
+    double frontUp;
+    double backX;
+    double backY;
+    double backUp;
+    double nadirRadius;
+    double nadirCorrectionStart;
+    double distortionA;
+    double distortionB;
+    double distortionC;
+    double distortionRadius;
+    double vignettingA;
+    double vignettingB;
+    double vignettingC;
+    double vignettingD;
+    double vignettingRadius;
+    double emorH1;
+    double emorH2;
+    double emorH3;
+    double emorH4;
+    double emorH5;
+
+    bool operator== (const HemiToEquirectParameters& other) const {
+        return yaw == other.yaw && pitch == other.pitch && roll == other.roll &&
+               projection == other.projection && fov == other.fov && radius == other.radius &&
+               frontX == other.frontX && frontY == other.frontY && frontUp == other.frontUp &&
+               backX == other.backX && backY == other.backY && backUp == other.backUp &&
+               nadirRadius == other.nadirRadius && nadirCorrectionStart == other.nadirCorrectionStart &&
+               distortionA == other.distortionA && distortionB == other.distortionB && distortionC == other.distortionC &&
+               distortionRadius == other.distortionRadius &&
+               vignettingA == other.vignettingA && vignettingB == other.vignettingB && vignettingC == other.vignettingC &&
+               vignettingD == other.vignettingD && vignettingRadius == other.vignettingRadius &&
+               emorH1 == other.emorH1 && emorH2 == other.emorH2 && emorH3 == other.emorH3 &&
+               emorH4 == other.emorH4 && emorH5 == other.emorH5;
+    }
+};
 
+class HemiToEquirectMap {
   public:
-    Frei0rParameter<double,double> yaw;
-    Frei0rParameter<double,double> pitch;
-    Frei0rParameter<double,double> roll;
-    Frei0rParameter<int,double> interpolation;
-    Frei0rParameter<int,double> projection;
-    Frei0rParameter<double,double> fov;
-    Frei0rParameter<double,double> radius;
-    Frei0rParameter<double,double> frontX;
-    Frei0rParameter<double,double> frontY;
-    Frei0rParameter<double,double> frontUp;
-    Frei0rParameter<double,double> backX;
-    Frei0rParameter<double,double> backY;
-    Frei0rParameter<double,double> backUp;
-    Frei0rParameter<double,double> nadirRadius;
-    Frei0rParameter<double,double> nadirCorrectionStart;
+    /**
+     * @param allocate false if the map will not be filled in, and frames
+     *                 build it a few rows at a time instead
+     */
+    HemiToEquirectMap(int width, int height, const HemiToEquirectParameters& parameters, bool allocate) : parameters(parameters), map(NULL) {
+        if (allocate) {
+            map = (float*) malloc (width * height * MAP_ENTRY_SIZE * sizeof(float));
+        }
 
-    Frei0rParameter<double,double> distortionA;
-    Frei0rParameter<double,double> distortionB;
-    Frei0rParameter<double,double> distortionC;
-    Frei0rParameter<double,double> distortionRadius;
+        std::vector<double> emorParameters = { parameters.emorH1, parameters.emorH2, parameters.emorH3, parameters.emorH4, parameters.emorH5 };
+        emor.compute(emorParameters, 16, 255);
+        emor.initialize();
+        invEmor.compute(emorParameters, 8, 65536);
+        invEmor.invert();
+        invEmor.initialize();
+    }
 
-    Frei0rParameter<double,double> vignettingA;
-    Frei0rParameter<double,double> vignettingB;
-    Frei0rParameter<double,double> vignettingC;
-    Frei0rParameter<double,double> vignettingD;
-    Frei0rParameter<double,double> vignettingRadius;
+    ~HemiToEquirectMap() {
+        free (map);
+    }
 
-    Frei0rParameter<double,double> emorH1;
-    Frei0rParameter<double,double> emorH2;
-    Frei0rParameter<double,double> emorH3;
-    Frei0rParameter<double,double> emorH4;
-    Frei0rParameter<double,double> emorH5;
-    bool emorEnabled;
-    std::mutex lock;
+    const HemiToEquirectParameters parameters;
 
     /**
      * Map consist of MAP_ENTRY_SIZE records:
@@ -71,157 +113,200 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
      * 6: blend factor
      */
     float* map;
-    bool updateMap;
 
     EMoR emor;
     EMoR invEmor;
+};
 
-    HemiToEquirect(unsigned int width, unsigned int height) : Frei0rFilter (width, height) { /*, emor(), invEmor() */
-        yaw = 0.357f;
-        pitch = 0.389f;
-        roll = -0.693f;
-
-        interpolation = Interpolation::NONE;
-        projection = Projection::EQUIDISTANT_FISHEYE;
-
-        fov = 182.8697f;
-        radius = 430.0 / 1920.0f;
-        frontX = 0.75;
-        frontY = 480.f / 1080.0f;
-        frontUp = 90.0f;
-        backX = 0.25;
-        backY = 480.f / 1080.0f;
-        backUp = 270.0f;
-        nadirRadius = 428.0 / 1920.0f;
-        nadirCorrectionStart = 0.8f;
+/**
+ * Renders one frame. If the map has no storage, each call builds the map
+ * for its scanlines and applies it.
+ */
+class HemiToEquirectFrame : public MPFilter {
+  public:
+    HemiToEquirectFrame(int width, int height, const HemiToEquirectMap& hemiMap, int interpolation, bool emorEnabled) :
+        width(width), height(height), params(hemiMap.parameters), map(hemiMap.map), emor(hemiMap.emor), invEmor(hemiMap.invEmor),
+        interpolation(interpolation), emorEnabled(emorEnabled) {
+    }
 
-        distortionA = 0.0;
-        distortionB = 0.0;
-        distortionC = 0.0;
-        distortionRadius = 0.0;
-        vignettingA = 0.0;
-        vignettingB = 0.0;
-        vignettingC = 0.0;
-        vignettingD = 0.0;
-        vignettingRadius = 0.0;
+    virtual void updateLines(double time,
+                             uint32_t* out,
+                             const uint32_t* in, int start, int num) {
+        if (map != NULL) {
+            applyMap(out, (uint32_t*) in, map + start * width * MAP_ENTRY_SIZE, start, num);
+        } else {
+            std::vector<float> rows(num * width * MAP_ENTRY_SIZE);
+            makeMap (rows.data(), start, num);
+            applyMap(out, (uint32_t*) in, rows.data(), start, num);
+        }
+    }
 
-        emorH1 = 0.0;
-        emorH2 = 0.0;
-        emorH3 = 0.0;
-        emorH4 = 0.0;
-        emorH5 = 0.0;
-        emorEnabled = false;
+    /**
+     * Fills in the map for the scanlines [start_scanline, start_scanline +
+     * num_scanlines). rows points to the entries of the first one.
+     */
+    void makeMap (float* rows, int start_scanline, int num_scanlines) {
 
-        map = NULL;
-        updateMap = true;
+        int w = width;
+        int h = height;
 
-        register_fparam(yaw, "yaw", "");
-        register_fparam(pitch, "pitch", "");
-        register_fparam(roll, "roll", "");
+        double yawR = DEG2RADF(params.yaw);
+        double pitchR = DEG2RADF(params.pitch);
+        double rollR = DEG2RADF(params.roll);
 
-        register_fparam(fov, "fov", "");
-        register_fparam(radius, "radius", "");
+        Matrix3 xform_front;
+        Matrix3 xform_back;
 
-        register_fparam(nadirRadius, "nadirRadius", "");
-        register_fparam(nadirCorrectionStart, "nadirCorrectionStart", "");
+        xform_front.identity();
+        rotateX(xform_front, DEG2RADF(180.0 - params.frontUp));
+        rotateZ(xform_front, yawR / 2);
+        rotateY(xform_front, pitchR / 2);
+        rotateX(xform_front, rollR / 2);
 
-        register_fparam(frontX, "frontX", "");
-        register_fparam(frontY, "frontY", "");
-        register_fparam(frontUp, "frontUp", "");
+        xform_back.identity();
+        rotateX(xform_back, DEG2RADF(180.0 - params.backUp));
+        rotateZ(xform_back, -yawR / 2);
+        rotateY(xform_back, pitchR / 2);
+        rotateX(xform_back, rollR / 2);
 
-        register_fparam(backX, "backX", "");
-        register_fparam(backY, "backY", "");
-        register_fparam(backUp, "backUp", "");
+        double fov90radius = 90.0f * (params.radius * 2) / params.fov;
+        double fov2 = (params.radius * 90.0f / fov90radius) * 2 * M_PI / 360.0f;
 
-        register_fparam(distortionA, "distortionA", "");
-        register_fparam(distortionB, "distortionB", "");
-        register_fparam(distortionC, "distortionC", "");
-        register_fparam(distortionRadius, "distortionRadius", "");
+        double theta_margin = -cos(fov2);
+        double nadir_radius_scale = params.nadirRadius / params.radius;
 
-        register_fparam(vignettingA, "vignettingA", "");
-        register_fparam(vignettingB, "vignettingB", "");
-        register_fparam(vignettingC, "vignettingC", "");
-        register_fparam(vignettingD, "vignettingD", "");
-        register_fparam(vignettingRadius, "vignettingRadius", "");
+        double pixelRadius = params.radius * w;
 
-        register_fparam(emorH1, "emorH1", "");
-        register_fparam(emorH2, "emorH2", "");
-        register_fparam(emorH3, "emorH3", "");
-        register_fparam(emorH4, "emorH4", "");
-        register_fparam(emorH5, "emorH5", "");
-        register_param(emorEnabled, "emorEnabled", "");
+        double front_x = params.frontX * w;
+        double front_y = params.frontY * h;
+        double front_up = DEG2RADF(90 - params.frontUp);
 
-        register_fparam(interpolation, "interpolation", "");
-        register_fparam(projection, "projection", "");
-    }
+        double back_x = params.backX * w;
+        double back_y = params.backY * h;
+        double back_up = DEG2RADF(90 - params.backUp);
 
-    ~HemiToEquirect() {
-        if (map != NULL) {
-            free (map);
+        std::vector<double> theta(w);
+        std::vector<double> cos_theta(w);
+        std::vector<double> sin_theta(w);
+        for (int xi = 0; xi < w; xi++) {
+            theta[xi] = 2 * M_PI * ((double) xi - w / 2) / w;
         }
-    }
+        batchSinCos(theta.data(), sin_theta.data(), cos_theta.data(), w);
 
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
+        HemiSamples front(w);
+        HemiSamples back(w);
 
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
-
-        if (map == NULL || yaw.changed() || pitch.changed() || roll.changed() || projection.changed() || fov.changed() ||
-                radius.changed() || frontX.changed() || frontY.changed() || frontUp.changed() || backX.changed() || backY.changed() ||
-                backUp.changed() || nadirRadius.changed() || nadirCorrectionStart.changed() ||
-                distortionA.changed() || distortionB.changed() || distortionC.changed() || distortionRadius.changed() ||
-                vignettingA.changed() || vignettingB.changed() || vignettingC.changed() || vignettingD.changed() || vignettingRadius.changed() ||
-                emorH1.changed() || emorH2.changed() || emorH3.changed() || emorH4.changed() || emorH5.changed()) {
-            if (map == NULL) {
-                map = (float*) malloc (width * height * MAP_ENTRY_SIZE * sizeof(float));
-            }
-            std::vector<double> emorParameters = { emorH1, emorH2, emorH3, emorH4, emorH5 };
-            emor.compute(emorParameters, 16, 255);
-            emor.initialize();
-            invEmor.compute(emorParameters, 8, 65536);
-            invEmor.invert();
-            invEmor.initialize();
-            updateMap = true;
-        } else {
-            updateMap = false;
-        }
+        for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+            double phi = M_PI * ((double) yi - h / 2) / h;
+            double cos_phi = cos(phi);
+            double sin_phi = sin(phi);
+            float* row = rows + (yi - start_scanline) * w * MAP_ENTRY_SIZE;
+            front.n = 0;
+            back.n = 0;
+            for (int xi = 0; xi < w; xi++) {
+                double z = cos_theta[xi] * cos_phi;
 
-        MPFilter::updateMP(this, time, out, in, width, height);
-    }
+                int midx = xi * MAP_ENTRY_SIZE;
 
-    virtual void updateLines(double time,
-                             uint32_t* out,
-                             const uint32_t* in, int start, int num) {
-        if (updateMap) {
-            makeMap (start, num);
+                // The ray through the front lens is at longitude -theta, and
+                // through the back lens at -(theta + pi).
+                double frontX = cos_theta[xi] * cos_phi;
+                double frontY = -sin_theta[xi] * cos_phi;
+                if (z < -theta_margin) {
+                    // Back hemisphere, sides of image
+                    back.add(xi, 0, -frontX, -frontY, sin_phi);
+                    row[midx + 3] = -1;
+                } else if (z > theta_margin) {
+                    // front hemisphere, center of image
+                    front.add(xi, 0, frontX, frontY, sin_phi);
+                    row[midx + 3] = -1;
+                } else {
+                    // blend margin
+                    front.add(xi, 0, frontX, frontY, sin_phi);
+                    back.add(xi, 1, -frontX, -frontY, sin_phi);
+                    float blend = (theta_margin - z) / (2 * theta_margin);
+                    row[midx + 6] = blend;
+                }
+            }
+            sampleRow(row, front, fov2, front_up, xform_front, params.nadirCorrectionStart, nadir_radius_scale, front_x, front_y);
+            sampleRow(row, back, fov2, back_up, xform_back, params.nadirCorrectionStart, nadir_radius_scale, back_x, back_y);
         }
-
-        applyMap(out, (uint32_t*) in, start, num);
     }
 
   protected:
-    void sample (int mx, int my, int mz, double fov2, double thetaH, double phi, double up_dir, Matrix3& hemi_transform,
-                 double nadir_correction_start, double nadir_radius_scale, double cx, double cy) {
-        Vector3 ray;
-        Vector3 ray2;
-
-        double cos_phi = cos(phi);
-        ray[0] = cos(-thetaH) * cos_phi;
-        ray[1] = sin(-thetaH) * cos_phi;
-        ray[2] = sin(phi);
+    /**
+     * The rays of the pixels of one scanline that sample one hemisphere.
+     * mx is the column of the pixel, and mz the slot in the map entry.
+     */
+    class HemiSamples {
+      public:
+        HemiSamples(int width) : mx(width), mz(width), x(width), y(width), z(width), n(0) {
+        }
 
-        mulM3V3 (hemi_transform, ray, ray2);
+        void add(int column, int slot, double rx, double ry, double rz) {
+            mx[n] = column;
+            mz[n] = slot;
+            x[n] = rx;
+            y[n] = ry;
+            z[n] = rz;
+            ++n;
+        }
 
-        double off_axis = sqrt(ray2[1] * ray2[1] + ray2[2] * ray2[2]);
-        double off_axis_direction = atan2(-ray2[2], ray2[1]);
+        std::vector<int> mx;
+        std::vector<int> mz;
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> z;
+        int n;
+    };
 
-        double off_axis_down = -cos(up_dir - off_axis_direction) * off_axis;
+    /**
+     * Samples the rays of a scanline through one hemisphere into the map
+     * entries of the row. The rays are overwritten.
+     */
+    void sampleRow (float* row, HemiSamples& samples, double fov2, double up_dir, const Matrix3& hemi_transform,
+                    double nadir_correction_start, double nadir_radius_scale, double cx, double cy) {
+        int n = samples.n;
+        double* x = samples.x.data();
+        double* y = samples.y.data();
+        double* z = samples.z.data();
+        for (int i = 0; i < n; ++i) {
+            double x0 = x[i];
+            double y0 = y[i];
+            double z0 = z[i];
+            x[i] = hemi_transform[0] * x0 + hemi_transform[1] * y0 + hemi_transform[2] * z0;
+            y[i] = hemi_transform[3] * x0 + hemi_transform[4] * y0 + hemi_transform[5] * z0;
+            z[i] = hemi_transform[6] * x0 + hemi_transform[7] * y0 + hemi_transform[8] * z0;
+        }
 
-        double off_axis_angle = atan2(off_axis, ray2[0]);
+        std::vector<double> off_axis(n);
+        std::vector<double> off_axis_angle(n);
+        for (int i = 0; i < n; ++i) {
+            off_axis[i] = y[i] * y[i] + z[i] * z[i];
+        }
+        batchSqrt(off_axis.data(), off_axis.data(), n);
+        batchAtan2(off_axis.data(), x, off_axis_angle.data(), n);
+
+        double cos_up = cos(up_dir);
+        double sin_up = sin(up_dir);
+        for (int i = 0; i < n; ++i) {
+            // The direction of the ray from the axis is atan2(-z, y), so its
+            // cosine and sine are y and -z over the distance from the axis.
+            double cos_direction = 1.0;
+            double sin_direction = 0.0;
+            if (off_axis[i] > 0) {
+                cos_direction = y[i] / off_axis[i];
+                sin_direction = -z[i] / off_axis[i];
+            }
+            // -cos(up_dir - direction) * off_axis
+            double off_axis_down = -(cos_up * y[i] - sin_up * z[i]);
+            writeSample(row, samples.mx[i], samples.mz[i], fov2, off_axis_angle[i], off_axis_down, cos_direction, sin_direction,
+                        nadir_correction_start, nadir_radius_scale, cx, cy);
+        }
+    }
 
+    void writeSample (float* row, int mx, int mz, double fov2, double off_axis_angle, double off_axis_down, double cos_direction, double sin_direction,
+                      double nadir_correction_start, double nadir_radius_scale, double cx, double cy) {
         if (off_axis_down > nadir_correction_start) {
             double factor = 1.0 - (1.0 - nadir_radius_scale) * (off_axis_down - nadir_correction_start) / (1.0 - nadir_correction_start);
             off_axis_angle *= factor;
@@ -235,17 +320,18 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
         double offAxisDistance;
         double vignetting = -1;
 
-        switch (projection) {
+        switch (params.projection) {
         case Projection::EQUIDISTANT_FISHEYE:
+        default:
             offAxisDistance = off_axis_angle / fov2;
             break;
         }
 
-        if (radius > 0) {
-            if (vignettingRadius > 0.0) {
-                double vignettingOffAxisDistance = offAxisDistance * radius / vignettingRadius;
+        if (params.radius > 0) {
+            if (params.vignettingRadius > 0.0) {
+                double vignettingOffAxisDistance = offAxisDistance * params.radius / params.vignettingRadius;
                 double vignettingOffAxisDistance2 = vignettingOffAxisDistance * vignettingOffAxisDistance;
-                vignetting = ((/* r^6 */ vignettingD * vignettingOffAxisDistance2 + /* r^4 */ vignettingC) * vignettingOffAxisDistance2 + /* r^2 */ vignettingB) * vignettingOffAxisDistance2 + vignettingA;
+                vignetting = ((/* r^6 */ params.vignettingD * vignettingOffAxisDistance2 + /* r^4 */ params.vignettingC) * vignettingOffAxisDistance2 + /* r^2 */ params.vignettingB) * vignettingOffAxisDistance2 + params.vignettingA;
                 if (vignetting > 0.004) {
                     vignetting = 256 * 1.0 / vignetting;
                 } else {
@@ -253,36 +339,36 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
                 }
             }
 
-            if (distortionRadius > 0.0) {
-                double distortionD = 1.0 - distortionA - distortionB - distortionC;
+            if (params.distortionRadius > 0.0) {
+                double distortionD = 1.0 - params.distortionA - params.distortionB - params.distortionC;
 
-                double distortionOffAxisDistance = offAxisDistance * radius / distortionRadius;
-                double correctedOffAxisDistance = (((distortionA * distortionOffAxisDistance + distortionB) * distortionOffAxisDistance + distortionC) * distortionOffAxisDistance + distortionD) * distortionOffAxisDistance;
-                offAxisDistance = correctedOffAxisDistance * distortionRadius / radius;
+                double distortionOffAxisDistance = offAxisDistance * params.radius / params.distortionRadius;
+                double correctedOffAxisDistance = (((params.distortionA * distortionOffAxisDistance + params.distortionB) * distortionOffAxisDistance + params.distortionC) * distortionOffAxisDistance + distortionD) * distortionOffAxisDistance;
+                offAxisDistance = correctedOffAxisDistance * params.distortionRadius / params.radius;
             }
         }
 
-        switch (projection) {
+        switch (params.projection) {
         case Projection::EQUIDISTANT_FISHEYE:
-            srcX = cos(off_axis_direction) * offAxisDistance * radius * width;
-            srcY = sin(off_axis_direction) * offAxisDistance * radius * width;
+        default:
+            srcX = cos_direction * offAxisDistance * params.radius * width;
+            srcY = sin_direction * offAxisDistance * params.radius * width;
             break;
         }
 
         srcX += cx;
         srcY += cy;
 
-        int midx = ((my * width) + mx) * MAP_ENTRY_SIZE;
-        int mcidx = midx + 3 * mz;
+        int mcidx = mx * MAP_ENTRY_SIZE + 3 * mz;
 
         if (srcX >= 0 && srcY >= 0 && srcX < width && srcY < height) {
-            map[mcidx + 0] = (float) srcX;
-            map[mcidx + 1] = (float) srcY;
-            map[mcidx + 2] = (float) vignetting;
+            row[mcidx + 0] = (float) srcX;
+            row[mcidx + 1] = (float) srcY;
+            row[mcidx + 2] = (float) vignetting;
         } else {
-            map[mcidx + 0] = -1;
-            map[mcidx + 1] = -1;
-            map[mcidx + 2] = -1;
+            row[mcidx + 0] = -1;
+            row[mcidx + 1] = -1;
+            row[mcidx + 2] = -1;
         }
     }
 
@@ -296,18 +382,23 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
         return 0;
     }
 
-    void applyMap(uint32_t* out, const uint32_t* in, int start_scanline, int num_scanlines) {
+    /**
+     * Applies the map to the scanlines [start_scanline, start_scanline +
+     * num_scanlines). rows points to the map entries of the first one.
+     */
+    void applyMap(uint32_t* out, const uint32_t* in, const float* rows, int start_scanline, int num_scanlines) {
         for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+            const float* row = rows + (yi - start_scanline) * width * MAP_ENTRY_SIZE;
             for (int xi = 0; xi < width; xi++) {
                 int idx = ((yi * width) + xi);
-                int midx = idx * MAP_ENTRY_SIZE;
-                if (map[midx] > 0) {
-                    if (map[midx + 3] < 0) {
+                int midx = xi * MAP_ENTRY_SIZE;
+                if (row[midx] > 0) {
+                    if (row[midx + 3] < 0) {
                         // No blend
 
-                        float sx = map[midx + 0];
-                        float sy = map[midx + 1];
-                        float vi = map[midx + 2];
+                        float sx = row[midx + 0];
+                        float sy = row[midx + 1];
+                        float vi = row[midx + 2];
 
                         uint32_t c = sampleImage (in, sx, sy);
                         if (vi >= 0.0f) {
@@ -320,9 +411,9 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
                         out[idx] = c;
                     } else {
                         // Blend
-                        float sxA = map[midx + 0];
-                        float syA = map[midx + 1];
-                        float viA = map[midx + 2];
+                        float sxA = row[midx + 0];
+                        float syA = row[midx + 1];
+                        float viA = row[midx + 2];
                         uint32_t blendA = sampleImage (in, sxA, syA);
                         if (viA >= 0.0f) {
                             if (!emorEnabled) {
@@ -332,9 +423,9 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
                             }
                         }
 
-                        float sxB = map[midx + 3];
-                        float syB = map[midx + 4];
-                        float viB = map[midx + 5];
+                        float sxB = row[midx + 3];
+                        float syB = row[midx + 4];
+                        float viB = row[midx + 5];
                         uint32_t blendB = sampleImage (in, sxB, syB);
                         if (viB >= 0.0f) {
                             if (!emorEnabled) {
@@ -344,7 +435,7 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
                             }
                         }
 
-                        float blend = map[midx + 6];
+                        float blend = row[midx + 6];
 
                         unsigned char* blendCA = (unsigned char*) &blendA;
                         unsigned char* blendCB = (unsigned char*) &blendB;
@@ -359,88 +450,244 @@ class HemiToEquirect : public Frei0rFilter, MPFilter {
         }
     }
 
-    void makeMap (int start_scanline, int num_scanlines) {
+  private:
+    int width;
+    int height;
+    const HemiToEquirectParameters& params;
+    const float* map;
+    const EMoR& emor;
+    const EMoR& invEmor;
+    int interpolation;
+    bool emorEnabled;
+};
 
-        int w = width;
-        int h = height;
+class HemiToEquirect : public Frei0rFilter {
 
-        double yawR = DEG2RADF(yaw);
-        double pitchR = DEG2RADF(pitch);
-        double rollR = DEG2RADF(roll);
+  public:
+    Frei0rParameter<double,double> yaw;
+    Frei0rParameter<double,double> pitch;
+    Frei0rParameter<double,double> roll;
+    Frei0rParameter<int,double> interpolation;
+    Frei0rParameter<int,double> projection;
+    Frei0rParameter<double,double> fov;
+    Frei0rParameter<double,double> radius;
+    Frei0rParameter<double,double> frontX;
+    Frei0rParameter<double,double> frontY;
+    Frei0rParameter<double,double> frontUp;
+    Frei0rParameter<double,double> backX;
+    Frei0rParameter<double,double> backY;
+    Frei0rParameter<double,double> backUp;
+    Frei0rParameter<double,double> nadirRadius;
+    Frei0rParameter<double,double> nadirCorrectionStart;
 
-        Matrix3 xform_front;
-        Matrix3 xform_back;
+    Frei0rParameter<double,double> distortionA;
+    Frei0rParameter<double,double> distortionB;
+    Frei0rParameter<double,double> distortionC;
+    Frei0rParameter<double,double> distortionRadius;
 
-        xform_front.identity();
-        rotateX(xform_front, DEG2RADF(180.0 - frontUp));
-        rotateZ(xform_front, yawR / 2);
-        rotateY(xform_front, pitchR / 2);
-        rotateX(xform_front, rollR / 2);
+    Frei0rParameter<double,double> vignettingA;
+    Frei0rParameter<double,double> vignettingB;
+    Frei0rParameter<double,double> vignettingC;
+    Frei0rParameter<double,double> vignettingD;
+    Frei0rParameter<double,double> vignettingRadius;
 
-        xform_back.identity();
-        rotateX(xform_back, DEG2RADF(180.0 - backUp));
-        rotateZ(xform_back, -yawR / 2);
-        rotateY(xform_back, pitchR / 2);
-        rotateX(xform_back, rollR / 2);
+    Frei0rParameter<double,double> emorH1;
+    Frei0rParameter<double,double> emorH2;
+    Frei0rParameter<double,double> emorH3;
+    Frei0rParameter<double,double> emorH4;
+    Frei0rParameter<double,double> emorH5;
+    bool emorEnabled;
+    std::mutex lock;
 
-        double fov90radius = 90.0f * (radius * 2) / fov;
-        double fov2 = (radius * 90.0f / fov90radius) * 2 * M_PI / 360.0f;
+    /**
+     * Decides whether the parameters stay the same long enough for a map to
+     * pay off. Until it is built, frames build the map rows they need.
+     */
+    MapStrategy strategy;
 
-        double theta_margin = -cos(fov2);
-        double nadir_radius_scale = nadirRadius / radius;
+    /**
+     * The maps. Frames in flight hold their own reference, so a map can be
+     * replaced while they are still using it.
+     */
+    BackgroundMap maps;
 
-        double pixelRadius = radius * w;
+    HemiToEquirect(unsigned int width, unsigned int height) : Frei0rFilter (width, height) { /*, emor(), invEmor() */
+        yaw = 0.357f;
+        pitch = 0.389f;
+        roll = -0.693f;
 
-        double front_x = frontX * w;
-        double front_y = frontY * h;
-        double front_up = DEG2RADF(90 - frontUp);
+        interpolation = Interpolation::NONE;
+        projection = Projection::EQUIDISTANT_FISHEYE;
 
-        double back_x = backX * w;
-        double back_y = backY * h;
-        double back_up = DEG2RADF(90 - backUp);
+        fov = 182.8697f;
+        radius = 430.0 / 1920.0f;
+        frontX = 0.75;
+        frontY = 480.f / 1080.0f;
+        frontUp = 90.0f;
+        backX = 0.25;
+        backY = 480.f / 1080.0f;
+        backUp = 270.0f;
+        nadirRadius = 428.0 / 1920.0f;
+        nadirCorrectionStart = 0.8f;
 
-        for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
-            double phi = M_PI * ((double) yi - h / 2) / h;
-            for (int xi = 0; xi < w; xi++) {
-                double theta = 2 * M_PI * ((double) xi - w / 2) / w;
-                double z = cos(theta) * cos(phi);
+        distortionA = 0.0;
+        distortionB = 0.0;
+        distortionC = 0.0;
+        distortionRadius = 0.0;
+        vignettingA = 0.0;
+        vignettingB = 0.0;
+        vignettingC = 0.0;
+        vignettingD = 0.0;
+        vignettingRadius = 0.0;
 
-                int midx = ((yi * width) + xi) * MAP_ENTRY_SIZE;
+        emorH1 = 0.0;
+        emorH2 = 0.0;
+        emorH3 = 0.0;
+        emorH4 = 0.0;
+        emorH5 = 0.0;
+        emorEnabled = false;
 
-                if (z < -theta_margin) {
-                    // Back hemisphere, sides of image
-                    if (theta < 0) {
-                        theta = theta + M_PI;
-                    } else {
-                        theta = theta - M_PI;
-                    }
+        register_fparam(yaw, "yaw", "");
+        register_fparam(pitch, "pitch", "");
+        register_fparam(roll, "roll", "");
 
-                    sample(xi, yi, 0, fov2, theta, phi, back_up, xform_back, nadirCorrectionStart, nadir_radius_scale, back_x, back_y);
-                    map[midx + 3] = -1;
-                } else if (z > theta_margin) {
-                    // front hemisphere, center of image
-                    sample(xi, yi, 0, fov2, theta, phi, front_up, xform_front, nadirCorrectionStart, nadir_radius_scale, front_x, front_y);
-                    map[midx + 3] = -1;
-                } else {
-                    // blend margin
-                    sample(xi, yi, 0, fov2, theta, phi, front_up, xform_front, nadirCorrectionStart, nadir_radius_scale, front_x, front_y);
-                    float blend = (theta_margin - z) / (2 * theta_margin);
-                    if (theta < 0) {
-                        theta = theta + M_PI;
-                    } else {
-                        theta = theta - M_PI;
-                    }
-                    sample(xi, yi, 1, fov2, theta, phi, back_up, xform_back, nadirCorrectionStart, nadir_radius_scale, back_x, back_y);
+        register_fparam(fov, "fov", "");
+        register_fparam(radius, "radius", "");
 
-                    map[midx + 6] = blend;
-                }
-            }
-        }
+        register_fparam(nadirRadius, "nadirRadius", "");
+        register_fparam(nadirCorrectionStart, "nadirCorrectionStart", "");
+
+        register_fparam(frontX, "frontX", "");
+        register_fparam(frontY, "frontY", "");
+        register_fparam(frontUp, "frontUp", "");
+
+        register_fparam(backX, "backX", "");
+        register_fparam(backY, "backY", "");
+        register_fparam(backUp, "backUp", "");
+
+        register_fparam(distortionA, "distortionA", "");
+        register_fparam(distortionB, "distortionB", "");
+        register_fparam(distortionC, "distortionC", "");
+        register_fparam(distortionRadius, "distortionRadius", "");
+
+        register_fparam(vignettingA, "vignettingA", "");
+        register_fparam(vignettingB, "vignettingB", "");
+        register_fparam(vignettingC, "vignettingC", "");
+        register_fparam(vignettingD, "vignettingD", "");
+        register_fparam(vignettingRadius, "vignettingRadius", "");
+
+        register_fparam(emorH1, "emorH1", "");
+        register_fparam(emorH2, "emorH2", "");
+        register_fparam(emorH3, "emorH3", "");
+        register_fparam(emorH4, "emorH4", "");
+        register_fparam(emorH5, "emorH5", "");
+        register_param(emorEnabled, "emorEnabled", "");
+
+        register_fparam(interpolation, "interpolation", "");
+        register_fparam(projection, "projection", "");
     }
 
+    ~HemiToEquirect() {
+    }
 
-  private:
+    MapKey mapKey(const HemiToEquirectParameters& p) {
+        return MapKey("bigsh0t_hemi_to_eq", width, height)
+               .add(p.yaw).add(p.pitch).add(p.roll).add(p.projection).add(p.fov).add(p.radius)
+               .add(p.frontX).add(p.frontY).add(p.frontUp).add(p.backX).add(p.backY).add(p.backUp)
+               .add(p.nadirRadius).add(p.nadirCorrectionStart)
+               .add(p.distortionA).add(p.distortionB).add(p.distortionC).add(p.distortionRadius)
+               .add(p.vignettingA).add(p.vignettingB).add(p.vignettingC).add(p.vignettingD).add(p.vignettingRadius)
+               .add(p.emorH1).add(p.emorH2).add(p.emorH3).add(p.emorH4).add(p.emorH5);
+    }
+
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        HemiToEquirectParameters parameters;
+        int frameInterpolation;
+        bool frameEmorEnabled;
+        std::shared_ptr<HemiToEquirectMap> frameMap;
+        bool buildMap = false;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            parameters.yaw = yaw.read();
+            parameters.pitch = pitch.read();
+            parameters.roll = roll.read();
+            parameters.projection = projection.read();
+            parameters.fov = fov.read();
+            parameters.radius = radius.read();
+            parameters.frontX = frontX.read();
+            parameters.frontY = frontY.read();
+            parameters.frontUp = frontUp.read();
+            parameters.backX = backX.read();
+            parameters.backY = backY.read();
+            parameters.backUp = backUp.read();
+            parameters.nadirRadius = nadirRadius.read();
+            parameters.nadirCorrectionStart = nadirCorrectionStart.read();
+            parameters.distortionA = distortionA.read();
+            parameters.distortionB = distortionB.read();
+            parameters.distortionC = distortionC.read();
+            parameters.distortionRadius = distortionRadius.read();
+            parameters.vignettingA = vignettingA.read();
+            parameters.vignettingB = vignettingB.read();
+            parameters.vignettingC = vignettingC.read();
+            parameters.vignettingD = vignettingD.read();
+            parameters.vignettingRadius = vignettingRadius.read();
+            parameters.emorH1 = emorH1.read();
+            parameters.emorH2 = emorH2.read();
+            parameters.emorH3 = emorH3.read();
+            parameters.emorH4 = emorH4.read();
+            parameters.emorH5 = emorH5.read();
+            frameInterpolation = interpolation.read();
+            frameEmorEnabled = emorEnabled;
+        }
+
+        MapKey key = mapKey(parameters);
+        strategy.next(key);
+        frameMap = maps.get<HemiToEquirectMap>(key);
+        if (frameMap && !strategy.useMap()) {
+            frameMap.reset();
+        } else if (!frameMap && strategy.buildMap()) {
+            buildMap = true;
+            maps.build(key, [this, parameters](const std::atomic<bool>& cancelled) {
+                MapStrategy::Timer timer;
+                std::shared_ptr<HemiToEquirectMap> map = std::make_shared<HemiToEquirectMap>(width, height, parameters, true);
+                HemiToEquirectFrame builder(width, height, *map, Interpolation::NONE, false);
+                bool complete = BackgroundMap::forEachChunk(height, cancelled, [&](int start, int num) {
+                    builder.makeMap(map->map + start * width * MAP_ENTRY_SIZE, start, num);
+                });
+                if (!complete) {
+                    return std::shared_ptr<HemiToEquirectMap>();
+                }
+                strategy.addBuildTime(timer.seconds());
+                return map;
+            }, width * height * MAP_ENTRY_SIZE * sizeof(float));
+
+            // Without worker threads the map has been built already
+            frameMap = maps.get<HemiToEquirectMap>(key);
+        }
+        if (!frameMap && buildMap && BackgroundMap::useStaleMaps()) {
+            frameMap = maps.latest<HemiToEquirectMap>();
+        }
+
+        MapStrategy::Timer timer;
+        bool direct = !frameMap;
+        if (direct) {
+            frameMap = std::make_shared<HemiToEquirectMap>(width, height, parameters, false);
+        }
 
+        HemiToEquirectFrame frame(width, height, *frameMap, frameInterpolation, frameEmorEnabled);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
+        if (direct) {
+            strategy.addDirectTime(timer.seconds());
+        } else if (frameMap->parameters == parameters) {
+            strategy.addMapTime(timer.seconds());
+        }
+    }
 };
 
 frei0r::construct<HemiToEquirect> plugin("bigsh0t_hemi_to_eq",
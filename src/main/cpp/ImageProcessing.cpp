@@ -2,15 +2,22 @@
 #include <limits>
 #include <climits>
 #include <cmath>
+#include <cstdlib>
 #include <algorithm>
+#include <cstring>
 #include <iomanip>
+#include <vector>
 #include <inttypes.h>
 
 #include "sse_compat.hpp"
+#include "CPUFeatures.hpp"
 #include "EMoR.hpp"
 #include "ImageProcessing.hpp"
+#include "ImageProcessingAVX2.hpp"
+#include "ImageProcessingSSE41.hpp"
 #include "Matrix.hpp"
 #include "Math.hpp"
+#include "VectorMath.hpp"
 
 #define EXPAND_ABGR64(v) ( (v & 0xff000000) << 24 ) | ( (v & 0x00ff0000) << 16 ) | ( (v & 0x0000ff00) << 8 ) | ( (v & 0x000000ff) )
 #define COMPRESS_ABGR64(v) ( (v >> 24) & 0xff000000 ) | ( (v >> 16) & 0x00ff0000) | ( (v >> 8) & 0x0000ff00 ) | ( v & 0x000000ff )
@@ -293,27 +300,111 @@ uint32_t sampleBilinearWrappedClamped (const uint32_t* frame, double x, double y
 }
 
 
+/**
+ * Converts a yaw to a horizontal offset in the source image, in 1/128 pixels,
+ * the unit of the fractional part of a map entry. The offset is wrapped to
+ * [0, width * 128).
+ */
+static int yaw_360_offset(int width, double yaw) {
+    int64_t w128 = (int64_t) width << 7;
+    int64_t offset = (int64_t) floor(width * yaw / 360.0 * 128.0);
+    offset %= w128;
+    if (offset < 0) {
+        offset += w128;
+    }
+    return (int) offset;
+}
+
+/**
+ * The row kernels for one instruction set. Each returns the number of columns
+ * it did, and leaves the rest to the SSE2 or scalar code.
+ */
+class RowKernels {
+  public:
+    int (*apply360Map)(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation);
+    int (*lerpRow)(uint32_t* out, const uint32_t* row, int n, int ax);
+    int (*sadRow)(const short* a, const short* b, int n, int* sad);
+};
+
+static int apply_360_map_none(uint32_t*, const uint32_t*, const Map360Entry*, int, int, int, int, int, int) {
+    return 0;
+}
+
+static int lerp_row_none(uint32_t*, const uint32_t*, int, int) {
+    return 0;
+}
+
+static int sad_row_none(const short*, const short*, int, int* sad) {
+    *sad = 0;
+    return 0;
+}
+
+static RowKernels selectRowKernels() {
+    RowKernels kernels = { &apply_360_map_none, &lerp_row_none, &sad_row_none };
+    CPULevel level = cpuLevel();
+#ifdef USE_AVX2
+    // There are no AVX-512 row kernels: without AVX-512BW the pixel
+    // arithmetic is no wider than with AVX2.
+    if (level >= CPU_AVX2) {
+        kernels.apply360Map = &apply_360_map_avx2;
+        kernels.lerpRow = &lerp_row_avx2;
+        kernels.sadRow = &sad_row_avx2;
+        return kernels;
+    }
+#endif
+#ifdef USE_SSE41
+    if (level >= CPU_SSE41) {
+        kernels.apply360Map = &apply_360_map_sse41;
+        kernels.lerpRow = &lerp_row_sse41;
+        kernels.sadRow = &sad_row_sse41;
+        return kernels;
+    }
+#endif
+    return kernels;
+}
+
+static const RowKernels& rowKernels() {
+    static const RowKernels kernels = selectRowKernels();
+    return kernels;
+}
+
 template<int interpolation>
-void apply_360_map_tmpl(uint32_t* out, uint32_t* ibuf1, float* map, int width, int height, int start_scanline, int num_scanlines) {
+void apply_360_map_tmpl(uint32_t* out, uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int start_column, int x_offset) {
+    int hm1 = height - 1;
+    int w128 = width << 7;
     for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
-        for (int xi = 0; xi < width; xi++) {
+        for (int xi = start_column; xi < width; xi++) {
             int idx = yi * width + xi;
-            int midx = 2 * idx;
-            float xt = map[midx];
-            float yt = map[midx + 1];
+            const Map360Entry& entry = map[idx];
 
-            if (xt < 0) {
+            if (entry.x == MAP_360_OUTSIDE) {
                 out[idx] = 0;
                 continue;
             }
 
+            int ix0 = entry.x;
+            int ax = entry.ax;
+            if (x_offset != 0) {
+                int fx = (ix0 << 7) + ax + x_offset;
+                if (fx >= w128) {
+                    fx -= w128;
+                }
+                ix0 = fx >> 7;
+                ax = fx & 127;
+            }
+
+            // Wrap and clamp the neighbours like sampleBilinearWrappedClamped
+            int ix1 = ix0 + 1 < width ? ix0 + 1 : 0;
+            int iy0w = entry.y * width;
+            int iy1w = entry.y < hm1 ? iy0w + width : iy0w;
+
             uint32_t pixel;
             switch(interpolation) {
             case Interpolation::NONE:
-                pixel = sampleNearestNeighbor(ibuf1, xt, yt, width, height);
+                pixel = ibuf1[iy0w + ix0];
                 break;
             case Interpolation::BILINEAR:
-                pixel = sampleBilinearWrappedClamped(ibuf1, xt, yt, width, height);
+                pixel = blerp(ibuf1, iy0w + ix0, iy0w + ix1, iy1w + ix0, iy1w + ix1, ax, entry.ay, width, height);
                 break;
             }
             out[idx] = pixel;
@@ -321,20 +412,136 @@ void apply_360_map_tmpl(uint32_t* out, uint32_t* ibuf1, float* map, int width, i
     }
 }
 
-void apply_360_map(uint32_t* out, uint32_t* ibuf1, float* map, int width, int height, int start_scanline, int num_scanlines, int interpolation) {
+static void apply_360_map_offset(uint32_t* out, uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation) {
+    // The vector kernels do several pixels at a time; any columns left over
+    // at the end of the scanlines are done below.
+    int start_column = rowKernels().apply360Map(out, ibuf1, map, width, height, start_scanline, num_scanlines, x_offset, interpolation);
+    if (start_column == width) {
+        return;
+    }
     switch(interpolation) {
     case Interpolation::NONE:
-        apply_360_map_tmpl<Interpolation::NONE>(out, ibuf1, map, width, height, start_scanline, num_scanlines);
+        apply_360_map_tmpl<Interpolation::NONE>(out, ibuf1, map, width, height, start_scanline, num_scanlines, start_column, x_offset);
         break;
     case Interpolation::BILINEAR:
-        apply_360_map_tmpl<Interpolation::BILINEAR>(out, ibuf1, map, width, height, start_scanline, num_scanlines);
+        apply_360_map_tmpl<Interpolation::BILINEAR>(out, ibuf1, map, width, height, start_scanline, num_scanlines, start_column, x_offset);
         break;
     }
 }
 
+void apply_360_map(uint32_t* out, uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int interpolation) {
+    apply_360_map_offset(out, ibuf1, map, width, height, start_scanline, num_scanlines, 0, interpolation);
+}
+
+void apply_360_map(uint32_t* out, uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, double yaw, int interpolation) {
+    apply_360_map_offset(out, ibuf1, map, width, height, start_scanline, num_scanlines, yaw_360_offset(width, yaw), interpolation);
+}
+
+/**
+ * Interpolates between each pixel in a row and its right neighbour.
+ */
+static void lerp_row(uint32_t* out, const uint32_t* row, int n, int ax) {
+    int start = rowKernels().lerpRow(out, row, n, ax);
+    for (int i = start; i < n; ++i) {
+        // Same arithmetic as the map, with both rows the same
+        out[i] = blerp(row, i, i + 1, i, i + 1, ax, 0, n + 1, 1);
+    }
+}
+
+int sad_row(const short* a, const short* b, int n) {
+    int sad;
+    int start = rowKernels().sadRow(a, b, n, &sad);
+    for (int i = start; i < n; ++i) {
+        sad += abs(a[i] - b[i]);
+    }
+    return sad;
+}
+
+void rotate_360_yaw(uint32_t* out, const uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, int interpolation) {
+    // Without pitch and roll the map is the identity, so output pixel x
+    // samples the source at x + offset.
+    int offset = yaw_360_offset(width, yaw);
+    int shift = offset >> 7;
+    int ax = offset & 127;
+
+    for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+        const uint32_t* row = ibuf1 + yi * width;
+        uint32_t* outRow = out + yi * width;
+        if (interpolation == Interpolation::NONE || ax == 0) {
+            memcpy(outRow, row + shift, (width - shift) * sizeof(uint32_t));
+            memcpy(outRow + width - shift, row, shift * sizeof(uint32_t));
+        } else {
+            // Output pixels up to width - shift - 1 read two source pixels
+            // that are next to each other, the next one reads the last and
+            // the first pixel, and the rest start over from the first pixel.
+            int n = width - shift - 1;
+            lerp_row(outRow, row + shift, n, ax);
+            uint32_t seam[2] = { row[width - 1], row[0] };
+            lerp_row(outRow + n, seam, 1, ax);
+            lerp_row(outRow + n + 1, row, shift, ax);
+        }
+    }
+}
+
+
+static Matrix3 rotation_360(double yaw, double pitch, double roll) {
+    Matrix3 xform;
+    xform.identity();
+    rotateX(xform, DEG2RADF(roll));
+    rotateY(xform, DEG2RADF(pitch));
+    rotateZ(xform, DEG2RADF(yaw));
+    return xform;
+}
+
+RotatedColumns::RotatedColumns(const Transform360Support& t360, int width, const Matrix3& xform) :
+    x(width), y(width), z(width) {
+    for (int xi = 0; xi < width; ++xi) {
+        double cos_theta = t360.cos_theta[xi];
+        double sin_theta = t360.sin_theta[xi];
+        x[xi] = xform[0] * cos_theta + xform[1] * sin_theta;
+        y[xi] = xform[3] * cos_theta + xform[4] * sin_theta;
+        z[xi] = xform[6] * cos_theta + xform[7] * sin_theta;
+    }
+    zAxis[0] = xform[2];
+    zAxis[1] = xform[5];
+    zAxis[2] = xform[8];
+}
+
+RotatedColumns::RotatedColumns(const Transform360Support& t360, int width, double yaw, double pitch, double roll) :
+    RotatedColumns(t360, width, rotation_360(yaw, pitch, roll)) {
+}
+
+RotatedColumns::Rays::Rays(int width) : buffer(5 * width) {
+    x = buffer.data();
+    y = x + width;
+    z = y + width;
+    theta = z + width;
+    phi = theta + width;
+}
+
+void RotatedColumns::project(double cos_phi, double sin_phi, Rays& rays) const {
+    int width = (int) x.size();
+    double zx = zAxis[0] * sin_phi;
+    double zy = zAxis[1] * sin_phi;
+    double zz = zAxis[2] * sin_phi;
+    double* rx = rays.x;
+    double* ry = rays.y;
+    double* rz = rays.z;
+    for (int xi = 0; xi < width; xi++) {
+        rx[xi] = x[xi] * cos_phi + zx;
+        ry[xi] = y[xi] * cos_phi + zy;
+        rz[xi] = z[xi] * cos_phi + zz;
+    }
+    batchAtan2(ry, rx, rays.theta, width);
+    for (int xi = 0; xi < width; xi++) {
+        rx[xi] = rx[xi] * rx[xi] + ry[xi] * ry[xi];
+    }
+    batchSqrt(rx, rx, width);
+    batchAtan2(rz, rx, rays.phi, width);
+}
 
 template<int interpolation>
-void transform_360_tmpl(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, const Matrix3& xform) {
+void transform_360_tmpl(const RotatedColumns& columns, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines) {
 
     int w = width;
     int h = height;
@@ -343,27 +550,14 @@ void transform_360_tmpl(const Transform360Support& t360, uint32_t* out, uint32_t
     double w2__M_PI_R = w2 * M_PI_R;
     double h2__2__M_PI_R = h2 * 2 * M_PI_R;
 
-
-    Vector3 ray;
-    Vector3 ray2;
+    RotatedColumns::Rays rays(w);
 
     for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
         double phi = M_PI * ((double) yi - h / 2) / h;
-        double sin_phi = sin(phi);
-        double cos_phi = cos(phi);
+        columns.project(cos(phi), sin(phi), rays);
         for (int xi = 0; xi < w; xi++) {
-            ray[0] = t360.cos_theta[xi] * cos_phi;
-            ray[1] = t360.sin_theta[xi] * cos_phi;
-            ray[2] = sin_phi;
-
-            mulM3V3inline(xform, ray, ray2);
-
-            double theta_out = fastAtan2 (ray2[1], ray2[0]);
-            double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
-            double phi_out = fastAtan2 (ray2[2], dxy);
-
-            double xt = w2 + w2__M_PI_R * theta_out;
-            double yt = h2 + h2__2__M_PI_R * phi_out;
+            double xt = w2 + w2__M_PI_R * rays.theta[xi];
+            double yt = h2 + h2__2__M_PI_R * rays.phi[xi];
 
             if (xt < 0) {
                 xt += w;
@@ -394,40 +588,32 @@ void transform_360_tmpl(const Transform360Support& t360, uint32_t* out, uint32_t
     }
 }
 
-void transform_360(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll, int interpolation) {
-    double yawR = DEG2RADF(yaw);
-    double pitchR = DEG2RADF(pitch);
-    double rollR = DEG2RADF(roll);
-
-    Matrix3 xform;
-
-    xform.identity();
-    rotateX(xform, rollR);
-    rotateY(xform, pitchR);
-    rotateZ(xform, yawR);
-
+void transform_360(const RotatedColumns& columns, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, int interpolation) {
     switch(interpolation) {
     case Interpolation::NONE:
-        transform_360_tmpl<Interpolation::NONE>(t360, out, ibuf1, width, height, start_scanline, num_scanlines, xform);
+        transform_360_tmpl<Interpolation::NONE>(columns, out, ibuf1, width, height, start_scanline, num_scanlines);
         break;
     case Interpolation::BILINEAR:
-        transform_360_tmpl<Interpolation::BILINEAR>(t360, out, ibuf1, width, height, start_scanline, num_scanlines, xform);
+        transform_360_tmpl<Interpolation::BILINEAR>(columns, out, ibuf1, width, height, start_scanline, num_scanlines);
         break;
     }
 }
 
+void transform_360(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll, int interpolation) {
+    transform_360(RotatedColumns(t360, width, yaw, pitch, roll), out, ibuf1, width, height, start_scanline, num_scanlines, interpolation);
+}
+
 void transform_360(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, const Matrix3& xform, int interpolation) {
-    switch(interpolation) {
-    case Interpolation::NONE:
-        transform_360_tmpl<Interpolation::NONE>(t360, out, ibuf1, width, height, start_scanline, num_scanlines, xform);
-        break;
-    case Interpolation::BILINEAR:
-        transform_360_tmpl<Interpolation::BILINEAR>(t360, out, ibuf1, width, height, start_scanline, num_scanlines, xform);
-        break;
-    }
+    transform_360(RotatedColumns(t360, width, xform), out, ibuf1, width, height, start_scanline, num_scanlines, interpolation);
 }
 
-void transform_360_map(const Transform360Support& t360, float* out, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll) {
+/**
+ * Builds the map a scanline at a time. Rows decides where each scanline of
+ * the map goes: rows.row(yi) returns the entries to fill in, and
+ * rows.done(yi) is called when they are.
+ */
+template<class Rows>
+static void transform_360_map_rows(const RotatedColumns& columns, Rows& rows, int width, int height, int start_scanline, int num_scanlines) {
 
     int w = width;
     int h = height;
@@ -436,37 +622,15 @@ void transform_360_map(const Transform360Support& t360, float* out, int width, i
     double w2__M_PI_R = w2 * M_PI_R;
     double h2__2__M_PI_R = h2 * 2 * M_PI_R;
 
-    double yawR = DEG2RADF(yaw);
-    double pitchR = DEG2RADF(pitch);
-    double rollR = DEG2RADF(roll);
-
-    Matrix3 xform;
-
-    xform.identity();
-    rotateX(xform, rollR);
-    rotateY(xform, pitchR);
-    rotateZ(xform, yawR);
-
-    Vector3 ray;
-    Vector3 ray2;
+    RotatedColumns::Rays rays(w);
 
     for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
         double phi = M_PI * ((double) yi - h / 2) / h;
-        double sin_phi = sin(phi);
-        double cos_phi = cos(phi);
+        columns.project(cos(phi), sin(phi), rays);
+        Map360Entry* row = rows.row(yi);
         for (int xi = 0; xi < w; xi++) {
-            ray[0] = t360.cos_theta[xi] * cos_phi;
-            ray[1] = t360.sin_theta[xi] * cos_phi;
-            ray[2] = sin_phi;
-
-            mulM3V3inline(xform, ray, ray2);
-
-            double theta_out = fastAtan2 (ray2[1], ray2[0]);
-            double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
-            double phi_out = fastAtan2 (ray2[2], dxy);
-
-            double xt = w2 + w2__M_PI_R * theta_out;
-            double yt = h2 + h2__2__M_PI_R * phi_out;
+            double xt = w2 + w2__M_PI_R * rays.theta[xi];
+            double yt = h2 + h2__2__M_PI_R * rays.phi[xi];
 
             if (xt < 0) {
                 xt += w;
@@ -482,10 +646,211 @@ void transform_360_map(const Transform360Support& t360, float* out, int width, i
                 yt = h - 1;
             }
 
-            int idx = 2 * (yi * width + xi);
-            out[idx    ] = (float) xt;
-            out[idx + 1] = (float) yt;
+            row[xi] = makeMap360Entry(xt, yt);
+        }
+        rows.done(yi);
+    }
+}
+
+/**
+ * Puts the rows in a map of the whole frame.
+ */
+class WholeMapRows {
+  public:
+    WholeMapRows(Map360Entry* map, int width) : map(map), width(width) {
+    }
+
+    Map360Entry* row(int yi) {
+        return map + yi * width;
+    }
+
+    void done(int) {
+    }
+
+  private:
+    Map360Entry* map;
+    int width;
+};
+
+/**
+ * Applies each row as soon as it is built, and then reuses its memory.
+ */
+class AppliedMapRows {
+  public:
+    AppliedMapRows(uint32_t* out, uint32_t* ibuf1, int width, int height, double yaw, int interpolation) :
+        out(out), ibuf1(ibuf1), width(width), height(height), yaw(yaw), interpolation(interpolation), entries(width) {
+    }
+
+    Map360Entry* row(int) {
+        return entries.data();
+    }
+
+    void done(int yi) {
+        // The map entries hold source coordinates, so a map of one row can be
+        // applied as if it were the first row of the frame.
+        apply_360_map(out + yi * width, ibuf1, entries.data(), width, height, 0, 1, yaw, interpolation);
+    }
+
+  private:
+    uint32_t* out;
+    uint32_t* ibuf1;
+    int width;
+    int height;
+    double yaw;
+    int interpolation;
+    std::vector<Map360Entry> entries;
+};
+
+void transform_360_map(const RotatedColumns& columns, Map360Entry* out, int width, int height, int start_scanline, int num_scanlines) {
+    WholeMapRows rows(out, width);
+    transform_360_map_rows(columns, rows, width, height, start_scanline, num_scanlines);
+}
+
+void transform_360_map(const Transform360Support& t360, Map360Entry* out, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll) {
+    transform_360_map(RotatedColumns(t360, width, yaw, pitch, roll), out, width, height, start_scanline, num_scanlines);
+}
+
+void transform_360_map_direct(const RotatedColumns& columns, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, int interpolation) {
+    AppliedMapRows rows(out, ibuf1, width, height, yaw, interpolation);
+    transform_360_map_rows(columns, rows, width, height, start_scanline, num_scanlines);
+}
+
+void transform_360_map_direct(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll, int interpolation) {
+    transform_360_map_direct(RotatedColumns(t360, width, 0.0, pitch, roll), out, ibuf1, width, height, start_scanline, num_scanlines, yaw, interpolation);
+}
+
+void apply_360_projection(const Projection360& projection, uint32_t* out, uint32_t* in, int width, int height, int start_scanline, int num_scanlines, int interpolation) {
+    for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+        for (int xi = 0; xi < width; ++xi) {
+            double xt;
+            double yt;
+            uint32_t pixel = 0;
+            if (projection.project(xi, yi, xt, yt)) {
+                if (interpolation == Interpolation::NONE) {
+                    pixel = sampleNearestNeighbor(in, xt, yt, width, height);
+                } else {
+                    pixel = sampleBilinearWrappedClamped(in, xt, yt, width, height);
+                }
+            }
+            out[yi * width + xi] = pixel;
+        }
+    }
+}
+
+Transform360Projection::Transform360Projection(int width, int height, double yaw, double pitch, double roll) :
+    width(width), height(height) {
+    xform.identity();
+    rotateX(xform, DEG2RADF(roll));
+    rotateY(xform, DEG2RADF(pitch));
+    rotateZ(xform, DEG2RADF(yaw));
+}
+
+Transform360Projection::Transform360Projection(int width, int height, const Matrix3& xform) :
+    width(width), height(height), xform(xform) {
+}
+
+bool Transform360Projection::project(double x, double y, double& xt, double& yt) const {
+    int w = width;
+    int h = height;
+    int w2 = w >> 1;
+    int h2 = h >> 1;
+
+    // Same as transform_360_map, but x may be outside the Transform360Support tables
+    double theta = 2 * M_PI * (x - w / 2) / w;
+    double phi = M_PI * (y - h / 2) / h;
+    double cos_phi = cos(phi);
+
+    Vector3 ray;
+    Vector3 ray2;
+    ray[0] = cos(theta) * cos_phi;
+    ray[1] = sin(theta) * cos_phi;
+    ray[2] = sin(phi);
+
+    mulM3V3inline(xform, ray, ray2);
+
+    double theta_out = fastAtan2 (ray2[1], ray2[0]);
+    double dxy = sqrt(ray2[0] * ray2[0] + ray2[1] * ray2[1]);
+    double phi_out = fastAtan2 (ray2[2], dxy);
+
+    xt = w2 + w2 * M_PI_R * theta_out;
+    yt = h2 + h2 * 2 * M_PI_R * phi_out;
+
+    if (xt < 0) {
+        xt += w;
+    }
+    if (xt >= w) {
+        xt -= w;
+    }
+
+    if (yt < 0) {
+        yt = 0;
+    }
+    if (yt > h - 1) {
+        yt = h - 1;
+    }
+    return true;
+}
+
+Transform360Frame::Transform360Frame(const Transform360Support& t360, int width, int height, double yaw, double pitch, double roll, int interpolation) :
+    t360(t360), width(width), height(height), interpolation(interpolation),
+    yaw(yaw), pitch(pitch), roll(roll), yawOnly(pitch == 0.0 && roll == 0.0), map(NULL), buildMap(false) {
+    xform.identity();
+    rotateX(xform, DEG2RADF(roll));
+    rotateY(xform, DEG2RADF(pitch));
+    rotateZ(xform, DEG2RADF(yaw));
+    rotateColumns();
+}
+
+Transform360Frame::Transform360Frame(const Transform360Support& t360, int width, int height, const Matrix3& xform, int interpolation) :
+    t360(t360), width(width), height(height), xform(xform), interpolation(interpolation), map(NULL), buildMap(false) {
+    double yawR;
+    double pitchR;
+    double rollR;
+    decomposeRotation(xform, yawR, pitchR, rollR);
+    yaw = RAD2DEGF(yawR);
+    pitch = RAD2DEGF(pitchR);
+    roll = RAD2DEGF(rollR);
+    // Far less than a thousandth of a pixel at the poles of an 8K frame
+    yawOnly = fabs(pitchR) < 1e-9 && fabs(rollR) < 1e-9;
+    rotateColumns();
+}
+
+void Transform360Frame::rotateColumns() {
+    if (yawOnly || (map != NULL && !buildMap)) {
+        return;
+    }
+    if (map != NULL || canMap360(width, height)) {
+        columns.reset(new RotatedColumns(t360, width, 0.0, pitch, roll));
+    } else {
+        columns.reset(new RotatedColumns(t360, width, xform));
+    }
+}
+
+Transform360Frame::Transform360Frame(const Transform360Support& t360, int width, int height, double yaw, double pitch, double roll,
+                                     Map360Entry* map, bool buildMap, int interpolation) :
+    t360(t360), width(width), height(height), interpolation(interpolation),
+    yaw(yaw), pitch(pitch), roll(roll), yawOnly(pitch == 0.0 && roll == 0.0), map(map), buildMap(buildMap) {
+    xform.identity();
+    rotateX(xform, DEG2RADF(roll));
+    rotateY(xform, DEG2RADF(pitch));
+    rotateZ(xform, DEG2RADF(yaw));
+    rotateColumns();
+}
+
+void Transform360Frame::updateLines(double time,
+                                    uint32_t* out,
+                                    const uint32_t* in, int start, int num) {
+    if (yawOnly) {
+        rotate_360_yaw(out, in, width, height, start, num, yaw, interpolation);
+    } else if (map != NULL) {
+        if (buildMap) {
+            transform_360_map(*columns, map, width, height, start, num);
         }
+        apply_360_map(out, (uint32_t*) in, map, width, height, start, num, yaw, interpolation);
+    } else if (canMap360(width, height)) {
+        transform_360_map_direct(*columns, out, (uint32_t*) in, width, height, start, num, yaw, interpolation);
+    } else {
+        transform_360(*columns, out, (uint32_t*) in, width, height, start, num, interpolation);
     }
 }
 
@@ -3,8 +3,12 @@
 #define ImageProcessing_HPP
 
 #include <inttypes.h>
+#include <memory>
+#include <vector>
 #include "LUT.hpp"
+#include "Map360.hpp"
 #include "Matrix.hpp"
+#include "MPFilter.hpp"
 
 enum Interpolation {
     NONE = 0,
@@ -38,10 +42,228 @@ uint32_t int64lerp(const uint32_t a, const uint32_t b, const int x);
 uint32_t int32Scale(const uint32_t v, const uint32_t rs, const uint32_t gs, const uint32_t bs, const uint32_t shift);
 uint32_t int32Scale(const uint32_t v, const uint32_t rs, const uint32_t gs, const uint32_t bs, const uint32_t den, const LUT& lut, const LUT& invLut);
 
+/**
+ * The rays through the columns of a frame, rotated by a transform.
+ *
+ * The ray through an output pixel is cos_phi * (cos_theta, sin_theta, 0) +
+ * sin_phi * (0, 0, 1). Rotation is linear, so the rotated ray is cos_phi times
+ * the rotated column vector plus sin_phi times the rotated z axis. The column
+ * vectors are rotated once per frame, which leaves a few multiply-adds per
+ * pixel instead of a full matrix multiplication.
+ *
+ * Several threads can project scanlines at the same time, each with Rays of
+ * its own.
+ */
+class RotatedColumns {
+  public:
+    RotatedColumns(const Transform360Support& t360, int width, const Matrix3& xform);
+    RotatedColumns(const Transform360Support& t360, int width, double yaw, double pitch, double roll);
+
+    /**
+     * Room for the rays of one scanline, and the longitudes and latitudes
+     * they are projected to.
+     */
+    class Rays {
+      public:
+        Rays(int width);
+
+        double* theta;
+        double* phi;
+
+      private:
+        friend class RotatedColumns;
+
+        std::vector<double> buffer;
+        double* x;
+        double* y;
+        double* z;
+    };
+
+    /**
+     * Computes the longitude and latitude of the rotated rays of a scanline,
+     * into rays.theta and rays.phi, using the batch math functions. The
+     * results are the same as calling fastAtan2 for each pixel.
+     */
+    void project(double cos_phi, double sin_phi, Rays& rays) const;
+
+  private:
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> z;
+    double zAxis[3];
+};
+
 void transform_360(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll, int interpolation);
 void transform_360(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, const Matrix3& xform, int interpolation);
-void transform_360_map(const Transform360Support& t360, float* out, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll);
-void apply_360_map(uint32_t* out, uint32_t* ibuf1, float* map, int width, int height, int start_scanline, int num_scanlines, int interpolation);
+void transform_360_map(const Transform360Support& t360, Map360Entry* out, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll);
+
+/**
+ * Like the functions above, with the columns rotated by the caller, so that
+ * it can be done once for a whole frame.
+ */
+void transform_360(const RotatedColumns& columns, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, int interpolation);
+void transform_360_map(const RotatedColumns& columns, Map360Entry* out, int width, int height, int start_scanline, int num_scanlines);
+void apply_360_map(uint32_t* out, uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int interpolation);
+
+/**
+ * Applies a map built without yaw, and adds the yaw as a horizontal offset
+ * to the source coordinates. In an equirectangular image a rotation around
+ * the vertical axis is a circular shift of the columns, so one map built
+ * for a pitch and roll can be used with any yaw.
+ */
+void apply_360_map(uint32_t* out, uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, double yaw, int interpolation);
+
+/**
+ * Renders the scanlines like transform_360_map without yaw followed by
+ * apply_360_map with the yaw, with the same result, but builds and applies
+ * the map one row at a time instead of keeping it.
+ */
+void transform_360_map_direct(const Transform360Support& t360, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, double pitch, double roll, int interpolation);
+
+/**
+ * Like the function above, with the columns rotated by the pitch and roll by
+ * the caller.
+ */
+void transform_360_map_direct(const RotatedColumns& columns, uint32_t* out, uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, int interpolation);
+
+/**
+ * Rotates the scanlines in the range by a yaw only. This is a circular shift
+ * of each row, and needs no map.
+ */
+void rotate_360_yaw(uint32_t* out, const uint32_t* ibuf1, int width, int height, int start_scanline, int num_scanlines, double yaw, int interpolation);
+
+/**
+ * Returns the sum of the absolute differences between the first n values of
+ * a and b. The differences must fit in a short.
+ */
+int sad_row(const short* a, const short* b, int n);
+
+/**
+ * True if frames of the given size can be rendered through Map360Entry maps.
+ * Larger frames must be rendered without a map.
+ */
+inline bool canMap360(int width, int height) {
+    return width <= MAP_360_MAX_SIZE && height <= MAP_360_MAX_SIZE;
+}
+
+/**
+ * Creates a map entry for the given source coordinates. The coordinates must
+ * already be wrapped and clamped to the source image, or x be negative if
+ * the output pixel has no source pixel.
+ */
+inline Map360Entry makeMap360Entry(double xt, double yt) {
+    Map360Entry entry;
+    if (xt < 0) {
+        entry.x = MAP_360_OUTSIDE;
+        entry.y = 0;
+        entry.ax = 0;
+        entry.ay = 0;
+        return entry;
+    }
+    int ix = (int) xt;
+    int iy = (int) yt;
+    entry.x = (uint16_t) ix;
+    entry.y = (uint16_t) iy;
+    entry.ax = (uint8_t) ((xt - ix) * 128);
+    entry.ay = (uint8_t) ((yt - iy) * 128);
+    return entry;
+}
+
+/**
+ * Maps output pixels to coordinates in an equirectangular source image.
+ */
+class Projection360 {
+  public:
+    virtual ~Projection360() {
+    }
+
+    /**
+     * Computes the source coordinates for an output pixel. The coordinates
+     * are wrapped and clamped to the source image, like the ones stored in
+     * a map by transform_360_map.
+     *
+     * @return false if the output pixel has no source pixel.
+     */
+    virtual bool project(double x, double y, double& xt, double& yt) const = 0;
+};
+
+/**
+ * Renders the scanlines by projecting and sampling every pixel. For frames
+ * too large for a map (see canMap360).
+ */
+void apply_360_projection(const Projection360& projection, uint32_t* out, uint32_t* in, int width, int height, int start_scanline, int num_scanlines, int interpolation);
+
+/**
+ * The projection computed by transform_360_map, for any frame size.
+ */
+class Transform360Projection : public Projection360 {
+  public:
+    Transform360Projection(int width, int height, double yaw, double pitch, double roll);
+    Transform360Projection(int width, int height, const Matrix3& xform);
+
+    virtual bool project(double x, double y, double& xt, double& yt) const;
+
+  private:
+    int width;
+    int height;
+    Matrix3 xform;
+};
+
+/**
+ * A single frame rotated by transform_360. All state needed to render the frame
+ * is copied in when the object is created, so several frames can be processed
+ * at the same time by different threads.
+ *
+ * Rotations that only have a yaw are done with rotate_360_yaw. Other frames
+ * are rendered with a map if there is one, or else by
+ * transform_360_map_direct, which gives the same result, so whether a frame
+ * gets a map only affects how long it takes. Frames too large for a map are
+ * rendered by transform_360.
+ */
+class Transform360Frame : public MPFilter {
+  public:
+    Transform360Frame(const Transform360Support& t360, int width, int height, double yaw, double pitch, double roll, int interpolation);
+    Transform360Frame(const Transform360Support& t360, int width, int height, const Matrix3& xform, int interpolation);
+
+    /**
+     * Renders the frame with a map built for the pitch and roll only, and
+     * applies the yaw as an offset. If buildMap is true, the map is built
+     * first. If map is NULL the frame is rendered without a map.
+     */
+    Transform360Frame(const Transform360Support& t360, int width, int height, double yaw, double pitch, double roll,
+                      Map360Entry* map, bool buildMap, int interpolation);
+
+    virtual void updateLines(double time,
+                             uint32_t* out,
+                             const uint32_t* in, int start, int num);
+
+  private:
+    void rotateColumns();
+
+    const Transform360Support& t360;
+    int width;
+    int height;
+    Matrix3 xform;
+    int interpolation;
+
+    /**
+     * The rotation in degrees, when known.
+     */
+    double yaw;
+    double pitch;
+    double roll;
+    bool yawOnly;
+
+    Map360Entry* map;
+    bool buildMap;
+
+    /**
+     * The columns rotated for whatever the frame is rendered with: the
+     * pitch and roll if the map is built or the frame is rendered as if it
+     * were, else the whole rotation. Empty if neither is needed.
+     */
+    std::unique_ptr<RotatedColumns> columns;
+};
 
 
 
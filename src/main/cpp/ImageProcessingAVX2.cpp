@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "ImageProcessingAVX2.hpp"
+
+#ifdef USE_AVX2
+
+#include <immintrin.h>
+
+/*
+ * This file is compiled with AVX2 enabled. See ImageProcessingAVX2.hpp for
+ * why it must not include headers that define inline functions.
+ */
+
+/**
+ * Loads eight map entries into one register for each field.
+ */
+static inline void loadMapEntries(const Map360Entry* map, __m256i& x, __m256i& y, __m256i& ax, __m256i& ay) {
+    // Entries are six bytes, so gather them. Reading four bytes at offset 0
+    // gives x and y, and at offset 2 gives y, ax and ay. Both reads stay
+    // inside the entry.
+    const __m256i offsets = _mm256_setr_epi32(0, 6, 12, 18, 24, 30, 36, 42);
+    const __m256i lo16 = _mm256_set1_epi32(0xffff);
+    const __m256i lo8 = _mm256_set1_epi32(0xff);
+    const char* bytes = (const char*) map;
+    __m256i xy = _mm256_i32gather_epi32((const int*) bytes, offsets, 1);
+    __m256i yaa = _mm256_i32gather_epi32((const int*) (bytes + 2), offsets, 1);
+    x = _mm256_and_si256(xy, lo16);
+    y = _mm256_srli_epi32(xy, 16);
+    ax = _mm256_and_si256(_mm256_srli_epi32(yaa, 16), lo8);
+    ay = _mm256_srli_epi32(yaa, 24);
+}
+
+/**
+ * 7-bit linear interpolation of four pixels held in 16-bit lanes. This does the
+ * same arithmetic as _sseBlerp, so the results are identical.
+ */
+static inline __m256i lerp16(__m256i a, __m256i b, __m256i weight) {
+    return _mm256_add_epi16(a, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(b, a), weight), 7));
+}
+
+/**
+ * Bilinear interpolation of eight pixels, given their four neighbours and
+ * the 7-bit weights.
+ */
+static inline __m256i blerp8(__m256i a, __m256i b, __m256i c, __m256i d, __m256i ax, __m256i ay) {
+    const __m256i zero = _mm256_setzero_si256();
+
+    // Each weight goes in all four 16-bit channel lanes of its pixel, in
+    // the same order as the unpacked pixels below.
+    __m256i ax2 = _mm256_or_si256(ax, _mm256_slli_epi32(ax, 16));
+    __m256i ay2 = _mm256_or_si256(ay, _mm256_slli_epi32(ay, 16));
+    __m256i axLo = _mm256_unpacklo_epi32(ax2, ax2);
+    __m256i axHi = _mm256_unpackhi_epi32(ax2, ax2);
+    __m256i ayLo = _mm256_unpacklo_epi32(ay2, ay2);
+    __m256i ayHi = _mm256_unpackhi_epi32(ay2, ay2);
+
+    __m256i eLo = lerp16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), axLo);
+    __m256i fLo = lerp16(_mm256_unpacklo_epi8(c, zero), _mm256_unpacklo_epi8(d, zero), axLo);
+    __m256i gLo = lerp16(eLo, fLo, ayLo);
+
+    __m256i eHi = lerp16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), axHi);
+    __m256i fHi = lerp16(_mm256_unpackhi_epi8(c, zero), _mm256_unpackhi_epi8(d, zero), axHi);
+    __m256i gHi = lerp16(eHi, fHi, ayHi);
+
+    return _mm256_packus_epi16(gLo, gHi);
+}
+
+template<int interpolation>
+static int apply_360_map_avx2_tmpl(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset) {
+    const int vectorWidth = width & ~7;
+    const int* frame = (const int*) ibuf1;
+
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i w = _mm256_set1_epi32(width);
+    const __m256i hm1 = _mm256_set1_epi32(height - 1);
+    const __m256i outsideX = _mm256_set1_epi32(MAP_360_OUTSIDE);
+    const __m256i offset = _mm256_set1_epi32(x_offset);
+    const __m256i w128m1 = _mm256_set1_epi32((width << 7) - 1);
+    const __m256i w128 = _mm256_set1_epi32(width << 7);
+    const __m256i lo7 = _mm256_set1_epi32(127);
+
+    for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+        for (int xi = 0; xi < vectorWidth; xi += 8) {
+            int idx = yi * width + xi;
+
+            __m256i ix0;
+            __m256i iy0;
+            __m256i ax;
+            __m256i ay;
+            loadMapEntries(map + idx, ix0, iy0, ax, ay);
+
+            __m256i outside = _mm256_cmpeq_epi32(ix0, outsideX);
+            if (x_offset != 0) {
+                // Add the offset to x in 1/128 pixels, and wrap it
+                __m256i fx = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(ix0, 7), ax), offset);
+                fx = _mm256_sub_epi32(fx, _mm256_and_si256(_mm256_cmpgt_epi32(fx, w128m1), w128));
+                ix0 = _mm256_srli_epi32(fx, 7);
+                ax = _mm256_and_si256(fx, lo7);
+            }
+            __m256i iy0w = _mm256_andnot_si256(outside, _mm256_mullo_epi32(iy0, w));
+            ix0 = _mm256_andnot_si256(outside, ix0);
+
+            __m256i result;
+            if (interpolation == 0) {
+                result = _mm256_i32gather_epi32(frame, _mm256_add_epi32(iy0w, ix0), 4);
+            } else {
+                // Wrap x around the seam, clamp y to the image.
+                __m256i ix1 = _mm256_add_epi32(ix0, one);
+                ix1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(ix1, w), ix1);
+                __m256i iy1w = _mm256_add_epi32(iy0w, _mm256_and_si256(_mm256_cmpgt_epi32(hm1, iy0), w));
+
+                __m256i a = _mm256_i32gather_epi32(frame, _mm256_add_epi32(iy0w, ix0), 4);
+                __m256i b = _mm256_i32gather_epi32(frame, _mm256_add_epi32(iy0w, ix1), 4);
+                __m256i c = _mm256_i32gather_epi32(frame, _mm256_add_epi32(iy1w, ix0), 4);
+                __m256i d = _mm256_i32gather_epi32(frame, _mm256_add_epi32(iy1w, ix1), 4);
+
+                result = blerp8(a, b, c, d, ax, ay);
+            }
+
+            result = _mm256_andnot_si256(outside, result);
+            _mm256_storeu_si256((__m256i*) (out + idx), result);
+        }
+    }
+    return vectorWidth;
+}
+
+int apply_360_map_avx2(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation) {
+    switch(interpolation) {
+    case 0:
+        return apply_360_map_avx2_tmpl<0>(out, ibuf1, map, width, height, start_scanline, num_scanlines, x_offset);
+    case 1:
+        return apply_360_map_avx2_tmpl<1>(out, ibuf1, map, width, height, start_scanline, num_scanlines, x_offset);
+    }
+    return 0;
+}
+
+int lerp_row_avx2(uint32_t* out, const uint32_t* row, int n, int ax) {
+    const int vectorWidth = n & ~7;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weight = _mm256_set1_epi16((short) ax);
+    for (int i = 0; i < vectorWidth; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (row + i + 1));
+        __m256i lo = lerp16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), weight);
+        __m256i hi = lerp16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), weight);
+        _mm256_storeu_si256((__m256i*) (out + i), _mm256_packus_epi16(lo, hi));
+    }
+    return vectorWidth;
+}
+
+int sad_row_avx2(const short* a, const short* b, int n, int* sad) {
+    const int vectorWidth = n & ~15;
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < vectorWidth; i += 16) {
+        __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_abs_epi16(_mm256_sub_epi16(va, vb)), ones));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    *sad = _mm_cvtsi128_si32(half);
+    return vectorWidth;
+}
+
+#endif
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef ImageProcessingAVX2_HPP
+#define ImageProcessingAVX2_HPP
+
+#include <inttypes.h>
+#include "Map360.hpp"
+
+/*
+ * Kernels in this header live in a translation unit that is compiled with
+ * AVX2 enabled. Only call them when cpuLevel() is CPU_AVX2 or higher, and keep
+ * this header free of inline functions: an inline function instantiated in
+ * the AVX2 translation unit may be picked by the linker for the whole
+ * plugin, and would then crash on CPUs without AVX2.
+ */
+
+#ifdef USE_AVX2
+/**
+ * Applies a map built by transform_360_map to the scanlines in the range,
+ * eight pixels at a time. The result is identical to that of apply_360_map.
+ *
+ * @param x_offset offset added to the source x coordinates, in 1/128 pixels,
+ *                 in the range [0, width * 128)
+ * @return the number of columns in each scanline that were processed. The
+ *         remaining columns, up to width, are left for the caller.
+ */
+int apply_360_map_avx2(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation);
+
+/**
+ * Interpolates between each of the first n pixels in a row and its right
+ * neighbour, with the 7-bit weight ax. The row must have n + 1 pixels.
+ *
+ * @return the number of pixels that were processed. The remaining pixels,
+ *         up to n, are left for the caller.
+ */
+int lerp_row_avx2(uint32_t* out, const uint32_t* row, int n, int ax);
+
+/**
+ * Sums the absolute differences between a and b, 16 values at a time, into
+ * sad. The differences must fit in a short.
+ *
+ * @return the number of values that were processed. The remaining values, up
+ *         to n, are left for the caller.
+ */
+int sad_row_avx2(const short* a, const short* b, int n, int* sad);
+#endif
+
+#endif
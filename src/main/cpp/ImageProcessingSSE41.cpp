@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "ImageProcessingSSE41.hpp"
+
+#ifdef USE_SSE41
+
+#include <smmintrin.h>
+
+/*
+ * This file is compiled with SSE4.1 enabled. See ImageProcessingAVX2.hpp for
+ * why it must not include headers that define inline functions.
+ */
+
+/**
+ * 7-bit linear interpolation of two pixels held in 16-bit lanes. This does the
+ * same arithmetic as _sseBlerp, so the results are identical.
+ */
+static inline __m128i lerp16(__m128i a, __m128i b, __m128i weight) {
+    return _mm_add_epi16(a, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(b, a), weight), 7));
+}
+
+/**
+ * Bilinear interpolation of four pixels, given their four neighbours and
+ * the 7-bit weights.
+ */
+static inline __m128i blerp4(__m128i a, __m128i b, __m128i c, __m128i d, __m128i ax, __m128i ay) {
+    const __m128i zero = _mm_setzero_si128();
+
+    // Each weight goes in all four 16-bit channel lanes of its pixel, in
+    // the same order as the unpacked pixels below.
+    __m128i ax2 = _mm_or_si128(ax, _mm_slli_epi32(ax, 16));
+    __m128i ay2 = _mm_or_si128(ay, _mm_slli_epi32(ay, 16));
+    __m128i axLo = _mm_unpacklo_epi32(ax2, ax2);
+    __m128i axHi = _mm_unpackhi_epi32(ax2, ax2);
+    __m128i ayLo = _mm_unpacklo_epi32(ay2, ay2);
+    __m128i ayHi = _mm_unpackhi_epi32(ay2, ay2);
+
+    __m128i eLo = lerp16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), axLo);
+    __m128i fLo = lerp16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero), axLo);
+    __m128i gLo = lerp16(eLo, fLo, ayLo);
+
+    __m128i eHi = lerp16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), axHi);
+    __m128i fHi = lerp16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero), axHi);
+    __m128i gHi = lerp16(eHi, fHi, ayHi);
+
+    return _mm_packus_epi16(gLo, gHi);
+}
+
+/**
+ * Loads the four pixels at the given indices. There is no gather before
+ * AVX2, so this is done one pixel at a time.
+ */
+static inline __m128i loadPixels(const uint32_t* frame, __m128i indices) {
+    __m128i pixels = _mm_cvtsi32_si128((int) frame[_mm_cvtsi128_si32(indices)]);
+    pixels = _mm_insert_epi32(pixels, (int) frame[_mm_extract_epi32(indices, 1)], 1);
+    pixels = _mm_insert_epi32(pixels, (int) frame[_mm_extract_epi32(indices, 2)], 2);
+    pixels = _mm_insert_epi32(pixels, (int) frame[_mm_extract_epi32(indices, 3)], 3);
+    return pixels;
+}
+
+template<int interpolation>
+static int apply_360_map_sse41_tmpl(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset) {
+    const int vectorWidth = width & ~3;
+
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i w = _mm_set1_epi32(width);
+    const __m128i hm1 = _mm_set1_epi32(height - 1);
+    const __m128i outsideX = _mm_set1_epi32(MAP_360_OUTSIDE);
+    const __m128i offset = _mm_set1_epi32(x_offset);
+    const __m128i w128m1 = _mm_set1_epi32((width << 7) - 1);
+    const __m128i w128 = _mm_set1_epi32(width << 7);
+    const __m128i lo7 = _mm_set1_epi32(127);
+
+    for (int yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
+        for (int xi = 0; xi < vectorWidth; xi += 4) {
+            int idx = yi * width + xi;
+            const Map360Entry* m = map + idx;
+
+            __m128i ix0 = _mm_setr_epi32(m[0].x, m[1].x, m[2].x, m[3].x);
+            __m128i iy0 = _mm_setr_epi32(m[0].y, m[1].y, m[2].y, m[3].y);
+            __m128i ax = _mm_setr_epi32(m[0].ax, m[1].ax, m[2].ax, m[3].ax);
+            __m128i ay = _mm_setr_epi32(m[0].ay, m[1].ay, m[2].ay, m[3].ay);
+
+            __m128i outside = _mm_cmpeq_epi32(ix0, outsideX);
+            if (x_offset != 0) {
+                // Add the offset to x in 1/128 pixels, and wrap it
+                __m128i fx = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(ix0, 7), ax), offset);
+                fx = _mm_sub_epi32(fx, _mm_and_si128(_mm_cmpgt_epi32(fx, w128m1), w128));
+                ix0 = _mm_srli_epi32(fx, 7);
+                ax = _mm_and_si128(fx, lo7);
+            }
+            __m128i iy0w = _mm_andnot_si128(outside, _mm_mullo_epi32(iy0, w));
+            ix0 = _mm_andnot_si128(outside, ix0);
+
+            __m128i result;
+            if (interpolation == 0) {
+                result = loadPixels(ibuf1, _mm_add_epi32(iy0w, ix0));
+            } else {
+                // Wrap x around the seam, clamp y to the image.
+                __m128i ix1 = _mm_add_epi32(ix0, one);
+                ix1 = _mm_andnot_si128(_mm_cmpeq_epi32(ix1, w), ix1);
+                __m128i iy1w = _mm_add_epi32(iy0w, _mm_and_si128(_mm_cmpgt_epi32(hm1, iy0), w));
+
+                __m128i a = loadPixels(ibuf1, _mm_add_epi32(iy0w, ix0));
+                __m128i b = loadPixels(ibuf1, _mm_add_epi32(iy0w, ix1));
+                __m128i c = loadPixels(ibuf1, _mm_add_epi32(iy1w, ix0));
+                __m128i d = loadPixels(ibuf1, _mm_add_epi32(iy1w, ix1));
+
+                result = blerp4(a, b, c, d, ax, ay);
+            }
+
+            result = _mm_andnot_si128(outside, result);
+            _mm_storeu_si128((__m128i*) (out + idx), result);
+        }
+    }
+    return vectorWidth;
+}
+
+int apply_360_map_sse41(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation) {
+    switch(interpolation) {
+    case 0:
+        return apply_360_map_sse41_tmpl<0>(out, ibuf1, map, width, height, start_scanline, num_scanlines, x_offset);
+    case 1:
+        return apply_360_map_sse41_tmpl<1>(out, ibuf1, map, width, height, start_scanline, num_scanlines, x_offset);
+    }
+    return 0;
+}
+
+int lerp_row_sse41(uint32_t* out, const uint32_t* row, int n, int ax) {
+    const int vectorWidth = n & ~3;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight = _mm_set1_epi16((short) ax);
+    for (int i = 0; i < vectorWidth; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (row + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (row + i + 1));
+        __m128i lo = lerp16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), weight);
+        __m128i hi = lerp16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), weight);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(lo, hi));
+    }
+    return vectorWidth;
+}
+
+int sad_row_sse41(const short* a, const short* b, int n, int* sad) {
+    const int vectorWidth = n & ~7;
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < vectorWidth; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+        // Adds pairs of differences into 32-bit lanes, so the sum cannot
+        // overflow.
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_abs_epi16(_mm_sub_epi16(va, vb)), ones));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    *sad = _mm_cvtsi128_si32(sum);
+    return vectorWidth;
+}
+
+#endif
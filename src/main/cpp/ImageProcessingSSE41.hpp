@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef ImageProcessingSSE41_HPP
+#define ImageProcessingSSE41_HPP
+
+#include <inttypes.h>
+#include "Map360.hpp"
+
+/*
+ * Kernels in this header live in a translation unit that is compiled with
+ * SSE4.1 enabled. Only call them when cpuLevel() is CPU_SSE41 or higher. See
+ * ImageProcessingAVX2.hpp for why this header must not define inline
+ * functions.
+ */
+
+#ifdef USE_SSE41
+/**
+ * Applies a map built by transform_360_map to the scanlines in the range,
+ * four pixels at a time. The result is identical to that of apply_360_map.
+ *
+ * @param x_offset offset added to the source x coordinates, in 1/128 pixels,
+ *                 in the range [0, width * 128)
+ * @return the number of columns in each scanline that were processed. The
+ *         remaining columns, up to width, are left for the caller.
+ */
+int apply_360_map_sse41(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation);
+
+/**
+ * Interpolates between each of the first n pixels in a row and its right
+ * neighbour, with the 7-bit weight ax. The row must have n + 1 pixels.
+ *
+ * @return the number of pixels that were processed. The remaining pixels,
+ *         up to n, are left for the caller.
+ */
+int lerp_row_sse41(uint32_t* out, const uint32_t* row, int n, int ax);
+
+/**
+ * Sums the absolute differences between a and b, 8 values at a time, into
+ * sad. The differences must fit in a short.
+ *
+ * @return the number of values that were processed. The remaining values, up
+ *         to n, are left for the caller.
+ */
+int sad_row_sse41(const short* a, const short* b, int n, int* sad);
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include "KeyframeSchedule.hpp"
+
+KeyframeSchedule::KeyframeSchedule() : keyframeTime(-1), step(1), maxStep(1) {
+}
+
+void KeyframeSchedule::reset(int maxStep) {
+    keyframeTime = -1;
+    frameTimes.clear();
+    this->maxStep = std::max(maxStep, 1);
+    step = this->maxStep;
+}
+
+void KeyframeSchedule::setMaxStep(int maxStep) {
+    this->maxStep = std::max(maxStep, 1);
+    step = std::min(step, this->maxStep);
+}
+
+bool KeyframeSchedule::isKeyframe() const {
+    return keyframeTime < 0 || (int) frameTimes.size() + 1 >= step;
+}
+
+void KeyframeSchedule::skip(double time) {
+    frameTimes.push_back(time);
+}
+
+bool KeyframeSchedule::hasPending() const {
+    return keyframeTime >= 0 && !frameTimes.empty();
+}
+
+double KeyframeSchedule::takeLastPending() {
+    double time = frameTimes.back();
+    frameTimes.pop_back();
+    return time;
+}
+
+double KeyframeSchedule::keyframe(double time, double motion, double searchRadius) {
+    int frames = (int) frameTimes.size() + 1;
+    double scale = 1.0;
+    if (keyframeTime >= 0 && motion >= 0) {
+        // Track more often where the motion is large enough that the track
+        // points might have gone outside the search radius, or that turning
+        // at a constant rate is a poor guess for the frames in between.
+        if (motion > searchRadius / 2.0) {
+            step = std::max(step / 2, 1);
+        } else if (motion < searchRadius / 8.0) {
+            step = std::min(step * 2, maxStep);
+        }
+        scale = (double) step / frames;
+    }
+    keyframeTime = time;
+    frameTimes.clear();
+    return scale;
+}
+
+double KeyframeSchedule::getKeyframeTime() const {
+    return keyframeTime;
+}
+
+const std::vector<double>& KeyframeSchedule::getFrameTimes() const {
+    return frameTimes;
+}
+
+int KeyframeSchedule::getStep() const {
+    return step;
+}
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef KeyframeSchedule_HPP
+#define KeyframeSchedule_HPP
+
+#include <vector>
+
+/**
+ * Decides which frames of an analysis are tracked, the keyframes, and keeps
+ * the times of the frames in between, whose rotations are interpolated once
+ * the next keyframe has been tracked.
+ *
+ * The number of frames from one keyframe to the next, the step, adapts to
+ * the motion: it is halved when the motion comes close to the search radius,
+ * and doubled again when the motion is small, up to the largest step.
+ */
+class KeyframeSchedule {
+  public:
+    KeyframeSchedule();
+
+    /**
+     * Forgets the keyframe and the frames since it, and starts over at the
+     * largest step.
+     */
+    void reset(int maxStep);
+
+    /**
+     * Sets the largest step, and makes the current step no larger.
+     */
+    void setMaxStep(int maxStep);
+
+    /**
+     * True if the next frame should be tracked.
+     */
+    bool isKeyframe() const;
+
+    /**
+     * Adds a frame that is not tracked.
+     */
+    void skip(double time);
+
+    /**
+     * True if there is a keyframe, and frames after it that are not
+     * tracked. The rotations of those frames are lost unless the last one
+     * is tracked.
+     */
+    bool hasPending() const;
+
+    /**
+     * Removes the last frame that is not tracked, so that it can be tracked
+     * as a keyframe, and returns its time.
+     */
+    double takeLastPending();
+
+    /**
+     * Makes the frame the keyframe, and adapts the step to the motion since
+     * the previous keyframe.
+     *
+     * @param motion the largest motion of the track points since the
+     *     previous keyframe, in pixels, or a negative value if the frame
+     *     could not be tracked
+     * @param searchRadius the search radius of the track points, in pixels
+     * @return how much larger the motion to the next keyframe is expected
+     *     to be than the motion to this one, if the camera keeps turning at
+     *     the same rate
+     */
+    double keyframe(double time, double motion, double searchRadius);
+
+    /**
+     * The time of the keyframe, or -1 if there is none.
+     */
+    double getKeyframeTime() const;
+
+    /**
+     * The times of the frames since the keyframe, in order.
+     */
+    const std::vector<double>& getFrameTimes() const;
+
+    int getStep() const;
+
+  private:
+    double keyframeTime;
+    std::vector<double> frameTimes;
+    int step;
+    int maxStep;
+};
+
+#endif
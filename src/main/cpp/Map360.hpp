@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef Map360_HPP
+#define Map360_HPP
+
+#include <inttypes.h>
+
+/**
+ * Marks a map entry whose output pixel has no source pixel.
+ */
+#define MAP_360_OUTSIDE 0xffff
+
+/**
+ * The largest width and height of a frame that can be rendered through a map.
+ */
+#define MAP_360_MAX_SIZE 65534
+
+/**
+ * One output pixel of a map built by transform_360_map and friends, and
+ * applied by apply_360_map.
+ *
+ * The entry holds the source pixel to the top left of the sample point, and
+ * the 7-bit position of the sample point between that pixel and its right and
+ * lower neighbours - the same weights that the blerp functions take. This is
+ * six bytes per pixel, instead of eight for a pair of floats, and applying the
+ * map does not have to convert from floating point.
+ *
+ * Coordinates are 16 bits, so frames can be at most MAP_360_MAX_SIZE pixels
+ * wide and high; larger frames are rendered without a map, see canMap360.
+ * Entries outside the source image have x set to MAP_360_OUTSIDE.
+ *
+ * This header must not define inline functions, as it is included by
+ * ImageProcessingAVX2.cpp.
+ */
+struct Map360Entry {
+    uint16_t x;
+    uint16_t y;
+    uint8_t ax;
+    uint8_t ay;
+};
+
+#endif
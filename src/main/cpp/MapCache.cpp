@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <cstdlib>
+#include <cstring>
+#include <inttypes.h>
+
+#include "MapCache.hpp"
+
+#define MAP_CACHE_DEFAULT_BUDGET_MB 512
+
+MapKey::MapKey(const char* plugin, int width, int height) : plugin(plugin), width(width), height(height) {
+}
+
+MapKey& MapKey::add(double value) {
+    parameters.push_back(value);
+    return *this;
+}
+
+bool MapKey::operator== (const MapKey& other) const {
+    return width == other.width && height == other.height && plugin == other.plugin && parameters == other.parameters;
+}
+
+std::size_t MapKey::hash() const {
+    // FNV-1a over the parameter bits
+    uint64_t h = 14695981039346656037ull;
+    h = (h ^ std::hash<std::string>()(plugin)) * 1099511628211ull;
+    h = (h ^ (uint64_t) width) * 1099511628211ull;
+    h = (h ^ (uint64_t) height) * 1099511628211ull;
+    for (double v : parameters) {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        h = (h ^ bits) * 1099511628211ull;
+    }
+    return (std::size_t) h;
+}
+
+MapCache::MapCache(std::size_t budget) : budget(budget), used(0) {
+}
+
+static std::size_t budgetFromEnvironment() {
+    std::size_t megabytes = MAP_CACHE_DEFAULT_BUDGET_MB;
+    const char* env = getenv("BIGSH0T_MAP_CACHE_MB");
+    if (env != NULL && *env != '\0') {
+        megabytes = (std::size_t) strtoul(env, NULL, 10);
+    }
+    return megabytes * 1024 * 1024;
+}
+
+MapCache& MapCache::instance() {
+    static MapCache cache(budgetFromEnvironment());
+    return cache;
+}
+
+std::shared_ptr<void> MapCache::getMap(const MapKey& key) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = index.find(key);
+    if (found == index.end()) {
+        return std::shared_ptr<void>();
+    }
+    entries.splice(entries.begin(), entries, found->second);
+    return found->second->map;
+}
+
+void MapCache::put(const MapKey& key, const std::shared_ptr<void>& map, std::size_t size) {
+    if (size > budget) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = index.find(key);
+    if (found != index.end()) {
+        used -= found->second->size;
+        entries.erase(found->second);
+        index.erase(found);
+    }
+
+    entries.push_front(Entry(key, map, size));
+    index[key] = entries.begin();
+    used += size;
+
+    while (used > budget) {
+        Entry& last = entries.back();
+        used -= last.size;
+        index.erase(last.key);
+        entries.pop_back();
+    }
+}
+
+std::size_t MapCache::getBudget() const {
+    return budget;
+}
+
+std::size_t MapCache::getSize() {
+    std::lock_guard<std::mutex> guard(lock);
+    return used;
+}
@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef MapCache_HPP
+#define MapCache_HPP
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Identifies a map: the plugin that built it, the frame size, and the
+ * parameters it was built from.
+ */
+class MapKey {
+  public:
+    MapKey(const char* plugin, int width, int height);
+
+    MapKey& add(double value);
+
+    bool operator== (const MapKey& other) const;
+
+    std::size_t hash() const;
+
+  private:
+    std::string plugin;
+    int width;
+    int height;
+    std::vector<double> parameters;
+};
+
+class MapKeyHash {
+  public:
+    std::size_t operator() (const MapKey& key) const {
+        return key.hash();
+    }
+};
+
+/**
+ * A least-recently-used cache of maps, shared by all filter instances in the
+ * plugin. Shotcut and melt create several instances of the same filter - for
+ * the preview, for the export, and for every clip the filter is on - and with
+ * the cache they can share maps, as can keyframes that return to earlier
+ * values.
+ *
+ * Maps are handed out as shared pointers and must not be modified once they
+ * have been put in the cache. Evicting a map only drops the reference held
+ * by the cache, so a map that is in use stays valid.
+ *
+ * The total size of the maps kept is limited by a budget, in megabytes, set
+ * through the BIGSH0T_MAP_CACHE_MB environment variable. The default is 512.
+ * A budget of zero turns the cache off.
+ */
+class MapCache {
+  public:
+    MapCache(std::size_t budget);
+
+    /**
+     * The cache for this plugin.
+     */
+    static MapCache& instance();
+
+    /**
+     * Returns the map for the key, or an empty pointer if it isn't cached.
+     */
+    template<typename T>
+    std::shared_ptr<T> get(const MapKey& key) {
+        return std::static_pointer_cast<T>(getMap(key));
+    }
+
+    /**
+     * Adds a map to the cache, evicting the least recently used maps if
+     * the cache goes over budget.
+     *
+     * @param size the size of the map in bytes
+     */
+    void put(const MapKey& key, const std::shared_ptr<void>& map, std::size_t size);
+
+    std::size_t getBudget() const;
+
+    std::size_t getSize();
+
+  private:
+    class Entry {
+      public:
+        Entry(const MapKey& key, const std::shared_ptr<void>& map, std::size_t size) : key(key), map(map), size(size) {
+        }
+
+        MapKey key;
+        std::shared_ptr<void> map;
+        std::size_t size;
+    };
+
+    std::shared_ptr<void> getMap(const MapKey& key);
+
+    std::size_t budget;
+    std::size_t used;
+    std::mutex lock;
+
+    /**
+     * Most recently used first.
+     */
+    std::list<Entry> entries;
+    std::unordered_map<MapKey, std::list<Entry>::iterator, MapKeyHash> index;
+};
+
+#endif
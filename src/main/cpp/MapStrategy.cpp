@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "MapStrategy.hpp"
+
+/**
+ * The weight of a new sample in the moving averages.
+ */
+#define MAP_STRATEGY_ALPHA 0.25
+
+/**
+ * How much slower than rendering directly a map must be before it is no
+ * longer used. Without the margin, noise in the timings would switch back
+ * and forth between the two.
+ */
+#define MAP_STRATEGY_MARGIN 1.25
+
+void MapStrategy::Average::add(double sample) {
+    if (samples == 0) {
+        value = sample;
+    } else {
+        value += MAP_STRATEGY_ALPHA * (sample - value);
+    }
+    ++samples;
+}
+
+MapStrategy::MapStrategy() : runLength(0) {
+}
+
+void MapStrategy::next(const MapKey& key) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (previous && *previous == key) {
+        ++runLength;
+    } else {
+        previous.reset(new MapKey(key));
+        runLength = 1;
+    }
+}
+
+bool MapStrategy::useMap() const {
+    std::lock_guard<std::mutex> guard(lock);
+    if (map.samples == 0 || direct.samples == 0) {
+        return true;
+    }
+    return map.value < direct.value * MAP_STRATEGY_MARGIN;
+}
+
+bool MapStrategy::buildMap() const {
+    std::lock_guard<std::mutex> guard(lock);
+    if (map.samples == 0 || direct.samples == 0 || build.samples == 0) {
+        return runLength >= 2;
+    }
+    double saving = direct.value - map.value;
+    return saving > 0 && runLength * saving > build.value;
+}
+
+void MapStrategy::addDirectTime(double seconds) {
+    std::lock_guard<std::mutex> guard(lock);
+    direct.add(seconds);
+}
+
+void MapStrategy::addMapTime(double seconds) {
+    std::lock_guard<std::mutex> guard(lock);
+    map.add(seconds);
+}
+
+void MapStrategy::addBuildTime(double seconds) {
+    std::lock_guard<std::mutex> guard(lock);
+    build.add(seconds);
+}
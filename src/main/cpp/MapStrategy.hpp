@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef MapStrategy_HPP
+#define MapStrategy_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include "MapCache.hpp"
+
+/**
+ * Chooses between rendering a frame through a map and rendering it directly,
+ * from the measured cost of each. Building a map pays off if
+ *
+ *     build < frames * (direct - map)
+ *
+ * where build is the time to build it, direct and map the time to render a
+ * frame without and with it, and frames the number of frames that will use
+ * it. The times are moving averages of what the filter instance has
+ * measured, so the choice follows the frame size and the machine. frei0r
+ * does not tell a plugin where the keyframes are, so the number of frames
+ * the parameters will stay the same is estimated from how long they have
+ * stayed the same so far: a run of n frames is expected to last n more.
+ *
+ * Until a cost has been measured, a map is built as soon as the parameters
+ * are the same for two frames in a row, and used whenever there is one.
+ *
+ * Thread-safe.
+ */
+class MapStrategy {
+  public:
+    MapStrategy();
+
+    /**
+     * Call once per frame, before useMap and buildMap, with the key of the
+     * map that the frame would use.
+     */
+    void next(const MapKey& key);
+
+    /**
+     * True if a map that is already built should be used.
+     */
+    bool useMap() const;
+
+    /**
+     * True if a map should be built for the parameters of the current frame.
+     */
+    bool buildMap() const;
+
+    /**
+     * Adds the time to render a frame without a map.
+     */
+    void addDirectTime(double seconds);
+
+    /**
+     * Adds the time to render a frame with a map that was already built.
+     */
+    void addMapTime(double seconds);
+
+    /**
+     * Adds the time to build a map.
+     */
+    void addBuildTime(double seconds);
+
+    /**
+     * Measures the time since it was created, for the add functions.
+     */
+    class Timer {
+      public:
+        Timer() : start(std::chrono::steady_clock::now()) {
+        }
+
+        double seconds() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+      private:
+        std::chrono::steady_clock::time_point start;
+    };
+
+  private:
+    /**
+     * An exponential moving average, empty until the first sample.
+     */
+    class Average {
+      public:
+        Average() : value(0.0), samples(0) {
+        }
+
+        void add(double sample);
+
+        double value;
+        int samples;
+    };
+
+    mutable std::mutex lock;
+    std::unique_ptr<MapKey> previous;
+    int runLength;
+    Average direct;
+    Average map;
+    Average build;
+};
+
+#endif
@@ -14,6 +14,7 @@
 
 
 #define DEG2RADF(x) ((x) * M_PI / 180.0)
+#define RAD2DEGF(x) ((x) * 180.0 / M_PI)
 
 void smooth (std::vector<double>& samples, int window, double windowBias);
 double fastAtan2(double y, double x);
@@ -135,6 +135,30 @@ void rotateQuaternion(Matrix3& m, const Quaternion& q) {
     m.prepend(rm);
 }
 
+/**
+ * Decomposes a rotation matrix into the angles, in radians, that give the same
+ * matrix when applied with rotateX(roll), rotateY(pitch) and rotateZ(yaw), in
+ * that order.
+ */
+void decomposeRotation(const Matrix3& m, double& yaw, double& pitch, double& roll) {
+    double sp = -m[6];
+    if (sp > 1.0) {
+        sp = 1.0;
+    }
+    if (sp < -1.0) {
+        sp = -1.0;
+    }
+    pitch = asin(sp);
+    if (fabs(sp) < 1.0 - 1e-12) {
+        yaw = atan2(m[3], m[0]);
+        roll = atan2(m[7], m[8]);
+    } else {
+        // Gimbal lock: only yaw - roll (or yaw + roll) is defined.
+        yaw = 0.0;
+        roll = atan2(-m[5], m[4]);
+    }
+}
+
 /**
  * Decomposes a quaternion rotation into swing (rotation around a vector perpendicular to v),
  * and twist (rotation around v)
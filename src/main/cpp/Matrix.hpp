@@ -119,6 +119,7 @@ void rotateX(Matrix3& m, double a);
 void rotateY(Matrix3& m, double a);
 void rotateZ(Matrix3& m, double a);
 void rotateQuaternion(Matrix3& m, const Quaternion& q);
+void decomposeRotation(const Matrix3& m, double& yaw, double& pitch, double& roll);
 
 void rotateQV3(const Quaternion& q, const Vector3& v, Vector3& out);
 void mulM3V3(const Matrix3& m, const Vector3& v, Vector3& out);
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "AnalysisFile.hpp"
+#include "AnalysisMerge.hpp"
+#include "Version.hpp"
+
+/**
+ * Merges the analysis files of the shards of a clip, analyzed separately
+ * by Stabilize 360, into one analysis file.
+ *
+ *     bigsh0t_merge_analysis output shard1 shard2 ...
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "bigsh0t %d.%d\n", BIGSH0T_VERSION_MAJOR, BIGSH0T_VERSION_MINOR);
+        fprintf(stderr, "Usage: %s output shard1 [shard2 ...]\n", argv[0]);
+        fprintf(stderr, "Merges the Stabilize 360 analysis files of the shards of a clip into one.\n");
+        return 1;
+    }
+
+    AnalysisMerge merge;
+    for (int i = 2; i < argc; ++i) {
+        std::shared_ptr<AnalysisFile> file = AnalysisFile::open(argv[i]);
+        if (file->isUnreadable()) {
+            fprintf(stderr, "Warning: %s is not an analysis file that this version can read all of.\n", argv[i]);
+        }
+        merge.add(argv[i], *file);
+    }
+
+    std::vector<std::string> warnings;
+    std::vector<AnalysisRecord> records = merge.merge(warnings);
+    for (const std::string& warning : warnings) {
+        fprintf(stderr, "Warning: %s\n", warning.c_str());
+    }
+    if (records.empty()) {
+        fprintf(stderr, "No analysis to merge.\n");
+        return 1;
+    }
+
+    std::shared_ptr<AnalysisFile> output = AnalysisFile::open(argv[1]);
+    if (output->isUnreadable()) {
+        fprintf(stderr, "%s is not an analysis file that this version can read, and is left alone.\n", argv[1]);
+        return 1;
+    }
+    if (!output->rewrite(records, 0, 0)) {
+        fprintf(stderr, "Could not write %s.\n", argv[1]);
+        return 1;
+    }
+    printf("Merged %d shards into %s: %d frames from %.3f s to %.3f s.\n", argc - 2, argv[1], (int) records.size(),
+           records.front().previousTime, records.back().time);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <cstdlib>
+
+#include "ImageProcessing.hpp"
+#include "PitchRollMap.hpp"
+
+PitchRollMap::PitchRollMap(const char* plugin, int width, int height) :
+    plugin(plugin), width(width), height(height),
+    mapPitch(0.0), mapRoll(0.0),
+    hasPrevious(false), previousPitch(0.0), previousRoll(0.0) {
+}
+
+MapKey PitchRollMap::mapKey(double pitch, double roll) const {
+    return MapKey(plugin.c_str(), width, height).add(pitch).add(roll);
+}
+
+std::shared_ptr<Map360Entry> PitchRollMap::get(double pitch, double roll, bool& build) {
+    build = false;
+
+    bool repeated = hasPrevious && pitch == previousPitch && roll == previousRoll;
+    hasPrevious = true;
+    previousPitch = pitch;
+    previousRoll = roll;
+
+    if ((pitch == 0.0 && roll == 0.0) || !canMap360(width, height)) {
+        return std::shared_ptr<Map360Entry>();
+    }
+
+    if (map && mapPitch == pitch && mapRoll == roll) {
+        return map;
+    }
+
+    std::shared_ptr<Map360Entry> cached = MapCache::instance().get<Map360Entry>(mapKey(pitch, roll));
+    if (cached) {
+        map = cached;
+        mapPitch = pitch;
+        mapRoll = roll;
+        return map;
+    }
+
+    if (repeated) {
+        build = true;
+        return std::shared_ptr<Map360Entry>((Map360Entry*) malloc (width * height * sizeof(Map360Entry)), free);
+    }
+    return std::shared_ptr<Map360Entry>();
+}
+
+void PitchRollMap::put(const std::shared_ptr<Map360Entry>& map, double pitch, double roll) {
+    MapCache::instance().put(mapKey(pitch, roll), map, width * height * sizeof(Map360Entry));
+    this->map = map;
+    mapPitch = pitch;
+    mapRoll = roll;
+}
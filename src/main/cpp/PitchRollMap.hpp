@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef PitchRollMap_HPP
+#define PitchRollMap_HPP
+
+#include <memory>
+#include <string>
+#include "Map360.hpp"
+#include "MapCache.hpp"
+
+/**
+ * Keeps the map for a pitch and roll, for filters whose rotation changes
+ * from frame to frame but mostly in yaw - stabilization corrections, for
+ * example. The map is built without yaw, and Transform360Frame applies the
+ * yaw as a column offset, so the map stays valid as long as pitch and roll
+ * stay the same.
+ *
+ * A map is only built when pitch and roll are the same as in the previous
+ * frame; until then frames are rendered directly. Maps are shared through
+ * the MapCache.
+ *
+ * Not thread-safe: call it under the filter's lock.
+ */
+class PitchRollMap {
+  public:
+    PitchRollMap(const char* plugin, int width, int height);
+
+    /**
+     * Returns the map to render a frame with, or an empty pointer if the
+     * frame should be rendered without one. Frames without pitch and roll
+     * never need a map, and frames too large for one never get one.
+     *
+     * @param build set to true if the map is new and must be built by the
+     *              frame. Pass it to put once the frame is done.
+     */
+    std::shared_ptr<Map360Entry> get(double pitch, double roll, bool& build);
+
+    /**
+     * Makes a map that has been built available to later frames.
+     */
+    void put(const std::shared_ptr<Map360Entry>& map, double pitch, double roll);
+
+  private:
+    MapKey mapKey(double pitch, double roll) const;
+
+    std::string plugin;
+    int width;
+    int height;
+
+    std::shared_ptr<Map360Entry> map;
+    double mapPitch;
+    double mapRoll;
+
+    bool hasPrevious;
+    double previousPitch;
+    double previousRoll;
+};
+
+#endif
@@ -5,47 +5,23 @@
 #include <mutex>
 #include <string>
 #include <cstring>
+#include <vector>
 #include "frei0r.hpp"
 #include "Matrix.hpp"
 #include "Math.hpp"
 #include "MPFilter.hpp"
 #include "ImageProcessing.hpp"
+#include "VectorMath.hpp"
 #include "Version.hpp"
 
 
-class RectToEq : public frei0r::filter, MPFilter {
-
+/**
+ * Renders one frame from a parameter snapshot.
+ */
+class RectToEqFrame : public MPFilter {
   public:
-    double hfov;
-    double vfov;
-    double interpolationParam;
-    int interpolation;
-
-    std::mutex lock;
-
-    RectToEq(unsigned int width, unsigned int height) {
-        register_param(hfov, "hfov", "");
-        register_param(vfov, "vfov", "");
-        register_param(interpolationParam, "interpolation", "");
-
-        hfov = 90;
-        vfov = 60;
-
-        interpolation = Interpolation::BILINEAR;
-    }
-
-    ~RectToEq() {
-    }
-
-    virtual void update(double time,
-                        uint32_t* out,
-                        const uint32_t* in) {
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
-
-        interpolation = (int) interpolationParam;
-        MPFilter::updateMP(this, time, out, in, width, height);
+    RectToEqFrame(int width, int height, double hfov, double vfov, int interpolation) :
+        width(width), height(height), hfov(hfov), vfov(vfov), interpolation(interpolation) {
     }
 
     virtual void updateLines(double time,
@@ -86,17 +62,23 @@ class RectToEq : public frei0r::filter, MPFilter {
 
         memset(&out[start_scanline * width], 0, num_scanlines * width * 4);
 
+        std::vector<double> theta(w);
+        std::vector<double> cos_theta(w);
+        std::vector<double> sin_theta(w);
+        for (xi = min_x; xi < max_x; xi++) {
+            theta[xi] = 2 * M_PI * ((double) xi - w / 2) / w;
+        }
+        batchSinCos(theta.data() + min_x, sin_theta.data() + min_x, cos_theta.data() + min_x, max_x - min_x);
+
         for (yi = start_scanline; yi < start_scanline + num_scanlines; yi++) {
             double phi = M_PI * ((double) yi - h / 2) / h;
             double cos_phi = cos(phi);
             double sin_phi = sin(phi);
             for (xi = min_x; xi < max_x; xi++) {
-                double theta = 2 * M_PI * ((double) xi - w / 2) / w;
-
-                ray[0] = cos(theta) * cos_phi;
+                ray[0] = cos_theta[xi] * cos_phi;
 
                 if (ray[0] > 0) {
-                    ray[1] = sin(theta) * cos_phi;
+                    ray[1] = sin_theta[xi] * cos_phi;
                     ray[2] = sin_phi;
 
                     ray[1] /= ray[0];
@@ -122,9 +104,57 @@ class RectToEq : public frei0r::filter, MPFilter {
         }
     }
 
-
   private:
+    int width;
+    int height;
+    double hfov;
+    double vfov;
+    int interpolation;
+};
+
+class RectToEq : public frei0r::filter {
+
+  public:
+    double hfov;
+    double vfov;
+    double interpolationParam;
+
+    std::mutex lock;
+
+    RectToEq(unsigned int width, unsigned int height) {
+        register_param(hfov, "hfov", "");
+        register_param(vfov, "vfov", "");
+        register_param(interpolationParam, "interpolation", "");
+
+        hfov = 90;
+        vfov = 60;
 
+        interpolationParam = Interpolation::BILINEAR;
+    }
+
+    ~RectToEq() {
+    }
+
+    virtual void update(double time,
+                        uint32_t* out,
+                        const uint32_t* in) {
+        double frameHfov;
+        double frameVfov;
+        int frameInterpolation;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            frameHfov = hfov;
+            frameVfov = vfov;
+            frameInterpolation = (int) interpolationParam;
+        }
+
+        RectToEqFrame frame(width, height, frameHfov, frameVfov, frameInterpolation);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
+    }
 };
 
 frei0r::construct<RectToEq> plugin("bigsh0t_rect_to_eq",
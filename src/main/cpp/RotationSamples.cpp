@@ -0,0 +1,437 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include <cmath>
+#include "AnalysisMerge.hpp"
+#include "Math.hpp"
+#include "RotationSamples.hpp"
+
+Rotation::Rotation (double previousTime, double time, double yaw, double pitch, double roll, bool updated) {
+    this->previousTime = previousTime;
+    this->time = time;
+    this->yaw = yaw;
+    this->pitch = pitch;
+    this->roll = roll;
+    this->updated = updated;
+}
+
+Rotation::Rotation (const AnalysisRecord& record) {
+    this->previousTime = record.previousTime;
+    this->time = record.time;
+    this->yaw = record.yaw;
+    this->pitch = record.pitch;
+    this->roll = record.roll;
+    this->updated = false;
+}
+
+double Rotation::span () const {
+    return time - previousTime;
+}
+
+bool Rotation::contains (const double t) const {
+    return t >= previousTime && t <= time;
+}
+
+bool Rotation::spanOverlaps (const Rotation& other) const {
+    if (other.contains(time) || other.contains (previousTime)) {
+        return true;
+    }
+    if (previousTime < other.previousTime && time > other.time) {
+        return true;
+    }
+    return false;
+}
+
+AnalysisRecord Rotation::toRecord () const {
+    AnalysisRecord record;
+    record.previousTime = previousTime;
+    record.time = time;
+    record.yaw = yaw;
+    record.pitch = pitch;
+    record.roll = roll;
+    return record;
+}
+
+RotationSamples::RotationSamples () {
+    minSpan = -1.0;
+    invalidateAggregates ();
+}
+
+void RotationSamples::add (Rotation rot) {
+    if (rotations.size() == 0 || rotations.back().time < rot.previousTime) {
+        // Appending, and nothing to remove
+        if (aggregatesValid) {
+            includeInAggregates (rot, rotations.size() > 0 ? &rotations.back() : NULL);
+        }
+        rotations.push_back(rot);
+        includeInMinSpan (rot);
+        return;
+    }
+
+    size_t first;
+    size_t last;
+    findOverlapping (rot, first, last);
+    invalidateAggregates ();
+    rotations.erase (rotations.begin() + first, rotations.begin() + last);
+    rotations.insert (rotations.begin() + first, rot);
+    includeInMinSpan (rot);
+}
+
+Rotation RotationSamples::getMax () {
+    if (!aggregatesValid) {
+        updateAggregates ();
+    }
+    Rotation m (0, 0, 0, 0, 0, false);
+    m.yaw = maxYaw;
+    m.pitch = maxPitch;
+    m.roll = maxRoll;
+    m.time = m.yaw;
+    if (m.pitch > m.time) {
+        m.time = m.pitch;
+    }
+    if (m.roll > m.time) {
+        m.time = m.roll;
+    }
+    return m;
+}
+
+void RotationSamples::drawDiagramValue (Graphics& g, int x, int y, int h, uint32_t mask, uint32_t color) {
+    int y0 = y;
+    if (h < 0) {
+        h = -h;
+        y0 -= h;
+    }
+    g.plot (x, y, mask, color);
+    g.fillRect (x, y0, 1, h, mask, color);
+}
+
+void RotationSamples::drawDiagram (Graphics& g, double time, int x, int y, int samples, int height) {
+    int lastIndex = indexOf (time);
+    if (lastIndex == -1) {
+        return;
+    }
+    if (samples > lastIndex + 1) {
+        samples = lastIndex + 1;
+    }
+    int rx = x + (samples / 2);
+    double scale = getMax ().time;
+    if (scale < 0.01) {
+        scale = 1.0;
+    }
+    for (int i = 0; i < samples; ++i) {
+        int index = lastIndex - i;
+        const Rotation& r = rotations[index];
+        int x0 = rx - i;
+
+        drawDiagramValue (g, x0, y, (int) (height * r.yaw / scale),   0x0000ffff, 0xffff0000);
+        drawDiagramValue (g, x0, y, (int) (height * r.pitch / scale), 0x00ff00ff, 0xff00ff00);
+        drawDiagramValue (g, x0, y, (int) (height * r.roll / scale),  0x00ffff00, 0xff0000ff);
+    }
+}
+
+void RotationSamples::clear () {
+    rotations.clear();
+    minSpan = -1.0;
+    invalidateAggregates ();
+}
+
+const Rotation& RotationSamples::operator[](int index) const {
+    return rotations[index];
+}
+
+int RotationSamples::indexOf (const Rotation& rot) {
+    return indexOf (rot.time);
+}
+
+int RotationSamples::indexOf (const double time) {
+    // The first rotation that ends at or after the time is the only one
+    // that can contain it.
+    std::vector<Rotation>::const_iterator found = std::lower_bound(rotations.begin(), rotations.end(), time, [](const Rotation& r, double t) {
+        return r.time < t;
+    });
+    if (found != rotations.end() && found->contains(time)) {
+        return (int) (found - rotations.begin());
+    }
+    return -1;
+}
+
+int RotationSamples::lookup (const double time) {
+    return indexOf(time - getMinSpan() / 2);
+}
+
+size_t RotationSamples::size () {
+    return rotations.size();
+}
+
+void RotationSamples::findOverlapping (const Rotation& r, size_t& first, size_t& last) {
+    std::vector<Rotation>::const_iterator begin = std::lower_bound(rotations.begin(), rotations.end(), r.previousTime, [](const Rotation& r2, double t) {
+        return r2.time < t;
+    });
+    std::vector<Rotation>::const_iterator end = std::upper_bound(begin, rotations.cend(), r.time, [](double t, const Rotation& r2) {
+        return t < r2.previousTime;
+    });
+    first = begin - rotations.cbegin();
+    last = end - rotations.cbegin();
+}
+
+void RotationSamples::removeOverlapping (const Rotation& r) {
+    size_t first;
+    size_t last;
+    findOverlapping (r, first, last);
+    if (first != last) {
+        rotations.erase (rotations.begin() + first, rotations.begin() + last);
+        invalidateAggregates ();
+    }
+}
+
+bool RotationSamples::hasOverlapping (const Rotation& r) {
+    size_t first;
+    size_t last;
+    findOverlapping (r, first, last);
+    return first != last;
+}
+
+double RotationSamples::getMinSpan () {
+    return minSpan;
+}
+
+int RotationSamples::findFirstSkip () {
+    if (size () < 2) {
+        return -1;
+    }
+
+    if (!aggregatesValid) {
+        updateAggregates ();
+    }
+    double averageInterval = intervalSum / (size () - 1);
+    if (maxInterval <= averageInterval * 1.5) {
+        return -1;
+    }
+    for (int i = 1; i < rotations.size(); ++i) {
+        const Rotation& r0 = rotations[i - 1];
+        const Rotation& r1 = rotations[i];
+        double interval = r1.time - r0.time;
+        if (interval > averageInterval * 1.5) {
+            return i - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * A rotation by angle radians around the x, y or z axis.
+ */
+static void axisQuaternion (int axis, double angle, Quaternion& q) {
+    q[0] = cos (angle / 2);
+    q[1] = 0.0;
+    q[2] = 0.0;
+    q[3] = 0.0;
+    q[1 + axis] = sin (angle / 2);
+}
+
+void RotationSamples::addInterpolated (double previousTime, const std::vector<double>& frameTimes, double time, double yaw, double pitch, double roll, bool updated) {
+    size_t n = frameTimes.size() + 1;
+    double stepYaw = yaw;
+    double stepPitch = pitch;
+    double stepRoll = roll;
+    if (n > 1) {
+        // The transform that undoes the rotation, as a quaternion, in the
+        // order the transform rotates: roll, pitch, and then yaw. Splitting
+        // the transform, and not the angles, gives per-frame rotations that
+        // are undone by the same transforms as the rotations that
+        // addOrientations finds for the same camera motion.
+        Quaternion q;
+        Quaternion qy;
+        Quaternion qyp;
+        axisQuaternion (2, DEG2RADF(-yaw), qy);
+        axisQuaternion (1, DEG2RADF(-pitch), q);
+        mulQQ (qy, q, qyp);
+        axisQuaternion (0, DEG2RADF(-roll), q);
+        Quaternion rotation;
+        mulQQ (qyp, q, rotation);
+        if (rotation[0] < 0) {
+            // The same rotation, the short way around
+            for (int i = 0; i < 4; ++i) {
+                rotation[i] = -rotation[i];
+            }
+        }
+
+        double s = sqrt (rotation[1] * rotation[1] + rotation[2] * rotation[2] + rotation[3] * rotation[3]);
+        double angle = 2 * atan2 (s, rotation[0]);
+        Quaternion step;
+        step[0] = 1.0;
+        step[1] = 0.0;
+        step[2] = 0.0;
+        step[3] = 0.0;
+        if (s > 1e-12) {
+            double stepS = sin (angle / (2 * n)) / s;
+            step[0] = cos (angle / (2 * n));
+            step[1] = rotation[1] * stepS;
+            step[2] = rotation[2] * stepS;
+            step[3] = rotation[3] * stepS;
+        }
+
+        Matrix3 xform;
+        xform.identity ();
+        rotateQuaternion (xform, step);
+        double yawR;
+        double pitchR;
+        double rollR;
+        decomposeRotation (xform, yawR, pitchR, rollR);
+        stepYaw = -RAD2DEGF(yawR);
+        stepPitch = -RAD2DEGF(pitchR);
+        stepRoll = -RAD2DEGF(rollR);
+    }
+
+    double t0 = previousTime;
+    for (size_t i = 0; i < n; ++i) {
+        double t1 = i < frameTimes.size() ? frameTimes[i] : time;
+        add (Rotation (t0 + ROTATION_TIME_INSTANT, t1, stepYaw, stepPitch, stepRoll, updated));
+        t0 = t1;
+    }
+}
+
+void RotationSamples::addOrientations (const std::vector<Quaternion>& orientations, double frameRate) {
+    rotations.reserve (rotations.size() + orientations.size());
+    for (size_t i = 1; i < orientations.size(); ++i) {
+        // The transform that makes frame i look like frame i - 1 is the
+        // correction of frame i followed by the inverse of the correction
+        // of frame i - 1. The corrections are the inverse orientations.
+        Quaternion inverse;
+        invertQ (orientations[i], inverse);
+        Quaternion delta;
+        mulQQ (inverse, orientations[i - 1], delta);
+
+        Matrix3 xform;
+        xform.identity ();
+        rotateQuaternion (xform, delta);
+        double yawR;
+        double pitchR;
+        double rollR;
+        decomposeRotation (xform, yawR, pitchR, rollR);
+
+        // The analysis finds the rotation that is undone by the transform
+        add (Rotation ((i - 1) / frameRate + ROTATION_TIME_INSTANT, i / frameRate, -RAD2DEGF(yawR), -RAD2DEGF(pitchR), -RAD2DEGF(rollR), false));
+    }
+}
+
+void RotationSamples::read (AnalysisFile& file) {
+    // Where segments overlap, the later one wins, as it does when the file
+    // is compacted.
+    std::vector<AnalysisRecord> records;
+    file.read ([&records](const AnalysisFile::Segment& segment) {
+        AnalysisMerge::overlay (records, segment.records, segment.count);
+    });
+    rotations.reserve (rotations.size() + records.size());
+    for (const AnalysisRecord& record : records) {
+        add (Rotation (record));
+    }
+}
+
+std::vector<AnalysisRecord> RotationSamples::toRecords (bool onlyUpdated) const {
+    std::vector<AnalysisRecord> records;
+    for (const Rotation& r : rotations) {
+        if (r.updated || !onlyUpdated) {
+            records.push_back (r.toRecord ());
+        }
+    }
+    return records;
+}
+
+void RotationSamples::includeInMinSpan (const Rotation& r) {
+    double s = r.span();
+    if (minSpan < 0.0 || s < minSpan) {
+        minSpan = s;
+    }
+}
+
+void RotationSamples::invalidateAggregates () {
+    aggregatesValid = false;
+}
+
+void RotationSamples::includeInAggregates (const Rotation& r, const Rotation* previous) {
+    maxYaw = std::max(maxYaw, std::abs(r.yaw));
+    maxPitch = std::max(maxPitch, std::abs(r.pitch));
+    maxRoll = std::max(maxRoll, std::abs(r.roll));
+    if (previous != NULL) {
+        double interval = r.time - previous->time;
+        intervalSum += interval;
+        maxInterval = std::max(maxInterval, interval);
+    }
+}
+
+void RotationSamples::updateAggregates () {
+    maxYaw = 0;
+    maxPitch = 0;
+    maxRoll = 0;
+    intervalSum = 0;
+    maxInterval = 0;
+    for (size_t i = 0; i < rotations.size(); ++i) {
+        includeInAggregates (rotations[i], i > 0 ? &rotations[i - 1] : NULL);
+    }
+    aggregatesValid = true;
+}
+
+void Corrections::setSamples (const RotationSamples& samples) {
+    this->samples = samples;
+    yaw.clear ();
+    pitch.clear ();
+    roll.clear ();
+    for (size_t i = 0; i < samples.rotations.size(); ++i) {
+        const Rotation& r = samples.rotations[i];
+        yaw.add (r.yaw);
+        pitch.add (r.pitch);
+        roll.add (r.roll);
+    }
+}
+
+void Corrections::setSmoothing (int wYaw, int wPitch, int wRoll, double bYaw, double bPitch, double bRoll) {
+    yaw.setSmoothing (wYaw, bYaw);
+    pitch.setSmoothing (wPitch, bPitch);
+    roll.setSmoothing (wRoll, bRoll);
+}
+
+bool Corrections::lookup (double time, Rotation& correction) {
+    int i = samples.lookup (time);
+    if (i < 0) {
+        return false;
+    }
+    const Rotation& r = samples[i];
+    correction = Rotation (r.previousTime, r.time, yaw.correction (i), pitch.correction (i), roll.correction (i), false);
+    return true;
+}
+
+void Corrections::Component::clear () {
+    orientations.clear ();
+    sums.clear ();
+}
+
+void Corrections::Component::add (double rotation) {
+    double orientation = (orientations.empty() ? 0.0 : orientations.back()) + rotation;
+    orientations.push_back (orientation);
+    sums.push_back ((sums.empty() ? 0.0 : sums.back()) + orientation);
+}
+
+void Corrections::Component::setSmoothing (int window, double bias) {
+    this->window = window < 1 ? 1 : window;
+    this->bias = (bias + 1.0) / 2;
+}
+
+double Corrections::Component::correction (int i) const {
+    int n = (int) sums.size();
+    int start = i - window + (int) (bias * window) - 1;
+    int end = start + window;
+    if (start < -1) {
+        start = -1;
+    }
+    if (end >= n) {
+        end = n - 1;
+    }
+    int num = end - start;
+    if (num <= 0) {
+        // The window is outside the samples
+        return 0.0;
+    }
+    double v0 = start < 0 ? 0 : sums[start];
+    double v1 = sums[end];
+    return (v1 - v0) / num - orientations[i];
+}
@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef RotationSamples_HPP
+#define RotationSamples_HPP
+
+#include <cstddef>
+#include <vector>
+#include "AnalysisFile.hpp"
+#include "Graphics.hpp"
+#include "Matrix.hpp"
+
+/**
+ * How long after the previous frame that the span of a rotation starts, so
+ * that the spans of consecutive rotations do not overlap.
+ */
+#define ROTATION_TIME_INSTANT (1.0 / 10000.0)
+
+/**
+ * The rotation of the camera from the frame at previousTime to the frame at
+ * time, in degrees.
+ */
+class Rotation {
+  public:
+    Rotation (double previousTime, double time, double yaw, double pitch, double roll, bool updated);
+    Rotation (const AnalysisRecord& record);
+
+    double span () const;
+    bool contains (const double t) const;
+    bool spanOverlaps (const Rotation& other) const;
+    AnalysisRecord toRecord () const;
+
+    double previousTime;
+    double time;
+    double yaw;
+    double pitch;
+    double roll;
+
+    /**
+     * True if the rotation has been found by the analysis, and not read from
+     * the analysis file.
+     */
+    bool updated;
+};
+
+/**
+ * Rotations sorted by time, whose spans do not overlap. Lookups by time are
+ * binary searches, and adding a rotation after the last one, which is what
+ * analysis and correction do, takes constant time. The sums and largest
+ * values that getMax and findFirstSkip need are kept up to date as rotations
+ * are appended, and only recomputed after a rotation has been inserted
+ * before the last one or removed.
+ */
+class RotationSamples {
+  public:
+    RotationSamples ();
+
+    /**
+     * Adds a rotation, replacing those whose spans it overlaps.
+     */
+    void add (Rotation rot);
+
+    /**
+     * Returns the largest absolute yaw, pitch and roll, and the largest of
+     * them as the time.
+     */
+    Rotation getMax ();
+
+    void drawDiagram (Graphics& g, double time, int x, int y, int samples, int height);
+
+    void clear ();
+
+    const Rotation& operator[](int index) const;
+
+    int indexOf (const Rotation& rot);
+
+    /**
+     * Returns the index of the rotation whose span contains the time, or -1.
+     */
+    int indexOf (const double time);
+
+    /**
+     * Returns the index of the rotation into the frame at the time, or -1.
+     */
+    int lookup (const double time);
+
+    size_t size ();
+
+    /**
+     * Finds the range [first, last) of rotations whose spans overlap that of
+     * r. If there are none, first and last are where r would be inserted.
+     */
+    void findOverlapping (const Rotation& r, size_t& first, size_t& last);
+
+    void removeOverlapping (const Rotation& r);
+
+    bool hasOverlapping (const Rotation& r);
+
+    /**
+     * The shortest span of the rotations added since the last clear, or -1.
+     */
+    double getMinSpan ();
+
+    /**
+     * Returns the index of the rotation before the first interval between
+     * rotations that is more than 1.5 times the average, or -1.
+     */
+    int findFirstSkip ();
+
+    /**
+     * Adds the rotation from the frame at previousTime to the frame at time,
+     * split into one rotation per frame in between. The camera is taken to
+     * turn at a constant rate around a fixed axis, so each frame gets an
+     * equal part of the rotation: the intermediate orientations are those
+     * given by spherical linear interpolation.
+     *
+     * @param frameTimes the times of the frames in between, in order
+     */
+    void addInterpolated (double previousTime, const std::vector<double>& frameTimes, double time, double yaw, double pitch, double roll, bool updated);
+
+    /**
+     * Adds the rotations between the orientations of the camera in
+     * consecutive frames, such as those recorded by the orientation sensor
+     * of the camera. The rotations are those that the analysis would have
+     * found.
+     *
+     * @param frameRate the number of orientations per second
+     */
+    void addOrientations (const std::vector<Quaternion>& orientations, double frameRate);
+
+    /**
+     * Adds the rotations of an analysis file, as add() would one by one. The
+     * segments of the file are joined by AnalysisMerge::overlay first, so
+     * reading into empty samples takes time linear in the number of records.
+     */
+    void read (AnalysisFile& file);
+
+    /**
+     * Returns the rotations, or only those that have been added by the
+     * analysis, as analysis file records.
+     */
+    std::vector<AnalysisRecord> toRecords (bool onlyUpdated) const;
+
+    std::vector<Rotation> rotations;
+    double minSpan;
+
+  private:
+    void drawDiagramValue (Graphics& g, int x, int y, int h, uint32_t mask, uint32_t color);
+    void includeInMinSpan (const Rotation& r);
+    void invalidateAggregates ();
+
+    /**
+     * Updates the aggregates with a rotation that is appended after
+     * previous, or is the first one if previous is NULL.
+     */
+    void includeInAggregates (const Rotation& r, const Rotation* previous);
+    void updateAggregates ();
+
+    bool aggregatesValid;
+    double maxYaw;
+    double maxPitch;
+    double maxRoll;
+    double intervalSum;
+    double maxInterval;
+};
+
+/**
+ * The corrections that smooth out the rotations of a RotationSamples. The
+ * rotations are accumulated into the orientation of the camera, and the
+ * correction for a sample is the difference between the orientation and its
+ * moving average.
+ *
+ * The orientations, and the sums of the orientations, are computed once for
+ * each set of samples. The moving average over any window is then the
+ * difference of two sums, so a correction is computed when it is looked up,
+ * and changing the smoothing costs nothing.
+ */
+class Corrections {
+  public:
+    /**
+     * Sets the samples to correct. Takes time linear in their number.
+     */
+    void setSamples (const RotationSamples& samples);
+
+    /**
+     * Sets the smoothing of each component.
+     *
+     * @param w the size of the moving average window, in samples
+     * @param b where the window is, from -1 (all before the sample) to 1
+     *          (all after it)
+     */
+    void setSmoothing (int wYaw, int wPitch, int wRoll, double bYaw, double bPitch, double bRoll);
+
+    /**
+     * Finds the correction for the time.
+     *
+     * @return false if there is no sample at the time
+     */
+    bool lookup (double time, Rotation& correction);
+
+  private:
+    /**
+     * One of yaw, pitch and roll.
+     */
+    class Component {
+      public:
+        void clear ();
+        void add (double rotation);
+        void setSmoothing (int window, double bias);
+
+        /**
+         * The moving average of the orientation at sample i, minus the
+         * orientation.
+         */
+        double correction (int i) const;
+
+      private:
+        std::vector<double> orientations;
+        std::vector<double> sums;
+        int window;
+        double bias;
+    };
+
+    RotationSamples samples;
+    Component yaw;
+    Component pitch;
+    Component roll;
+};
+
+#endif
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "ScanlineScheduler.hpp"
+#include "ThreadPool.hpp"
+
+/**
+ * Chunks per thread. More chunks balance better, but each one is a call to
+ * updateLines and a few atomic operations.
+ */
+#define CHUNKS_PER_THREAD 8
+
+/**
+ * The largest chunk, in scanlines.
+ */
+#define MAX_CHUNK_SIZE 16
+
+static inline uint64_t packRange(uint32_t begin, uint32_t end) {
+    return (uint64_t) begin | ((uint64_t) end << 32);
+}
+
+static inline uint32_t rangeBegin(uint64_t range) {
+    return (uint32_t) range;
+}
+
+static inline uint32_t rangeEnd(uint64_t range) {
+    return (uint32_t) (range >> 32);
+}
+
+ScanlineScheduler::ScanlineScheduler(int height, int numThreads) : height(height), queues(numThreads < 1 ? 1 : numThreads) {
+    numThreads = (int) queues.size();
+    chunkSize = height / (numThreads * CHUNKS_PER_THREAD);
+    if (chunkSize < 1) {
+        chunkSize = 1;
+    }
+    if (chunkSize > MAX_CHUNK_SIZE) {
+        chunkSize = MAX_CHUNK_SIZE;
+    }
+    numChunks = (height + chunkSize - 1) / chunkSize;
+
+    for (int i = 0; i < numThreads; ++i) {
+        uint32_t begin = (uint32_t) ((int64_t) numChunks * i / numThreads);
+        uint32_t end = (uint32_t) ((int64_t) numChunks * (i + 1) / numThreads);
+        queues[i].range.store(packRange(begin, end));
+    }
+}
+
+void ScanlineScheduler::chunkToScanlines(int chunk, int& start, int& num) const {
+    start = chunk * chunkSize;
+    num = chunkSize;
+    if (start + num > height) {
+        num = height - start;
+    }
+}
+
+bool ScanlineScheduler::next(int thread, int& start, int& num) {
+    std::atomic<uint64_t>& own = queues[thread].range;
+    uint64_t range = own.load();
+    while (rangeBegin(range) < rangeEnd(range)) {
+        // Take from the front. Thieves take from the back.
+        if (own.compare_exchange_weak(range, packRange(rangeBegin(range) + 1, rangeEnd(range)))) {
+            chunkToScanlines((int) rangeBegin(range), start, num);
+            return true;
+        }
+    }
+
+    int chunk;
+    if (steal(thread, chunk)) {
+        chunkToScanlines(chunk, start, num);
+        return true;
+    }
+    return false;
+}
+
+bool ScanlineScheduler::steal(int thread, int& chunk) {
+    int numThreads = (int) queues.size();
+    while (true) {
+        // Pick the thread with the most work left
+        int victim = -1;
+        uint64_t victimRange = 0;
+        uint32_t most = 0;
+        for (int i = 1; i < numThreads; ++i) {
+            int candidate = (thread + i) % numThreads;
+            uint64_t range = queues[candidate].range.load();
+            uint32_t left = rangeEnd(range) > rangeBegin(range) ? rangeEnd(range) - rangeBegin(range) : 0;
+            if (left > most) {
+                most = left;
+                victim = candidate;
+                victimRange = range;
+            }
+        }
+        if (victim < 0) {
+            return false;
+        }
+
+        // Take the back half, rounded up, so that a single chunk can be
+        // stolen too. Chunks never come back once taken, so a range that
+        // compares equal has not been touched.
+        uint32_t begin = rangeBegin(victimRange);
+        uint32_t end = rangeEnd(victimRange);
+        uint32_t middle = begin + (end - begin) / 2;
+        if (queues[victim].range.compare_exchange_strong(victimRange, packRange(begin, middle))) {
+            chunk = (int) middle;
+            // Only this thread adds work to its own queue, and it is empty,
+            // so no other thread can be changing it.
+            queues[thread].range.store(packRange(middle + 1, end));
+            return true;
+        }
+    }
+}
+
+void ScanlineScheduler::forEachChunk(int height, const std::function<void(int start, int num)>& f) {
+    ThreadPool& pool = ThreadPool::instance();
+    int numThreads = pool.getSize();
+    if (numThreads <= 1 || height <= 1) {
+        f(0, height);
+        return;
+    }
+    ScanlineScheduler scheduler(height, numThreads);
+    pool.run(numThreads, [&](int thread) {
+        int start;
+        int num;
+        while (scheduler.next(thread, start, num)) {
+            f(start, num);
+        }
+    });
+}
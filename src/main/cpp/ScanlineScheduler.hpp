@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef ScanlineScheduler_HPP
+#define ScanlineScheduler_HPP
+
+#include <atomic>
+#include <functional>
+#include <inttypes.h>
+#include <vector>
+
+/**
+ * Hands out the scanlines of a frame to threads in small chunks.
+ *
+ * Each thread starts with an even share of the chunks, in order, so that
+ * neighbouring rows are still processed by the same thread. A thread that
+ * runs out of work steals half of the remaining chunks of the thread that has
+ * the most left. A thread that got the expensive rows, or that was preempted,
+ * therefore no longer holds up the whole frame.
+ */
+class ScanlineScheduler {
+  public:
+    /**
+     * @param height the number of scanlines
+     * @param numThreads the number of threads that will call next
+     */
+    ScanlineScheduler(int height, int numThreads);
+
+    /**
+     * Gets the next chunk for a thread. Chunks are handed out exactly once.
+     *
+     * @param thread the index of the calling thread, in [0, numThreads)
+     * @param start set to the first scanline of the chunk
+     * @param num set to the number of scanlines in the chunk
+     * @return false if there is no work left
+     */
+    bool next(int thread, int& start, int& num);
+
+    /**
+     * Calls f(start, num) for all chunks of the scanlines [0, height), from
+     * the threads of the ThreadPool, and returns when all have been processed.
+     */
+    static void forEachChunk(int height, const std::function<void(int start, int num)>& f);
+
+  private:
+    /**
+     * The chunks [begin, end) that a thread has left, packed as
+     * begin | (end << 32) so that both can be changed at once. The padding
+     * keeps the queues of different threads in different cache lines.
+     */
+    class Queue {
+      public:
+        Queue() : range(0) {
+        }
+        Queue(const Queue& other) : range(other.range.load()) {
+        }
+
+        std::atomic<uint64_t> range;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    bool steal(int thread, int& chunk);
+    void chunkToScanlines(int chunk, int& start, int& num) const;
+
+    int height;
+    int chunkSize;
+    int numChunks;
+    std::vector<Queue> queues;
+};
+
+#endif
@@ -6,661 +6,26 @@
 #include <string>
 #include <cstring>
 #include <mutex>
-#include <fstream>
+#include <memory>
 #include <algorithm>
 #include "frei0r.hpp"
+#include "AnalysisFile.hpp"
+#include "Math.hpp"
 #include "Matrix.hpp"
+#include "MP4.hpp"
 #include "MPFilter.hpp"
 #include "Graphics.hpp"
 #include "ImageProcessing.hpp"
+#include "KeyframeSchedule.hpp"
+#include "PitchRollMap.hpp"
+#include "RotationSamples.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
-#include "omp_compat.h"
+#include "ThreadPool.hpp"
+#include "Tracker.hpp"
 #include "Version.hpp"
 
-#define ROTATION_TIME_INSTANT (1.0 / 10000.0)
-
-
-class Rotation {
-
-  public:
-    double previousTime;
-    double time;
-    double yaw;
-    double pitch;
-    double roll;
-    bool updated;
-
-    Rotation (double previousTime, double time, double yaw, double pitch, double roll, bool updated) {
-        this->previousTime = previousTime;
-        this->time = time;
-        this->yaw = yaw;
-        this->pitch = pitch;
-        this->roll = roll;
-        this->updated = updated;
-    }
-
-    ~Rotation() {
-    }
-
-    double span () const {
-        return time - previousTime;
-    }
-
-    bool contains (const double t) const {
-        return t >= previousTime && t <= time;
-    }
-
-    bool spanOverlaps (const Rotation& other) const {
-        if (other.contains(time) || other.contains (previousTime)) {
-            return true;
-        }
-        if (previousTime < other.previousTime && time > other.time) {
-            return true;
-        }
-        return false;
-    }
-
-    void writeTo (std::ofstream& file) {
-        file.write ((char*) &previousTime, sizeof(previousTime));
-        file.write ((char*) &time, sizeof(time));
-        file.write ((char*) &yaw, sizeof(yaw));
-        file.write ((char*) &pitch, sizeof(pitch));
-        file.write ((char*) &roll, sizeof(roll));
-    }
-
-    void readFrom (std::ifstream& file) {
-        file.read ((char*) &previousTime, sizeof(previousTime));
-        file.read ((char*) &time, sizeof(time));
-        file.read ((char*) &yaw, sizeof(yaw));
-        file.read ((char*) &pitch, sizeof(pitch));
-        file.read ((char*) &roll, sizeof(roll));
-        this->updated = false;
-    }
-};
-
-class RotationSamples {
-  public:
-    std::vector<Rotation> rotations;
-    double minSpan;
-
-    void add (Rotation rot) {
-        removeOverlapping (rot);
-        if (rotations.size() == 0) {
-            rotations.push_back(rot);
-            return;
-        }
-        size_t pos = 0;
-        for (size_t i = rotations.size(); i > 0; --i) {
-            if (rotations[i - 1].time < rot.time) {
-                pos = i;
-                break;
-            }
-        }
-        if (pos == rotations.size()) {
-            rotations.push_back(rot);
-        } else {
-            rotations.insert (rotations.begin() + pos, rot);
-        }
-
-        updateMinSpan();
-    }
-
-    Rotation getMax () {
-        Rotation m (0, 0, 0, 0, 0, false);
-        for (Rotation& r : rotations) {
-            double ay = std::abs(r.yaw);
-            double ap = std::abs(r.pitch);
-            double ar = std::abs(r.roll);
-            if (ay > m.yaw) {
-                m.yaw = ay;
-            }
-            if (ap > m.pitch) {
-                m.pitch = ap;
-            }
-            if (ar > m.roll) {
-                m.roll = ar;
-            }
-        }
-        m.time = m.yaw;
-        if (m.pitch > m.time) {
-            m.time = m.pitch;
-        }
-        if (m.roll > m.time) {
-            m.time = m.roll;
-        }
-        return m;
-    }
-
-    void drawDiagramValue (Graphics& g, int x, int y, int h, uint32_t mask, uint32_t color) {
-        int y0 = y;
-        if (h < 0) {
-            h = -h;
-            y0 -= h;
-        }
-        g.plot (x, y, mask, color);
-        g.fillRect (x, y0, 1, h, mask, color);
-    }
-
-    void drawDiagram (Graphics& g, double time, int x, int y, int samples, int height) {
-        int lastIndex = indexOf (time);
-        if (lastIndex == -1) {
-            return;
-        }
-        if (samples > lastIndex + 1) {
-            samples = lastIndex + 1;
-        }
-        int rx = x + (samples / 2);
-        double scale = getMax ().time;
-        if (scale < 0.01) {
-            scale = 1.0;
-        }
-        for (int i = 0; i < samples; ++i) {
-            int index = lastIndex - i;
-            Rotation& r = rotations[index];
-            int x0 = rx - i;
-
-            drawDiagramValue (g, x0, y, (int) (height * r.yaw / scale),   0x0000ffff, 0xffff0000);
-            drawDiagramValue (g, x0, y, (int) (height * r.pitch / scale), 0x00ff00ff, 0xff00ff00);
-            drawDiagramValue (g, x0, y, (int) (height * r.roll / scale),  0x00ffff00, 0xff0000ff);
-        }
-    }
-
-    void clear () {
-        rotations.clear();
-        updateMinSpan();
-    }
-
-    Rotation& operator[](int index) {
-        return rotations[index];
-    }
-
-    int indexOf (const Rotation& rot) {
-        return indexOf (rot.time);
-    }
-
-    int indexOf (const double time) {
-        for (int i = 0; i < rotations.size(); ++i) {
-            Rotation r = rotations[i];
-            if (r.contains(time)) {
-                return i;
-            }
-        }
-        return -1;
-    }
-
-    int lookup(const double time) {
-        return indexOf(time - getMinSpan() / 2);
-    }
-
-    size_t size () {
-        return rotations.size();
-    }
-
-    void removeOverlapping (const Rotation& r) {
-        for (int i = ((int) rotations.size()) - 1; i >= 0; --i) {
-            Rotation r2 = rotations[i];
-            if (r.spanOverlaps (r2)) {
-                rotations.erase (rotations.begin() + i);
-            }
-        }
-    }
-
-    bool hasOverlapping (const Rotation& r) {
-        for (int i = ((int) rotations.size()) - 1; i >= 0; --i) {
-            Rotation r2 = rotations[i];
-            if (r.spanOverlaps (r2)) {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    void updateMinSpan() {
-        for (Rotation& r : rotations) {
-            double s = r.span();
-            if (minSpan < 0.0 || s < minSpan) {
-                minSpan = s;
-            }
-        }
-    }
-
-    double getMinSpan() {
-        return minSpan;
-    }
-
-    int findFirstSkip () {
-        if (size () < 2) {
-            return -1;
-        }
-
-        double intervalSum = 0;
-        for (int i = 1; i < rotations.size(); ++i) {
-            Rotation& r0 = rotations[i - 1];
-            Rotation& r1 = rotations[i];
-            intervalSum += r1.time - r0.time;
-        }
-        double averageInterval = intervalSum / (size () - 1);
-        for (int i = 1; i < rotations.size(); ++i) {
-            Rotation& r0 = rotations[i - 1];
-            Rotation& r1 = rotations[i];
-            double interval = r1.time - r0.time;
-            if (interval > averageInterval * 1.5) {
-                return i - 1;
-            }
-        }
-        return -1;
-    }
-
-    std::string parseFileName (const std::string& fileName) {
-        if (fileName.length() > 8 && fileName.compare(0, 8, std::string("file:///")) == 0) {
-            if (fileName.length() > 10 && fileName.at (9) == ':') {
-                // Windows file URL - file:///X:/...
-                return fileName.substr (8);
-            } else {
-                // UNIX / OSX file URL - file:///home/...
-                return fileName.substr (7);
-            }
-        } else {
-            return fileName;
-        }
-    }
-
-    void write (const std::string& fileName) {
-        std::ofstream file;
-        char buffer [128000];
-        file.rdbuf()->pubsetbuf(buffer, 128000);
-
-        file.open (parseFileName(fileName), std::ios::out | std::ios::binary);
-        if (file) {
-            uint64_t s = (uint64_t) size();
-            file.write ((char*) &s, sizeof(s));
-            for (Rotation& r : rotations) {
-                r.writeTo (file);
-            }
-            file.close();
-        }
-    }
-
-    void read (const std::string& fileName) {
-        std::ifstream file;
-        char buffer [128000];
-        file.rdbuf()->pubsetbuf(buffer, 128000);
-
-        file.open (parseFileName(fileName), std::ios::in | std::ios::binary);
-        if (file) {
-            uint64_t s = 0;
-            file.read ((char*) &s, sizeof(s));
-            for (int i = 0; i < s; ++i) {
-                Rotation r(0, 0, 0, 0, 0, false);
-                r.readFrom (file);
-                rotations.push_back (r);
-            }
-            file.close();
-        }
-        updateMinSpan();
-    }
-
-    void smoothComponent (std::vector<double>& samples, int window, double windowBias) {
-        if (window < 1) {
-            window = 1;
-        }
-
-        double acc = 0.0;
-        std::vector<double> sums;
-        for (double& v : samples) {
-            acc += v;
-            sums.push_back(acc);
-        }
-
-        windowBias = (windowBias + 1.0) / 2;
-
-        for (int i = 0; i < samples.size(); ++i) {
-            int start = i - window + (int) (windowBias * window) - 1;
-            int end = start + window;
-            if (start < -1) {
-                start = -1;
-            }
-            if (end >= samples.size()) {
-                end = samples.size() - 1;
-            }
-            int num = end - start;
-            double v0 = start < 0 ? 0 : sums[start];
-            double v1 = sums[end];
-
-            double v = (v1 - v0) / num;
-            samples[i] = v;
-        }
-        updateMinSpan();
-    }
-
-    void correct (int wYaw, int wPitch, int wRoll, double bYaw, double bPitch, double bRoll, RotationSamples& dest) {
-        std::vector<Rotation> accs;
-        {
-            Rotation acc (0, 0, 0, 0, 0, false);
-            for (Rotation& r : rotations) {
-                acc.yaw += r.yaw;
-                acc.pitch += r.pitch;
-                acc.roll += r.roll;
-
-                Rotation r2 (r.previousTime, r.time, acc.yaw, acc.pitch, acc.roll, false);
-                accs.push_back(r2);
-            }
-        }
-
-        std::vector<Rotation> smooths;
-        {
-            std::vector<double> cYaw;
-            std::vector<double> cPitch;
-            std::vector<double> cRoll;
-            for (Rotation& r : accs) {
-                cYaw.push_back(r.yaw);
-                cPitch.push_back(r.pitch);
-                cRoll.push_back(r.roll);
-            }
-            smoothComponent (cYaw, wYaw, bYaw);
-            smoothComponent (cPitch, wPitch, bPitch);
-            smoothComponent (cRoll, wRoll, bRoll);
-
-            for (int i = 0; i < accs.size(); ++i) {
-                Rotation& r = accs[i];
-
-                Rotation smooth (r.previousTime, r.time, cYaw[i], cPitch[i], cRoll[i], false);
-
-                smooths.push_back (smooth);
-            }
-        }
-
-        for (int i = 0; i < accs.size(); ++i) {
-            Rotation& measured = accs[i];
-            Rotation& smoothed = smooths[i];
-
-            Rotation correction (measured.previousTime, measured.time, smoothed.yaw - measured.yaw, smoothed.pitch - measured.pitch, smoothed.roll - measured.roll, false);
-            dest.add(correction);
-        }
-    }
-
-    void merge (RotationSamples& other) {
-        for (size_t i = 0; i < other.rotations.size(); ++i) {
-            const Rotation& otherRot = other.rotations[i];
-            if (otherRot.updated || !hasOverlapping(otherRot)) {
-                add(otherRot);
-            }
-        }
-    }
-
-    void clearUpdated () {
-        for (Rotation& r : rotations) {
-            r.updated = false;
-        }
-    }
-};
-
-inline short toGray(uint32_t color) {
-    return
-        ((color      ) & 0xff) +
-        ((color >>  8) & 0xff) +
-        ((color >> 16) & 0xff);
-}
-
-class TrackPoint {
-  public:
-
-    TrackPoint (int x, int y, int sampleRadius, int searchRadius, int subpixels) {
-        this->x = x;
-        this->y = y;
-        this->cx = x;
-        this->cy = y;
-        this->sampleRadius = sampleRadius;
-        this->searchRadius = searchRadius;
-        this->subpixels = subpixels;
-        this->subpixelFactor = 1.0 / (subpixels > 1 ? subpixels : 1);
-
-        this->subcx = 0;
-        this->subcy = 0;
-
-        sampleBuffer = NULL;
-        active = true;
-    }
-
-    ~TrackPoint() {
-        if (sampleBuffer != NULL) {
-            free(sampleBuffer);
-        }
-    }
-
-    int match (Graphics& g, const uint32_t* buffer, int atx, int aty, int abortAtError) {
-        int error = 0;
-        int sbp = 0;
-        for (int sy = aty; sy < aty + sampleRadius * 2; ++sy) {
-            for (int sx = atx; sx < atx + sampleRadius * 2; ++sx) {
-                int sample = sampleBuffer[sbp];
-                int actual = toGray(buffer[sy * g.width + sx]);
-                int err = abs(sample - actual);
-                error += err;
-                ++sbp;
-                if (error > abortAtError) {
-                    return error;
-                }
-            }
-        }
-        return error;
-    }
-
-    int matchSubpixel (Graphics& g, const uint32_t* buffer, int atx, int aty, double spx, double spy, int abortAtError) {
-        int error = 0;
-        int sbp = 0;
-        for (int sy = aty; sy < aty + sampleRadius * 2; ++sy) {
-            for (int sx = atx; sx < atx + sampleRadius * 2; ++sx) {
-                int sample = sampleBuffer[sbp];
-                int actual = toGray(sampleBilinear(buffer, sx + spx, sy + spy, g.width, g.height));
-                int err = abs(sample - actual);
-                error += err;
-                ++sbp;
-                if (error > abortAtError) {
-                    return error;
-                }
-            }
-        }
-        return error;
-    }
-
-    void update (Graphics& g, const uint32_t* previous, const uint32_t* current) {
-        active = true;
-
-        if (sampleBuffer == NULL) {
-            sampleBuffer = (short*) malloc(sampleRadius * sampleRadius * 4 * sizeof(short));
-        }
-
-        int sbp = 0;
-        for (int sy = y - sampleRadius; sy < y + sampleRadius; ++sy) {
-            for (int sx = x - sampleRadius; sx < x + sampleRadius; ++sx) {
-                sampleBuffer[sbp] = toGray(previous[sy * g.width + sx]);
-                ++sbp;
-            }
-        }
-
-        cx = x;
-        cy = y;
-
-        int bestError = sampleRadius * sampleRadius * 4 * 256 * 3;
-        bestError = match (g, current, x - sampleRadius, y - sampleRadius, bestError);
-        for (int radius = 1; radius < searchRadius; ++radius) {
-            for (int my = y - radius; my < y + radius; ++my) {
-                for (int mx = x - radius; mx < x + radius; ++mx) {
-                    if (my == (y - radius) || my == (y + radius - 1) || mx == (x - radius) || mx == (x + radius - 1)) {
-                        int error = match (g, current, mx - sampleRadius, my - sampleRadius, bestError);
-                        if (bestError < 0 || error < bestError) {
-                            bestError = error;
-                            cx = mx;
-                            cy = my;
-                            cerr = bestError;
-                        }
-                    }
-                }
-            }
-        }
-
-        subcx = 0;
-        subcy = 0;
-        for (int radius = 1; radius <= subpixels / 2; ++radius) {
-            for (int my = -radius; my < radius; ++my) {
-                for (int mx = -radius; mx < radius; ++mx) {
-                    if (my == (- radius) || my == (radius - 1) || mx == (- radius) || mx == (radius - 1)) {
-                        int error = matchSubpixel (g, current, cx - sampleRadius, cy - sampleRadius, mx * subpixelFactor, my * subpixelFactor, bestError);
-                        if (bestError < 0 || error < bestError) {
-                            bestError = error;
-                            subcx = mx;
-                            subcy = my;
-                            cerr = bestError;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
-    void markOrigin (Graphics& g) {
-        g.drawRect(x - sampleRadius, y - sampleRadius, 2 * sampleRadius, 2 * sampleRadius, 0xffffff00, 0xff0000ff);
-        g.drawRect(x - sampleRadius + 1, y - sampleRadius + 1, 2 * sampleRadius - 2, 2 * sampleRadius - 2, 0xffffff00, 0xff0000ff);
-        g.drawRect(x - sampleRadius - searchRadius, y - sampleRadius - searchRadius,
-                   2 * searchRadius + 2 * sampleRadius, 2 * searchRadius + 2 * sampleRadius, 0xffff0000, 0xff00ffff);
-    }
-
-    void markOriginTransformed (Graphics& g) {
-        g.fillRect(x - sampleRadius, y - sampleRadius, 2 * sampleRadius, 2 * sampleRadius, 0xff00ffff, 0xffff0000);
-    }
-
-    void markCurrent (Graphics& g) {
-        if (active) {
-            g.fillRect(cx - sampleRadius, cy - sampleRadius, 2 * sampleRadius, 2 * sampleRadius, 0xffff00ff, 0xff00aa00);
-            if (subpixels > 1) {
-                g.fillRect(cx + subcx * subpixelFactor * sampleRadius - 2, cy + subcy * subpixelFactor * sampleRadius - 2, 4, 4, 0xffffff00, 0xff0000ff);
-            }
-        }
-    }
-
-    void getMotion (Vector2& motion) {
-        motion[0] = cx - x + subcx * subpixelFactor;
-        motion[1] = cy - y + subcy * subpixelFactor;
-    }
-
-    int getError () {
-        return cerr;
-    }
-
-    void setActive (bool active) {
-        this->active = active;
-    }
-
-  private:
-    int x;
-    int y;
-    int cx;
-    int cy;
-    int subcx;
-    int subcy;
-    int subpixels;
-    double subpixelFactor;
-    int cerr;
-    int sampleRadius;
-    int searchRadius;
-    short* sampleBuffer;
-    bool active;
-};
-
-class TrackPointMatrix {
-  public:
-    TrackPointMatrix (int x, int y, int numh, int numv, int offset, int sampleRadius, int searchRadius, int subpixels) {
-        this->x = x;
-        this->y = y;
-        this->sampleRadius = sampleRadius;
-        this->searchRadius = searchRadius;
-        this->subpixels = subpixels;
-
-        int x0 = x - (offset * numh / 2) + offset / 2;
-        int y0 = y - (offset * numv / 2) + offset / 2;
-        for (int tpy = 0; tpy < numv; ++tpy) {
-            for (int tpx = 0; tpx < numh; ++tpx) {
-                trackPoints.push_back (TrackPoint (x0 + tpx * offset, y0 + tpy * offset, sampleRadius, searchRadius, subpixels));
-                errors.push_back (0);
-            }
-        }
-    }
-
-    ~TrackPointMatrix() {
-    }
-
-    void update (Graphics& g, const uint32_t* previous, const uint32_t* current) {
-        #pragma omp parallel for
-        for (int i = 0; i < trackPoints.size(); ++i) {
-            TrackPoint& tp = trackPoints[i];
-            tp.update (g, previous, current);
-        }
-    }
-
-    void markOrigin (Graphics& g) {
-        for (TrackPoint& tp : trackPoints) {
-            tp.markOrigin (g);
-        }
-    }
-
-    void markOriginTransformed (Graphics& g) {
-        for (TrackPoint& tp : trackPoints) {
-            tp.markOriginTransformed (g);
-        }
-    }
-
-    void markCurrent (Graphics& g) {
-        for (TrackPoint& tp : trackPoints) {
-            tp.markCurrent (g);
-        }
-    }
-
-    void getMotion (Vector2& motion) {
-        Vector2 acc;
-        acc.zero ();
-        Vector2 tpm;
-        int totalWeights = 0;
-        int maxError = sampleRadius * sampleRadius * 3 * 255;
-        int avgError = 0;
-        for (int i = 0; i < trackPoints.size(); ++i) {
-            int err = trackPoints[i].getError();
-            errors[i] = err;
-            avgError += err;
-        }
-        avgError /= (int) trackPoints.size();
-        std::sort(errors.begin(), errors.end());
-        int maxAllowedError = errors[errors.size() * 2 / 3];
-        for (TrackPoint& tp : trackPoints) {
-            tp.getMotion (tpm);
-            if (tp.getError() <= maxAllowedError) {
-                int weight = maxError - tp.getError ();
-                acc[0] += tpm[0] * weight;
-                acc[1] += tpm[1] * weight;
-                totalWeights += weight;
-                tp.setActive (true);
-            } else {
-                tp.setActive (false);
-            }
-        }
-        acc[0] /= totalWeights;
-        acc[1] /= totalWeights;
-        motion[0] = acc[0];
-        motion[1] = acc[1];
-    }
-
-  private:
-    int x;
-    int y;
-    int sampleRadius;
-    int searchRadius;
-    int subpixels;
-    std::vector<TrackPoint> trackPoints;
-    std::vector<int> errors;
-};
-
-class Stabilize360 : public Frei0rFilter, MPFilter {
+class Stabilize360 : public Frei0rFilter {
 
   private:
     bool previousAnalyzeState;
@@ -671,11 +36,17 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
     double roll;
 
     RotationSamples rawSamples;
-    RotationSamples corrections;
+    Corrections corrections;
 
     std::mutex lock;
     Transform360Support t360;
 
+    /**
+     * Map for the pitch and roll of the correction, if they stay the same
+     * from frame to frame - for example when only yaw is stabilized.
+     */
+    PitchRollMap pitchRollMap;
+
   public:
     Frei0rParameter<int,double> interpolation;
     bool analyze;
@@ -686,6 +57,7 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
     Frei0rParameter<int,double> searchRadius;
     Frei0rParameter<int,double> offset;
     Frei0rParameter<int,double> subpixels;
+    bool subpixelFit;
 
     double stabilizeYaw;
     double stabilizePitch;
@@ -702,11 +74,59 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
     std::string analysisFile;
     Frei0rParameter<double,double> clipOffset;
 
-    uint32_t* previousFrame;
+    /**
+     * The shard of the clip that is being analyzed, from 1, and the number
+     * of shards, or 0 if the analysis is not split into shards. Only used
+     * to mark the analysis, so that the shards can be merged.
+     */
+    Frei0rParameter<int,double> shard;
+    Frei0rParameter<int,double> shards;
+
+    /**
+     * The analysis file, shared with the other instances that use it.
+     */
+    std::shared_ptr<AnalysisFile> file;
+
+    /**
+     * A video file with orientation sensor data. If set, the rotations are
+     * computed from the orientation data instead of read from the analysis
+     * file.
+     */
+    std::string orientationFile;
+    std::string orientationDataFrom;
+
+    /**
+     * Track every frameStep:th frame, and interpolate the rotations of the
+     * frames in between. The search radius is scaled up by the step.
+     */
+    Frei0rParameter<int,double> frameStep;
+
+    /**
+     * The number of track points on each side of the ahead, left and right
+     * grids, and in each of the backwards-facing columns.
+     */
+    Frei0rParameter<int,double> trackPointGrid;
+
+    /**
+     * The tracker of the analysis, kept from frame to frame.
+     */
+    std::unique_ptr<Tracker> tracker;
     double previousFrameTime;
 
+    /**
+     * Which frames are tracked, at most every frameStep:th.
+     */
+    KeyframeSchedule schedule;
 
-    Stabilize360(unsigned int width, unsigned int height) : Frei0rFilter(width, height), t360(width, height) {
+    /**
+     * The frame that the track points are drawn on before it is transformed,
+     * when transformWhenAnalyzing is set.
+     */
+    std::vector<uint32_t> overlayFrame;
+
+
+    Stabilize360(unsigned int width, unsigned int height) : Frei0rFilter(width, height), t360(width, height),
+        pitchRollMap("bigsh0t_stabilize_360", width, height) {
         initializedAnalyzeState = false;
         previousAnalyzeState = false;
 
@@ -716,9 +136,11 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
         searchRadius = 24;
         offset = 64;
         subpixels = 0;
+        subpixelFit = false;
 
-        previousFrame = NULL;
         previousFrameTime = -1;
+        frameStep = 1;
+        trackPointGrid = 3;
         analyze = false;
         transformWhenAnalyzing = true;
 
@@ -738,6 +160,9 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
         smoothPitch = 120;
         smoothRoll = 120;
 
+        shard = 0;
+        shards = 0;
+
         register_param(analysisFile, "analysisFile", "");
         register_fparam(clipOffset, "clipOffset", "");
         register_fparam(interpolation, "interpolation", "");
@@ -746,6 +171,7 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
         register_fparam(searchRadius, "searchRadius", "");
         register_fparam(offset, "offset", "");
         register_fparam(subpixels, "subpixels", "");
+        register_param(subpixelFit, "subpixelFit", "");
 
         register_param(stabilizeYaw, "stabilizeYaw", "");
         register_param(stabilizePitch, "stabilizePitch", "");
@@ -761,6 +187,13 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
 
         register_param(useBackTrackpoints, "useBackTrackpoints", "");
         register_param(transformWhenAnalyzing, "transformWhenAnalyzing", "");
+
+        register_fparam(shard, "shard", "");
+        register_fparam(shards, "shards", "");
+
+        register_param(orientationFile, "orientationFile", "");
+        register_fparam(frameStep, "frameStep", "");
+        register_fparam(trackPointGrid, "trackPointGrid", "");
     }
 
     virtual ~Stabilize360() {
@@ -769,11 +202,6 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
         } else {
             endApply ();
         }
-
-        if (previousFrame != NULL) {
-            free(previousFrame);
-            previousFrame = NULL;
-        }
     }
 
     void updateAnalyzeState(double time,
@@ -799,36 +227,73 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
         }
     }
 
+    void openAnalysisFile() {
+        if (analysisFile.empty()) {
+            file.reset ();
+        } else {
+            file = AnalysisFile::open (analysisFile);
+        }
+    }
+
     virtual void beginAnalyze(double time, uint32_t* out, const uint32_t* in) {
         rawSamples.clear();
-        if (!analysisFile.empty()) {
-            rawSamples.read (analysisFile);
+        openAnalysisFile ();
+        if (file) {
+            rawSamples.read (*file);
         }
     }
 
     virtual void endAnalyze() {
-        if (!analysisFile.empty() && rawSamples.size() > 0) {
-            RotationSamples onDisk;
-            onDisk.read (analysisFile);
-            onDisk.merge (rawSamples);
-            onDisk.write (analysisFile);
-
+        trackPendingFrame ();
+        if (file && rawSamples.size() > 0) {
+            // Only what this session has analyzed is written
+            std::vector<AnalysisRecord> updated = rawSamples.toRecords (true);
+            if (updated.size() > 0) {
+                file->append (updated, shard, shards);
+            }
             rawSamples.clear ();
-            rawSamples.read (analysisFile);
+            rawSamples.read (*file);
+            if (file->needsCompaction ()) {
+                file->rewrite (rawSamples.toRecords (false), shard, shards);
+            }
         }
     }
 
+    /**
+     * Reads the orientation of the camera in every frame from the orientation
+     * data in the video file.
+     */
+    void readOrientationData() {
+        orientationDataFrom = orientationFile;
+        MP4Parser parser(AnalysisFile::parseFileName(orientationFile));
+        if (parser.valid()) {
+            float duration = parser.getDuration();
+            if (duration > 0) {
+                std::vector<Quaternion> orientations;
+                parser.readZenithData(orientations);
+                rawSamples.addOrientations (orientations, orientations.size() / duration);
+            }
+        }
+        parser.close();
+    }
+
     virtual void beginApply(double time, uint32_t* out, const uint32_t* in) {
         rawSamples.clear ();
-        if (!analysisFile.empty()) {
-            rawSamples.read (analysisFile);
+        if (!orientationFile.empty()) {
+            readOrientationData ();
+        } else {
+            orientationDataFrom.clear ();
+            openAnalysisFile ();
+            if (file) {
+                rawSamples.read (*file);
+            }
         }
+        corrections.setSamples (rawSamples);
         updateCorrections();
     }
 
     void updateCorrections() {
-        corrections.clear ();
-        rawSamples.correct (smoothYaw, smoothPitch, smoothRoll, timeBiasYaw / 100.0, timeBiasPitch / 100.0, timeBiasRoll / 100.0, corrections);
+        corrections.setSmoothing (smoothYaw, smoothPitch, smoothRoll, timeBiasYaw / 100.0, timeBiasPitch / 100.0, timeBiasRoll / 100.0);
     }
 
     virtual void endApply() {
@@ -843,101 +308,68 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
     }
 
     virtual void update(double time, uint32_t* out, const uint32_t* in) {
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
+        // frei0r filter instances are not thread-safe, and Shotcut will call update
+        // from several threads when exporting in parallel. Analysis has to see the
+        // frames in order and runs entirely under the lock, but when applying the
+        // stabilization we only look up the correction under the lock.
+        std::unique_lock<std::mutex> guard(lock);
 
         double clipTime = time + clipOffset;
 
         updateAnalyzeState (clipTime, out, in);
 
         if (analyze) {
-            int backPos = offset;
-            if (backPos < searchRadius + sampleRadius) {
-                backPos = searchRadius + sampleRadius;
-            }
             int numSubpixels = 1 << subpixels;
-            TrackPointMatrix trackAhead (        width / 2, height / 2, 3, 3, offset, sampleRadius, searchRadius, numSubpixels);
-            TrackPointMatrix trackLeft  (        width / 4, height / 2, 3, 3, offset, sampleRadius, searchRadius, numSubpixels);
-            TrackPointMatrix trackRight (width - width / 4, height / 2, 3, 3, offset, sampleRadius, searchRadius, numSubpixels);
-            TrackPointMatrix trackBackL (          backPos, height / 2, 1, 3, offset, sampleRadius, searchRadius, numSubpixels);
-            TrackPointMatrix trackBackR (  width - backPos, height / 2, 1, 3, offset, sampleRadius, searchRadius, numSubpixels);
-
-            uint32_t* intermediateFrame = (uint32_t*) malloc(width * height * sizeof(uint32_t));
-            memcpy (intermediateFrame, in, width * height * sizeof(uint32_t));
-
-            Graphics preXform (intermediateFrame, width, height);
-
-            bool updated = false;
-            if (previousFrame != NULL && previousFrameTime < clipTime) {
-                trackAhead.update(preXform, previousFrame, in);
-                trackLeft.update(preXform, previousFrame, in);
-                trackRight.update(preXform, previousFrame, in);
-                if (useBackTrackpoints) {
-                    trackBackL.update(preXform, previousFrame, in);
-                    trackBackR.update(preXform, previousFrame, in);
-                }
-                updated = true;
-
-                double xScale = 360.0 / width;
-                double yScale = 180.0 / height;
-                Vector2 aheadMotion;
-                trackAhead.getMotion (aheadMotion);
-
-                Vector2 leftMotion;
-                trackLeft.getMotion (leftMotion);
-
-                Vector2 rightMotion;
-                trackRight.getMotion (rightMotion);
-
-                Vector2 backMotionL;
-                trackBackL.getMotion (backMotionL);
-
-                Vector2 backMotionR;
-                trackBackR.getMotion (backMotionR);
-
-                double backTrackpointWeight = useBackTrackpoints ? 0.3 : 0.0;
-
-                double dYaw = -weighted(aheadMotion[0], 1.0, backMotionL[0], backTrackpointWeight, backMotionR[0], backTrackpointWeight) * xScale; // if the point has moved left, we have turned right (+yaw)
-                double dPitch = weighted(aheadMotion[1], 1.0, -backMotionL[1], backTrackpointWeight, -backMotionR[1], backTrackpointWeight) * yScale; // if the point has moved down, we have pitched up (+pitch)
-                double dRoll = weighted(leftMotion[1], 1.0, -rightMotion[1], 1.0) * yScale; // if the left point has moved down, we have rolled right (+roll)
-
-                view (-dYaw, -dPitch, -dRoll);
+            int step = std::max((int) frameStep, 1);
+            int trackerSearchRadius = searchRadius * step;
+            // Keep the patches of the left and right grids inside the frame.
+            int gridSize = std::max((int) trackPointGrid, 1);
+            while (gridSize > 1 && offset * (gridSize - 1) / 2 + sampleRadius > (int) std::min(width / 4, height / 2)) {
+                --gridSize;
+            }
+            if (!tracker || !tracker->hasSettings(sampleRadius, trackerSearchRadius, offset, gridSize, numSubpixels, subpixelFit)) {
+                trackPendingFrame ();
+                tracker.reset(new Tracker(width, height, sampleRadius, trackerSearchRadius, offset, gridSize, numSubpixels, subpixelFit));
+                schedule.reset(step);
+            } else if (previousFrameTime >= clipTime) {
+                trackPendingFrame ();
+                tracker->clear();
+                schedule.reset(step);
+            }
+            schedule.setMaxStep(step);
 
-                rawSamples.add (Rotation (previousFrameTime + ROTATION_TIME_INSTANT, clipTime, dYaw, dPitch, dRoll, true));
+            Graphics postXform (out, width, height);
+            if (!schedule.isKeyframe()) {
+                // Not tracked. The rotation is interpolated once the next
+                // frame has been tracked. The tracker keeps the frame in gray,
+                // so that it can be tracked if the analysis ends before the
+                // next keyframe.
+                schedule.skip(clipTime);
+                tracker->setPendingFrame(in);
+                memcpy (out, in, width * height * sizeof(uint32_t));
             } else {
-                view (0, 0, 0);
-            }
+                // The track points are drawn on the frame before it is
+                // transformed, so they are drawn on a copy of it if it will be.
+                uint32_t* intermediateFrame = out;
+                if (transformWhenAnalyzing) {
+                    overlayFrame.resize(width * height);
+                    intermediateFrame = overlayFrame.data();
+                }
+                memcpy (intermediateFrame, in, width * height * sizeof(uint32_t));
 
-            trackAhead.markOrigin(preXform);
-            trackLeft.markOrigin(preXform);
-            trackRight.markOrigin(preXform);
-            if (useBackTrackpoints) {
-                trackBackL.markOrigin(preXform);
-                trackBackR.markOrigin(preXform);
-            }
+                Graphics preXform (intermediateFrame, width, height);
+                tracker->nextFrame(in);
+                trackKeyframe (clipTime);
 
-            trackAhead.markCurrent(preXform);
-            trackLeft.markCurrent(preXform);
-            trackRight.markCurrent(preXform);
-            if (useBackTrackpoints) {
-                trackBackL.markCurrent(preXform);
-                trackBackR.markCurrent(preXform);
-            }
+                tracker->markOrigin(preXform, useBackTrackpoints);
+                tracker->markCurrent(preXform, useBackTrackpoints);
 
-            if (transformWhenAnalyzing) {
-                MPFilter::updateMP(this, time, out, intermediateFrame, width, height);
-            } else {
-                memcpy (out, intermediateFrame, width * height * sizeof(uint32_t));
-            }
+                if (transformWhenAnalyzing) {
+                    Transform360Frame frame(t360, width, height, yaw, pitch, roll, interpolation);
+                    MPFilter::updateMP(&frame, time, out, intermediateFrame, width, height);
+                }
 
-            Graphics postXform (out, width, height);
-            trackAhead.markOriginTransformed(postXform);
-            trackLeft.markOriginTransformed(postXform);
-            trackRight.markOriginTransformed(postXform);
-            if (useBackTrackpoints) {
-                trackBackL.markOriginTransformed(postXform);
-                trackBackR.markOriginTransformed(postXform);
+                tracker->markOriginTransformed(postXform, useBackTrackpoints);
             }
 
             unsigned int diagramWidth = 512;
@@ -946,7 +378,7 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
             }
             unsigned int diagramHeight = 128;
             if (diagramHeight > height / 4) {
-                diagramHeight = diagramHeight;
+                diagramHeight = height / 4;
             }
             rawSamples.drawDiagram (postXform, clipTime, width / 2, 3 * height / 4, diagramWidth, diagramHeight);
 
@@ -973,53 +405,112 @@ class Stabilize360 : public Frei0rFilter, MPFilter {
 
             postXform.drawText(8, 8, status, 0, 0xff0000ff);
 
-            free (intermediateFrame);
-
             previousFrameTime = clipTime;
-            if (previousFrame == NULL) {
-                previousFrame = (uint32_t*) malloc(width * height * sizeof(uint32_t));
-            }
-            memcpy (previousFrame, in, width * height * sizeof(uint32_t));
         } else {
+            if (orientationFile != orientationDataFrom) {
+                beginApply (clipTime, out, in);
+            }
             if (smoothYaw.changed() || smoothPitch.changed() || smoothRoll.changed() ||
                     timeBiasYaw.changed() || timeBiasPitch.changed() || timeBiasRoll.changed()) {
                 updateCorrections();
             }
 
-            int correctionIndex = corrections.lookup (clipTime);
-            if (correctionIndex >= 0) {
-                Rotation correction = corrections[correctionIndex];
+            Rotation correction (0, 0, 0, 0, 0, false);
+            if (corrections.lookup (clipTime, correction)) {
                 view (
                     correction.yaw * stabilizeYaw / 100.0,
                     correction.pitch * stabilizePitch / 100.0,
                     correction.roll * stabilizeRoll / 100.0
                 );
-
-                MPFilter::updateMP(this, time, out, in, width, height);
             } else {
                 view(0, 0, 0);
-                MPFilter::updateMP(this, time, out, in, width, height);
             }
+            double framePitch = pitch;
+            double frameRoll = roll;
+            bool buildMap;
+            std::shared_ptr<Map360Entry> frameMap = pitchRollMap.get(framePitch, frameRoll, buildMap);
+            Transform360Frame frame(t360, width, height, yaw, framePitch, frameRoll, frameMap.get(), buildMap, interpolation);
 
             previousFrameTime = -1;
-            if (previousFrame != NULL) {
-                free(previousFrame);
-                previousFrame = NULL;
+            tracker.reset();
+            overlayFrame.clear();
+            overlayFrame.shrink_to_fit();
+
+            guard.unlock();
+            MPFilter::updateMP(&frame, time, out, in, width, height);
+
+            if (buildMap) {
+                guard.lock();
+                pitchRollMap.put(frameMap, framePitch, frameRoll);
             }
         }
     }
 
+    /**
+     * Tracks the current frame of the tracker from the keyframe, adds the
+     * rotation from the keyframe, split over the frames in between, and
+     * makes the frame the keyframe.
+     */
+    void trackKeyframe (double clipTime) {
+        double motion = -1;
+        if (tracker->canTrack()) {
+            tracker->track(useBackTrackpoints);
+
+            double xScale = 360.0 / width;
+            double yScale = 180.0 / height;
+            Vector2 aheadMotion;
+            tracker->ahead.getMotion (aheadMotion);
+
+            Vector2 leftMotion;
+            tracker->left.getMotion (leftMotion);
+
+            Vector2 rightMotion;
+            tracker->right.getMotion (rightMotion);
+
+            Vector2 backMotionL;
+            tracker->backL.getMotion (backMotionL);
+
+            Vector2 backMotionR;
+            tracker->backR.getMotion (backMotionR);
+
+            double backTrackpointWeight = useBackTrackpoints ? 0.3 : 0.0;
+
+            double dYaw = -weighted(aheadMotion[0], 1.0, backMotionL[0], backTrackpointWeight, backMotionR[0], backTrackpointWeight) * xScale; // if the point has moved left, we have turned right (+yaw)
+            double dPitch = weighted(aheadMotion[1], 1.0, -backMotionL[1], backTrackpointWeight, -backMotionR[1], backTrackpointWeight) * yScale; // if the point has moved down, we have pitched up (+pitch)
+            double dRoll = weighted(leftMotion[1], 1.0, -rightMotion[1], 1.0) * yScale; // if the left point has moved down, we have rolled right (+roll)
+
+            view (-dYaw, -dPitch, -dRoll);
+
+            rawSamples.addInterpolated (schedule.getKeyframeTime(), schedule.getFrameTimes(), clipTime, dYaw, dPitch, dRoll, true);
+
+            motion = std::max(std::max(std::abs(aheadMotion[0]), std::abs(aheadMotion[1])),
+                              std::max(std::abs(leftMotion[1]), std::abs(rightMotion[1])));
+        } else {
+            view (0, 0, 0);
+        }
+        // The track points look for the motion over as many frames as
+        // there will be to the next keyframe.
+        tracker->scalePrediction (schedule.keyframe(clipTime, motion, tracker->getSearchRadius()));
+    }
+
+    /**
+     * Tracks the last frame since the keyframe, if it was not tracked, so
+     * that the frames before it get their rotations.
+     */
+    void trackPendingFrame () {
+        if (!tracker || !schedule.hasPending()) {
+            return;
+        }
+        double time = schedule.takeLastPending();
+        tracker->nextPendingFrame();
+        trackKeyframe (time);
+    }
+
     void view (double y, double p, double r) {
         yaw = y;
         pitch = p;
         roll = r;
     }
-
-    virtual void updateLines(double time,
-                             uint32_t* out,
-                             const uint32_t* in, int start, int num) {
-        transform_360(t360, out, (uint32_t*) in, width, height, start, num, yaw, pitch, roll, interpolation);
-    }
 };
 
 frei0r::construct<Stabilize360> plugin("bigsh0t_stabilize_360",
@@ -8,6 +8,7 @@
 
 #include "ImageProcessing.hpp"
 #include "SummedAreaTable.hpp"
+#include "ThreadPool.hpp"
 
 SummedAreaTable::SummedAreaTable(int width, int height) {
     this->width = width + 1;
@@ -47,8 +48,7 @@ void SummedAreaTable::compute(const uint32_t *in, int inW, int x0, int y0, int w
     for (int x = 0; x < width * 4; ++x) {
         sums[x] = 0;
     }
-    #pragma omp parallel for
-    for (int c = 0; c < 4; ++c) {
+    ThreadPool::instance().parallelFor(4, [&](int c) {
         uint32_t* p = &sums[stride + 4 + c];
         int shift = c * 8;
         for (int y = 1; y < height; ++y) {
@@ -69,7 +69,7 @@ void SummedAreaTable::compute(const uint32_t *in, int inW, int x0, int y0, int w
             }
             p += 4;
         }
-    }
+    });
 }
 
 void SummedAreaTable::sumComponents(int imx0, int imy0, int sampleWidth, int sampleHeight, uint32_t& r, uint32_t& g, uint32_t& b, uint32_t& a) {
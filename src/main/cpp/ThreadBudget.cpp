@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ThreadBudget.hpp"
+
+/**
+ * How long, in milliseconds, to wait for the module that creates the shared
+ * budget to fill it in.
+ */
+#define THREAD_BUDGET_OPEN_TIMEOUT 1000
+
+/**
+ * How many times to open the shared budget again if the last module that
+ * had it open removed it while it was being opened.
+ */
+#define THREAD_BUDGET_OPEN_ATTEMPTS 10
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "The shared counters must be lock-free");
+
+ThreadBudget::ThreadBudget(const std::string& name, int workers) : name(name), counters(&local), mapping(NULL), fd(-1) {
+    local.ready = 1;
+    local.available = workers;
+    local.next = 0;
+    if (!name.empty()) {
+        open(workers);
+    }
+}
+
+ThreadBudget::~ThreadBudget() {
+    close();
+}
+
+std::string ThreadBudget::processName() {
+    char buf[64];
+#ifdef _WIN32
+    snprintf(buf, sizeof(buf), "Local\\bigsh0t-threads-%lu", (unsigned long) GetCurrentProcessId());
+#else
+    snprintf(buf, sizeof(buf), "/bigsh0t-threads-%ld", (long) getpid());
+#endif
+    return buf;
+}
+
+bool ThreadBudget::open(int workers) {
+    void* view = NULL;
+    bool create = false;
+
+#ifdef _WIN32
+    // The mapping lives as long as a module has it open, and goes away with
+    // the process.
+    HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Counters), name.c_str());
+    if (handle == NULL) {
+        return false;
+    }
+    create = GetLastError() != ERROR_ALREADY_EXISTS;
+    view = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Counters));
+    if (view == NULL) {
+        CloseHandle(handle);
+        return false;
+    }
+    mapping = handle;
+#else
+    // Every module holds a shared lock on the block for as long as it has
+    // it open. The locks go away with the process, so a module that gets the
+    // lock exclusively knows that no live module uses the block: it is new,
+    // or left behind by a process that had the same id, and is filled in
+    // anew. The other modules wait for it to finish.
+    struct stat st;
+    int attempt = 0;
+    while (true) {
+        int file = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (file < 0) {
+            return false;
+        }
+        create = flock(file, LOCK_EX | LOCK_NB) == 0;
+        if (!create && (errno != EWOULDBLOCK || flock(file, LOCK_SH) != 0)) {
+            ::close(file);
+            return false;
+        }
+        if (fstat(file, &st) != 0) {
+            ::close(file);
+            return false;
+        }
+        if (st.st_nlink > 0) {
+            fd = file;
+            break;
+        }
+        // The last module that had it open removed it while this one
+        // waited for the lock.
+        ::close(file);
+        if (++attempt == THREAD_BUDGET_OPEN_ATTEMPTS) {
+            return false;
+        }
+    }
+    bool sized = create ? ftruncate(fd, sizeof(Counters)) == 0 : st.st_size >= (off_t) sizeof(Counters);
+    if (!sized) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    view = mmap(NULL, sizeof(Counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+#endif
+
+    // New shared memory is zero-filled, so ready is 0 until the counters
+    // have been set.
+    counters = (Counters*) view;
+    if (create) {
+        counters->available = workers;
+        counters->next = 0;
+        counters->ready = 1;
+#ifndef _WIN32
+        flock(fd, LOCK_SH);
+#endif
+    } else {
+        for (int i = 0; counters->ready.load() == 0 && i < THREAD_BUDGET_OPEN_TIMEOUT; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (counters->ready.load() == 0) {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ThreadBudget::close() {
+    if (counters != &local) {
+#ifdef _WIN32
+        UnmapViewOfFile(counters);
+        CloseHandle((HANDLE) mapping);
+#else
+        munmap(counters, sizeof(Counters));
+        // The last module removes the name. The lock can only be taken
+        // exclusively if no other module has the block open.
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            shm_unlink(name.c_str());
+        }
+        ::close(fd);
+#endif
+    }
+    counters = &local;
+    mapping = NULL;
+    fd = -1;
+}
+
+bool ThreadBudget::tryAcquire() {
+    int available = counters->available.load();
+    while (available > 0) {
+        if (counters->available.compare_exchange_weak(available, available - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadBudget::release() {
+    counters->available.fetch_add(1);
+}
+
+int ThreadBudget::next() {
+    return counters->next.fetch_add(1);
+}
+
+bool ThreadBudget::isShared() const {
+    return counters != &local;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef ThreadBudget_HPP
+#define ThreadBudget_HPP
+
+#include <atomic>
+#include <string>
+
+/**
+ * The number of worker threads that may work at the same time, shared by all
+ * ThreadPools that open a budget of the same name.
+ *
+ * Each plugin is a module of its own that the host loads privately, with a
+ * ThreadPool of its own. So that the workers of the filters in a chain do not
+ * together take more cores than the budget, the budget of a process is kept
+ * in a small block of named shared memory that the pool of every module maps.
+ * The name holds the process id, so every process has a budget of its own.
+ * Every module that has the block open holds a lock on it, and the locks go
+ * away with the process. A module that opens the block when no other module
+ * holds a lock on it fills it in anew, so a block left behind by a killed
+ * process that had the same id starts from the full budget. The last module
+ * to close the block removes the name.
+ *
+ * The numbers that workers are spread over the cores by come from the same
+ * block, so that workers of different plugins are pinned to different cores.
+ *
+ * If the shared memory can not be opened, the budget only covers this module.
+ *
+ * Thread-safe.
+ */
+class ThreadBudget {
+  public:
+    /**
+     * @param name the name of the budget, or empty for a budget that is not
+     *     shared with other modules
+     * @param workers how many workers may work at the same time, if the
+     *     budget does not exist yet
+     */
+    ThreadBudget(const std::string& name, int workers);
+    ~ThreadBudget();
+
+    /**
+     * The name of the budget of this process.
+     */
+    static std::string processName();
+
+    /**
+     * Takes a worker from the budget, if there is one left. Does not wait.
+     *
+     * @return true if the worker may start
+     */
+    bool tryAcquire();
+
+    /**
+     * Gives back a worker taken by tryAcquire.
+     */
+    void release();
+
+    /**
+     * Returns a number that no other call with this budget returns, counting
+     * up from 0.
+     */
+    int next();
+
+    /**
+     * True if the budget is in shared memory.
+     */
+    bool isShared() const;
+
+  private:
+    class Counters {
+      public:
+        std::atomic<int> ready;
+        std::atomic<int> available;
+        std::atomic<int> next;
+    };
+
+    bool open(int workers);
+    void close();
+
+    std::string name;
+    Counters local;
+    Counters* counters;
+
+    /**
+     * The mapping on Windows, and the locked descriptor of the block
+     * elsewhere.
+     */
+    void* mapping;
+    int fd;
+};
+
+#endif
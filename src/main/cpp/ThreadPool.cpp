@@ -0,0 +1,256 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "ThreadPool.hpp"
+
+/**
+ * The shortest and the longest time, in milliseconds, that a worker waits
+ * for the workers of other pools to give back the budget before it tries
+ * again.
+ */
+#define THREAD_POOL_MIN_BACKOFF 1
+#define THREAD_POOL_MAX_BACKOFF 32
+
+ThreadPool::Job::Job(int numThreads, const std::function<void(int thread)>& f) : f(f), numThreads(numThreads), next(0), finished(0) {
+}
+
+int ThreadPool::Job::claim() {
+    int thread = next.fetch_add(1);
+    return thread < numThreads ? thread : -1;
+}
+
+bool ThreadPool::Job::claimed() const {
+    return next.load() >= numThreads;
+}
+
+void ThreadPool::Job::finish() {
+    // Notify while holding the lock, as the job is destroyed as soon as
+    // wait returns.
+    std::lock_guard<std::mutex> guard(lock);
+    ++finished;
+    if (finished == numThreads) {
+        done.notify_all();
+    }
+}
+
+void ThreadPool::Job::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] {
+        return finished == numThreads;
+    });
+}
+
+static void pinToCore(std::thread& thread, int core) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+}
+
+ThreadPool::ThreadPool(int size, bool pin) : size(std::max(size, 1)),
+    ownBudget(new ThreadBudget("", std::max(size, 1) - 1)), budget(ownBudget.get()), stopping(false), waitingForBudget(0) {
+    start(pin);
+}
+
+ThreadPool::ThreadPool(int size, bool pin, ThreadBudget& budget) : size(std::max(size, 1)), budget(&budget), stopping(false),
+    waitingForBudget(0) {
+    start(pin);
+}
+
+void ThreadPool::start(bool pin) {
+    int cores = std::max((int) std::thread::hardware_concurrency(), 1);
+    for (int i = 1; i < size; ++i) {
+        workers.push_back(std::thread(&ThreadPool::work, this));
+        if (pin) {
+            // Core 0 is left to the threads of the host, and the rest are
+            // taken in turn by the workers of all pools on the budget.
+            pinToCore(workers.back(), cores > 1 ? 1 + budget->next() % (cores - 1) : 0);
+        }
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    // Run the tasks that no worker started, as someone may be waiting for
+    // them to finish. Jobs that they start run on this thread.
+    while (!tasks.empty()) {
+        std::function<void()> task = tasks.front();
+        tasks.pop_front();
+        task();
+    }
+}
+
+static int sizeFromEnvironment() {
+    int size = (int) std::thread::hardware_concurrency();
+    const char* env = getenv("BIGSH0T_THREADS");
+    if (env != NULL && *env != '\0') {
+        size = (int) strtol(env, NULL, 10);
+    }
+    return std::max(size, 1);
+}
+
+static bool pinFromEnvironment() {
+    const char* env = getenv("BIGSH0T_PIN_THREADS");
+    return env != NULL && strcmp(env, "1") == 0;
+}
+
+ThreadPool& ThreadPool::instance() {
+#ifdef _WIN32
+    // Windows holds the loader lock while the plugin is unloaded, and the
+    // workers can not exit, and so not be joined, until it is released. The
+    // plugin is therefore kept loaded, and the pool is left running until
+    // the process exits.
+    static ThreadPool* pool = [] {
+        HMODULE module;
+        GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+                           (LPCSTR) &sizeFromEnvironment, &module);
+        int size = sizeFromEnvironment();
+        ThreadBudget* budget = new ThreadBudget(ThreadBudget::processName(), size - 1);
+        return new ThreadPool(size, pinFromEnvironment(), *budget);
+    }();
+    return *pool;
+#else
+    static ThreadBudget budget(ThreadBudget::processName(), sizeFromEnvironment() - 1);
+    static ThreadPool pool(sizeFromEnvironment(), pinFromEnvironment(), budget);
+    return pool;
+#endif
+}
+
+int ThreadPool::getSize() const {
+    return size;
+}
+
+void ThreadPool::work() {
+    int backoff = THREAD_POOL_MIN_BACKOFF;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        wakeup.wait(guard, [this] {
+            return stopping || !jobs.empty() || !tasks.empty();
+        });
+        if (stopping) {
+            return;
+        }
+        if (!budget->tryAcquire()) {
+            // The workers of this pool wake it when they give back the
+            // budget, but those of other pools can not, so wait a little
+            // longer each time in case they have it.
+            ++waitingForBudget;
+            wakeup.wait_for(guard, std::chrono::milliseconds(backoff));
+            --waitingForBudget;
+            backoff = std::min(backoff * 2, THREAD_POOL_MAX_BACKOFF);
+            continue;
+        }
+        backoff = THREAD_POOL_MIN_BACKOFF;
+        if (jobs.empty()) {
+            std::function<void()> task = tasks.front();
+            tasks.pop_front();
+            guard.unlock();
+            task();
+            guard.lock();
+            releaseBudget();
+            continue;
+        }
+        Job* job = jobs.front();
+        int thread = job->claim();
+        if (job->claimed()) {
+            jobs.pop_front();
+        }
+        if (thread < 0) {
+            releaseBudget();
+            continue;
+        }
+
+        guard.unlock();
+        job->f(thread);
+        job->finish();
+        guard.lock();
+        releaseBudget();
+    }
+}
+
+void ThreadPool::releaseBudget() {
+    budget->release();
+    if (waitingForBudget > 0) {
+        wakeup.notify_all();
+    }
+}
+
+void ThreadPool::remove(Job* job) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = std::find(jobs.begin(), jobs.end(), job);
+    if (found != jobs.end()) {
+        jobs.erase(found);
+    }
+}
+
+void ThreadPool::run(int numThreads, const std::function<void(int thread)>& f) {
+    if (numThreads <= 1 || workers.empty()) {
+        for (int thread = 0; thread < numThreads; ++thread) {
+            f(thread);
+        }
+        return;
+    }
+
+    Job job(numThreads, f);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(&job);
+    }
+    wakeup.notify_all();
+
+    int thread;
+    while ((thread = job.claim()) >= 0) {
+        f(thread);
+        job.finish();
+    }
+    // Every thread index has been claimed, but a worker may not have taken
+    // the job off the queue yet.
+    remove(&job);
+    job.wait();
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int i)>& f) {
+    std::atomic<int> next(0);
+    run(std::min(n, size), [&](int) {
+        int i;
+        while ((i = next.fetch_add(1)) < n) {
+            f(i);
+        }
+    });
+}
+
+void ThreadPool::post(const std::function<void()>& task) {
+    if (workers.empty()) {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(task);
+    }
+    wakeup.notify_one();
+}
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef ThreadPool_HPP
+#define ThreadPool_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ThreadBudget.hpp"
+
+/**
+ * A fixed set of worker threads, shared by all filter instances in the
+ * plugin. The workers are started the first time the pool is used and then
+ * wait for jobs, so a frame does not pay for starting threads, and several
+ * instances rendering at the same time - the frames of a parallel export -
+ * share the workers instead of each starting threads of their own.
+ *
+ * Every plugin has a pool of its own, but a worker only works while it holds
+ * a worker from a ThreadBudget, and the pools of all plugins in a process
+ * share one budget. So the workers of the filters in a chain together work on
+ * no more than size - 1 jobs at a time. The threads that call into the pool
+ * are not counted, as they belong to the host.
+ *
+ * The size is set through the BIGSH0T_THREADS environment variable. The
+ * default is the number of hardware threads. Setting BIGSH0T_PIN_THREADS to
+ * 1 pins each worker to a core, on Linux. The cores are handed out through the
+ * budget, so the workers of different plugins get different cores as far as
+ * there are enough.
+ *
+ * A job may start other jobs. The thread that starts a job always works on it
+ * too, and does whatever the workers have not picked up, so a job finishes
+ * even if all workers are busy.
+ *
+ * Tasks are work that nobody waits for, such as building a map in the
+ * background. Workers only pick up a task when there is no job for them.
+ */
+class ThreadPool {
+  public:
+    /**
+     * @param size the number of threads that work at the same time,
+     *     counting the caller. The pool starts size - 1 workers.
+     * @param pin if true, pin the workers to a core each
+     */
+    ThreadPool(int size, bool pin);
+
+    /**
+     * Creates a pool whose workers share a budget with other pools. The
+     * budget must outlive the pool.
+     */
+    ThreadPool(int size, bool pin, ThreadBudget& budget);
+    ~ThreadPool();
+
+    /**
+     * The pool for this plugin, which uses the budget of the process. On
+     * Windows it is never destroyed, see the implementation.
+     */
+    static ThreadPool& instance();
+
+    /**
+     * The number of threads that work at the same time, counting the caller.
+     */
+    int getSize() const;
+
+    /**
+     * Calls f(thread) once for each thread in [0, numThreads), and returns
+     * when all calls have returned. Calls may run one after the other on the
+     * same thread, so f must not wait for other calls. The calling thread
+     * makes some of the calls itself.
+     */
+    void run(int numThreads, const std::function<void(int thread)>& f);
+
+    /**
+     * Calls f(i) for each i in [0, n), and returns when all calls have
+     * returned.
+     */
+    void parallelFor(int n, const std::function<void(int i)>& f);
+
+    /**
+     * Runs a task on a worker, and returns without waiting for it. With no
+     * workers, the task runs on the calling thread before post returns.
+     * Tasks that have not started when the pool is destroyed run on the
+     * thread that destroys it.
+     */
+    void post(const std::function<void()>& task);
+
+  private:
+    class Job {
+      public:
+        Job(int numThreads, const std::function<void(int thread)>& f);
+
+        /**
+         * Claims the next thread index of the job, or returns -1 if all
+         * have been claimed.
+         */
+        int claim();
+        bool claimed() const;
+        void finish();
+        void wait();
+
+        const std::function<void(int thread)>& f;
+        const int numThreads;
+
+      private:
+        std::atomic<int> next;
+        int finished;
+        std::mutex lock;
+        std::condition_variable done;
+    };
+
+    void start(bool pin);
+    void work();
+    void remove(Job* job);
+
+    /**
+     * Gives back a worker to the budget, and wakes the workers that wait for
+     * one. Call with the lock held.
+     */
+    void releaseBudget();
+
+    int size;
+    std::unique_ptr<ThreadBudget> ownBudget;
+    ThreadBudget* budget;
+    bool stopping;
+
+    /**
+     * The number of workers that wait for the budget.
+     */
+    int waitingForBudget;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::deque<Job*> jobs;
+    std::deque<std::function<void()> > tasks;
+    std::vector<std::thread> workers;
+};
+
+#endif
@@ -0,0 +1,877 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef Tracker_HPP
+#define Tracker_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <inttypes.h>
+#include <vector>
+#include "Graphics.hpp"
+#include "ImageProcessing.hpp"
+#include "Matrix.hpp"
+#include "ThreadPool.hpp"
+
+inline short toGray(uint32_t color) {
+    return
+        ((color      ) & 0xff) +
+        ((color >>  8) & 0xff) +
+        ((color >> 16) & 0xff);
+}
+
+/**
+ * Converts n pixels to gray, so that block matching can compare whole rows
+ * of gray values with sad_row.
+ */
+inline void toGray(short* out, const uint32_t* in, int n) {
+    for (int i = 0; i < n; ++i) {
+        out[i] = toGray(in[i]);
+    }
+}
+
+/**
+ * The most levels a GrayPyramid has, including the full-resolution one.
+ */
+#define PYRAMID_MAX_LEVELS 5
+
+/**
+ * A level is only used if the search radius at that level is at least this
+ * many pixels...
+ */
+#define PYRAMID_MIN_SEARCH_RADIUS 8
+
+/**
+ * ...and the sample radius is at least this many pixels. Smaller patches
+ * have too little detail to match reliably.
+ */
+#define PYRAMID_MIN_SAMPLE_RADIUS 4
+
+/**
+ * How far from the position found at the coarser level that a level
+ * searches, in pixels of that level.
+ */
+#define PYRAMID_REFINE_RADIUS 2
+
+/**
+ * How far from the predicted position that a track point searches before
+ * falling back to the whole search radius.
+ */
+#define PREDICTION_RADIUS 3
+
+/**
+ * The largest mean error per pixel, in the 0-765 range of toGray, at which
+ * a match near the predicted position is accepted.
+ */
+#define PREDICTION_MAX_ERROR 24
+
+/**
+ * A frame in gray, and copies of it that are halved in size, level by level.
+ * Level 0 is the full frame, and each pixel of level n + 1 is the average of
+ * 2x2 pixels in level n.
+ */
+class GrayPyramid {
+  public:
+    /**
+     * Replaces the contents with those for a new frame. The memory of the
+     * levels is reused if the frame size and number of levels are the same.
+     */
+    void update (const uint32_t* frame, int width, int height, int numLevels) {
+        updateBase (frame, width, height);
+        updateLevels (numLevels);
+    }
+
+    /**
+     * Replaces level 0 with a new frame, and drops the other levels until
+     * updateLevels is called. Their memory is kept.
+     */
+    void updateBase (const uint32_t* frame, int width, int height) {
+        numLevels = 1;
+        if (levels.empty()) {
+            levels.resize(1);
+            widths.resize(1);
+            heights.resize(1);
+        }
+        widths[0] = width;
+        heights[0] = height;
+        levels[0].resize(width * height);
+        toGray(levels[0].data(), frame, width * height);
+    }
+
+    /**
+     * Builds the levels above level 0.
+     */
+    void updateLevels (int numLevels) {
+        if ((int) levels.size() < numLevels) {
+            levels.resize(numLevels);
+            widths.resize(numLevels);
+            heights.resize(numLevels);
+        }
+        this->numLevels = numLevels;
+
+        for (int level = 1; level < numLevels; ++level) {
+            const std::vector<short>& finer = levels[level - 1];
+            int finerWidth = widths[level - 1];
+            int w = finerWidth / 2;
+            int h = heights[level - 1] / 2;
+            std::vector<short>& coarser = levels[level];
+            coarser.resize(w * h);
+            for (int y = 0; y < h; ++y) {
+                const short* row0 = finer.data() + 2 * y * finerWidth;
+                const short* row1 = row0 + finerWidth;
+                for (int x = 0; x < w; ++x) {
+                    coarser[y * w + x] = (short) ((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+                }
+            }
+            widths[level] = w;
+            heights[level] = h;
+        }
+    }
+
+    /**
+     * Returns how many levels a pyramid needs for track points with the
+     * given radii.
+     */
+    static int levelsFor (int sampleRadius, int searchRadius) {
+        int levels = 1;
+        while (levels < PYRAMID_MAX_LEVELS &&
+                (searchRadius >> levels) >= PYRAMID_MIN_SEARCH_RADIUS &&
+                (sampleRadius >> levels) >= PYRAMID_MIN_SAMPLE_RADIUS) {
+            ++levels;
+        }
+        return levels;
+    }
+
+    int getLevels () const {
+        return numLevels;
+    }
+
+    const short* getLevel (int level) const {
+        return levels[level].data();
+    }
+
+    int getWidth (int level) const {
+        return widths[level];
+    }
+
+    int getHeight (int level) const {
+        return heights[level];
+    }
+
+  private:
+    int numLevels = 0;
+    std::vector<std::vector<short>> levels;
+    std::vector<int> widths;
+    std::vector<int> heights;
+};
+
+class TrackPoint {
+  public:
+
+    /**
+     * @param subpixels the number of subpixels to match, if more than 1
+     * @param fitSubpixels if true, the subpixel position is computed from the
+     *                     errors around the best match, instead of matching
+     *                     each subpixel
+     */
+    TrackPoint (int x, int y, int sampleRadius, int searchRadius, int subpixels, bool fitSubpixels) {
+        this->x = x;
+        this->y = y;
+        this->cx = x;
+        this->cy = y;
+        this->sampleRadius = sampleRadius;
+        this->searchRadius = searchRadius;
+        this->subpixels = subpixels;
+        this->subpixelFactor = 1.0 / (subpixels > 1 ? subpixels : 1);
+        this->fitSubpixels = fitSubpixels;
+
+        sampleBuffer = NULL;
+        reset ();
+    }
+
+    /**
+     * Moves the track point back to its origin.
+     */
+    void reset () {
+        cx = x;
+        cy = y;
+        subx = 0;
+        suby = 0;
+        cerr = 0;
+        active = true;
+    }
+
+    /**
+     * Returns the size, in shorts, of the buffer that setSampleBuffer needs.
+     */
+    int getSampleBufferSize () const {
+        return sampleRadius * sampleRadius * 4;
+    }
+
+    /**
+     * Sets the buffer that the patch to match is copied to. The track point
+     * does not take ownership of it.
+     */
+    void setSampleBuffer (short* sampleBuffer) {
+        this->sampleBuffer = sampleBuffer;
+    }
+
+    int match (const short* gray, int width, int size, int atx, int aty, int abortAtError) {
+        int error = 0;
+        for (int sy = 0; sy < size; ++sy) {
+            error += sad_row(sampleBuffer + sy * size, gray + (aty + sy) * width + atx, size);
+            if (error > abortAtError) {
+                return error;
+            }
+        }
+        return error;
+    }
+
+    /**
+     * Samples level 0 of a pyramid between pixels, with the same 7-bit
+     * weights as sampleBilinear.
+     */
+    static int sampleGray (const GrayPyramid& pyramid, double x, double y) {
+        const short* gray = pyramid.getLevel(0);
+        int width = pyramid.getWidth(0);
+        int height = pyramid.getHeight(0);
+        int ix0 = (int) x;
+        int iy0 = (int) y;
+        int ix1 = std::min(ix0 + 1, width - 1);
+        int iy1 = std::min(iy0 + 1, height - 1);
+        int ax = (int) ((x - ix0) * 128);
+        int ay = (int) ((y - iy0) * 128);
+        if (ix0 < 0 || iy0 < 0 || ix0 > width - 1 || iy0 > height - 1) {
+            return 0;
+        }
+        const short* row0 = gray + iy0 * width;
+        const short* row1 = gray + iy1 * width;
+        int top = row0[ix0] + (((row0[ix1] - row0[ix0]) * ax) >> 7);
+        int bottom = row1[ix0] + (((row1[ix1] - row1[ix0]) * ax) >> 7);
+        return top + (((bottom - top) * ay) >> 7);
+    }
+
+    int matchSubpixel (const GrayPyramid& currentGray, int atx, int aty, double spx, double spy, int abortAtError) {
+        int error = 0;
+        int sbp = 0;
+        for (int sy = aty; sy < aty + sampleRadius * 2; ++sy) {
+            for (int sx = atx; sx < atx + sampleRadius * 2; ++sx) {
+                int sample = sampleBuffer[sbp];
+                int actual = sampleGray(currentGray, sx + spx, sy + spy);
+                int err = abs(sample - actual);
+                error += err;
+                ++sbp;
+                if (error > abortAtError) {
+                    return error;
+                }
+            }
+        }
+        return error;
+    }
+
+    /**
+     * Returns where the minimum of the parabola through the errors at -1, 0
+     * and 1 is, clamped to [-0.5, 0.5].
+     */
+    static double fitParabola (int before, int at, int after) {
+        int curvature = before - 2 * at + after;
+        if (curvature <= 0) {
+            return 0.0;
+        }
+        double offset = 0.5 * (before - after) / curvature;
+        return std::max(-0.5, std::min(0.5, offset));
+    }
+
+    /**
+     * Sets the subpixel position of the match from the errors at the
+     * positions next to it, with one parabola fit per axis. This costs four
+     * matches, however many subpixels there are.
+     */
+    void fitSubpixel (const GrayPyramid& currentGray, int bestError) {
+        const short* gray = currentGray.getLevel(0);
+        int width = currentGray.getWidth(0);
+        int height = currentGray.getHeight(0);
+        int size = sampleRadius * 2;
+        int atx = cx - sampleRadius;
+        int aty = cy - sampleRadius;
+        if (atx > 0 && atx + size < width) {
+            subx = fitParabola (
+                       match (gray, width, size, atx - 1, aty, INT_MAX),
+                       bestError,
+                       match (gray, width, size, atx + 1, aty, INT_MAX));
+        }
+        if (aty > 0 && aty + size < height) {
+            suby = fitParabola (
+                       match (gray, width, size, atx, aty - 1, INT_MAX),
+                       bestError,
+                       match (gray, width, size, atx, aty + 1, INT_MAX));
+        }
+    }
+
+    /**
+     * Copies the patch around the origin in a pyramid level to sampleBuffer.
+     */
+    void samplePatch (const GrayPyramid& previous, int level) {
+        int width = previous.getWidth(level);
+        int patchRadius = sampleRadius >> level;
+        int patchSize = patchRadius * 2;
+        const short* origin = previous.getLevel(level) + ((y >> level) - patchRadius) * width + (x >> level) - patchRadius;
+        for (int sy = 0; sy < patchSize; ++sy) {
+            memcpy(sampleBuffer + sy * patchSize, origin + sy * width, patchSize * sizeof(short));
+        }
+    }
+
+    /**
+     * Searches the positions within radius of (cx, cy) in a pyramid level,
+     * nearest first, for the patch in sampleBuffer, and moves (cx, cy) to
+     * the best match. Positions more than limit from the origin, or where
+     * the patch would not be inside the frame, are skipped. (cx, cy) is
+     * first moved to the nearest position where the patch is inside the
+     * frame, as scaling a match up from a coarser level can put it just
+     * outside.
+     *
+     * @return the error of the best match
+     */
+    int search (const GrayPyramid& current, int level, int radius, int limit) {
+        const short* gray = current.getLevel(level);
+        int width = current.getWidth(level);
+        int height = current.getHeight(level);
+        int patchRadius = sampleRadius >> level;
+        int size = patchRadius * 2;
+        int ox = x >> level;
+        int oy = y >> level;
+        cx = std::max(patchRadius, std::min(cx, width - patchRadius));
+        cy = std::max(patchRadius, std::min(cy, height - patchRadius));
+        int px = cx;
+        int py = cy;
+        int bestError = match (gray, width, size, px - patchRadius, py - patchRadius, INT_MAX);
+        for (int ring = 1; ring <= radius; ++ring) {
+            for (int my = py - ring; my <= py + ring; ++my) {
+                for (int mx = px - ring; mx <= px + ring; ++mx) {
+                    if (my != py - ring && my != py + ring && mx != px - ring && mx != px + ring) {
+                        continue;
+                    }
+                    if (abs(mx - ox) > limit || abs(my - oy) > limit) {
+                        continue;
+                    }
+                    if (mx < patchRadius || my < patchRadius || mx + patchRadius > width || my + patchRadius > height) {
+                        continue;
+                    }
+                    int error = match (gray, width, size, mx - patchRadius, my - patchRadius, bestError);
+                    if (error < bestError) {
+                        bestError = error;
+                        cx = mx;
+                        cy = my;
+                    }
+                }
+            }
+        }
+        return bestError;
+    }
+
+    /**
+     * Searches near the position that the track point is predicted to have
+     * moved to. The prediction may be outside the search radius.
+     *
+     * @return true if a good match was found, that is not at the edge of the
+     *         searched area
+     */
+    bool searchPredicted (const GrayPyramid& previous, const GrayPyramid& currentGray, const Vector2& predicted, int& bestError) {
+        int width = currentGray.getWidth(0);
+        int height = currentGray.getHeight(0);
+        if (!std::isfinite(predicted[0]) || !std::isfinite(predicted[1])) {
+            return false;
+        }
+        int px = x + (int) floor(predicted[0] + 0.5);
+        int py = y + (int) floor(predicted[1] + 0.5);
+        if (px < sampleRadius || py < sampleRadius || px + sampleRadius > width || py + sampleRadius > height) {
+            return false;
+        }
+
+        samplePatch (previous, 0);
+        cx = px;
+        cy = py;
+        bestError = search (currentGray, 0, PREDICTION_RADIUS, INT_MAX);
+        int size = sampleRadius * 2;
+        return bestError <= PREDICTION_MAX_ERROR * size * size &&
+               abs(cx - px) < PREDICTION_RADIUS && abs(cy - py) < PREDICTION_RADIUS;
+    }
+
+    /**
+     * Finds where the patch around the origin in the previous frame has
+     * moved to in the current frame. The whole search radius is searched at
+     * the coarsest level of the pyramids, and the match is then refined at
+     * each finer level, so the cost grows with the number of levels rather
+     * than with the square of the search radius.
+     *
+     * @param predicted the predicted motion of the track point, or NULL. The
+     *                  area around it is searched first, and the search
+     *                  radius only if no good match was found there.
+     */
+    void update (const GrayPyramid& previous, const GrayPyramid& currentGray, const Vector2* predicted) {
+        active = true;
+
+        int bestError = 0;
+        if (predicted == NULL || !searchPredicted (previous, currentGray, *predicted, bestError)) {
+            int levels = std::min(GrayPyramid::levelsFor(sampleRadius, searchRadius), std::min(previous.getLevels(), currentGray.getLevels()));
+            int limit = searchRadius - 1;
+            cx = x >> (levels - 1);
+            cy = y >> (levels - 1);
+            for (int level = levels - 1; level >= 0; --level) {
+                samplePatch (previous, level);
+                int radius = level == levels - 1 ? limit >> level : PYRAMID_REFINE_RADIUS;
+                bestError = search (currentGray, level, radius, limit >> level);
+                if (level > 0) {
+                    cx *= 2;
+                    cy *= 2;
+                }
+            }
+        }
+        cerr = bestError;
+
+        subx = 0;
+        suby = 0;
+        if (fitSubpixels && subpixels > 1) {
+            fitSubpixel (currentGray, bestError);
+            return;
+        }
+        for (int radius = 1; radius <= subpixels / 2; ++radius) {
+            for (int my = -radius; my < radius; ++my) {
+                for (int mx = -radius; mx < radius; ++mx) {
+                    if (my == (- radius) || my == (radius - 1) || mx == (- radius) || mx == (radius - 1)) {
+                        int error = matchSubpixel (currentGray, cx - sampleRadius, cy - sampleRadius, mx * subpixelFactor, my * subpixelFactor, bestError);
+                        if (bestError < 0 || error < bestError) {
+                            bestError = error;
+                            subx = mx * subpixelFactor;
+                            suby = my * subpixelFactor;
+                            cerr = bestError;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void markOrigin (Graphics& g) {
+        g.drawRect(x - sampleRadius, y - sampleRadius, 2 * sampleRadius, 2 * sampleRadius, 0xffffff00, 0xff0000ff);
+        g.drawRect(x - sampleRadius + 1, y - sampleRadius + 1, 2 * sampleRadius - 2, 2 * sampleRadius - 2, 0xffffff00, 0xff0000ff);
+        g.drawRect(x - sampleRadius - searchRadius, y - sampleRadius - searchRadius,
+                   2 * searchRadius + 2 * sampleRadius, 2 * searchRadius + 2 * sampleRadius, 0xffff0000, 0xff00ffff);
+    }
+
+    void markOriginTransformed (Graphics& g) {
+        g.fillRect(x - sampleRadius, y - sampleRadius, 2 * sampleRadius, 2 * sampleRadius, 0xff00ffff, 0xffff0000);
+    }
+
+    void markCurrent (Graphics& g) {
+        if (active) {
+            g.fillRect(cx - sampleRadius, cy - sampleRadius, 2 * sampleRadius, 2 * sampleRadius, 0xffff00ff, 0xff00aa00);
+            if (subpixels > 1) {
+                g.fillRect(cx + subx * sampleRadius - 2, cy + suby * sampleRadius - 2, 4, 4, 0xffffff00, 0xff0000ff);
+            }
+        }
+    }
+
+    void getMotion (Vector2& motion) {
+        motion[0] = cx - x + subx;
+        motion[1] = cy - y + suby;
+    }
+
+    int getError () {
+        return cerr;
+    }
+
+    void setActive (bool active) {
+        this->active = active;
+    }
+
+  private:
+    int x;
+    int y;
+    int cx;
+    int cy;
+    double subx;
+    double suby;
+    int subpixels;
+    double subpixelFactor;
+    bool fitSubpixels;
+    int cerr;
+    int sampleRadius;
+    int searchRadius;
+    short* sampleBuffer;
+    bool active;
+};
+
+class TrackPointMatrix {
+  public:
+    TrackPointMatrix (int x, int y, int numh, int numv, int offset, int sampleRadius, int searchRadius, int subpixels, bool fitSubpixels) {
+        this->x = x;
+        this->y = y;
+        this->sampleRadius = sampleRadius;
+        this->searchRadius = searchRadius;
+        this->subpixels = subpixels;
+        this->hasPrediction = false;
+
+        int x0 = x - (offset * numh / 2) + offset / 2;
+        int y0 = y - (offset * numv / 2) + offset / 2;
+        for (int tpy = 0; tpy < numv; ++tpy) {
+            for (int tpx = 0; tpx < numh; ++tpx) {
+                trackPoints.push_back (TrackPoint (x0 + tpx * offset, y0 + tpy * offset, sampleRadius, searchRadius, subpixels, fitSubpixels));
+                errors.push_back (0);
+            }
+        }
+    }
+
+    ~TrackPointMatrix() {
+    }
+
+    /**
+     * Hands each track point its part of buffer, and returns the first
+     * short after the parts.
+     */
+    short* setSampleBuffers (short* buffer) {
+        for (TrackPoint& tp : trackPoints) {
+            tp.setSampleBuffer (buffer);
+            buffer += tp.getSampleBufferSize ();
+        }
+        return buffer;
+    }
+
+    /**
+     * Returns the size, in shorts, of the buffer that setSampleBuffers needs.
+     */
+    int getSampleBufferSize () const {
+        int size = 0;
+        for (const TrackPoint& tp : trackPoints) {
+            size += tp.getSampleBufferSize ();
+        }
+        return size;
+    }
+
+    /**
+     * Moves the track points back to their origins, and forgets the motion.
+     */
+    void reset () {
+        for (TrackPoint& tp : trackPoints) {
+            tp.reset ();
+        }
+        hasPrediction = false;
+    }
+
+    int size () const {
+        return (int) trackPoints.size();
+    }
+
+    TrackPoint& operator[] (int i) {
+        return trackPoints[i];
+    }
+
+    /**
+     * Returns the motion that the track points are predicted to have, or
+     * NULL. Camera motion changes little from one frame to the next, so this
+     * is the motion that getMotion last returned.
+     */
+    const Vector2* getPrediction () const {
+        return hasPrediction ? &predictedMotion : NULL;
+    }
+
+    /**
+     * Scales the predicted motion, for when the next frame is further from
+     * the current one than the current one is from the one before.
+     */
+    void scalePrediction (double factor) {
+        predictedMotion[0] *= factor;
+        predictedMotion[1] *= factor;
+    }
+
+    void markOrigin (Graphics& g) {
+        for (TrackPoint& tp : trackPoints) {
+            tp.markOrigin (g);
+        }
+    }
+
+    void markOriginTransformed (Graphics& g) {
+        for (TrackPoint& tp : trackPoints) {
+            tp.markOriginTransformed (g);
+        }
+    }
+
+    void markCurrent (Graphics& g) {
+        for (TrackPoint& tp : trackPoints) {
+            tp.markCurrent (g);
+        }
+    }
+
+    void getMotion (Vector2& motion) {
+        Vector2 acc;
+        acc.zero ();
+        Vector2 tpm;
+        int totalWeights = 0;
+        int maxError = sampleRadius * sampleRadius * 3 * 255;
+        int avgError = 0;
+        for (int i = 0; i < trackPoints.size(); ++i) {
+            int err = trackPoints[i].getError();
+            errors[i] = err;
+            avgError += err;
+        }
+        avgError /= (int) trackPoints.size();
+        std::sort(errors.begin(), errors.end());
+        int maxAllowedError = errors[errors.size() * 2 / 3];
+        for (TrackPoint& tp : trackPoints) {
+            tp.getMotion (tpm);
+            if (tp.getError() <= maxAllowedError) {
+                int weight = maxError - tp.getError ();
+                acc[0] += tpm[0] * weight;
+                acc[1] += tpm[1] * weight;
+                totalWeights += weight;
+                tp.setActive (true);
+            } else {
+                tp.setActive (false);
+            }
+        }
+        acc[0] /= totalWeights;
+        acc[1] /= totalWeights;
+        motion[0] = acc[0];
+        motion[1] = acc[1];
+        predictedMotion[0] = motion[0];
+        predictedMotion[1] = motion[1];
+        hasPrediction = true;
+    }
+
+  private:
+    int x;
+    int y;
+    int sampleRadius;
+    int searchRadius;
+    int subpixels;
+    std::vector<TrackPoint> trackPoints;
+    std::vector<int> errors;
+    bool hasPrediction;
+    Vector2 predictedMotion;
+};
+
+/**
+ * The track points of the analysis, the two latest tracked frames, and the
+ * latest frame that was not tracked, in gray. It is kept from frame to
+ * frame, and allocates no memory once each of the three frames has been
+ * filled: the patches of all track points share one buffer, and the memory
+ * of a frame that is no longer needed is reused for the next one.
+ */
+class Tracker {
+  public:
+    /**
+     * @param gridSize the number of track points on each side of the ahead,
+     *                 left and right matrices, and the number of track
+     *                 points in each of the two backwards-facing columns
+     */
+    Tracker (int width, int height, int sampleRadius, int searchRadius, int offset, int gridSize, int subpixels, bool fitSubpixels) :
+        ahead (        width / 2, height / 2, gridSize, gridSize, offset, sampleRadius, searchRadius, subpixels, fitSubpixels),
+        left  (        width / 4, height / 2, gridSize, gridSize, offset, sampleRadius, searchRadius, subpixels, fitSubpixels),
+        right (width - width / 4, height / 2, gridSize, gridSize, offset, sampleRadius, searchRadius, subpixels, fitSubpixels),
+        backL (          backPosition(offset, sampleRadius, searchRadius), height / 2, 1, gridSize, offset, sampleRadius, searchRadius, subpixels, fitSubpixels),
+        backR (  width - backPosition(offset, sampleRadius, searchRadius), height / 2, 1, gridSize, offset, sampleRadius, searchRadius, subpixels, fitSubpixels) {
+        this->width = width;
+        this->height = height;
+        this->sampleRadius = sampleRadius;
+        this->searchRadius = searchRadius;
+        this->offset = offset;
+        this->gridSize = gridSize;
+        this->subpixels = subpixels;
+        this->fitSubpixels = fitSubpixels;
+
+        samples.resize(ahead.getSampleBufferSize() + left.getSampleBufferSize() + right.getSampleBufferSize() +
+                       backL.getSampleBufferSize() + backR.getSampleBufferSize());
+        short* buffer = samples.data();
+        buffer = ahead.setSampleBuffers (buffer);
+        buffer = left.setSampleBuffers (buffer);
+        buffer = right.setSampleBuffers (buffer);
+        buffer = backL.setSampleBuffers (buffer);
+        backR.setSampleBuffers (buffer);
+
+        // The backwards-facing track points go last, so that they can be
+        // left out by only running the first tasks.
+        TrackPointMatrix* matrices[5] = { &ahead, &left, &right, &backL, &backR };
+        for (TrackPointMatrix* matrix : matrices) {
+            if (matrix == &backL) {
+                numForwardTasks = (int) tasks.size();
+            }
+            for (int i = 0; i < matrix->size(); ++i) {
+                tasks.push_back(Task(&(*matrix)[i], matrix));
+            }
+        }
+
+        clear ();
+    }
+
+    /**
+     * True if the tracker was created with these parameters.
+     */
+    bool hasSettings (int sampleRadius, int searchRadius, int offset, int gridSize, int subpixels, bool fitSubpixels) const {
+        return this->sampleRadius == sampleRadius && this->searchRadius == searchRadius && this->offset == offset &&
+               this->gridSize == gridSize && this->subpixels == subpixels && this->fitSubpixels == fitSubpixels;
+    }
+
+    /**
+     * Forgets the frames and the motion, and moves the track points back to
+     * their origins.
+     */
+    void clear () {
+        hasCurrent = false;
+        hasPrevious = false;
+        ahead.reset ();
+        left.reset ();
+        right.reset ();
+        backL.reset ();
+        backR.reset ();
+    }
+
+    /**
+     * Makes the frame the current one, and the current one the previous.
+     */
+    void nextFrame (const uint32_t* frame) {
+        std::swap(previous, current);
+        current.update (frame, width, height, GrayPyramid::levelsFor(sampleRadius, searchRadius));
+        hasPrevious = hasCurrent;
+        hasCurrent = true;
+    }
+
+    /**
+     * Keeps the frame, in gray, so that it can be made the current one with
+     * nextPendingFrame. Only level 0 of it is built, as most pending frames
+     * are replaced by the next one without being tracked.
+     */
+    void setPendingFrame (const uint32_t* frame) {
+        pending.updateBase (frame, width, height);
+    }
+
+    /**
+     * Makes the frame that was last passed to setPendingFrame the current
+     * one, and the current one the previous.
+     */
+    void nextPendingFrame () {
+        std::swap(previous, current);
+        std::swap(current, pending);
+        current.updateLevels (GrayPyramid::levelsFor(sampleRadius, searchRadius));
+        hasPrevious = hasCurrent;
+        hasCurrent = true;
+    }
+
+    int getSearchRadius () const {
+        return searchRadius;
+    }
+
+    /**
+     * Scales the predicted motion of all track points.
+     */
+    void scalePrediction (double factor) {
+        ahead.scalePrediction (factor);
+        left.scalePrediction (factor);
+        right.scalePrediction (factor);
+        backL.scalePrediction (factor);
+        backR.scalePrediction (factor);
+    }
+
+    /**
+     * True if there is a previous frame to track from.
+     */
+    bool canTrack () const {
+        return hasPrevious;
+    }
+
+    /**
+     * Tracks the points from the previous frame to the current one. All
+     * track points are handed out to the ThreadPool as one
+     * batch, one at a time, so a point that takes long to find does not hold
+     * up the points of the other matrices.
+     */
+    void track (bool useBackTrackpoints) {
+        int numTasks = useBackTrackpoints ? (int) tasks.size() : numForwardTasks;
+        ThreadPool::instance().parallelFor(numTasks, [&](int i) {
+            const Task& task = tasks[i];
+            task.trackPoint->update (previous, current, task.matrix->getPrediction());
+        });
+    }
+
+    void markOrigin (Graphics& g, bool useBackTrackpoints) {
+        ahead.markOrigin (g);
+        left.markOrigin (g);
+        right.markOrigin (g);
+        if (useBackTrackpoints) {
+            backL.markOrigin (g);
+            backR.markOrigin (g);
+        }
+    }
+
+    void markCurrent (Graphics& g, bool useBackTrackpoints) {
+        ahead.markCurrent (g);
+        left.markCurrent (g);
+        right.markCurrent (g);
+        if (useBackTrackpoints) {
+            backL.markCurrent (g);
+            backR.markCurrent (g);
+        }
+    }
+
+    void markOriginTransformed (Graphics& g, bool useBackTrackpoints) {
+        ahead.markOriginTransformed (g);
+        left.markOriginTransformed (g);
+        right.markOriginTransformed (g);
+        if (useBackTrackpoints) {
+            backL.markOriginTransformed (g);
+            backR.markOriginTransformed (g);
+        }
+    }
+
+    TrackPointMatrix ahead;
+    TrackPointMatrix left;
+    TrackPointMatrix right;
+    TrackPointMatrix backL;
+    TrackPointMatrix backR;
+
+  private:
+    /**
+     * A track point, and the matrix it is in.
+     */
+    class Task {
+      public:
+        Task (TrackPoint* trackPoint, const TrackPointMatrix* matrix) : trackPoint(trackPoint), matrix(matrix) {
+        }
+
+        TrackPoint* trackPoint;
+        const TrackPointMatrix* matrix;
+    };
+
+    /**
+     * The distance of the backwards-facing track points from the edges of
+     * the frame, so that their search areas stay inside it.
+     */
+    static int backPosition (int offset, int sampleRadius, int searchRadius) {
+        int backPos = offset;
+        if (backPos < searchRadius + sampleRadius) {
+            backPos = searchRadius + sampleRadius;
+        }
+        return backPos;
+    }
+
+    int width;
+    int height;
+    int sampleRadius;
+    int searchRadius;
+    int offset;
+    int gridSize;
+    int subpixels;
+    bool fitSubpixels;
+
+    std::vector<short> samples;
+    std::vector<Task> tasks;
+    int numForwardTasks;
+
+    GrayPyramid previous;
+    GrayPyramid current;
+    GrayPyramid pending;
+    bool hasPrevious;
+    bool hasCurrent;
+};
+
+#endif
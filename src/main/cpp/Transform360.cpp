@@ -3,10 +3,14 @@
 #include <climits>
 #include <cmath>
 #include <mutex>
+#include <memory>
 #include "frei0r.hpp"
 #include "Matrix.hpp"
 #include "MPFilter.hpp"
+#include "BackgroundMap.hpp"
 #include "ImageProcessing.hpp"
+#include "MapCache.hpp"
+#include "MapStrategy.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
 #include "Version.hpp"
@@ -15,7 +19,7 @@
 #define INTERP_NONE 0
 
 
-class Transform360 : public Frei0rFilter, MPFilter {
+class Transform360 : public Frei0rFilter {
 
   public:
     Frei0rParameter<double,double> yaw;
@@ -23,24 +27,28 @@ class Transform360 : public Frei0rFilter, MPFilter {
     Frei0rParameter<double,double> roll;
     Frei0rParameter<int,double> interpolation;
     bool grid;
-    bool updateMap;
-    float* map;
-
-    int mapHits;
 
     std::mutex lock;
     Transform360Support t360;
 
+    /**
+     * Decides between the map and rendering directly.
+     */
+    MapStrategy strategy;
+
+    /**
+     * The maps, built without yaw. Frames in flight hold their own
+     * reference, so the map can be replaced while they are still reading
+     * from it.
+     */
+    BackgroundMap maps;
+
     Transform360(unsigned int width, unsigned int height) : Frei0rFilter(width, height), t360(width, height) {
         yaw = 0.0;
         pitch = 0.0;
         roll = 0.0;
         grid = false;
 
-        map = NULL;
-
-        mapHits = 24;
-
         interpolation = Interpolation::BILINEAR;
 
         register_fparam(yaw, "yaw", "");
@@ -51,39 +59,87 @@ class Transform360 : public Frei0rFilter, MPFilter {
     }
 
     ~Transform360() {
-        if (map != NULL) {
-            free(map);
-        }
+    }
+
+    MapKey mapKey(double pitch, double roll) {
+        return MapKey("bigsh0t_transform_360", width, height).add(pitch).add(roll);
     }
 
     virtual void update(double time,
                         uint32_t* out,
                         const uint32_t* in) {
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
-
-        if (map == NULL || yaw.changed() || pitch.changed() || roll.changed()) {
-            if (map == NULL) {
-                map = (float*) malloc (2 * width * height * sizeof(float));
-            }
-            updateMap = true;
-            --mapHits;
-            if (mapHits < 0) {
-                mapHits = 0;
+        double frameYaw;
+        double framePitch;
+        double frameRoll;
+        int frameInterpolation;
+        bool frameGrid;
+
+        std::shared_ptr<Map360Entry> frameMap;
+        bool buildMap = false;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Take a snapshot of the
+            // parameters and the map under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            frameYaw = yaw.read();
+            framePitch = pitch.read();
+            frameRoll = roll.read();
+            frameInterpolation = interpolation.read();
+            frameGrid = grid;
+
+            // Yaw is applied as an offset, so only pitch and roll need
+            // a map, and a rotation that only has a yaw needs none. Frames
+            // too large for a map are always rendered directly.
+            bool yawOnly = framePitch == 0.0 && frameRoll == 0.0;
+            if (!yawOnly && canMap360(width, height)) {
+                strategy.next(mapKey(framePitch, frameRoll));
+                std::shared_ptr<Map360Entry> map = maps.get<Map360Entry>(mapKey(framePitch, frameRoll));
+                if (map && strategy.useMap()) {
+                    frameMap = map;
+                } else if (!map && strategy.buildMap()) {
+                    buildMap = true;
+                    if (BackgroundMap::useStaleMaps()) {
+                        frameMap = maps.latest<Map360Entry>();
+                    }
+                }
             }
-        } else {
-            ++mapHits;
-            if (mapHits > 32) {
-                mapHits = 32;
+        }
+
+        if (buildMap) {
+            maps.build(mapKey(framePitch, frameRoll), [this, framePitch, frameRoll](const std::atomic<bool>& cancelled) {
+                MapStrategy::Timer timer;
+                std::shared_ptr<Map360Entry> map((Map360Entry*) malloc (width * height * sizeof(Map360Entry)), free);
+                RotatedColumns columns(t360, width, 0.0, framePitch, frameRoll);
+                bool complete = BackgroundMap::forEachChunk(height, cancelled, [&](int start, int num) {
+                    transform_360_map(columns, map.get(), width, height, start, num);
+                });
+                if (!complete) {
+                    return std::shared_ptr<Map360Entry>();
+                }
+                strategy.addBuildTime(timer.seconds());
+                return map;
+            }, width * height * sizeof(Map360Entry));
+
+            // Without worker threads the map has been built already
+            std::shared_ptr<Map360Entry> built = maps.get<Map360Entry>(mapKey(framePitch, frameRoll));
+            if (built) {
+                frameMap = built;
             }
-            updateMap = false;
-            if (mapHits == 17) {
-                updateMap = true;
+        }
+
+        MapStrategy::Timer timer;
+        Transform360Frame frame(t360, width, height, frameYaw, framePitch, frameRoll, frameMap.get(), false, frameInterpolation);
+        MPFilter::updateMP(&frame, time, out, in, width, height);
+        if ((framePitch != 0.0 || frameRoll != 0.0) && canMap360(width, height)) {
+            if (!frameMap) {
+                strategy.addDirectTime(timer.seconds());
+            } else if (!buildMap) {
+                strategy.addMapTime(timer.seconds());
             }
         }
-        MPFilter::updateMP(this, time, out, in, width, height);
-        if (grid) {
+
+        if (frameGrid) {
             {
                 unsigned int x = width / 2;
                 unsigned int x2 = x / 2;
@@ -102,19 +158,6 @@ class Transform360 : public Frei0rFilter, MPFilter {
             }
         }
     }
-
-    virtual void updateLines(double time,
-                             uint32_t* out,
-                             const uint32_t* in, int start, int num) {
-        if (mapHits > 16) {
-            if (updateMap) {
-                transform_360_map(t360, map, width, height, start, num, yaw, pitch, roll);
-            }
-            apply_360_map (out, (uint32_t*) in, map, width, height, start, num, interpolation);
-        } else {
-            transform_360(t360, out, (uint32_t*) in, width, height, start, num, yaw, pitch, roll, interpolation);
-        }
-    }
 };
 
 frei0r::construct<Transform360> plugin("bigsh0t_transform_360",
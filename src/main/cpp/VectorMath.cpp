@@ -0,0 +1,280 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <cmath>
+#include <inttypes.h>
+
+#include "sse_compat.hpp"
+#include "CPUFeatures.hpp"
+#include "VectorMath.hpp"
+#include "VectorMathAVX2.hpp"
+#include "VectorMathKernels.hpp"
+
+namespace {
+
+template<typename Scalar>
+class ScalarTraits {
+  public:
+    typedef Scalar S;
+    typedef Scalar V;
+    typedef bool M;
+    static const int N = 1;
+
+    static V load(const S* p) {
+        return *p;
+    }
+    static void store(S* p, V v) {
+        *p = v;
+    }
+    static V set1(S v) {
+        return v;
+    }
+    static V add(V a, V b) {
+        return a + b;
+    }
+    static V sub(V a, V b) {
+        return a - b;
+    }
+    static V mul(V a, V b) {
+        return a * b;
+    }
+    static V div(V a, V b) {
+        return a / b;
+    }
+    static V sqrt(V a) {
+        return std::sqrt(a);
+    }
+    static V abs(V a) {
+        return std::abs(a);
+    }
+    static V neg(V a) {
+        return -a;
+    }
+    static V min(V a, V b) {
+        return b < a ? b : a;
+    }
+    static V max(V a, V b) {
+        return a < b ? b : a;
+    }
+    static M lt(V a, V b) {
+        return a < b;
+    }
+    static M gt(V a, V b) {
+        return a > b;
+    }
+    static M eq(V a, V b) {
+        return a == b;
+    }
+    static M andMask(M a, M b) {
+        return a && b;
+    }
+    static M orMask(M a, M b) {
+        return a || b;
+    }
+    static V select(M m, V a, V b) {
+        return m ? a : b;
+    }
+};
+
+#ifdef USE_SSE
+class SSE2Double {
+  public:
+    typedef double S;
+    typedef __m128d V;
+    typedef __m128d M;
+    static const int N = 2;
+
+    static V load(const S* p) {
+        return _mm_loadu_pd(p);
+    }
+    static void store(S* p, V v) {
+        _mm_storeu_pd(p, v);
+    }
+    static V set1(S v) {
+        return _mm_set1_pd(v);
+    }
+    static V add(V a, V b) {
+        return _mm_add_pd(a, b);
+    }
+    static V sub(V a, V b) {
+        return _mm_sub_pd(a, b);
+    }
+    static V mul(V a, V b) {
+        return _mm_mul_pd(a, b);
+    }
+    static V div(V a, V b) {
+        return _mm_div_pd(a, b);
+    }
+    static V sqrt(V a) {
+        return _mm_sqrt_pd(a);
+    }
+    static V abs(V a) {
+        return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+    }
+    static V neg(V a) {
+        return _mm_xor_pd(_mm_set1_pd(-0.0), a);
+    }
+    static V min(V a, V b) {
+        return _mm_min_pd(a, b);
+    }
+    static V max(V a, V b) {
+        return _mm_max_pd(a, b);
+    }
+    static M lt(V a, V b) {
+        return _mm_cmplt_pd(a, b);
+    }
+    static M gt(V a, V b) {
+        return _mm_cmpgt_pd(a, b);
+    }
+    static M eq(V a, V b) {
+        return _mm_cmpeq_pd(a, b);
+    }
+    static M andMask(M a, M b) {
+        return _mm_and_pd(a, b);
+    }
+    static M orMask(M a, M b) {
+        return _mm_or_pd(a, b);
+    }
+    static V select(M m, V a, V b) {
+        return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+    }
+};
+
+class SSE2Float {
+  public:
+    typedef float S;
+    typedef __m128 V;
+    typedef __m128 M;
+    static const int N = 4;
+
+    static V load(const S* p) {
+        return _mm_loadu_ps(p);
+    }
+    static void store(S* p, V v) {
+        _mm_storeu_ps(p, v);
+    }
+    static V set1(S v) {
+        return _mm_set1_ps(v);
+    }
+    static V add(V a, V b) {
+        return _mm_add_ps(a, b);
+    }
+    static V sub(V a, V b) {
+        return _mm_sub_ps(a, b);
+    }
+    static V mul(V a, V b) {
+        return _mm_mul_ps(a, b);
+    }
+    static V div(V a, V b) {
+        return _mm_div_ps(a, b);
+    }
+    static V sqrt(V a) {
+        return _mm_sqrt_ps(a);
+    }
+    static V abs(V a) {
+        return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+    }
+    static V neg(V a) {
+        return _mm_xor_ps(_mm_set1_ps(-0.0f), a);
+    }
+    static V min(V a, V b) {
+        return _mm_min_ps(a, b);
+    }
+    static V max(V a, V b) {
+        return _mm_max_ps(a, b);
+    }
+    static M lt(V a, V b) {
+        return _mm_cmplt_ps(a, b);
+    }
+    static M gt(V a, V b) {
+        return _mm_cmpgt_ps(a, b);
+    }
+    static M eq(V a, V b) {
+        return _mm_cmpeq_ps(a, b);
+    }
+    static M andMask(M a, M b) {
+        return _mm_and_ps(a, b);
+    }
+    static M orMask(M a, M b) {
+        return _mm_or_ps(a, b);
+    }
+    static V select(M m, V a, V b) {
+        return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+    }
+};
+#endif
+
+typedef ScalarTraits<double> ScalarDouble;
+typedef ScalarTraits<float> ScalarFloat;
+
+}
+
+static const VectorMathTable& selectVectorMathTable() {
+    CPULevel level = cpuLevel();
+#ifdef USE_AVX512
+    if (level >= CPU_AVX512) {
+        return vectorMathAVX512();
+    }
+#endif
+#ifdef USE_AVX2
+    if (level >= CPU_AVX2) {
+        return vectorMathAVX2();
+    }
+#endif
+#ifdef USE_SSE
+    // SSE4.1 adds nothing that these kernels use
+    if (level >= CPU_SSE2) {
+        static const VectorMathTable sse2 = makeVectorMathTable<SSE2Double, SSE2Float>();
+        return sse2;
+    }
+#endif
+    static const VectorMathTable scalar = makeVectorMathTable<ScalarDouble, ScalarFloat>();
+    return scalar;
+}
+
+/**
+ * The kernels for this CPU. Elements left over at the end of the arrays are
+ * done by the scalar kernels.
+ */
+static const VectorMathTable& vectorMath() {
+    static const VectorMathTable& table = selectVectorMathTable();
+    return table;
+}
+
+void batchAtan2(const double* y, const double* x, double* out, int n) {
+    int done = vectorMath().atan2d(y, x, out, n);
+    atan2Loop<ScalarDouble>(y + done, x + done, out + done, n - done);
+}
+
+void batchAtan2(const float* y, const float* x, float* out, int n) {
+    int done = vectorMath().atan2f(y, x, out, n);
+    atan2Loop<ScalarFloat>(y + done, x + done, out + done, n - done);
+}
+
+void batchSinCos(const double* a, double* s, double* c, int n) {
+    int done = vectorMath().sinCosd(a, s, c, n);
+    sinCosLoop<ScalarDouble>(a + done, s + done, c + done, n - done);
+}
+
+void batchSinCos(const float* a, float* s, float* c, int n) {
+    int done = vectorMath().sinCosf(a, s, c, n);
+    sinCosLoop<ScalarFloat>(a + done, s + done, c + done, n - done);
+}
+
+void batchSqrt(const double* a, double* out, int n) {
+    int done = vectorMath().sqrtd(a, out, n);
+    sqrtLoop<ScalarDouble>(a + done, out + done, n - done);
+}
+
+void batchSqrt(const float* a, float* out, int n) {
+    int done = vectorMath().sqrtf(a, out, n);
+    sqrtLoop<ScalarFloat>(a + done, out + done, n - done);
+}
+
+void batchNormalize(double* x, double* y, double* z, int n) {
+    int done = vectorMath().normalized(x, y, z, n);
+    normalizeLoop<ScalarDouble>(x + done, y + done, z + done, n - done);
+}
+
+void batchNormalize(float* x, float* y, float* z, int n) {
+    int done = vectorMath().normalizef(x, y, z, n);
+    normalizeLoop<ScalarFloat>(x + done, y + done, z + done, n - done);
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef VectorMath_HPP
+#define VectorMath_HPP
+
+/*
+ * Batch versions of the math functions that the map builders call for every
+ * pixel. Each function works on n elements at a time, using AVX-512, AVX2 or
+ * SSE2 when the CPU has them, and gives the same result whichever is used.
+ * The arrays must not overlap, except where noted.
+ *
+ * Error bounds are given against the resolution of a map, 1/128 of a pixel.
+ * On an equirectangular image w pixels wide, an angle error of e radians moves
+ * the source point by e * w / (2 * pi) pixels, so 1/128 pixel is about
+ * 4.9e-2 / w radians: 1.2e-5 at 4096 pixels, and 1.5e-6 at 32768.
+ */
+
+/**
+ * atan2(y, x), the same polynomial as fastAtan2. The double version returns
+ * exactly what fastAtan2 does, and is off by at most 2.3e-7 radians. The
+ * float version is off by at most 6e-7 radians, most of which is the rounding
+ * of the result.
+ */
+void batchAtan2(const double* y, const double* x, double* out, int n);
+void batchAtan2(const float* y, const float* x, float* out, int n);
+
+/**
+ * Sine and cosine. The double version is off by at most 1e-15 for
+ * |a| < 1e5. The float version is off by at most 2e-7 for |a| < 4096, good
+ * for equirectangular images up to 200000 pixels wide.
+ */
+void batchSinCos(const double* a, double* s, double* c, int n);
+void batchSinCos(const float* a, float* s, float* c, int n);
+
+/**
+ * Square root, correctly rounded. out may be the same array as a.
+ */
+void batchSqrt(const double* a, double* out, int n);
+void batchSqrt(const float* a, float* out, int n);
+
+/**
+ * Normalizes the vectors (x[i], y[i], z[i]) in place, with the same result as
+ * Matrix::normalize. Zero vectors become NaN.
+ */
+void batchNormalize(double* x, double* y, double* z, int n);
+void batchNormalize(float* x, float* y, float* z, int n);
+
+#endif
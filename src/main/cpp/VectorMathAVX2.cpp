@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "VectorMathAVX2.hpp"
+
+#ifdef USE_AVX2
+
+#include <immintrin.h>
+#include "VectorMathKernels.hpp"
+
+/*
+ * This file is compiled with AVX2 enabled. See ImageProcessingAVX2.hpp for
+ * why it must not include headers that define inline functions.
+ */
+
+namespace {
+
+class AVX2Double {
+  public:
+    typedef double S;
+    typedef __m256d V;
+    typedef __m256d M;
+    static const int N = 4;
+
+    static V load(const S* p) {
+        return _mm256_loadu_pd(p);
+    }
+    static void store(S* p, V v) {
+        _mm256_storeu_pd(p, v);
+    }
+    static V set1(S v) {
+        return _mm256_set1_pd(v);
+    }
+    static V add(V a, V b) {
+        return _mm256_add_pd(a, b);
+    }
+    static V sub(V a, V b) {
+        return _mm256_sub_pd(a, b);
+    }
+    static V mul(V a, V b) {
+        return _mm256_mul_pd(a, b);
+    }
+    static V div(V a, V b) {
+        return _mm256_div_pd(a, b);
+    }
+    static V sqrt(V a) {
+        return _mm256_sqrt_pd(a);
+    }
+    static V abs(V a) {
+        return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+    }
+    static V neg(V a) {
+        return _mm256_xor_pd(_mm256_set1_pd(-0.0), a);
+    }
+    static V min(V a, V b) {
+        return _mm256_min_pd(a, b);
+    }
+    static V max(V a, V b) {
+        return _mm256_max_pd(a, b);
+    }
+    static M lt(V a, V b) {
+        return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+    }
+    static M gt(V a, V b) {
+        return _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+    }
+    static M eq(V a, V b) {
+        return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);
+    }
+    static M andMask(M a, M b) {
+        return _mm256_and_pd(a, b);
+    }
+    static M orMask(M a, M b) {
+        return _mm256_or_pd(a, b);
+    }
+    static V select(M m, V a, V b) {
+        return _mm256_blendv_pd(b, a, m);
+    }
+};
+
+class AVX2Float {
+  public:
+    typedef float S;
+    typedef __m256 V;
+    typedef __m256 M;
+    static const int N = 8;
+
+    static V load(const S* p) {
+        return _mm256_loadu_ps(p);
+    }
+    static void store(S* p, V v) {
+        _mm256_storeu_ps(p, v);
+    }
+    static V set1(S v) {
+        return _mm256_set1_ps(v);
+    }
+    static V add(V a, V b) {
+        return _mm256_add_ps(a, b);
+    }
+    static V sub(V a, V b) {
+        return _mm256_sub_ps(a, b);
+    }
+    static V mul(V a, V b) {
+        return _mm256_mul_ps(a, b);
+    }
+    static V div(V a, V b) {
+        return _mm256_div_ps(a, b);
+    }
+    static V sqrt(V a) {
+        return _mm256_sqrt_ps(a);
+    }
+    static V abs(V a) {
+        return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+    }
+    static V neg(V a) {
+        return _mm256_xor_ps(_mm256_set1_ps(-0.0f), a);
+    }
+    static V min(V a, V b) {
+        return _mm256_min_ps(a, b);
+    }
+    static V max(V a, V b) {
+        return _mm256_max_ps(a, b);
+    }
+    static M lt(V a, V b) {
+        return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+    }
+    static M gt(V a, V b) {
+        return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+    }
+    static M eq(V a, V b) {
+        return _mm256_cmp_ps(a, b, _CMP_EQ_OQ);
+    }
+    static M andMask(M a, M b) {
+        return _mm256_and_ps(a, b);
+    }
+    static M orMask(M a, M b) {
+        return _mm256_or_ps(a, b);
+    }
+    static V select(M m, V a, V b) {
+        return _mm256_blendv_ps(b, a, m);
+    }
+};
+
+}
+
+const VectorMathTable& vectorMathAVX2() {
+    static const VectorMathTable table = makeVectorMathTable<AVX2Double, AVX2Float>();
+    return table;
+}
+
+#endif
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef VectorMathAVX2_HPP
+#define VectorMathAVX2_HPP
+
+/*
+ * The VectorMath kernels for AVX2 and AVX-512. Each lives in a translation
+ * unit of its own that is compiled for that instruction set, so only call
+ * these when cpuLevel() is at least CPU_AVX2 or CPU_AVX512. See
+ * ImageProcessingAVX2.hpp.
+ */
+
+struct VectorMathTable;
+
+#ifdef USE_AVX2
+const VectorMathTable& vectorMathAVX2();
+#endif
+
+#ifdef USE_AVX512
+const VectorMathTable& vectorMathAVX512();
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "VectorMathAVX2.hpp"
+
+#ifdef USE_AVX512
+
+#include <inttypes.h>
+#include <immintrin.h>
+#include "VectorMathKernels.hpp"
+
+/*
+ * This file is compiled with AVX-512 enabled. See ImageProcessingAVX2.hpp
+ * for why it must not include headers that define inline functions.
+ *
+ * Only AVX-512F instructions are used.
+ */
+
+namespace {
+
+class AVX512Double {
+  public:
+    typedef double S;
+    typedef __m512d V;
+    typedef __mmask8 M;
+    static const int N = 8;
+
+    static V load(const S* p) {
+        return _mm512_loadu_pd(p);
+    }
+    static void store(S* p, V v) {
+        _mm512_storeu_pd(p, v);
+    }
+    static V set1(S v) {
+        return _mm512_set1_pd(v);
+    }
+    static V add(V a, V b) {
+        return _mm512_add_pd(a, b);
+    }
+    static V sub(V a, V b) {
+        return _mm512_sub_pd(a, b);
+    }
+    static V mul(V a, V b) {
+        return _mm512_mul_pd(a, b);
+    }
+    static V div(V a, V b) {
+        return _mm512_div_pd(a, b);
+    }
+    static V sqrt(V a) {
+        return _mm512_sqrt_pd(a);
+    }
+    static V abs(V a) {
+        return _mm512_castsi512_pd(_mm512_andnot_si512(_mm512_set1_epi64(INT64_MIN), _mm512_castpd_si512(a)));
+    }
+    static V neg(V a) {
+        return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_set1_epi64(INT64_MIN), _mm512_castpd_si512(a)));
+    }
+    static V min(V a, V b) {
+        return _mm512_min_pd(a, b);
+    }
+    static V max(V a, V b) {
+        return _mm512_max_pd(a, b);
+    }
+    static M lt(V a, V b) {
+        return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+    }
+    static M gt(V a, V b) {
+        return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);
+    }
+    static M eq(V a, V b) {
+        return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ);
+    }
+    static M andMask(M a, M b) {
+        return a & b;
+    }
+    static M orMask(M a, M b) {
+        return a | b;
+    }
+    static V select(M m, V a, V b) {
+        return _mm512_mask_blend_pd(m, b, a);
+    }
+};
+
+class AVX512Float {
+  public:
+    typedef float S;
+    typedef __m512 V;
+    typedef __mmask16 M;
+    static const int N = 16;
+
+    static V load(const S* p) {
+        return _mm512_loadu_ps(p);
+    }
+    static void store(S* p, V v) {
+        _mm512_storeu_ps(p, v);
+    }
+    static V set1(S v) {
+        return _mm512_set1_ps(v);
+    }
+    static V add(V a, V b) {
+        return _mm512_add_ps(a, b);
+    }
+    static V sub(V a, V b) {
+        return _mm512_sub_ps(a, b);
+    }
+    static V mul(V a, V b) {
+        return _mm512_mul_ps(a, b);
+    }
+    static V div(V a, V b) {
+        return _mm512_div_ps(a, b);
+    }
+    static V sqrt(V a) {
+        return _mm512_sqrt_ps(a);
+    }
+    static V abs(V a) {
+        return _mm512_castsi512_ps(_mm512_andnot_si512(_mm512_set1_epi32(INT32_MIN), _mm512_castps_si512(a)));
+    }
+    static V neg(V a) {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_set1_epi32(INT32_MIN), _mm512_castps_si512(a)));
+    }
+    static V min(V a, V b) {
+        return _mm512_min_ps(a, b);
+    }
+    static V max(V a, V b) {
+        return _mm512_max_ps(a, b);
+    }
+    static M lt(V a, V b) {
+        return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+    }
+    static M gt(V a, V b) {
+        return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+    }
+    static M eq(V a, V b) {
+        return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ);
+    }
+    static M andMask(M a, M b) {
+        return a & b;
+    }
+    static M orMask(M a, M b) {
+        return a | b;
+    }
+    static V select(M m, V a, V b) {
+        return _mm512_mask_blend_ps(m, b, a);
+    }
+};
+
+}
+
+const VectorMathTable& vectorMathAVX512() {
+    static const VectorMathTable table = makeVectorMathTable<AVX512Double, AVX512Float>();
+    return table;
+}
+
+#endif
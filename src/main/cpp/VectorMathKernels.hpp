@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef VectorMathKernels_HPP
+#define VectorMathKernels_HPP
+
+/*
+ * The kernels behind VectorMath.hpp. This header is included by one
+ * translation unit per instruction set, each of which defines traits classes
+ * for its vector types and instantiates the kernels with them.
+ *
+ * A traits class T has:
+ *
+ *   typedef ... S;   the scalar type, float or double
+ *   typedef ... V;   a vector of N scalars
+ *   typedef ... M;   a mask from a comparison of two vectors
+ *   static const int N;
+ *
+ * and the static functions load, store, set1, add, sub, mul, div, sqrt, abs,
+ * neg, min, max, lt, gt, eq, andMask, orMask and select(mask, a, b). They must
+ * do exactly what the names say, one IEEE operation each, so that every
+ * instruction set gets the same results as the scalar traits.
+ *
+ * Everything here has internal linkage, so that code compiled for AVX2 or
+ * AVX-512 is never shared with other translation units. See
+ * ImageProcessingAVX2.hpp.
+ */
+
+/**
+ * The kernels of one instruction set. Each function processes a multiple of
+ * the vector width, and returns the number of elements it did.
+ */
+struct VectorMathTable {
+    int (*atan2d)(const double* y, const double* x, double* out, int n);
+    int (*atan2f)(const float* y, const float* x, float* out, int n);
+    int (*sinCosd)(const double* a, double* s, double* c, int n);
+    int (*sinCosf)(const float* a, float* s, float* c, int n);
+    int (*sqrtd)(const double* a, double* out, int n);
+    int (*sqrtf)(const float* a, float* out, int n);
+    int (*normalized)(double* x, double* y, double* z, int n);
+    int (*normalizef)(float* x, float* y, float* z, int n);
+};
+
+namespace {
+
+#define VECTOR_MATH_PI 3.14159265358979323846
+
+/**
+ * Constants that differ between float and double.
+ */
+template<typename S>
+struct VectorMathConstants;
+
+template<>
+struct VectorMathConstants<double> {
+    // 1.5 * 2^52: adding and subtracting it rounds to the nearest integer
+    static double roundingMagic() {
+        return 6755399441055744.0;
+    }
+    static double smallest() {
+        return 2.2250738585072014e-308;
+    }
+};
+
+template<>
+struct VectorMathConstants<float> {
+    // 1.5 * 2^23
+    static float roundingMagic() {
+        return 12582912.0f;
+    }
+    static float smallest() {
+        return 1.17549435e-38f;
+    }
+};
+
+/**
+ * Rounds to the nearest integer, ties to even. Valid for |x| < 2^51 for
+ * double and 2^22 for float.
+ */
+template<class T>
+static inline typename T::V roundNearest(typename T::V x) {
+    typedef typename T::S S;
+    typename T::V magic = T::set1(VectorMathConstants<S>::roundingMagic());
+    return T::sub(T::add(x, magic), magic);
+}
+
+/**
+ * The polynomial approximation of fastAtan2, in the same order of operations.
+ */
+template<class T>
+static inline typename T::V atan2v(typename T::V y, typename T::V x) {
+    typedef typename T::S S;
+    typedef typename T::V V;
+
+    V zero = T::set1((S) 0.0);
+    V abs_x = T::abs(x);
+    V abs_y = T::abs(y);
+    V a = T::div(T::min(abs_x, abs_y), T::max(abs_x, abs_y));
+    V a2 = T::mul(a, a);
+
+    V p = T::set1((S) (-1.0 / 240.0));
+    p = T::add(T::set1((S) (1.0 / 28.0)), T::mul(a, p));
+    p = T::add(T::set1((S) (-27.0 / 208)), T::mul(a, p));
+    p = T::add(T::set1((S) (1.0 / 4.0)), T::mul(a, p));
+    p = T::add(T::set1((S) (-43.0 / 176.0)), T::mul(a, p));
+    p = T::add(T::set1((S) (1.0 / 20.0)), T::mul(a, p));
+    p = T::add(T::set1((S) (5.0 / 48.0)), T::mul(a, p));
+    p = T::add(T::set1((S) (-1.0 / 7.0)), T::mul(a2, p));
+    p = T::add(T::set1((S) (1.0 / 5.0)), T::mul(a2, p));
+    p = T::add(T::set1((S) (-1.0 / 3.0)), T::mul(a2, p));
+    p = T::add(T::set1((S) 1.0), T::mul(a2, p));
+    V r = T::mul(a, p);
+
+    r = T::select(T::gt(abs_y, abs_x), T::sub(T::set1((S) (VECTOR_MATH_PI / 2)), r), r);
+    r = T::select(T::lt(x, zero), T::sub(T::set1((S) VECTOR_MATH_PI), r), r);
+    r = T::select(T::lt(y, zero), T::neg(r), r);
+
+    V smallest = T::set1(VectorMathConstants<S>::smallest());
+    return T::select(T::andMask(T::lt(abs_x, smallest), T::lt(abs_y, smallest)), zero, r);
+}
+
+/**
+ * Reduces x to r in [-pi/4, pi/4], where x = r + k * pi/2.
+ */
+template<class T>
+static inline typename T::V reduceHalfPi(typename T::V x, typename T::V k, double) {
+    // Cody-Waite reduction with pi/2 split in two. The first part has 33
+    // significant bits, so k times it is exact for |k| < 2^20.
+    typename T::V r = T::sub(x, T::mul(k, T::set1(1.57079632673412561417e+00)));
+    return T::sub(r, T::mul(k, T::set1(6.07710050650619224932e-11)));
+}
+
+template<class T>
+static inline typename T::V reduceHalfPi(typename T::V x, typename T::V k, float) {
+    // Three parts, the first two with 12 significant bits: exact for |k| < 2^12.
+    typename T::V r = T::sub(x, T::mul(k, T::set1(1.5703125f)));
+    r = T::sub(r, T::mul(k, T::set1(4.837512969970703e-4f)));
+    return T::sub(r, T::mul(k, T::set1(7.549790126404332e-8f)));
+}
+
+template<class T>
+static inline void sinCosPolynomials(typename T::V r, typename T::V& s, typename T::V& c, double) {
+    typedef typename T::V V;
+    // Minimax coefficients from fdlibm's __kernel_sin and __kernel_cos
+    V z = T::mul(r, r);
+    V ps = T::set1(1.58969099521155010221e-10);
+    ps = T::add(T::set1(-2.50507602534068634195e-08), T::mul(z, ps));
+    ps = T::add(T::set1(2.75573137070700676789e-06), T::mul(z, ps));
+    ps = T::add(T::set1(-1.98412698298579493134e-04), T::mul(z, ps));
+    ps = T::add(T::set1(8.33333333332248946124e-03), T::mul(z, ps));
+    ps = T::add(T::set1(-1.66666666666666324348e-01), T::mul(z, ps));
+    s = T::add(r, T::mul(T::mul(r, z), ps));
+
+    V pc = T::set1(-1.13596475577881948265e-11);
+    pc = T::add(T::set1(2.08757232129817482790e-09), T::mul(z, pc));
+    pc = T::add(T::set1(-2.75573143513906633035e-07), T::mul(z, pc));
+    pc = T::add(T::set1(2.48015872894767294178e-05), T::mul(z, pc));
+    pc = T::add(T::set1(-1.38888888888741095749e-03), T::mul(z, pc));
+    pc = T::add(T::set1(4.16666666666666019037e-02), T::mul(z, pc));
+    c = T::add(T::sub(T::set1(1.0), T::mul(T::set1(0.5), z)), T::mul(T::mul(z, z), pc));
+}
+
+template<class T>
+static inline void sinCosPolynomials(typename T::V r, typename T::V& s, typename T::V& c, float) {
+    typedef typename T::V V;
+    // Coefficients from Cephes' sinf and cosf
+    V z = T::mul(r, r);
+    V ps = T::set1(-1.9515295891e-4f);
+    ps = T::add(T::set1(8.3321608736e-3f), T::mul(z, ps));
+    ps = T::add(T::set1(-1.6666654611e-1f), T::mul(z, ps));
+    s = T::add(r, T::mul(T::mul(r, z), ps));
+
+    V pc = T::set1(2.443315711809948e-5f);
+    pc = T::add(T::set1(-1.388731625493765e-3f), T::mul(z, pc));
+    pc = T::add(T::set1(4.166664568298827e-2f), T::mul(z, pc));
+    c = T::add(T::sub(T::set1(1.0f), T::mul(T::set1(0.5f), z)), T::mul(T::mul(z, z), pc));
+}
+
+template<class T>
+static inline void sinCosv(typename T::V x, typename T::V& s, typename T::V& c) {
+    typedef typename T::S S;
+    typedef typename T::V V;
+
+    V k = roundNearest<T>(T::mul(x, T::set1((S) (2.0 / VECTOR_MATH_PI))));
+    V r = reduceHalfPi<T>(x, k, (S) 0);
+
+    V sr;
+    V cr;
+    sinCosPolynomials<T>(r, sr, cr, (S) 0);
+
+    // The quadrant, k mod 4, as 0.0, 1.0, 2.0 or 3.0
+    V quarter = T::mul(k, T::set1((S) 0.25));
+    V fl = roundNearest<T>(quarter);
+    fl = T::select(T::gt(fl, quarter), T::sub(fl, T::set1((S) 1.0)), fl);
+    V q = T::sub(k, T::mul(fl, T::set1((S) 4.0)));
+
+    typename T::M q1 = T::eq(q, T::set1((S) 1.0));
+    typename T::M q2 = T::eq(q, T::set1((S) 2.0));
+    typename T::M q3 = T::eq(q, T::set1((S) 3.0));
+
+    typename T::M swap = T::orMask(q1, q3);
+    s = T::select(swap, cr, sr);
+    c = T::select(swap, sr, cr);
+    s = T::select(T::orMask(q2, q3), T::neg(s), s);
+    c = T::select(T::orMask(q1, q2), T::neg(c), c);
+}
+
+template<class T>
+static int atan2Loop(const typename T::S* y, const typename T::S* x, typename T::S* out, int n) {
+    int i = 0;
+    for (; i + T::N <= n; i += T::N) {
+        T::store(out + i, atan2v<T>(T::load(y + i), T::load(x + i)));
+    }
+    return i;
+}
+
+template<class T>
+static int sinCosLoop(const typename T::S* a, typename T::S* s, typename T::S* c, int n) {
+    int i = 0;
+    for (; i + T::N <= n; i += T::N) {
+        typename T::V vs;
+        typename T::V vc;
+        sinCosv<T>(T::load(a + i), vs, vc);
+        T::store(s + i, vs);
+        T::store(c + i, vc);
+    }
+    return i;
+}
+
+template<class T>
+static int sqrtLoop(const typename T::S* a, typename T::S* out, int n) {
+    int i = 0;
+    for (; i + T::N <= n; i += T::N) {
+        T::store(out + i, T::sqrt(T::load(a + i)));
+    }
+    return i;
+}
+
+template<class T>
+static int normalizeLoop(typename T::S* x, typename T::S* y, typename T::S* z, int n) {
+    typedef typename T::S S;
+    typedef typename T::V V;
+    int i = 0;
+    for (; i + T::N <= n; i += T::N) {
+        V vx = T::load(x + i);
+        V vy = T::load(y + i);
+        V vz = T::load(z + i);
+        // Same order of operations as Matrix::normalize
+        V norm = T::sqrt(T::add(T::add(T::mul(vx, vx), T::mul(vy, vy)), T::mul(vz, vz)));
+        V factor = T::div(T::set1((S) 1.0), norm);
+        T::store(x + i, T::mul(vx, factor));
+        T::store(y + i, T::mul(vy, factor));
+        T::store(z + i, T::mul(vz, factor));
+    }
+    return i;
+}
+
+template<class D, class F>
+static VectorMathTable makeVectorMathTable() {
+    VectorMathTable table = {
+        &atan2Loop<D>, &atan2Loop<F>,
+        &sinCosLoop<D>, &sinCosLoop<F>,
+        &sqrtLoop<D>, &sqrtLoop<F>,
+        &normalizeLoop<D>, &normalizeLoop<F>
+    };
+    return table;
+}
+
+#undef VECTOR_MATH_PI
+
+}
+
+#endif
@@ -3,12 +3,14 @@
 #include <climits>
 #include <cmath>
 #include <mutex>
+#include <memory>
 #include "frei0r.hpp"
 #include "Math.hpp"
 #include "Matrix.hpp"
 #include "MPFilter.hpp"
 #include "Graphics.hpp"
 #include "ImageProcessing.hpp"
+#include "PitchRollMap.hpp"
 #include "Frei0rParameter.hpp"
 #include "Frei0rFilter.hpp"
 #include "MP4.hpp"
@@ -18,7 +20,7 @@
 #define INTERP_NONE 0
 
 
-class ZenithCorrection : public Frei0rFilter, MPFilter {
+class ZenithCorrection : public Frei0rFilter {
 
   public:
     Frei0rParameter<double,double> yaw;
@@ -41,11 +43,19 @@ class ZenithCorrection : public Frei0rFilter, MPFilter {
     double frameRate;
     Transform360Support t360;
 
-    ZenithCorrection(unsigned int width, unsigned int height) : Frei0rFilter(width, height), t360(width, height) {
+    /**
+     * Map for the pitch and roll of the correction, for footage where the
+     * camera is held at a constant tilt.
+     */
+    PitchRollMap pitchRollMap;
+
+    ZenithCorrection(unsigned int width, unsigned int height) : Frei0rFilter(width, height), t360(width, height),
+        pitchRollMap("bigsh0t_zenith_correction", width, height) {
         enableSmoothYaw = false;
         timeBiasYaw = 0.0;
         smoothYaw = 120;
         clipOffset = 0.0;
+        frameRate = 0.0;
 
         analysisFile = std::string("");
         zenithDataFrom = std::string("");
@@ -79,14 +89,20 @@ class ZenithCorrection : public Frei0rFilter, MPFilter {
         }
     }
 
-    void loadData() {
+    /**
+     * Loads the zenith data if the analysis file has changed.
+     *
+     * @return true if the zenith data was reloaded
+     */
+    bool loadData() {
         if (analysisFile == zenithDataFrom) {
-            return;
+            return false;
         }
 
         zenithData.clear();
         if (analysisFile == std::string("")) {
-            return;
+            zenithDataFrom = analysisFile;
+            return true;
         }
 
         zenithDataFrom = analysisFile;
@@ -99,6 +115,7 @@ class ZenithCorrection : public Frei0rFilter, MPFilter {
             }
         }
         parser.close();
+        return true;
     }
 
     void createYawCorrection() {
@@ -147,54 +164,61 @@ class ZenithCorrection : public Frei0rFilter, MPFilter {
     virtual void update(double time,
                         uint32_t* out,
                         const uint32_t* in) {
-        // frei0r filter instances are not thread-safe. Shotcut ignores that, so we'll
-        // deal with it by wrapping the execution in a mutex
-        std::lock_guard<std::mutex> guard(lock);
+        Matrix3 xform;
+        int frameInterpolation;
+        double frameYaw;
+        double framePitch;
+        double frameRoll;
+        std::shared_ptr<Map360Entry> frameMap;
+        bool buildMap;
+        {
+            // frei0r filter instances are not thread-safe, and Shotcut will call update
+            // from several threads when exporting in parallel. Compute the rotation for
+            // this frame under the lock, and render the frame outside it.
+            std::lock_guard<std::mutex> guard(lock);
+
+            bool reloaded = loadData();
+
+            if (enableSmoothYaw) {
+                if (reloaded || yawCorrection.empty() || smoothYaw.changed() || timeBiasYaw.changed()) {
+                    createYawCorrection();
+                }
+            } else {
+                yawCorrection.clear();
+            }
 
-        loadData();
+            xform.identity();
+            double clipTime = time + clipOffset;
+            int frame = (int) round(clipTime * frameRate);
+            if (frame >= 0 && frame < yawCorrection.size()) {
+                rotateZ(xform, yawCorrection[frame]);
+            }
+            if (frame >= 0 && frame < zenithData.size()) {
+                Quaternion q;
+                invertQ(zenithData[frame], q);
+                rotateQuaternion(xform, q);
+            }
+            frameInterpolation = interpolation.read();
 
-        if (enableSmoothYaw) {
-            createYawCorrection();
-        } else {
-            yawCorrection.clear();
+            decomposeRotation(xform, frameYaw, framePitch, frameRoll);
+            frameYaw = RAD2DEGF(frameYaw);
+            framePitch = RAD2DEGF(framePitch);
+            frameRoll = RAD2DEGF(frameRoll);
+            frameMap = pitchRollMap.get(framePitch, frameRoll, buildMap);
         }
 
-        MPFilter::updateMP(this, time, out, in, width, height);
-
-        /*
-        double clipTime = time + clipOffset;
-        int frame = (int) round(clipTime * frameRate);
-
-        char buf[1024];
-        snprintf (buf, 1024,
-        "F %d FR %f ZD %d YC %d SY %s\n",
-        frame, frameRate, zenithData.size(), yawCorrection.size(),
-        enableSmoothYaw ? "ON" : "OFF"
-        );
-        std::string status(buf);
-
-        Graphics g(out, width, height);
-        g.drawText(8, 8, status, 0, 0xff0000ff);
-        */
-    }
-
-    virtual void updateLines(double time,
-                             uint32_t* out,
-                             const uint32_t* in, int start, int num) {
-        Matrix3 xform;
-        xform.identity();
-        double clipTime = time + clipOffset;
-        int frame = (int) round(clipTime * frameRate);
-        if (frame >= 0 && frame < yawCorrection.size()) {
-            rotateZ(xform, yawCorrection[frame]);
-        }
-        if (frame >= 0 && frame < zenithData.size()) {
-            Quaternion q;
-            invertQ(zenithData[frame], q);
-            rotateQuaternion(xform, q);
+        if (frameMap) {
+            Transform360Frame frame(t360, width, height, frameYaw, framePitch, frameRoll, frameMap.get(), buildMap, frameInterpolation);
+            MPFilter::updateMP(&frame, time, out, in, width, height);
+        } else {
+            Transform360Frame frame(t360, width, height, xform, frameInterpolation);
+            MPFilter::updateMP(&frame, time, out, in, width, height);
         }
 
-        transform_360(t360, out, (uint32_t*) in, width, height, start, num, xform, interpolation);
+        if (buildMap) {
+            std::lock_guard<std::mutex> guard(lock);
+            pitchRollMap.put(frameMap, framePitch, frameRoll);
+        }
     }
 };
 
@@ -9,12 +9,14 @@ Item {
     property bool blockUpdate: true
     property int interpolationValue: 0
     property int subpixelsValue: 0
+    property bool subpixelFitValue: false
     property bool analyzeValue: false
     property bool transformWhenAnalyzingValue: false
     property double sampleRadiusValue: 0
     property double searchRadiusValue: 0
     property double offsetValue: 0
     property string analysisFileValue: ""
+    property string orientationFileValue: ""
     property bool useBackTrackpointsValue: false
     property double stabilizeYawValue: 0
     property double stabilizePitchValue: 0
@@ -34,10 +36,12 @@ Item {
         transformWhenAnalyzingCheckBox.checked = filter.get("transformWhenAnalyzing") == '1';
         interpolationComboBox.currentIndex = filter.get("interpolation");
         subpixelsComboBox.currentIndex = filter.get("subpixels");
+        subpixelFitCheckBox.checked = filter.get("subpixelFit") == '1';
         sampleRadiusSlider.value = filter.getDouble("sampleRadius");
         searchRadiusSlider.value = filter.getDouble("searchRadius");
         offsetSlider.value = filter.getDouble("offset");
         analysisFileTextField.text = filter.get("analysisFile");
+        orientationFileTextField.text = filter.get("orientationFile");
         useBackTrackpointsCheckBox.checked = filter.get("useBackTrackpoints") == '1';
         stabilizeYawSlider.value = filter.getDouble("stabilizeYaw");
         stabilizePitchSlider.value = filter.getDouble("stabilizePitch");
@@ -101,6 +105,13 @@ Item {
         filter.set("analysisFile", value);
     }
 
+    function updateProperty_orientationFile() {
+        if (blockUpdate)
+            return;
+        var value = orientationFileTextField.text;
+        filter.set("orientationFile", value);
+    }
+
     function updateProperty_useBackTrackpoints() {
         if (blockUpdate)
             return;
@@ -115,6 +126,13 @@ Item {
         filter.set("subpixels", value);
     }
 
+    function updateProperty_subpixelFit() {
+        if (blockUpdate)
+            return;
+        var value = subpixelFitCheckBox.checked;
+        filter.set("subpixelFit", value);
+    }
+
     function updateProperty_stabilizeYaw(position) {
         if (blockUpdate)
             return;
@@ -229,6 +247,10 @@ Item {
             filter.set("subpixels", 1);
         else
             subpixelsValue = filter.get("subpixels");
+        if (filter.isNew)
+            filter.set("subpixelFit", true);
+        else
+            subpixelFitValue = filter.get("subpixelFit");
         if (filter.isNew)
             filter.set("sampleRadius", 16);
         else
@@ -245,6 +267,10 @@ Item {
             filter.set("analysisFile", "");
         else
             analysisFileValue = filter.get("analysisFile");
+        if (filter.isNew)
+            filter.set("orientationFile", "");
+        else
+            orientationFileValue = filter.get("orientationFile");
         if (filter.isNew)
             filter.set("useBackTrackpoints", false);
         else
@@ -312,6 +338,23 @@ Item {
         }
     }
 
+    Shotcut.File {
+        id: orientationFile
+    }
+
+    Shotcut.FileDialog {
+        id: selectOrientationFile
+
+        title: qsTr("Video with orientation data")
+        nameFilters: ['Theta video (*.mp4)', 'All Files (*)']
+        onAccepted: {
+            orientationFile.url = selectOrientationFile.selectedFile;
+            orientationFileTextField.text = orientationFile.filePath;
+            updateProperty_orientationFile();
+            settings.openPath = orientationFile.path;
+        }
+    }
+
     GridLayout {
         columns: 4
         anchors.fill: parent
@@ -404,6 +447,34 @@ Item {
             }
         }
 
+        Label {
+            text: qsTr('Orientation')
+            Layout.alignment: Qt.AlignRight
+        }
+
+        TextField {
+            id: orientationFileTextField
+
+            text: qsTr("")
+            Layout.columnSpan: 2
+            Layout.fillWidth: true
+            Layout.alignment: Qt.AlignLeft
+            selectByMouse: true
+            onEditingFinished: updateProperty_orientationFile()
+        }
+
+        Shotcut.Button {
+            icon.name: 'document-open'
+            icon.source: 'qrc:///icons/oxygen/32x32/actions/document-open.png'
+            implicitWidth: 20
+            implicitHeight: 20
+            onClicked: selectOrientationFile.open()
+
+            Shotcut.HoverTip {
+                text: qsTr('Browse...')
+            }
+        }
+
         Label {
             text: qsTr('Start Offset')
             Layout.alignment: Qt.AlignRight
@@ -563,6 +634,23 @@ Item {
             onClicked: subpixelsComboBox.currentIndex = 0
         }
 
+        Label {
+        }
+
+        CheckBox {
+            id: subpixelFitCheckBox
+
+            text: qsTr('Subpixel fit')
+            Layout.columnSpan: 2
+            onCheckedChanged: updateProperty_subpixelFit()
+        }
+
+        Shotcut.UndoButton {
+            id: subpixelFitUndo
+
+            onClicked: subpixelFitCheckBox.checked = true
+        }
+
         Label {
             text: qsTr('Yaw')
             Layout.alignment: Qt.AlignLeft
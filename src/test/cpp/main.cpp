@@ -4,13 +4,36 @@
 #include <cmath>
 #include <chrono>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstring>
 #include "../../main/cpp/sse_compat.hpp"
 #include <iomanip>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "../../main/cpp/Math.hpp"
 #include "../../main/cpp/Matrix.hpp"
 #include "../../main/cpp/MP4.hpp"
+#include "../../main/cpp/RotationSamples.hpp"
+#include "../../main/cpp/AnalysisFile.hpp"
+#include "../../main/cpp/AnalysisMerge.hpp"
+#include "../../main/cpp/MapCache.hpp"
+#include "../../main/cpp/MapStrategy.hpp"
+#include "../../main/cpp/BackgroundMap.hpp"
+#include "../../main/cpp/CPUFeatures.hpp"
 #include "../../main/cpp/ImageProcessing.hpp"
+#include "../../main/cpp/ImageProcessingAVX2.hpp"
+#include "../../main/cpp/ImageProcessingSSE41.hpp"
+#include "../../main/cpp/KeyframeSchedule.hpp"
+#include "../../main/cpp/ScanlineScheduler.hpp"
 #include "../../main/cpp/SummedAreaTable.hpp"
+#include "../../main/cpp/ThreadPool.hpp"
+#include "../../main/cpp/Tracker.hpp"
+#include "../../main/cpp/VectorMath.hpp"
 #include "../../main/cpp/EMoR.hpp"
 
 void testMP4() {
@@ -294,6 +317,1235 @@ void testTransform() {
     free(frame);
 }
 
+typedef int (*Apply360MapKernel)(uint32_t* out, const uint32_t* ibuf1, const Map360Entry* map, int width, int height, int start_scanline, int num_scanlines, int x_offset, int interpolation);
+
+/**
+ * Checks that a vector kernel for apply_360_map gives the same result as the
+ * scalar code, for the columns it does.
+ */
+void checkApply360MapKernel(Apply360MapKernel kernel, int pixelsPerVector) {
+    // Odd width, so that the scalar code has to do the last columns.
+    int width = 1027;
+    int height = 512;
+    size_t frameSize = width * height;
+    uint32_t* frame = (uint32_t*) malloc(frameSize * sizeof(uint32_t));
+    uint32_t* expected = (uint32_t*) malloc(frameSize * sizeof(uint32_t));
+    uint32_t* actual = (uint32_t*) malloc(frameSize * sizeof(uint32_t));
+    Map360Entry* map = (Map360Entry*) malloc(frameSize * sizeof(Map360Entry));
+    for (int i = 0; i < frameSize; ++i) {
+        frame[i] = std::rand() & 0xffffffff;
+    }
+
+    Transform360Support t360(width, height);
+    transform_360_map(t360, map, width, height, 0, height, 30.0, 20.0, 10.0);
+    // Mark some entries as outside the source image.
+    for (int i = 0; i < frameSize; i += 7) {
+        map[i] = makeMap360Entry(-1, 0);
+    }
+
+    for (int interpolation = Interpolation::NONE; interpolation <= Interpolation::BILINEAR; ++interpolation) {
+        for (int i = 0; i < frameSize; ++i) {
+            double xt = map[i].x + map[i].ax / 128.0;
+            double yt = map[i].y + map[i].ay / 128.0;
+            if (map[i].x == MAP_360_OUTSIDE) {
+                expected[i] = 0;
+            } else if (interpolation == Interpolation::NONE) {
+                expected[i] = sampleNearestNeighbor(frame, xt, yt, width, height);
+            } else {
+                expected[i] = sampleBilinearWrappedClamped(frame, xt, yt, width, height);
+            }
+        }
+
+        int columns = kernel(actual, frame, map, width, height, 0, height, 0, interpolation);
+        assertEquals(columns, width - width % pixelsPerVector);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < columns; ++x) {
+                assertEquals(actual[y * width + x], expected[y * width + x]);
+            }
+        }
+
+        apply_360_map(actual, frame, map, width, height, 0, height, interpolation);
+        for (int i = 0; i < frameSize; ++i) {
+            assertEquals(actual[i], expected[i]);
+        }
+    }
+
+    free(map);
+    free(actual);
+    free(expected);
+    free(frame);
+}
+
+void testApply360MapAVX2() {
+#ifdef USE_AVX2
+    if (!cpuSupportsAVX2()) {
+        std::cout << "AVX2 not supported, skipping ... ";
+        return;
+    }
+    checkApply360MapKernel(&apply_360_map_avx2, 8);
+#endif
+}
+
+void testApply360MapSSE41() {
+#ifdef USE_SSE41
+    if (!cpuSupportsSSE41()) {
+        std::cout << "SSE4.1 not supported, skipping ... ";
+        return;
+    }
+    checkApply360MapKernel(&apply_360_map_sse41, 4);
+#endif
+}
+
+void testMapSizeLimit() {
+    assertTrue(canMap360(MAP_360_MAX_SIZE, MAP_360_MAX_SIZE));
+    assertTrue(!canMap360(MAP_360_MAX_SIZE + 1, 1024));
+    assertTrue(!canMap360(1024, MAP_360_MAX_SIZE + 1));
+
+    // Too wide for map entries, so every pixel is projected and sampled
+    int width = MAP_360_MAX_SIZE + 2;
+    int height = 4;
+    size_t frameSize = width * height;
+    std::vector<uint32_t> frame(frameSize);
+    std::vector<uint32_t> expected(frameSize);
+    std::vector<uint32_t> actual(frameSize);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t r = (uint32_t) (127.5 + 127.5 * sin(8 * M_PI * x / width));
+            frame[y * width + x] = 0xff000000 | (y << 12) | r;
+        }
+    }
+
+    Transform360Support t360(width, height);
+    transform_360(t360, expected.data(), frame.data(), width, height, 0, height, 30.0, 20.0, 10.0, Interpolation::BILINEAR);
+
+    Transform360Projection projection(width, height, 30.0, 20.0, 10.0);
+    apply_360_projection(projection, actual.data(), frame.data(), width, height, 0, height, Interpolation::BILINEAR);
+    for (size_t j = 0; j < frameSize; ++j) {
+        if (!assertComponentDifferenceLessThan(actual[j], expected[j], 3, "oversize projection")) {
+            fail();
+        }
+    }
+}
+
+void testYawOffset() {
+    // Odd width, so that the scalar code has to do the last columns.
+    int width = 1027;
+    int height = 512;
+    int w128 = width * 128;
+    size_t frameSize = width * height;
+    uint32_t* frame = (uint32_t*) malloc(frameSize * sizeof(uint32_t));
+    uint32_t* expected = (uint32_t*) malloc(frameSize * sizeof(uint32_t));
+    uint32_t* actual = (uint32_t*) malloc(frameSize * sizeof(uint32_t));
+    Map360Entry* map = (Map360Entry*) malloc(frameSize * sizeof(Map360Entry));
+    Map360Entry* shifted = (Map360Entry*) malloc(frameSize * sizeof(Map360Entry));
+    for (int i = 0; i < frameSize; ++i) {
+        frame[i] = std::rand() & 0xffffffff;
+    }
+
+    Transform360Support t360(width, height);
+    transform_360_map(t360, map, width, height, 0, height, 0.0, 20.0, 10.0);
+    for (int i = 0; i < frameSize; i += 7) {
+        map[i] = makeMap360Entry(-1, 0);
+    }
+
+    double yaws[4] = {0.0, 37.3, -200.0, 359.9};
+    for (int i = 0; i < 4; ++i) {
+        double yaw = yaws[i];
+        int offset = (int) floor(width * yaw / 360.0 * 128.0) % w128;
+        if (offset < 0) {
+            offset += w128;
+        }
+
+        // Applying the offset must be the same as shifting the map entries.
+        for (int j = 0; j < frameSize; ++j) {
+            shifted[j] = map[j];
+            if (map[j].x != MAP_360_OUTSIDE) {
+                int fx = (map[j].x * 128 + map[j].ax + offset) % w128;
+                shifted[j].x = fx >> 7;
+                shifted[j].ax = fx & 127;
+            }
+        }
+
+        for (int interpolation = Interpolation::NONE; interpolation <= Interpolation::BILINEAR; ++interpolation) {
+            apply_360_map(expected, frame, shifted, width, height, 0, height, interpolation);
+            apply_360_map(actual, frame, map, width, height, 0, height, yaw, interpolation);
+            for (int j = 0; j < frameSize; ++j) {
+                assertEquals(actual[j], expected[j]);
+            }
+        }
+
+        // Without pitch and roll, the rows are rotated.
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                shifted[y * width + x] = makeMap360Entry(x, y);
+            }
+        }
+        for (int interpolation = Interpolation::NONE; interpolation <= Interpolation::BILINEAR; ++interpolation) {
+            apply_360_map(expected, frame, shifted, width, height, 0, height, yaw, interpolation);
+            rotate_360_yaw(actual, frame, width, height, 0, height, yaw, interpolation);
+            for (int j = 0; j < frameSize; ++j) {
+                assertEquals(actual[j], expected[j]);
+            }
+        }
+    }
+
+    free(shifted);
+    free(map);
+    free(actual);
+    free(expected);
+    free(frame);
+}
+
+void testSadRow() {
+    short a[67];
+    short b[67];
+    for (int i = 0; i < 67; ++i) {
+        a[i] = std::rand() % 766;
+        b[i] = std::rand() % 766;
+    }
+    // Lengths that are not a multiple of the vector width leave columns to
+    // the scalar code.
+    for (int n = 0; n <= 67; ++n) {
+        int expected = 0;
+        for (int i = 0; i < n; ++i) {
+            expected += std::abs(a[i] - b[i]);
+        }
+        assertEquals(sad_row(a, b, n), expected);
+    }
+}
+
+void testVectorMath() {
+    // Odd length, so that the scalar code has to do the last elements.
+    int n = 4099;
+    std::vector<double> y(n);
+    std::vector<double> x(n);
+    std::vector<double> out(n);
+    std::vector<double> s(n);
+    std::vector<double> c(n);
+    std::vector<float> yf(n);
+    std::vector<float> xf(n);
+    std::vector<float> outf(n);
+    std::vector<float> sf(n);
+    std::vector<float> cf(n);
+    for (int i = 0; i < n; ++i) {
+        y[i] = (std::rand() % 20001 - 10000) / 1000.0;
+        x[i] = (std::rand() % 20001 - 10000) / 1000.0;
+        yf[i] = (float) y[i];
+        xf[i] = (float) x[i];
+    }
+    y[0] = 0.0;
+    x[0] = 0.0;
+    y[1] = 1.0;
+    x[1] = 0.0;
+    y[2] = 0.0;
+    x[2] = -1.0;
+
+    batchAtan2(y.data(), x.data(), out.data(), n);
+    batchAtan2(yf.data(), xf.data(), outf.data(), n);
+    for (int i = 0; i < n; ++i) {
+        assertEquals(out[i], fastAtan2(y[i], x[i]));
+        assertTrue(fabs(outf[i] - atan2((double) yf[i], (double) xf[i])) <= 6e-7);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        // Angles of up to a few turns, as the map builders use
+        x[i] = (i - n / 2) * 0.01;
+        xf[i] = (float) x[i];
+    }
+    x[n - 1] = 99999.0;
+    batchSinCos(x.data(), s.data(), c.data(), n);
+    batchSinCos(xf.data(), sf.data(), cf.data(), n);
+    for (int i = 0; i < n; ++i) {
+        assertTrue(fabs(s[i] - sin(x[i])) <= 1e-15);
+        assertTrue(fabs(c[i] - cos(x[i])) <= 1e-15);
+        if (fabs(xf[i]) < 4096) {
+            assertTrue(fabs(sf[i] - sin((double) xf[i])) <= 2e-7);
+            assertTrue(fabs(cf[i] - cos((double) xf[i])) <= 2e-7);
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        x[i] = i * 0.37;
+        y[i] = (std::rand() % 2001 - 1000) / 100.0;
+        out[i] = 1.0 - i * 0.001;
+    }
+    batchSqrt(x.data(), s.data(), n);
+    for (int i = 0; i < n; ++i) {
+        assertEquals(s[i], sqrt(x[i]));
+    }
+
+    std::vector<double> z(n);
+    for (int i = 0; i < n; ++i) {
+        z[i] = x[i];
+        c[i] = y[i];
+        s[i] = out[i];
+    }
+    batchNormalize(z.data(), c.data(), s.data(), n);
+    for (int i = 1; i < n; ++i) {
+        Vector3 v;
+        v[0] = x[i];
+        v[1] = y[i];
+        v[2] = out[i];
+        v.normalize();
+        assertEquals(z[i], v[0]);
+        assertEquals(c[i], v[1]);
+        assertEquals(s[i], v[2]);
+    }
+}
+
+void testScanlineScheduler() {
+    int height = 1031;
+    int numThreads = 6;
+    std::vector<std::atomic<int> > counts(height);
+    for (int i = 0; i < height; ++i) {
+        counts[i] = 0;
+    }
+    std::atomic<int> stolen(0);
+
+    ScanlineScheduler scheduler(height, numThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            int first = -1;
+            int start;
+            int num;
+            while (scheduler.next(t, start, num)) {
+                if (first < 0) {
+                    first = start;
+                }
+                // Thread 0 is slow, so the others must take its rows.
+                if (t == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                } else if (start < height / numThreads) {
+                    ++stolen;
+                }
+                for (int y = start; y < start + num; ++y) {
+                    ++counts[y];
+                }
+            }
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < height; ++i) {
+        assertEquals(counts[i].load(), 1);
+    }
+    assertTrue(stolen.load() > 0);
+
+    // All rows, exactly once, from the threads of the pool.
+    for (int i = 0; i < height; ++i) {
+        counts[i] = 0;
+    }
+    ScanlineScheduler::forEachChunk(height, [&](int start, int num) {
+        for (int y = start; y < start + num; ++y) {
+            ++counts[y];
+        }
+    });
+    for (int i = 0; i < height; ++i) {
+        assertEquals(counts[i].load(), 1);
+    }
+}
+
+void testThreadPool() {
+    ThreadPool pool(4, false);
+    assertEquals(pool.getSize(), 4);
+
+    // Every thread index once, also for more threads than the pool has.
+    for (int numThreads : {1, 3, 4, 9}) {
+        std::vector<std::atomic<int> > calls(numThreads);
+        for (int i = 0; i < numThreads; ++i) {
+            calls[i] = 0;
+        }
+        pool.run(numThreads, [&](int thread) {
+            ++calls[thread];
+        });
+        for (int i = 0; i < numThreads; ++i) {
+            assertEquals(calls[i].load(), 1);
+        }
+    }
+
+    // Jobs started from jobs, and from several threads at once, must finish
+    // even when all workers are busy.
+    std::atomic<int> sum(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+        threads.push_back(std::thread([&]() {
+            for (int j = 0; j < 50; ++j) {
+                pool.parallelFor(8, [&](int i) {
+                    pool.parallelFor(8, [&](int k) {
+                        sum += i * 8 + k;
+                    });
+                });
+            }
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    assertEquals(sum.load(), 3 * 50 * (63 * 64 / 2));
+
+    // Tasks that no worker has started when the pool is destroyed still
+    // run, here because the workers never get a budget.
+    ThreadBudget none("", 0);
+    std::atomic<int> ran(0);
+    {
+        ThreadPool starved(2, false, none);
+        for (int i = 0; i < 3; ++i) {
+            starved.post([&ran]() {
+                ++ran;
+            });
+        }
+        assertEquals(ran.load(), 0);
+    }
+    assertEquals(ran.load(), 3);
+}
+
+void testThreadBudget() {
+    std::string name = ThreadBudget::processName() + "-test";
+    ThreadBudget a(name, 2);
+    ThreadBudget b(name, 5);
+    if (!a.isShared() || !b.isShared()) {
+        printf("    Shared memory not available, skipped\n");
+        return;
+    }
+
+    // Both see the budget of the first, and one's workers count for the other.
+    assertTrue(a.tryAcquire());
+    assertTrue(b.tryAcquire());
+    assertTrue(!a.tryAcquire());
+    assertTrue(!b.tryAcquire());
+    a.release();
+    assertTrue(b.tryAcquire());
+    a.release();
+    b.release();
+
+    assertEquals(a.next(), 0);
+    assertEquals(b.next(), 1);
+    assertEquals(a.next(), 2);
+
+    ThreadBudget other("", 2);
+    assertTrue(!other.isShared());
+    assertEquals(other.next(), 0);
+
+#ifndef _WIN32
+    // The first module to open the budget can close it before the others,
+    // and a module that opens it later still shares it with them.
+    std::string handOver = name + "-handover";
+    std::unique_ptr<ThreadBudget> creator(new ThreadBudget(handOver, 1));
+    ThreadBudget user(handOver, 1);
+    creator.reset();
+    ThreadBudget later(handOver, 5);
+    assertTrue(later.isShared());
+    assertTrue(user.tryAcquire());
+    assertTrue(!later.tryAcquire());
+    user.release();
+
+    // A block left behind by a process that had the same id, and that was
+    // killed while its workers had the whole budget, starts out full.
+    std::string stale = name + "-stale";
+    int fd = shm_open(stale.c_str(), O_RDWR | O_CREAT, 0600);
+    assertTrue(fd >= 0);
+    assertEquals(ftruncate(fd, 4096), 0);
+    close(fd);
+    {
+        ThreadBudget reopened(stale, 2);
+        assertTrue(reopened.isShared());
+        assertTrue(reopened.tryAcquire());
+        assertTrue(reopened.tryAcquire());
+        assertTrue(!reopened.tryAcquire());
+    }
+    // The last module to close it removes the name.
+    assertTrue(shm_open(stale.c_str(), O_RDWR, 0600) < 0);
+#endif
+
+    // Two pools on a budget of one worker never have more than one worker
+    // working between them, and their jobs still finish.
+    ThreadBudget shared(name + "-pools", 1);
+    ThreadPool first(4, false, shared);
+    ThreadPool second(4, false, shared);
+    std::atomic<int> active(0);
+    std::atomic<int> maxActive(0);
+    std::atomic<int> sum(0);
+    auto job = [&](ThreadPool& pool) {
+        std::thread::id caller = std::this_thread::get_id();
+        for (int j = 0; j < 20; ++j) {
+            pool.run(4, [&](int thread) {
+                bool worker = std::this_thread::get_id() != caller;
+                if (worker) {
+                    int now = ++active;
+                    int seen = maxActive.load();
+                    while (now > seen && !maxActive.compare_exchange_weak(seen, now)) {
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                sum += thread;
+                if (worker) {
+                    --active;
+                }
+            });
+        }
+    };
+    std::thread t1([&]() {
+        job(first);
+    });
+    std::thread t2([&]() {
+        job(second);
+    });
+    t1.join();
+    t2.join();
+    assertEquals(sum.load(), 2 * 20 * 6);
+    assertTrue(maxActive.load() <= 1);
+}
+
+void testBackgroundMap() {
+    BackgroundMap maps;
+    MapKey a = MapKey("testBackgroundMap", 4, 4).add(1.0);
+    MapKey b = MapKey("testBackgroundMap", 4, 4).add(2.0);
+    assertTrue(!maps.get<int>(a));
+    assertTrue(!maps.latest<int>());
+
+    maps.build(a, [](const std::atomic<bool>& cancelled) {
+        return std::make_shared<int>(1);
+    }, sizeof(int));
+    std::shared_ptr<int> map;
+    for (int i = 0; i < 1000 && !map; ++i) {
+        map = maps.get<int>(a);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assertTrue((bool) map);
+    assertEquals(*map, 1);
+    assertEquals(*maps.latest<int>(), 1);
+    assertTrue(!maps.get<int>(b));
+
+    // Maps built by one instance are found by others through the cache.
+    BackgroundMap other;
+    assertEquals(*other.get<int>(a), 1);
+
+    // A build for another key cancels the running one. Needs a worker.
+    if (ThreadPool::instance().getSize() > 1) {
+        std::atomic<bool> started(false);
+        maps.build(b, [&](const std::atomic<bool>& cancelled) {
+            started = true;
+            while (!cancelled) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return std::shared_ptr<int>();
+        }, sizeof(int));
+        while (!started) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        maps.build(a, [](const std::atomic<bool>& cancelled) {
+            return std::make_shared<int>(2);
+        }, sizeof(int));
+    }
+    assertTrue(!maps.get<int>(b));
+    assertEquals(*maps.latest<int>(), 1);
+
+    // The builders' helper stops once cancelled.
+    std::atomic<bool> cancelled(false);
+    std::atomic<int> rows(0);
+    assertTrue(BackgroundMap::forEachChunk(100, cancelled, [&](int start, int num) {
+        rows += num;
+    }));
+    assertEquals(rows.load(), 100);
+    cancelled = true;
+    assertTrue(!BackgroundMap::forEachChunk(100, cancelled, [&](int start, int num) {
+        rows += num;
+    }));
+    assertEquals(rows.load(), 100);
+}
+
+void testMapStrategy() {
+    MapStrategy strategy;
+    MapKey a = MapKey("testMapStrategy", 4, 4).add(1.0);
+    MapKey b = MapKey("testMapStrategy", 4, 4).add(2.0);
+
+    // Before anything is measured, build once the parameters repeat.
+    strategy.next(a);
+    assertTrue(!strategy.buildMap());
+    assertTrue(strategy.useMap());
+    strategy.next(a);
+    assertTrue(strategy.buildMap());
+
+    // A map saves 8 per frame and costs 40, so the parameters must have
+    // stayed the same for more than 5 frames.
+    strategy.addDirectTime(10.0);
+    strategy.addMapTime(2.0);
+    strategy.addBuildTime(40.0);
+    strategy.next(b);
+    for (int frame = 1; frame <= 5; ++frame) {
+        assertTrue(!strategy.buildMap());
+        strategy.next(b);
+    }
+    assertTrue(strategy.buildMap());
+    assertTrue(strategy.useMap());
+    strategy.next(a);
+    assertTrue(!strategy.buildMap());
+
+    // A map that is slower than rendering directly is neither used nor built.
+    for (int i = 0; i < 20; ++i) {
+        strategy.addMapTime(20.0);
+    }
+    assertTrue(!strategy.useMap());
+    for (int i = 0; i < 100; ++i) {
+        strategy.next(a);
+    }
+    assertTrue(!strategy.buildMap());
+}
+
+void testMapCache() {
+    MapCache cache(300);
+    std::shared_ptr<int> a(new int(1));
+    std::shared_ptr<int> b(new int(2));
+    std::shared_ptr<int> c(new int(3));
+
+    cache.put(MapKey("test", 10, 10).add(1.0), a, 100);
+    cache.put(MapKey("test", 10, 10).add(2.0), b, 100);
+    assertTrue(cache.get<int>(MapKey("test", 10, 10).add(1.0)) == a);
+    assertTrue(!cache.get<int>(MapKey("test", 10, 10).add(3.0)));
+    assertTrue(!cache.get<int>(MapKey("other", 10, 10).add(1.0)));
+    assertTrue(!cache.get<int>(MapKey("test", 10, 20).add(1.0)));
+
+    // b is now the least recently used, and is evicted
+    cache.put(MapKey("test", 10, 10).add(3.0), c, 150);
+    assertEquals(cache.getSize(), (std::size_t) 250);
+    assertTrue(cache.get<int>(MapKey("test", 10, 10).add(1.0)) == a);
+    assertTrue(!cache.get<int>(MapKey("test", 10, 10).add(2.0)));
+    assertTrue(cache.get<int>(MapKey("test", 10, 10).add(3.0)) == c);
+
+    // Maps larger than the budget are not kept
+    cache.put(MapKey("test", 10, 10).add(4.0), b, 301);
+    assertTrue(!cache.get<int>(MapKey("test", 10, 10).add(4.0)));
+    assertEquals(cache.getSize(), (std::size_t) 250);
+}
+
+static std::vector<AnalysisRecord> readAnalysisFile(AnalysisFile& file) {
+    std::vector<AnalysisRecord> records;
+    file.read([&](const AnalysisFile::Segment& segment) {
+        records.insert(records.end(), segment.records, segment.records + segment.count);
+    });
+    return records;
+}
+
+static AnalysisRecord analysisRecord(double time) {
+    AnalysisRecord r;
+    r.previousTime = time - 0.5;
+    r.time = time;
+    r.yaw = time * 2;
+    r.pitch = time * 3;
+    r.roll = time * 4;
+    return r;
+}
+
+static long fileSize(const char* fileName) {
+    FILE* fp = fopen(fileName, "rb");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+void testAnalysisFile() {
+    assertEquals(AnalysisFile::parseFileName("file:///home/a.bin"), std::string("/home/a.bin"));
+    assertEquals(AnalysisFile::parseFileName("file:///C:/a.bin"), std::string("C:/a.bin"));
+
+    const char* fileName = "bigsh0t_test_analysis.bin";
+    std::remove(fileName);
+
+    // A file in the old format: a count followed by the records
+    {
+        FILE* fp = fopen(fileName, "wb");
+        uint64_t count = 2;
+        AnalysisRecord records[] = { analysisRecord(1), analysisRecord(2) };
+        fwrite(&count, sizeof(count), 1, fp);
+        fwrite(records, sizeof(AnalysisRecord), 2, fp);
+        fclose(fp);
+    }
+    std::shared_ptr<AnalysisFile> file = AnalysisFile::open(fileName);
+    assertTrue(AnalysisFile::open(fileName) == file);
+    assertEquals(readAnalysisFile(*file).size(), (std::size_t) 2);
+    assertTrue(file->needsCompaction());
+
+    // Appending converts it
+    assertTrue(file->append(std::vector<AnalysisRecord>(1, analysisRecord(3)), 0, 0));
+    assertTrue(!file->needsCompaction());
+    assertEquals(file->getNumSegments(), (std::size_t) 2);
+    assertTrue(file->append(std::vector<AnalysisRecord>(1, analysisRecord(4)), 2, 3));
+    assertEquals(file->getNumSegments(), (std::size_t) 3);
+    std::vector<AnalysisRecord> records = readAnalysisFile(*file);
+    assertEquals(records.size(), (std::size_t) 4);
+    for (int i = 0; i < 4; ++i) {
+        assertEquals(records[i].time, i + 1.0);
+        assertEquals(records[i].roll, (i + 1.0) * 4);
+    }
+
+    // A segment that was cut short keeps the records that made it
+    {
+        FILE* fp = fopen(fileName, "ab");
+        char header[32] = { 's', 'e', 'g', 'm' };
+        uint64_t count = 3;
+        AnalysisRecord record = analysisRecord(5);
+        memcpy(header + 8, &count, sizeof(count));
+        fwrite(header, sizeof(header), 1, fp);
+        fwrite(&record, sizeof(record), 1, fp);
+        fclose(fp);
+    }
+    assertEquals(readAnalysisFile(*file).size(), (std::size_t) 5);
+    assertTrue(file->needsCompaction());
+
+    assertTrue(file->rewrite(readAnalysisFile(*file), 0, 0));
+    assertEquals(file->getNumSegments(), (std::size_t) 1);
+    assertEquals(readAnalysisFile(*file).size(), (std::size_t) 5);
+    assertTrue(!file->isUnreadable());
+
+    // Something else than a segment after the segments: what can be read is
+    // read, but the file is left alone.
+    {
+        FILE* fp = fopen(fileName, "ab");
+        char junk[48] = { 'j', 'u', 'n', 'k' };
+        fwrite(junk, sizeof(junk), 1, fp);
+        fclose(fp);
+    }
+    long size = fileSize(fileName);
+    assertEquals(readAnalysisFile(*file).size(), (std::size_t) 5);
+    assertTrue(file->isUnreadable());
+    assertTrue(!file->needsCompaction());
+    assertTrue(!file->append(std::vector<AnalysisRecord>(1, analysisRecord(6)), 0, 0));
+    assertTrue(!file->rewrite(readAnalysisFile(*file), 0, 0));
+    assertEquals(fileSize(fileName), size);
+
+    file.reset();
+    std::remove(fileName);
+
+    // A file written by a later version is not read, nor written.
+    const char* laterFileName = "bigsh0t_test_analysis_later.bin";
+    {
+        FILE* fp = fopen(laterFileName, "wb");
+        char header[24] = "bigsh0t-stab360";
+        uint32_t version = 2;
+        memcpy(header + 16, &version, sizeof(version));
+        fwrite(header, sizeof(header), 1, fp);
+        AnalysisRecord record = analysisRecord(1);
+        fwrite(&record, sizeof(record), 1, fp);
+        fclose(fp);
+    }
+    size = fileSize(laterFileName);
+    std::shared_ptr<AnalysisFile> later = AnalysisFile::open(laterFileName);
+    assertEquals(readAnalysisFile(*later).size(), (std::size_t) 0);
+    assertTrue(later->isUnreadable());
+    assertTrue(!later->needsCompaction());
+    assertTrue(!later->append(std::vector<AnalysisRecord>(1, analysisRecord(2)), 0, 0));
+    assertTrue(!later->rewrite(std::vector<AnalysisRecord>(1, analysisRecord(2)), 0, 0));
+    assertEquals(fileSize(laterFileName), size);
+
+    later.reset();
+    std::remove(laterFileName);
+}
+
+/**
+ * The rotations of frames first to last of a clip whose yaw changes by the
+ * frame number every frame.
+ */
+static std::vector<AnalysisRecord> analysisShard(int first, int last) {
+    std::vector<AnalysisRecord> records;
+    for (int i = first + 1; i <= last; ++i) {
+        AnalysisRecord r;
+        r.previousTime = (i - 1) / 30.0 + 0.0001;
+        r.time = i / 30.0;
+        r.yaw = i;
+        r.pitch = 0;
+        r.roll = 0;
+        records.push_back(r);
+    }
+    return records;
+}
+
+void testAnalysisMerge() {
+    // Overlapping by one frame, and by ten
+    AnalysisMerge merge;
+    merge.add("c", analysisShard(50, 90), 3, 3);
+    merge.add("a", analysisShard(0, 30), 1, 3);
+    merge.add("b", analysisShard(30, 60), 2, 3);
+    std::vector<std::string> warnings;
+    std::vector<AnalysisRecord> records = merge.merge(warnings);
+    assertEquals(warnings.size(), (std::size_t) 0);
+    assertEquals(records.size(), (std::size_t) 90);
+    for (int i = 0; i < 90; ++i) {
+        assertEquals(records[i].yaw, i + 1.0);
+    }
+
+    // A gap between shards, and a shard missing
+    AnalysisMerge gap;
+    gap.add("a", analysisShard(0, 30), 1, 3);
+    gap.add("c", analysisShard(31, 60), 3, 3);
+    warnings.clear();
+    records = gap.merge(warnings);
+    assertEquals(warnings.size(), (std::size_t) 2);
+    assertEquals(records.size(), (std::size_t) 59);
+
+    // Later segments of a file replace what they overlap
+    std::vector<AnalysisRecord> base = analysisShard(0, 10);
+    std::vector<AnalysisRecord> redone = analysisShard(3, 6);
+    for (AnalysisRecord& r : redone) {
+        r.pitch = 1;
+    }
+    AnalysisMerge::overlay(base, redone.data(), redone.size());
+    assertEquals(base.size(), (std::size_t) 10);
+    for (int i = 0; i < 10; ++i) {
+        assertEquals(base[i].yaw, i + 1.0);
+        assertEquals(base[i].pitch, i >= 3 && i < 6 ? 1.0 : 0.0);
+    }
+}
+
+/**
+ * The correction of sample i as a plain moving average: the mean of the
+ * orientations in the window, minus the orientation of the sample.
+ */
+double referenceCorrection(const std::vector<double>& rotations, int i, int window, double bias) {
+    int n = (int) rotations.size();
+    std::vector<double> orientations(n);
+    double orientation = 0.0;
+    for (int k = 0; k < n; ++k) {
+        orientation += rotations[k];
+        orientations[k] = orientation;
+    }
+    int first = i - window + (int) ((bias + 1.0) / 2 * window);
+    double sum = 0.0;
+    int num = 0;
+    for (int k = first; k < first + window; ++k) {
+        if (k >= 0 && k < n) {
+            sum += orientations[k];
+            ++num;
+        }
+    }
+    return num == 0 ? 0.0 : sum / num - orientations[i];
+}
+
+Rotation testRotation(int frame, double yaw) {
+    return Rotation((frame - 1) / 30.0 + ROTATION_TIME_INSTANT, frame / 30.0, yaw, -yaw, yaw / 2, false);
+}
+
+void testRotationSamples() {
+    RotationSamples samples;
+    for (int frame = 1; frame <= 10; ++frame) {
+        samples.add(testRotation(frame, frame));
+    }
+    assertEquals(samples.size(), (size_t) 10);
+    assertEquals(samples.getMax().yaw, 10.0);
+    assertEquals(samples.findFirstSkip(), -1);
+    assertEquals(samples.lookup(4 / 30.0), 3);
+    assertEquals(samples.lookup(11 / 30.0), -1);
+
+    // The rotation with the same span, and a span over several.
+    size_t first;
+    size_t last;
+    samples.findOverlapping(testRotation(5, 0), first, last);
+    assertEquals(first, (size_t) 4);
+    assertEquals(last, (size_t) 5);
+    samples.findOverlapping(Rotation(3.5 / 30, 6.5 / 30, 0, 0, 0, false), first, last);
+    assertEquals(first, (size_t) 3);
+    assertEquals(last, (size_t) 7);
+    samples.findOverlapping(Rotation(11 / 30.0, 12 / 30.0, 0, 0, 0, false), first, last);
+    assertEquals(first, (size_t) 10);
+    assertEquals(last, (size_t) 10);
+
+    // Replacing a rotation in the middle updates the largest values.
+    samples.add(testRotation(3, -20));
+    assertEquals(samples.size(), (size_t) 10);
+    assertEquals(samples[2].yaw, -20.0);
+    assertEquals(samples.getMax().yaw, 20.0);
+    assertEquals(samples.getMax().roll, 10.0);
+
+    // A removed rotation leaves a gap, which findFirstSkip finds, and that
+    // findOverlapping puts a rotation in.
+    samples.removeOverlapping(testRotation(6, 0));
+    assertEquals(samples.size(), (size_t) 9);
+    assertEquals(samples.findFirstSkip(), 4);
+    assertEquals(samples.lookup(6 / 30.0), -1);
+    samples.findOverlapping(testRotation(6, 0), first, last);
+    assertEquals(first, (size_t) 5);
+    assertEquals(last, (size_t) 5);
+    assertTrue(!samples.hasOverlapping(testRotation(6, 0)));
+
+    // Appending after a removal keeps the aggregates right.
+    samples.add(testRotation(11, 30));
+    assertEquals(samples.getMax().yaw, 30.0);
+    assertEquals(samples.findFirstSkip(), 4);
+    samples.add(testRotation(6, 6));
+    assertEquals(samples.findFirstSkip(), -1);
+    assertEquals(samples.lookup(6 / 30.0), 5);
+
+    // Reading an analysis file gives the same rotations as adding its
+    // records one by one, with segments that overlap those before them.
+    const char* fileName = "bigsh0t_test_rotations.bin";
+    std::remove(fileName);
+    std::shared_ptr<AnalysisFile> file = AnalysisFile::open(fileName);
+    std::vector<AnalysisRecord> older = samples.toRecords(false);
+    std::vector<AnalysisRecord> newer;
+    newer.push_back(Rotation(-1 / 30.0 + ROTATION_TIME_INSTANT, 0.0, 1, 1, 1, false).toRecord());
+    newer.push_back(testRotation(4, 40).toRecord());
+    newer.push_back(Rotation(7.5 / 30, 8.5 / 30, 85, 0, 0, false).toRecord());
+    newer.push_back(testRotation(13, 13).toRecord());
+    assertTrue(file->append(older, 0, 0));
+    assertTrue(file->append(newer, 0, 0));
+    RotationSamples read;
+    read.read(*file);
+    RotationSamples oneByOne;
+    for (const AnalysisRecord& record : older) {
+        oneByOne.add(Rotation(record));
+    }
+    for (const AnalysisRecord& record : newer) {
+        oneByOne.add(Rotation(record));
+    }
+    assertEquals(read.size(), oneByOne.size());
+    for (size_t i = 0; i < read.size(); ++i) {
+        assertEquals(read[i].previousTime, oneByOne[i].previousTime);
+        assertEquals(read[i].time, oneByOne[i].time);
+        assertEquals(read[i].yaw, oneByOne[i].yaw);
+    }
+    assertEquals(read.getMax().yaw, 85.0);
+    assertEquals(read.findFirstSkip(), oneByOne.findFirstSkip());
+    assertEquals(read.getMinSpan(), oneByOne.getMinSpan());
+    file.reset();
+    std::remove(fileName);
+}
+
+void testCorrections() {
+    const int n = 40;
+    const double frameRate = 30.0;
+    RotationSamples samples;
+    std::vector<double> yaw(n);
+    std::vector<double> pitch(n);
+    std::vector<double> roll(n);
+    for (int k = 0; k < n; ++k) {
+        yaw[k] = sin(k * 0.7) * 2.0;
+        pitch[k] = cos(k * 1.3) - 0.2;
+        roll[k] = (k % 5) * 0.1 - 0.25;
+        samples.add(Rotation((k - 1) / frameRate + ROTATION_TIME_INSTANT, k / frameRate, yaw[k], pitch[k], roll[k], false));
+    }
+
+    Corrections corrections;
+    corrections.setSamples(samples);
+    // Windows of one sample, wider than the samples, and biases at both
+    // ends, so that some windows are partly or wholly outside the samples.
+    for (int window : {1, 2, 7, 15, 100}) {
+        for (double bias : {-1.0, -0.5, 0.0, 0.3, 1.0}) {
+            corrections.setSmoothing(window, window + 1, window + 2, bias, -bias, bias);
+            for (int i = 0; i < n; ++i) {
+                Rotation correction(0, 0, 0, 0, 0, false);
+                assertTrue(corrections.lookup(i / frameRate, correction));
+                assertTrue(std::abs(correction.yaw - referenceCorrection(yaw, i, window, bias)) < 1e-9);
+                assertTrue(std::abs(correction.pitch - referenceCorrection(pitch, i, window + 1, -bias)) < 1e-9);
+                assertTrue(std::abs(correction.roll - referenceCorrection(roll, i, window + 2, bias)) < 1e-9);
+            }
+        }
+    }
+
+    // A window entirely before the first sample corrects nothing.
+    corrections.setSmoothing(5, 5, 5, -1.0, -1.0, -1.0);
+    Rotation correction(0, 0, 0, 0, 0, false);
+    assertTrue(corrections.lookup(0.0, correction));
+    assertEquals(correction.yaw, 0.0);
+
+    // No correction outside the samples.
+    assertTrue(!corrections.lookup(-1.0, correction));
+    assertTrue(!corrections.lookup(n / frameRate + 1.0, correction));
+}
+
+/**
+ * The orientation after turning the given number of degrees around an axis.
+ */
+Quaternion testOrientation(double x, double y, double z, double degrees) {
+    double length = sqrt(x * x + y * y + z * z);
+    Quaternion q;
+    q.setQuaternionRotation(DEG2RADF(degrees), x / length, y / length, z / length);
+    return q;
+}
+
+/**
+ * Returns the largest difference between where the transform of the rotation
+ * takes the axes of a frame, and where the camera saw the same directions in
+ * the frame before. Transform360 and the tracker undo a rotation by
+ * transforming the frame by the rotation with all angles negated.
+ */
+double testOrientationError(const Quaternion& previous, const Quaternion& current, const Rotation& r) {
+    Matrix3 xform;
+    xform.identity();
+    rotateX(xform, DEG2RADF(-r.roll));
+    rotateY(xform, DEG2RADF(-r.pitch));
+    rotateZ(xform, DEG2RADF(-r.yaw));
+
+    Matrix3 previousM;
+    previousM.identity();
+    rotateQuaternion(previousM, previous);
+    Matrix3 currentM;
+    currentM.identity();
+    rotateQuaternion(currentM, current);
+
+    double error = 0.0;
+    for (int axis = 0; axis < 3; ++axis) {
+        Vector3 v;
+        v.zero();
+        v[axis] = 1.0;
+        Vector3 world;
+        mulM3V3(previousM, v, world);
+        // The inverse of a rotation matrix is its transpose.
+        Vector3 expected;
+        for (int row = 0; row < 3; ++row) {
+            expected[row] = currentM[row] * world[0] + currentM[row + 3] * world[1] + currentM[row + 6] * world[2];
+        }
+        Vector3 actual;
+        mulM3V3(xform, v, actual);
+        for (int row = 0; row < 3; ++row) {
+            error = std::max(error, std::abs(actual[row] - expected[row]));
+        }
+    }
+    return error;
+}
+
+void testOrientations() {
+    const double frameRate = 30.0;
+
+    // A camera that turns one degree per frame around each axis gives the
+    // rotations that the tracker would: yaw around z, pitch around y and
+    // roll around x.
+    const double axes[3][3] = {{0, 0, 1}, {0, 1, 0}, {1, 0, 0}};
+    for (int axis = 0; axis < 3; ++axis) {
+        std::vector<Quaternion> orientations;
+        for (int i = 0; i < 5; ++i) {
+            orientations.push_back(testOrientation(axes[axis][0], axes[axis][1], axes[axis][2], i));
+        }
+        RotationSamples samples;
+        samples.addOrientations(orientations, frameRate);
+        assertEquals(samples.size(), (size_t) 4);
+        for (size_t i = 0; i < samples.size(); ++i) {
+            const Rotation& r = samples[i];
+            assertTrue(std::abs(r.previousTime - (i / frameRate + ROTATION_TIME_INSTANT)) < 1e-12);
+            assertTrue(std::abs(r.time - (i + 1) / frameRate) < 1e-12);
+            assertTrue(std::abs(r.yaw - (axis == 0 ? 1.0 : 0.0)) < 1e-9);
+            assertTrue(std::abs(r.pitch - (axis == 1 ? 1.0 : 0.0)) < 1e-9);
+            assertTrue(std::abs(r.roll - (axis == 2 ? 1.0 : 0.0)) < 1e-9);
+            assertTrue(!r.updated);
+        }
+    }
+
+    // For a camera that turns around all axes at once, undoing each
+    // rotation turns the frame back into the one before it.
+    std::vector<Quaternion> orientations;
+    orientations.push_back(testOrientation(0.2, -0.5, 1.0, 30.0));
+    for (int i = 1; i < 20; ++i) {
+        Quaternion turn = testOrientation(sin(i * 0.9), cos(i * 1.7), 0.5, 2.0 + (i % 4));
+        Quaternion next;
+        mulQQ(orientations.back(), turn, next);
+        orientations.push_back(next);
+    }
+    RotationSamples samples;
+    samples.addOrientations(orientations, frameRate);
+    assertEquals(samples.size(), orientations.size() - 1);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        assertTrue(testOrientationError(orientations[i], orientations[i + 1], samples[i]) < 1e-9);
+        assertEquals(samples.lookup((i + 1) / frameRate), (int) i);
+    }
+}
+
+void testInterpolatedRotations() {
+    const double frameRate = 30.0;
+
+    // Without frames in between, the rotation is added as it is.
+    RotationSamples samples;
+    samples.addInterpolated(0.0, std::vector<double>(), 1 / frameRate, 3.0, -2.0, 1.0, true);
+    assertEquals(samples.size(), (size_t) 1);
+    assertEquals(samples[0].previousTime, ROTATION_TIME_INSTANT);
+    assertEquals(samples[0].yaw, 3.0);
+    assertEquals(samples[0].pitch, -2.0);
+    assertEquals(samples[0].roll, 1.0);
+    assertTrue(samples[0].updated);
+
+    // A turn around one axis is split into equal parts, one per frame.
+    samples.clear();
+    std::vector<double> frameTimes = {2 / frameRate, 3 / frameRate};
+    samples.addInterpolated(1 / frameRate, frameTimes, 4 / frameRate, 6.0, 0.0, 0.0, false);
+    assertEquals(samples.size(), (size_t) 3);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        assertTrue(std::abs(samples[i].previousTime - ((i + 1) / frameRate + ROTATION_TIME_INSTANT)) < 1e-12);
+        assertTrue(std::abs(samples[i].time - (i + 2) / frameRate) < 1e-12);
+        assertTrue(std::abs(samples[i].yaw - 2.0) < 1e-9);
+        assertTrue(std::abs(samples[i].pitch) < 1e-9);
+        assertTrue(std::abs(samples[i].roll) < 1e-9);
+        assertTrue(!samples[i].updated);
+    }
+
+    // For a camera that turns at a constant rate around any axis, splitting
+    // the rotation from the first frame to the last gives the rotations
+    // between consecutive frames.
+    const int frames = 6;
+    std::vector<Quaternion> orientations;
+    orientations.push_back(testOrientation(1.0, 0.3, -0.4, 20.0));
+    Quaternion turn = testOrientation(0.4, -0.7, 0.6, 5.0);
+    for (int i = 1; i <= frames; ++i) {
+        Quaternion next;
+        mulQQ(orientations.back(), turn, next);
+        orientations.push_back(next);
+    }
+    RotationSamples perFrame;
+    perFrame.addOrientations(orientations, frameRate);
+
+    std::vector<Quaternion> ends;
+    ends.push_back(orientations.front());
+    ends.push_back(orientations.back());
+    RotationSamples total;
+    total.addOrientations(ends, frameRate / frames);
+    assertEquals(total.size(), (size_t) 1);
+
+    frameTimes.clear();
+    for (int i = 1; i < frames; ++i) {
+        frameTimes.push_back(i / frameRate);
+    }
+    samples.clear();
+    samples.addInterpolated(0.0, frameTimes, frames / frameRate, total[0].yaw, total[0].pitch, total[0].roll, true);
+    assertEquals(samples.size(), perFrame.size());
+    for (size_t i = 0; i < samples.size(); ++i) {
+        assertTrue(std::abs(samples[i].time - perFrame[i].time) < 1e-12);
+        assertTrue(std::abs(samples[i].yaw - perFrame[i].yaw) < 1e-9);
+        assertTrue(std::abs(samples[i].pitch - perFrame[i].pitch) < 1e-9);
+        assertTrue(std::abs(samples[i].roll - perFrame[i].roll) < 1e-9);
+    }
+}
+
+void testTrackPoint() {
+    const int width = 256;
+    const int height = 256;
+    const int sampleRadius = 16;
+    const int searchRadius = 24;
+    std::vector<uint32_t> texture(width * height);
+    uint32_t seed = 12345;
+    for (int i = 0; i < width * height; ++i) {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t v = (seed >> 24) & 0xff;
+        texture[i] = 0xff000000 | (v << 16) | (v << 8) | v;
+    }
+    int levels = GrayPyramid::levelsFor(sampleRadius, searchRadius);
+    GrayPyramid previous;
+    previous.update(texture.data(), width, height, levels);
+
+    // The search range is symmetric: a motion of searchRadius - 1 is found
+    // in both directions, but not one of searchRadius.
+    const int shifts[] = { searchRadius - 1, -(searchRadius - 1), searchRadius };
+    for (int shift : shifts) {
+        std::vector<uint32_t> frame(width * height);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                frame[y * width + x] = texture[y * width + (x - shift + width) % width];
+            }
+        }
+        GrayPyramid current;
+        current.update(frame.data(), width, height, levels);
+
+        TrackPoint tp(width / 2, height / 2, sampleRadius, searchRadius, 1, false);
+        std::vector<short> sampleBuffer(tp.getSampleBufferSize());
+        tp.setSampleBuffer(sampleBuffer.data());
+        tp.update(previous, current, NULL);
+
+        Vector2 motion;
+        tp.getMotion(motion);
+        if (shift < searchRadius) {
+            assertEquals(motion[0], (double) shift);
+            assertEquals(motion[1], 0.0);
+            assertEquals(tp.getError(), 0);
+        } else {
+            assertTrue(motion[0] != (double) shift);
+        }
+    }
+}
+
+void testKeyframeSchedule() {
+    const double searchRadius = 48.0;
+    KeyframeSchedule schedule;
+    schedule.reset(4);
+    assertEquals(schedule.getStep(), 4);
+    assertEquals(schedule.getKeyframeTime(), -1.0);
+
+    // The first frame is always a keyframe, and can not be tracked, so the
+    // step stays the same.
+    assertTrue(schedule.isKeyframe());
+    assertTrue(!schedule.hasPending());
+    assertEquals(schedule.keyframe(0.0, -1.0, searchRadius), 1.0);
+    assertEquals(schedule.getStep(), 4);
+
+    // Every fourth frame is a keyframe.
+    for (int i = 1; i < 4; ++i) {
+        assertTrue(!schedule.isKeyframe());
+        schedule.skip(i);
+    }
+    assertTrue(schedule.isKeyframe());
+    assertEquals(schedule.getFrameTimes().size(), (size_t) 3);
+    assertEquals(schedule.getFrameTimes()[2], 3.0);
+
+    // Motion close to the search radius halves the step, so the motion to
+    // the next keyframe is expected to be half as large.
+    assertEquals(schedule.keyframe(4.0, 30.0, searchRadius), 0.5);
+    assertEquals(schedule.getStep(), 2);
+    assertEquals(schedule.getKeyframeTime(), 4.0);
+    assertTrue(schedule.getFrameTimes().empty());
+
+    // Motion in between keeps it.
+    assertTrue(!schedule.isKeyframe());
+    schedule.skip(5.0);
+    assertTrue(schedule.isKeyframe());
+    assertEquals(schedule.keyframe(6.0, 10.0, searchRadius), 1.0);
+    assertEquals(schedule.getStep(), 2);
+
+    // Small motion doubles it, up to the largest step.
+    schedule.skip(7.0);
+    assertEquals(schedule.keyframe(8.0, 1.0, searchRadius), 2.0);
+    assertEquals(schedule.getStep(), 4);
+    for (int i = 9; i < 12; ++i) {
+        schedule.skip(i);
+    }
+    assertEquals(schedule.keyframe(12.0, 1.0, searchRadius), 1.0);
+    assertEquals(schedule.getStep(), 4);
+
+    // Large motion halves it down to every frame.
+    for (int i = 13; i < 16; ++i) {
+        schedule.skip(i);
+    }
+    assertEquals(schedule.keyframe(16.0, 40.0, searchRadius), 0.5);
+    schedule.skip(17.0);
+    assertEquals(schedule.keyframe(18.0, 40.0, searchRadius), 0.5);
+    assertEquals(schedule.getStep(), 1);
+    assertTrue(schedule.isKeyframe());
+    assertEquals(schedule.keyframe(19.0, 40.0, searchRadius), 1.0);
+    assertEquals(schedule.getStep(), 1);
+
+    // Lowering the largest step takes effect at once.
+    schedule.reset(8);
+    schedule.keyframe(0.0, -1.0, searchRadius);
+    schedule.setMaxStep(2);
+    assertEquals(schedule.getStep(), 2);
+
+    // Frames after the last keyframe are pending until the last of them is
+    // tracked, and the frames before it are then in between.
+    schedule.reset(4);
+    schedule.keyframe(0.0, -1.0, searchRadius);
+    schedule.skip(1.0);
+    schedule.skip(2.0);
+    assertTrue(schedule.hasPending());
+    assertEquals(schedule.takeLastPending(), 2.0);
+    assertEquals(schedule.getFrameTimes().size(), (size_t) 1);
+    assertEquals(schedule.getFrameTimes()[0], 1.0);
+    assertEquals(schedule.keyframe(2.0, 10.0, searchRadius), 2.0);
+    assertTrue(!schedule.hasPending());
+
+    // Resetting forgets the pending frames.
+    schedule.skip(3.0);
+    assertTrue(schedule.hasPending());
+    schedule.reset(4);
+    assertTrue(!schedule.hasPending());
+    assertTrue(schedule.getFrameTimes().empty());
+}
+
 void testSummedAreaTable() {
     uint32_t zeros[] = {
         0, 0, 0, 0, 0,
@@ -366,6 +1618,26 @@ void runTest(const char* name, TestCase testCase) {
 
 int main(int argc, char* argv[]) {
     RUN_TEST(testEMoR);
+    RUN_TEST(testApply360MapAVX2);
+    RUN_TEST(testApply360MapSSE41);
+    RUN_TEST(testMapSizeLimit);
+    RUN_TEST(testYawOffset);
+    RUN_TEST(testSadRow);
+    RUN_TEST(testVectorMath);
+    RUN_TEST(testMapCache);
+    RUN_TEST(testScanlineScheduler);
+    RUN_TEST(testThreadPool);
+    RUN_TEST(testThreadBudget);
+    RUN_TEST(testBackgroundMap);
+    RUN_TEST(testMapStrategy);
+    RUN_TEST(testAnalysisFile);
+    RUN_TEST(testAnalysisMerge);
+    RUN_TEST(testRotationSamples);
+    RUN_TEST(testCorrections);
+    RUN_TEST(testOrientations);
+    RUN_TEST(testInterpolatedRotations);
+    RUN_TEST(testKeyframeSchedule);
+    RUN_TEST(testTrackPoint);
     //RUN_TEST(testSummedAreaTable);
     //RUN_TEST(testBlerp);
     //RUN_TEST(testFastAtan2);